@@ -34,6 +34,9 @@
 /* Whether we have linger */
 #define HAVE_LINGER 1
 
+/* Define to 1 if you have the <linux/errqueue.h> header file. */
+/* #undef HAVE_LINUX_ERRQUEUE_H */
+
 /* Define to 1 if you have the <netdb.h> header file. */
 #define HAVE_NETDB_H 1
 
@@ -73,6 +76,9 @@
 /* Define to 1 if you have the <sys/fcntl.h> header file. */
 /* #undef HAVE_SYS_FCNTL_H */
 
+/* Define to 1 if you have the <sys/inotify.h> header file. */
+/* #undef HAVE_SYS_INOTIFY_H */
+
 /* Define to 1 if you have the <sys/ioctl.h> header file. */
 #define HAVE_SYS_IOCTL_H 1
 
@@ -94,6 +100,9 @@
 /* Define to 1 if you have the <sys/uio.h> header file. */
 #define HAVE_SYS_UIO_H 1
 
+/* Define to 1 if you have the <sys/un.h> header file. */
+/* #undef HAVE_SYS_UN_H */
+
 /* Define to 1 if you have the <sys/unistd.h> header file. */
 /* #undef HAVE_SYS_UNISTD_H */
 
@@ -129,16 +129,32 @@ struct sync_cb_data {
 	void *ptr;
 };
 
+/* An AES-128 key with its round keys (AES128_ROUND_KEYS_SIZE in aes.h) */
+struct smb2_aes_key {
+        int valid;
+        uint8_t key[SMB2_KEY_SIZE];
+        uint8_t round_keys[176];
+};
+
 struct smb2_context {
 
         t_socket fd;
 
+        /* how the byte stream is carried, see transport.c */
+        const struct smb2_transport *transport;
+        void *transport_data;
+        /* smb2_connect_async() connects to this one in-process if set */
+        struct smb2_server *pipe_server;
+
         struct smb2_server *owning_server;
 
         t_socket *connecting_fds;
         size_t connecting_fds_count;
         struct addrinfo *addrinfos;
         const struct addrinfo *next_addrinfo;
+        /* what addrinfos were resolved from, see smb2_resolve_forget() */
+        char *connect_host;
+        char *connect_port;
 
         int timeout;
 
@@ -185,6 +201,11 @@ struct smb2_context {
         uint8_t signing_key[SMB2_KEY_SIZE];
         uint8_t serverin_key[SMB2_KEY_SIZE];
         uint8_t serverout_key[SMB2_KEY_SIZE];
+        /* the round keys of the above, expanded once a session, see
+         * smb2-signing.c */
+        struct smb2_aes_key sign_key;
+        struct smb2_aes_key encrypt_key;
+        struct smb2_aes_key decrypt_key;
         uint8_t salt[SMB2_SALT_SIZE];
         uint16_t cypher;
         uint8_t preauthhash[SMB2_PREAUTH_HASH_SIZE];
@@ -256,6 +277,16 @@ struct smb2_context {
         uint32_t max_write_size;
         uint16_t dialect;
 
+        /* The file system of the share as it was when it was connected,
+         * queried in the same compound as the TREE_CONNECT.
+         */
+        uint8_t have_share_statvfs;
+        uint8_t have_share_fs_attributes;
+        struct smb2_statvfs share_statvfs;
+        uint32_t share_fs_attributes;
+        /* ShareCapabilities from the TREE_CONNECT reply */
+        uint32_t share_capabilities;
+
         char error_string[MAX_ERROR_SIZE];
         int nterror;
 
@@ -273,6 +304,57 @@ struct smb2_context {
         uint8_t ndr;
         int endianness;
 
+        /* idle keepalive and dead peer detection, see keepalive.c */
+        int keepalive_idle;
+        uint32_t keepalive_min_dead_ms;
+        smb2_peer_dead_cb peer_dead_cb;
+        void *peer_dead_cb_data;
+        int peer_dead;
+        uint64_t last_rx_ms;
+        uint64_t echo_sent_ms;
+        uint32_t srtt_ms;
+        uint32_t rttvar_ms;
+
+        /* bytes held by queued and in flight pdus */
+        size_t queued_bytes;
+
+        /* requests that identical ones can attach to, see singleflight.c */
+        struct smb2_flight *flights;
+
+        /* MSG_ZEROCOPY sends of write data, see zerocopy.c */
+        size_t zc_threshold;
+        int zc_state;           /* 0 not tried, 1 on, -1 off for this socket */
+        uint32_t zc_next;       /* number of the next zerocopy send */
+        uint32_t zc_done;       /* sends before this one have completed */
+        /* answered requests whose data the kernel still holds */
+        struct smb2_pdu *zc_waitqueue;
+
+        /* serving requests fairly between connections, see sched.c */
+        int64_t sched_deficit;
+        uint64_t sched_rx;      /* bytes read, to charge them */
+        int sched_credits;      /* credits the client still holds */
+
+        /* opens the server read cache knows of, see readcache.c */
+        struct smb2_rcache_open *rcache_opens;
+
+        /* the compound request being served, see compound.c */
+        int compound_open;
+        uint32_t compound_status;       /* error the chain failed with */
+        int compound_have_fid;
+        smb2_file_id compound_fid;      /* opened by a CREATE in the chain */
+        struct smb2_pdu *compound_replies;
+
+        /* the opens resume keys are issued for, see copychunk.c */
+        struct smb2_copychunk_open *copychunk_opens;
+        uint64_t resume_key_counter;
+
+        /* the NTLMv2 key (NTOWFv2) of the password for a user and domain,
+         * see ntlmssp.c */
+        int have_ntlm_key;
+        uint8_t ntlm_key[16];
+        char *ntlm_key_user;
+        char *ntlm_key_domain;
+
         /* to maintain lists of contexts for server used */
         struct smb2_context *next;
 };
@@ -285,6 +367,16 @@ typedef void (*smb2_free_payload)(struct smb2_context *smb2, void *payload);
 
 #define SMB2_MAX_PDU_SIZE 16*1024*1024
 
+/* Largest fixed part encoded in place, see smb2-fixed.c */
+#define SMB2_MAX_FIXED_SIZE 48
+
+/* Replies small enough to be decoded into the pdu itself */
+union smb2_fixed_reply {
+        struct smb2_close_reply close;
+        struct smb2_read_reply read;
+        struct smb2_write_reply write;
+};
+
 struct smb2_pdu {
         struct smb2_pdu *next;
         struct smb2_header header;
@@ -297,6 +389,12 @@ struct smb2_pdu {
         /* buffer to avoid having to malloc the headers */
         uint8_t hdr[SMB2_HEADER_SIZE];
 
+        /* and the same for the fixed part of the command */
+        uint8_t fixed[SMB2_MAX_FIXED_SIZE];
+
+        /* payload of a small reply, not freed with the pdu */
+        union smb2_fixed_reply reply;
+
         /* pointer to the unmarshalled payload in a reply */
         void *payload;
 
@@ -322,9 +420,19 @@ struct smb2_pdu {
 
         /* For encrypted PDUs */
         uint8_t seal:1;
+        /* data sent with MSG_ZEROCOPY, last in send number zc_seq */
+        uint8_t zc:1;
+        uint32_t zc_seq;
+        /* reply status of a request waiting in zc_waitqueue */
+        uint32_t zc_status;
+        /* bytes at the end of out that are the caller's write data */
+        size_t out_data_len;
         uint32_t crypt_len;
         unsigned char *crypt;
         time_t timeout;
+
+        /* charged to smb2->queued_bytes until the pdu is freed */
+        size_t queued_bytes;
 };
 
 struct smb2_dirent_internal {
@@ -351,6 +459,7 @@ void smb2_set_nterror(struct smb2_context *smb2, int nterror,
                     const char *error_string, ...);
 
 void smb2_close_connecting_fds(struct smb2_context *smb2);
+void smb2_connect_failed(struct smb2_context *smb2);
 
 void *smb2_alloc_init(struct smb2_context *smb2, size_t size);
 void *smb2_alloc_data(struct smb2_context *smb2, void *memctx, size_t size);
@@ -383,6 +492,13 @@ int smb2_decode_header(struct smb2_context *smb2, struct smb2_iovec *iov,
                        struct smb2_header *hdr);
 int smb2_calc_signature(struct smb2_context *smb2, uint8_t *signature,
                         struct smb2_iovec *iov, size_t niov);
+int smb2_check_signature(struct smb2_context *smb2,
+                         struct smb2_iovec *iov, size_t niov);
+const uint8_t *smb2_aes_round_keys(struct smb2_aes_key *k, const uint8_t *key);
+
+const uint8_t *smb2_ntlm_key_find(struct smb2_context *smb2, const char *user,
+                                  const char *domain);
+void smb2_ntlm_key_clear(struct smb2_context *smb2);
 
 int smb2_set_uint8(struct smb2_iovec *iov, int offset, uint8_t value);
 int smb2_set_uint16(struct smb2_iovec *iov, int offset, uint16_t value);
@@ -539,6 +655,17 @@ int smb2_encode_file_stream_info(struct smb2_context *smb2,
                                    struct smb2_file_stream_info *fs,
                                    struct smb2_iovec *vec);
 
+int smb2_decode_file_full_ea_info(struct smb2_context *smb2,
+                                  void *memctx,
+                                  struct smb2_file_full_ea_info *fs,
+                                  struct smb2_iovec *vec);
+
+int smb2_encode_file_full_ea_info(struct smb2_context *smb2,
+                                  struct smb2_file_full_ea_info *fs,
+                                  struct smb2_iovec *vec);
+
+int smb2_file_full_ea_info_length(struct smb2_file_full_ea_info *fs);
+
 int smb2_decode_file_position_info(struct smb2_context *smb2,
                                    void *memctx,
                                    struct smb2_file_position_info *fs,
@@ -644,6 +771,156 @@ void smb2_free_all_dirs(struct smb2_context *smb2);
 int smb2_read_from_buf(struct smb2_context *smb2);
 void smb2_change_events(struct smb2_context *smb2, t_socket fd, int events);
 void smb2_timeout_pdus(struct smb2_context *smb2);
+void smb2_keepalive_rx(struct smb2_context *smb2);
+
+#define SMB2_FLIGHT_STAT    1
+#define SMB2_FLIGHT_STATVFS 2
+#define SMB2_FLIGHT_READ    3
+
+struct smb2_flight;
+int smb2_flight_attach(struct smb2_context *smb2, int type, const char *path,
+                       struct smb2fh *fh, uint64_t offset, uint32_t length,
+                       void *buf, smb2_command_cb cb, void *cb_data);
+struct smb2_flight *smb2_flight_begin(struct smb2_context *smb2, int type,
+                                      const char *path, struct smb2fh *fh,
+                                      uint64_t offset, uint32_t length);
+void smb2_flight_end(struct smb2_context *smb2, struct smb2_flight *flight,
+                     int status, const void *result, size_t len);
+void smb2_flight_seal(struct smb2_context *smb2);
+void smb2_flight_free_all(struct smb2_context *smb2);
+void smb2_set_fh_offset(struct smb2fh *fh, int64_t offset);
+
+/*
+ * A transport carries the SMB2 byte stream of a context. The socket based
+ * ones (TCP and Unix-domain) use smb2->fd and are driven by polling it,
+ * the others have no fd and are driven by their service function instead.
+ */
+struct iovec;
+struct smb2_transport {
+        const char *name;
+        int (*is_connected)(struct smb2_context *smb2);
+        ssize_t (*writev)(struct smb2_context *smb2,
+                          const struct iovec *iov, int iovcnt);
+        ssize_t (*readv)(struct smb2_context *smb2,
+                         const struct iovec *iov, int iovcnt);
+        void (*disconnect)(struct smb2_context *smb2);
+        /* NULL for transports that have an fd to poll */
+        int (*service)(struct smb2_context *smb2, int revents);
+};
+
+extern const struct smb2_transport smb2_tcp_transport;
+extern const struct smb2_transport smb2_unix_transport;
+extern const struct smb2_transport smb2_pipe_transport;
+
+#define SMB2_IS_CONNECTED(smb2) ((smb2)->transport->is_connected(smb2))
+
+void smb2_transport_close(struct smb2_context *smb2);
+int smb2_service_stream(struct smb2_context *smb2, int revents);
+
+int smb2_zerocopy_wanted(struct smb2_context *smb2, struct smb2_pdu *pdu);
+ssize_t smb2_zerocopy_send(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                           const struct iovec *iov, int iovcnt);
+int smb2_zerocopy_defer(struct smb2_context *smb2, struct smb2_pdu *pdu);
+int smb2_zerocopy_service(struct smb2_context *smb2, int revents);
+void smb2_zerocopy_flush(struct smb2_context *smb2);
+
+void smb2_sched_charge(struct smb2_context *smb2, struct smb2_pdu *pdu);
+uint16_t smb2_sched_grant(struct smb2_context *smb2, uint16_t grant);
+int smb2_sched_may_read(struct smb2_context *smb2);
+int smb2_sched_service(struct smb2_context *smb2);
+void smb2_sched_idle(struct smb2_context *smb2);
+
+void smb2_compound_begin(struct smb2_context *smb2);
+void smb2_compound_end(struct smb2_context *smb2);
+int smb2_compound_defer(struct smb2_context *smb2, struct smb2_pdu *pdu);
+void smb2_compound_opened(struct smb2_context *smb2,
+                          const smb2_file_id file_id);
+int smb2_compound_failed(struct smb2_context *smb2, void *command_data,
+                         void *cb_data);
+void smb2_compound_free(struct smb2_context *smb2);
+
+void smb2_copychunk_opened(struct smb2_server *server, struct smb2_context *smb2,
+                           struct smb2_create_request *req,
+                           struct smb2_create_reply *rep);
+void smb2_copychunk_closed(struct smb2_context *smb2,
+                           const smb2_file_id file_id);
+void smb2_copychunk_free_opens(struct smb2_context *smb2);
+int smb2_copychunk_ioctl(struct smb2_server *server, struct smb2_context *smb2,
+                         struct smb2_ioctl_request *req,
+                         struct smb2_ioctl_reply *rep, uint8_t *out,
+                         uint32_t *status);
+
+void smb2_rcache_opened(struct smb2_server *server, struct smb2_context *smb2,
+                        struct smb2_create_request *req,
+                        struct smb2_create_reply *rep);
+void smb2_rcache_changed(struct smb2_server *server, struct smb2_context *smb2,
+                         const smb2_file_id file_id);
+void smb2_rcache_locked(struct smb2_server *server, struct smb2_context *smb2,
+                        struct smb2_lock_request *req);
+void smb2_rcache_closed(struct smb2_server *server, struct smb2_context *smb2,
+                        const smb2_file_id file_id);
+int smb2_rcache_read(struct smb2_server *server, struct smb2_context *smb2,
+                     struct smb2_read_request *req,
+                     struct smb2_read_reply *rep);
+void smb2_rcache_store(struct smb2_server *server, struct smb2_context *smb2,
+                       struct smb2_read_request *req,
+                       struct smb2_read_reply *rep);
+void smb2_rcache_free_opens(struct smb2_context *smb2);
+void smb2_rcache_free(struct smb2_server *server);
+
+int smb2_notify_cancel(struct smb2_server *server, struct smb2_context *smb2);
+void smb2_notify_closed(struct smb2_server *server, struct smb2_context *smb2,
+                        const smb2_file_id file_id);
+void smb2_notify_free_watches(struct smb2_context *smb2);
+int smb2_notify_inotify_fd(struct smb2_server *server);
+void smb2_notify_inotify_service(struct smb2_server *server);
+
+int smb2_durable_reconnect(struct smb2_server *server, struct smb2_context *smb2,
+                           struct smb2_create_request *req,
+                           struct smb2_create_reply *rep,
+                           uint8_t **contexts, uint32_t *status);
+void smb2_durable_opened(struct smb2_server *server, struct smb2_context *smb2,
+                         struct smb2_create_request *req,
+                         struct smb2_create_reply *rep,
+                         uint8_t **contexts);
+void smb2_durable_closed(struct smb2_server *server, struct smb2_context *smb2,
+                         const smb2_file_id file_id);
+void smb2_durable_logoff(struct smb2_server *server, struct smb2_context *smb2);
+void smb2_durable_broken(struct smb2_server *server, struct smb2_context *smb2,
+                         struct smb2_oplock_or_lease_break_request *req);
+void smb2_durable_disconnected(struct smb2_server *server, struct smb2_context *smb2);
+void smb2_durable_expire(struct smb2_server *server, int all);
+
+void smb2_server_set_defaults(struct smb2_server *server);
+int smb2_serve_context(struct smb2_server *server, struct smb2_context *smb2);
+
+enum smb2_fixed_type {
+        SMB2_FIXED_CLOSE_REQUEST,
+        SMB2_FIXED_CLOSE_REPLY,
+        SMB2_FIXED_FLUSH_REQUEST,
+        SMB2_FIXED_READ_REQUEST,
+        SMB2_FIXED_READ_REPLY,
+        SMB2_FIXED_WRITE_REQUEST,
+        SMB2_FIXED_WRITE_REPLY,
+        SMB2_FIXED_QUERY_INFO_REQUEST,
+        SMB2_FIXED_SET_INFO_REQUEST,
+        SMB2_FIXED_MAX
+};
+
+struct smb2_iovec *smb2_fixed_encode(struct smb2_context *smb2,
+                                     struct smb2_pdu *pdu,
+                                     enum smb2_fixed_type type,
+                                     const void *src);
+int smb2_fixed_decode(struct smb2_context *smb2, enum smb2_fixed_type type,
+                      const struct smb2_iovec *iov, void *dst);
+
+struct addrinfo;
+int smb2_resolve(const char *host, const char *port, struct addrinfo **res);
+void smb2_resolve_free(struct addrinfo *ai);
+/* Drops the cached addresses of host, e.g. when none could be connected */
+void smb2_resolve_forget(const char *host, const char *port);
+/* Waits for the background lookups; call before the code is unloaded */
+void smb2_resolve_shutdown(void);
 
 struct dcerpc_context;
 int dcerpc_set_uint8(struct dcerpc_context *ctx, struct smb2_iovec *iov,
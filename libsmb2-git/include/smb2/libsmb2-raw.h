@@ -197,6 +197,18 @@ struct smb2_pdu *smb2_cmd_read_async(struct smb2_context *smb2,
                                      struct smb2_read_request *req,
                                      smb2_command_cb cb, void *cb_data);
 
+/*
+ * Asynchronous SMB2 Read into several buffers
+ *
+ * Same as smb2_cmd_read_async() but req->buf is ignored and the data is
+ * scattered over the nvec (at most SMB2_MAX_IO_SEGMENTS) buffers instead.
+ * Their total length must be at least req->length.
+ */
+struct smb2_pdu *smb2_cmd_readv_async(struct smb2_context *smb2,
+                                      struct smb2_read_request *req,
+                                      const struct smb2_iovec *vec, int nvec,
+                                      smb2_command_cb cb, void *cb_data);
+
 struct smb2_pdu *smb2_cmd_read_reply_async(struct smb2_context *smb2,
                                      struct smb2_read_reply *rep,
                                      smb2_command_cb cb, void *cb_data);
@@ -226,6 +238,19 @@ struct smb2_pdu *smb2_cmd_write_async(struct smb2_context *smb2,
                                       int pass_buf_ownership,
                                       smb2_command_cb cb, void *cb_data);
 
+/*
+ * Asynchronous SMB2 Write from several buffers
+ *
+ * Same as smb2_cmd_write_async() but req->buf is ignored and the data is
+ * gathered from the nvec (at most SMB2_MAX_IO_SEGMENTS) buffers instead.
+ * Their total length must be at least req->length. The buffers are never
+ * freed by the library.
+ */
+struct smb2_pdu *smb2_cmd_writev_async(struct smb2_context *smb2,
+                                       struct smb2_write_request *req,
+                                       const struct smb2_iovec *vec, int nvec,
+                                       smb2_command_cb cb, void *cb_data);
+
 struct smb2_pdu *smb2_cmd_write_reply_async(struct smb2_context *smb2,
                                       struct smb2_write_reply *rep,
                                       smb2_command_cb cb, void *cb_data);
@@ -375,6 +400,22 @@ struct smb2_pdu *smb2_cmd_echo_async(struct smb2_context *smb2,
 struct smb2_pdu *smb2_cmd_echo_reply_async(struct smb2_context *smb2,
                                      smb2_command_cb cb, void *cb_data);
 
+/*
+ * Asynchronous SMB2 Cancel
+ *
+ * Builds a CANCEL for req_pdu, which must already have been queued so
+ * that it has a message id. Most applications should use smb2_cancel()
+ * instead.
+ *
+ * Returns:
+ * pdu  : The CANCEL request, ready to be queued with smb2_queue_pdu().
+ *        There is no reply and no callback, the server completes
+ *        req_pdu instead.
+ * NULL : If there was an error.
+ */
+struct smb2_pdu *smb2_cmd_cancel_async(struct smb2_context *smb2,
+                                       struct smb2_pdu *req_pdu);
+
 /*
  * Asynchronous SMB2 Lock
  *
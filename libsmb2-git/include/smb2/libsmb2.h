@@ -88,6 +88,7 @@ struct smb2_stat_64 {
         uint64_t smb2_ctime_nsec;
         uint64_t smb2_btime;
         uint64_t smb2_btime_nsec;
+        uint32_t smb2_ea_size;
 };
 
 struct smb2_statvfs {
@@ -269,6 +270,64 @@ int smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents);
  */
 void smb2_set_timeout(struct smb2_context *smb2, int seconds);
 
+/*
+ * Callback invoked when the keepalive logic has declared the server dead.
+ * The context can no longer be used after this and should be destroyed.
+ */
+typedef void (*smb2_peer_dead_cb)(struct smb2_context *smb2, void *cb_data);
+
+/*
+ * Enable idle keepalive and dead peer detection.
+ * An ECHO is sent once nothing has been received from the server for
+ * idle_seconds. The round trip time of these ECHOs is tracked and the
+ * server is declared dead when an ECHO is not answered, and no other
+ * data arrives, within a timeout derived from the smoothed RTT and its
+ * variance. The timeout is never shorter than min_dead_seconds
+ * (0 selects the default of 10 seconds).
+ * Once the peer is declared dead cb is invoked and smb2_service() as
+ * well as all sync functions will fail.
+ *
+ * Default is 0: No keepalive.
+ */
+void smb2_set_keepalive(struct smb2_context *smb2, int idle_seconds,
+                        int min_dead_seconds,
+                        smb2_peer_dead_cb cb, void *cb_data);
+
+/*
+ * Send the data of WRITE requests of at least threshold bytes with
+ * MSG_ZEROCOPY, straight from the caller's buffer, where the platform has
+ * it (Linux). Only unencrypted TCP connections are affected.
+ * The write callback is then invoked only once both the reply has arrived
+ * and the kernel has released the buffer, so the buffer must not be
+ * touched until then, and smb2_service() must also be called for POLLERR.
+ *
+ * Default is 0: Always copy.
+ */
+void smb2_set_zerocopy_threshold(struct smb2_context *smb2,
+                                 size_t threshold);
+
+/*
+ * Returns the smoothed round trip time and its variance in milliseconds
+ * as measured by the keepalive ECHOs.
+ *
+ * Returns:
+ *  0 : Success
+ * -1 : No RTT sample has been taken yet.
+ */
+int smb2_get_rtt(struct smb2_context *smb2, uint32_t *srtt_ms,
+                 uint32_t *rttvar_ms);
+
+/*
+ * Drive the keepalive logic. This is called from smb2_service() and
+ * the sync functions, applications that only call smb2_service() when
+ * there are socket events should call this at least once every second.
+ *
+ * Returns:
+ *  0 : Success
+ * -1 : The server has been declared dead.
+ */
+int smb2_keepalive_service(struct smb2_context *smb2);
+
 /*
  * Set passthrough-enable.  Passthrough allows command packers
  * and unpackers to keep the extra data on complex commands
@@ -390,6 +449,20 @@ const char *smb2_get_user(struct smb2_context *smb2);
  */
 void smb2_set_password(struct smb2_context *smb2, const char *password);
 
+/*
+ * The NTLMv2 key that authenticating derived from the password, so that an
+ * application reconnecting with a new context can hand it over instead of
+ * having it derived again. Only the key is kept, and it goes with the
+ * context: smb2_set_password() and smb2_destroy_context() wipe it.
+ *
+ * smb2_get_ntlm_key() returns 0 and fills in key if the context has one.
+ * smb2_set_ntlm_key() gives a new context the key for user and domain (NULL
+ * if none), to be called after smb2_set_password(). Returns 0 on success.
+ */
+int smb2_get_ntlm_key(struct smb2_context *smb2, uint8_t key[16]);
+int smb2_set_ntlm_key(struct smb2_context *smb2, const char *user,
+                      const char *domain, const uint8_t key[16]);
+
 /*
  * Convert a win timestamp to a unix timeval
  */
@@ -480,6 +553,11 @@ const char *smb2_get_client_guid(struct smb2_context *smb2);
 /*
  * Asynchronous call to connect a TCP connection to the server
  *
+ * A server of the form "unix:<path>" is connected through the Unix-domain
+ * socket at path instead, where the platform has them (HAVE_SYS_UN_H), and
+ * if smb2_set_pipe_server() was called the in-process server is connected
+ * whatever the server name.
+ *
  * Returns:
  *  0 if the call was initiated and a connection will be attempted. Result of
  * the connection will be reported through the callback function.
@@ -494,6 +572,43 @@ const char *smb2_get_client_guid(struct smb2_context *smb2);
 int smb2_connect_async(struct smb2_context *smb2, const char *server,
                        smb2_command_cb cb, void *cb_data);
 
+/*
+ * Asynchronous call to connect to a server listening on a Unix-domain
+ * socket. Only available where the platform has them (HAVE_SYS_UN_H).
+ *
+ * Returns and callback as for smb2_connect_async().
+ */
+int smb2_connect_unix_async(struct smb2_context *smb2, const char *path,
+                            smb2_command_cb cb, void *cb_data);
+
+/*
+ * Asynchronous call to connect to a server in the same process.
+ *
+ * A server side context for server is created, set up as smb2_serve_port()
+ * does for an accepted connection, and joined to smb2 by an in-memory pipe.
+ * Neither context has an fd: smb2_get_fd() returns -1 and the application
+ * simply calls smb2_service(smb2, smb2_which_events(smb2)) whenever it has
+ * queued a request, which runs both ends until the pipe is idle. Kerberos
+ * server credentials are not loaded, unlike in smb2_serve_port().
+ *
+ * The server side context is destroyed when smb2 disconnects.
+ *
+ * Returns and callback as for smb2_connect_async(), the callback is invoked
+ * from the first smb2_service().
+ */
+struct smb2_server;
+int smb2_connect_pipe_async(struct smb2_context *smb2,
+                            struct smb2_server *server,
+                            smb2_command_cb cb, void *cb_data);
+
+/*
+ * Make smb2_connect_async(), and so smb2_connect_share() and friends,
+ * connect to server through smb2_connect_pipe_async(). NULL restores
+ * normal connects.
+ */
+void smb2_set_pipe_server(struct smb2_context *smb2,
+                          struct smb2_server *server);
+
 /*
  * Async call to connect to a share.
  * On unix, if user is NULL then default to the current user.
@@ -528,6 +643,26 @@ int smb2_connect_share(struct smb2_context *smb2,
                        const char *share,
                        const char *user);
 
+/*
+ * The size and the FileSystemAttributes ([MS-FSCC] 2.5.1) of the file
+ * system of the share, as queried together with the tree connect. Saves a
+ * statvfs() or query info right after connecting.
+ *
+ * Returns:
+ * 0       : Success.
+ * -ENOENT : The server did not answer the query, or not connected.
+ */
+int smb2_get_share_statvfs(struct smb2_context *smb2,
+                           struct smb2_statvfs *statvfs);
+int smb2_get_share_fs_attributes(struct smb2_context *smb2,
+                                 uint32_t *attributes);
+
+/*
+ * The ShareCapabilities the server gave with the last successful tree
+ * connect, SMB2_SHARE_CAP_DFS among them. 0 if never connected.
+ */
+uint32_t smb2_get_share_capabilities(struct smb2_context *smb2);
+
 /*
  * Async call to disconnect from a share/
  *
@@ -554,6 +689,114 @@ int smb2_disconnect_share_async(struct smb2_context *smb2,
  */
 int smb2_disconnect_share(struct smb2_context *smb2);
 
+/*
+ * Async call to connect another share on the session of a connected
+ * context, without a new connection and session setup. The new share
+ * becomes the current one and the one that was current before is
+ * disconnected.
+ *
+ * Returns:
+ *  0 if the call was initiated and the share will be connected. Result of
+ * the connect will be reported through the callback function.
+ * -errno if there was an error. The callback function will not be invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    0     : Connection was successful. Command_data is NULL.
+ *
+ *   -errno : Failed to connect to the share. The context stays connected
+ *            to the share it was using. Command_data is NULL.
+ */
+int smb2_connect_tree_async(struct smb2_context *smb2, const char *share,
+                            smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync call to connect another share on the same session.
+ *
+ * Returns:
+ * 0      : Connected to the share successfully.
+ * -errno : Failure.
+ */
+int smb2_connect_tree(struct smb2_context *smb2, const char *share);
+
+/*
+ * DFS referrals. Paths are DFS paths: \server\share\path, with one or
+ * two leading backslashes.
+ */
+struct smb2_dfs_referral {
+        /* characters at the start of the requested path that the
+         * referral covers */
+        uint32_t path_consumed;
+        /* ReferralHeaderFlags [MS-DFSC] 2.2.4 */
+        uint32_t flags;
+        /* seconds the referral may be cached for */
+        uint32_t ttl;
+        int num_targets;
+        /* \server\share[\path] for each target, in the order to try them */
+        char **targets;
+};
+
+void smb2_free_dfs_referral(struct smb2_dfs_referral *ref);
+
+/*
+ * Async call to ask the server for the DFS referral of path.
+ *
+ * Returns:
+ *  0 if the call was initiated. Result will be reported through the
+ * callback function.
+ * -errno if there was an error. The callback function will not be invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    0     : Command_data is a struct smb2_dfs_referral, free it with
+ *            smb2_free_dfs_referral().
+ *
+ *   -errno : Failure, e.g. -ENOENT if path is not in a DFS namespace.
+ *            Command_data is NULL.
+ */
+int smb2_get_dfs_referral_async(struct smb2_context *smb2, const char *path,
+                                smb2_command_cb cb, void *cb_data);
+
+/*
+ * Async call to map path in a DFS namespace to the path it stands for,
+ * \server\share\path on the share that holds the data. The referrals
+ * are cached for all contexts until their TTL runs out, so most paths are
+ * resolved without a round trip (and the callback is then called before
+ * this returns).
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    0     : Command_data is the resolved path, a char * that is only
+ *            valid in the callback.
+ *
+ *   -errno : Failure, e.g. -ENOENT if path is not in a DFS namespace.
+ *            Command_data is NULL.
+ */
+int smb2_dfs_resolve_async(struct smb2_context *smb2, const char *path,
+                           smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync call to resolve a DFS path into buf.
+ *
+ * Returns:
+ * 0      : Success.
+ * -errno : Failure.
+ */
+int smb2_dfs_resolve(struct smb2_context *smb2, const char *path,
+                     char *buf, size_t len);
+
+/*
+ * Tells the referral cache that the target path resolved to could not be
+ * reached, so that the next resolve of it gives the next target. Once all
+ * targets of a referral have failed, the next resolve asks for it again.
+ */
+void smb2_dfs_target_failed(const char *path);
+
+/*
+ * Drops all cached referrals.
+ */
+void smb2_dfs_flush_cache(void);
+
 /*
  * Select a tree id that was previously connected. Sets the tree_id
  * in the context to be used for subsequent requests
@@ -644,6 +887,34 @@ void smb2_add_compound_pdu(struct smb2_context *smb2,
 void smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu);
 void smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu);
 
+/*
+ * Cancel a queued request, identified by the message id that
+ * smb2_get_pdu_message_id() returns once the pdu has been queued.
+ *
+ * If the request has not been sent yet it is dropped, together with
+ * the rest of its compound chain, and the callbacks are invoked right
+ * away with SMB2_STATUS_CANCELLED.
+ * Otherwise a CANCEL is sent for it and for any related requests
+ * compounded after it (using the async id if the server has already
+ * replied STATUS_PENDING). The callbacks are then invoked when the
+ * server completes the requests, normally with SMB2_STATUS_CANCELLED
+ * but possibly with the real result if it finished first.
+ *
+ * Returns:
+ *  0       : Success.
+ * -ENOENT  : No such request is outstanding.
+ * -errno   : Some other error.
+ */
+int smb2_cancel(struct smb2_context *smb2, uint64_t message_id);
+
+/*
+ * Returns the number of bytes held by requests that are queued or waiting
+ * for a reply, including the buffers that replies will be read into.
+ * Applications can use this to stop submitting new requests while a lot
+ * of data is outstanding.
+ */
+size_t smb2_get_queued_bytes(struct smb2_context *smb2);
+
 /*
  * These are used to access/modify pdus from application level
  * useful for proxies, etc.
@@ -771,6 +1042,19 @@ int smb2_open_async(struct smb2_context *smb2, const char *path, int flags,
  */
 struct smb2fh *smb2_open(struct smb2_context *smb2, const char *path, int flags);
 struct smb2fh *smb2_open_r2(struct smb2_context *smb2, const char *path, int flags, int *r2);
+/*
+ * As smb2_open_r2() but requesting an oplock. The level that was granted
+ * can be read with smb2_get_oplock_level().
+ */
+struct smb2fh *smb2_open_oplock_r2(struct smb2_context *smb2, const char *path,
+                                   int flags, uint8_t oplock_level, int *r2);
+
+/*
+ * Oplock level currently held on an open file, SMB2_OPLOCK_LEVEL_NONE if
+ * none was granted. Breaks received from the server lower it to the level
+ * that was acknowledged.
+ */
+uint8_t smb2_get_oplock_level(struct smb2fh *fh);
 
 /*
  * CLOSE
@@ -822,6 +1106,43 @@ int smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
  */
 int smb2_fsync(struct smb2_context *smb2, struct smb2fh *fh);
 
+/*
+ * LOCK
+ */
+/*
+ * Maximum number of byte range locks in one request.
+ */
+#define SMB2_MAX_LOCK_ELEMENTS 64
+
+/*
+ * Async byte range lock and unlock.
+ *
+ * All count elements are sent in a single LOCK request. The server applies
+ * them in order and, if one fails, undoes the ones before it. A request
+ * with more than one element must either unlock only, or lock only with
+ * SMB2_LOCKFLAG_FAIL_IMMEDIATELY set on every element.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ * -errno : An error occurred, -EDEADLK if a range is locked by someone else.
+ *
+ * Command_data is always NULL.
+ */
+int smb2_lock_async(struct smb2_context *smb2, struct smb2fh *fh,
+                    const struct smb2_lock_element *locks, int count,
+                    smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync lock()
+ */
+int smb2_lock(struct smb2_context *smb2, struct smb2fh *fh,
+              const struct smb2_lock_element *locks, int count);
+
 /*
  * GetMaxReadWriteSize
  * SMB2 servers have a maximum size for read/write data that they support.
@@ -909,6 +1230,80 @@ int smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
 int smb2_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
                 const uint8_t *buf, uint32_t count, uint64_t offset);
 
+/*
+ * PREADV / PWRITEV
+ */
+/*
+ * Maximum number of segments in one vectored read or write.
+ */
+#define SMB2_MAX_IO_SEGMENTS 64
+
+/*
+ * Async preadv()
+ * Like smb2_pread_async() but the data is scattered over nvec buffers,
+ * in order, as it is received. No intermediate copy is made.
+ * Only the buf and len members of the vectors are used.
+ *
+ * As with smb2_pread_async() fewer bytes than the total length of the
+ * vectors may be transferred, if it exceeds the maximum read size or
+ * the credits currently available. Check the result and call again
+ * for the rest.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *    >=0 : Number of bytes read.
+ * -errno : An error occurred.
+ *
+ * Command_data is struct smb2_read_cb_data, with buf set to NULL and
+ * count set to the total length of the vectors.
+ * This structure is automatically freed.
+ */
+int smb2_preadv_async(struct smb2_context *smb2, struct smb2fh *fh,
+                      const struct smb2_iovec *vec, int nvec,
+                      uint64_t offset,
+                      smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync preadv()
+ */
+int smb2_preadv(struct smb2_context *smb2, struct smb2fh *fh,
+                const struct smb2_iovec *vec, int nvec, uint64_t offset);
+
+/*
+ * Async pwritev()
+ * Like smb2_pwrite_async() but the data is gathered from nvec buffers,
+ * in order, straight into the outgoing request. No intermediate copy
+ * is made, so the buffers must stay valid until the callback has been
+ * invoked. Only the buf and len members of the vectors are used.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *    >=0 : Number of bytes written.
+ * -errno : An error occurred.
+ *
+ * Command_data is struct smb2_write_cb_data, with buf set to NULL and
+ * count set to the total length of the vectors.
+ * This structure is automatically freed.
+ */
+int smb2_pwritev_async(struct smb2_context *smb2, struct smb2fh *fh,
+                       const struct smb2_iovec *vec, int nvec,
+                       uint64_t offset,
+                       smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync pwritev()
+ */
+int smb2_pwritev(struct smb2_context *smb2, struct smb2fh *fh,
+                 const struct smb2_iovec *vec, int nvec, uint64_t offset);
+
 /*
  * READ
  */
@@ -1281,6 +1676,18 @@ struct smb2_server;
  * == 0 on OK, and the library should use the reply struct (if needed) to create a reply
  * > 0  if the handler created and queued a reply itself
  */
+/* Events passed to durable_handle_cmd for an open made by create_cmd */
+/* the client asked for the open to be durable */
+#define SMB2_DURABLE_GRANT      0
+/* the connection smb2 is gone, but the open must stay open when
+ * destruction_event closes the rest of them
+ */
+#define SMB2_DURABLE_DISCONNECT 1
+/* the client reconnected and the open now belongs to the connection smb2 */
+#define SMB2_DURABLE_RECONNECT  2
+/* the client did not come back in time, close the open (smb2 is NULL) */
+#define SMB2_DURABLE_EXPIRE     3
+
 struct smb2_server_request_handlers {
         int (*destruction_event)(struct smb2_server *srvr, struct smb2_context *smb2);
         int (*authorize_user)(struct smb2_server *srvr, struct smb2_context *smb2,
@@ -1330,6 +1737,29 @@ struct smb2_server_request_handlers {
                             struct smb2_query_info_reply *rep);
         int (*set_info_cmd)(struct smb2_server *srvr, struct smb2_context *smb2,
                             struct smb2_set_info_request *req);
+        /* For the read cache: what file an open made by create_cmd refers
+         * to, as a number that is the same for every open of that file
+         * (e.g. its inode number). Return non-0 to not cache its reads.
+         */
+        int (*file_identity_cmd)(struct smb2_server *srvr, struct smb2_context *smb2,
+                            const smb2_file_id file_id, uint64_t *identity);
+        /* For durable handles, see the SMB2_DURABLE_ events below. Return
+         * non-0 to not make an open durable or to fail a reconnect.
+         */
+        int (*durable_handle_cmd)(struct smb2_server *srvr, struct smb2_context *smb2,
+                            const smb2_file_id file_id, int event);
+        /* For server side copies (FSCTL_SRV_COPYCHUNK): copy length bytes
+         * at src_offset of the open src to dst_offset of the open dst and
+         * set *copied to what was copied, less than length only at the end
+         * of src. Return 0, or -errno if the copy failed. The library has
+         * checked that src was opened with FILE_READ_DATA and dst with
+         * FILE_WRITE_DATA (and FILE_READ_DATA for FSCTL_SRV_COPYCHUNK);
+         * anything more, e.g. share modes or locks, is up to the handler.
+         */
+        int (*copy_range_cmd)(struct smb2_server *srvr, struct smb2_context *smb2,
+                            const smb2_file_id src, uint64_t src_offset,
+                            const smb2_file_id dst, uint64_t dst_offset,
+                            uint32_t length, uint32_t *copied);
         /*
         int (*oplock_break cmd)(struct smb2_server *srvr, struct smb2_context *smb2,
                             struct smb2_oplock_break_request *req);
@@ -1347,6 +1777,26 @@ struct smb2_server {
         uint32_t max_transact_size;
         uint32_t max_read_size;
         uint32_t max_write_size;
+        /* bytes of requests each connection may have served per pass of
+         * smb2_serve_port() before the next one gets its turn */
+        uint32_t sched_quantum;
+        /* requests each connection may have in flight, the credits granted
+         * to the client are kept within this as well */
+        uint16_t max_requests;
+        /* bytes of READ data to cache for all connections, 0 for none.
+         * Needs the file_identity_cmd handler.
+         */
+        size_t read_cache_size;
+        struct smb2_read_cache *read_cache;
+        /* directories watched by CHANGE_NOTIFY, see smb2_notify_watch() */
+        struct smb2_notify_watch *notify_watches;
+        struct smb2_inotify *inotify;
+        /* ms a durable open is kept for a client that lost its
+         * connection, 0 for the default of 60 s. Needs the
+         * durable_handle_cmd handler.
+         */
+        uint32_t durable_timeout;
+        struct smb2_durable_open *durable_opens;
         int signing_enabled;
         int allow_anonymous;
         /* this can be set non-0 to delegate client authentication to
@@ -1374,6 +1824,59 @@ int smb2_serve_port_async(const int fd, const int to_msecs, struct smb2_context
  */
 int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_client_connection cb, void *cb_data);
 
+/*
+ * Drops what the read cache holds of the file with this identity (as
+ * returned by the file_identity_cmd handler). For backends to call when
+ * the file was changed other than through the server.
+ */
+void smb2_server_read_cache_invalidate(struct smb2_server *server,
+                                       uint64_t identity);
+
+/*
+ * For copy_range_cmd handlers of backends that serve local files: copies
+ * between two file descriptors without the data leaving the kernel where
+ * it can (copy_file_range()). Only where that exists, elsewhere it returns
+ * -ENOSYS.
+ *
+ * Returns 0 on success or -errno.
+ */
+int smb2_server_copy_fd_range(int src_fd, uint64_t src_offset,
+                              int dst_fd, uint64_t dst_offset,
+                              uint32_t length, uint32_t *copied);
+
+/*
+ * Change notification.
+ *
+ * For change_notify_cmd handlers: hands the request over to the library,
+ * which keeps it pending until smb2_notify_post() reports a change in the
+ * directory at path (or below it, with SMB2_CHANGE_NOTIFY_WATCH_TREE) that
+ * matches its completion filter. The handler then returns 1.
+ * Paths are '/' separated and without a leading '/', the root is "".
+ *
+ * Returns 0 on success or -errno, then the handler should return -1.
+ */
+int smb2_notify_watch(struct smb2_server *server, struct smb2_context *smb2,
+                      struct smb2_change_notify_request *req,
+                      const char *path);
+
+/*
+ * Reports a change to the item at path. action is one of the
+ * SMB2_NOTIFY_CHANGE_FILE_ACTION_* and filter the
+ * SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_* bits the change falls under.
+ */
+void smb2_notify_post(struct smb2_server *server, const char *path,
+                      uint32_t action, uint32_t filter);
+
+/*
+ * Posts the changes made to the local directory tree at root, with paths
+ * relative to root, while smb2_serve_port() runs. Only on Linux (inotify),
+ * elsewhere it returns -ENOSYS.
+ *
+ * Returns 0 on success or -errno.
+ */
+int smb2_notify_inotify_start(struct smb2_server *server, const char *root);
+void smb2_notify_inotify_stop(struct smb2_server *server);
+
 /*
  * Some symbols have moved over to a different header file to allow better
  * separation between dcerpc and smb2, so we need to include this header
@@ -341,6 +341,15 @@ struct smb2_create_request {
 
 #define SMB2_CREATE_REPLY_SIZE 89
 
+/* Create action */
+#define SMB2_FILE_SUPERSEDED  0x00000000
+#define SMB2_FILE_OPENED      0x00000001
+#define SMB2_FILE_CREATED     0x00000002
+#define SMB2_FILE_OVERWRITTEN 0x00000003
+
+/* Durable handle v2 flags */
+#define SMB2_DHANDLE_FLAG_PERSISTENT 0x00000002
+
 #define SMB2_FD_SIZE 16
 typedef uint8_t smb2_file_id[SMB2_FD_SIZE];
 
@@ -639,6 +648,18 @@ struct smb2_file_stream_info {
         const char *stream_name;
 };
 
+/*
+ * FILE_FULL_EA_INFORMATION
+ */
+struct smb2_file_full_ea_info {
+        uint32_t next_entry_offset;
+        uint8_t flags;
+        uint8_t ea_name_length;
+        uint16_t ea_value_length;
+        const char *ea_name;
+        const uint8_t *ea_value;
+};
+
 /*
  * FILE_POSITION_INFORMATION
  */
@@ -1218,6 +1239,11 @@ struct smb2_lock_element {
         uint32_t reserved;
 };
 
+#define SMB2_LOCKFLAG_SHARED_LOCK       0x00000001
+#define SMB2_LOCKFLAG_EXCLUSIVE_LOCK    0x00000002
+#define SMB2_LOCKFLAG_UNLOCK            0x00000004
+#define SMB2_LOCKFLAG_FAIL_IMMEDIATELY  0x00000010
+
 /* Note that this size includes 1 lock element */
 #define SMB2_LOCK_REQUEST_SIZE 48
 
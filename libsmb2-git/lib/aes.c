@@ -16,6 +16,8 @@
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
+
 #include "aes.h"
 
 #ifdef __APPLE__
@@ -31,3 +33,20 @@ AES128_ECB_encrypt_apple(input, key, output);
 AES128_ECB_encrypt_reference(input, key, output);
 #endif
 }
+
+void AES128_expand_key(const uint8_t* key, uint8_t *round_keys) {
+#ifdef __APPLE__
+/* CommonCrypto keeps the schedule to itself, keep the key */
+memcpy(round_keys, key, 16);
+#else
+AES128_expand_key_reference(key, round_keys);
+#endif
+}
+
+void AES128_ECB_encrypt_expanded(const uint8_t* input, const uint8_t* round_keys, uint8_t *output) {
+#ifdef __APPLE__
+AES128_ECB_encrypt_apple(input, round_keys, output);
+#else
+AES128_ECB_encrypt_expanded_reference(input, round_keys, output);
+#endif
+}
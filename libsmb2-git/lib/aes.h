@@ -26,4 +26,10 @@
 
 void AES128_ECB_encrypt(uint8_t* input, const uint8_t* key, uint8_t *output);
 
+/* The round keys of an AES-128 key, for encrypting many blocks with it */
+#define AES128_ROUND_KEYS_SIZE 176
+
+void AES128_expand_key(const uint8_t* key, uint8_t *round_keys);
+void AES128_ECB_encrypt_expanded(const uint8_t* input, const uint8_t* round_keys, uint8_t *output);
+
 #endif
@@ -35,9 +35,19 @@
 #include "portable-endian.h"
 #include "aes.h"
 
-static void aes_ccm_generate_b0(unsigned char *nonce, size_t nlen,
+#include "aes128ccm.h"
+
+/*
+ * CCM ([RFC 3610]) with the payload coming in pieces: the MAC and the key
+ * stream carry over from one piece to the next, so the vectors of a PDU are
+ * sealed into the send buffer, or opened where they were received, in one
+ * pass each without being gathered first. The key is expanded by the caller
+ * and used for every block.
+ */
+
+static void aes_ccm_generate_b0(const uint8_t *nonce, size_t nlen,
                                 size_t alen, size_t plen, size_t mlen,
-                                unsigned char *buf)
+                                uint8_t *buf)
 {
         uint32_t len;
 
@@ -53,101 +63,134 @@ static void aes_ccm_generate_b0(unsigned char *nonce, size_t nlen,
         memcpy(&buf[1], nonce, nlen);
 }
 
-static inline void bxory(unsigned char *b, unsigned char *y, size_t num)
+/* Adds data to the CBC-MAC, a block is encrypted once it is full */
+static void ccm_mac(struct aes128ccm *ccm, const uint8_t *p, size_t len)
 {
-        int i;
+        while (len--) {
+                ccm->y[ccm->y_len++] ^= *p++;
+                if (ccm->y_len == 16) {
+                        AES128_ECB_encrypt_expanded(ccm->y, ccm->round_keys,
+                                                    ccm->y);
+                        ccm->y_len = 0;
+                }
+        }
+}
+
+/* Pads the last block of the MAC with zeroes */
+static void ccm_mac_pad(struct aes128ccm *ccm)
+{
+        if (ccm->y_len) {
+                AES128_ECB_encrypt_expanded(ccm->y, ccm->round_keys, ccm->y);
+                ccm->y_len = 0;
+        }
+}
+
+/* The key stream block for counter i, which takes the L bytes after the
+ * nonce (L' + 1, see aes128ccm_init)
+ */
+static void ccm_generate_s(struct aes128ccm *ccm, uint32_t i, uint8_t *s)
+{
+        int n;
 
-        for(i = 0; i < (int)num; i++) {
-                b[i] = b[i] ^ y[i];
+        for (n = 15; n > 15 - ((ccm->a[0] & 0x07) + 1); n--) {
+                ccm->a[n] = i & 0xff;
+                i >>= 8;
         }
+        AES128_ECB_encrypt_expanded(ccm->a, ccm->round_keys, s);
 }
 
-static void ccm_generate_T(unsigned char *key,
-                           unsigned char *nonce, size_t nlen,
-                           unsigned char *aad, size_t alen,
-                           unsigned char *p, size_t plen,
-                           unsigned char *m, size_t mlen)
+void aes128ccm_init(struct aes128ccm *ccm, const uint8_t *round_keys,
+                    const uint8_t *nonce, size_t nlen,
+                    const uint8_t *aad, size_t alen,
+                    size_t plen, size_t mlen)
 {
-        unsigned char b[16] _U_, y[16]_U_;
+        uint8_t b[16];
         uint16_t l;
 
+        ccm->round_keys = round_keys;
+
         aes_ccm_generate_b0(nonce, nlen, alen, plen, mlen, &b[0]);
-        AES128_ECB_encrypt(b, key, y);
+        AES128_ECB_encrypt_expanded(b, round_keys, ccm->y);
+        ccm->y_len = 0;
 
-        /* Create Aad */
         if (alen) {
-                /* First block */
-                memset(b, 0, 16);
                 l = htobe16((uint16_t)alen);
-                memcpy(b, &l, 2);
-
-                l = (alen > 14) ? 14 : (uint16_t)alen;
-                memcpy(&b[2], aad, l);
-                aad  += l;
-                alen -= l;
+                ccm_mac(ccm, (uint8_t *)&l, 2);
+                ccm_mac(ccm, aad, alen);
+                ccm_mac_pad(ccm);
+        }
 
-                bxory(b, y, 16);
-                AES128_ECB_encrypt(b, key, y);
+        memset(ccm->a, 0, 16);
+        ccm->a[0] |= (15 - nlen - 1) & 0x07;
+        memcpy(&ccm->a[1], nonce, nlen);
+        ccm_generate_s(ccm, 0, ccm->s0);
+        ccm->ctr = 0;
+        ccm->s_used = 16;
+}
 
-                while (alen) {
-                        memset(b, 0, 16);
-                        l = (alen > 16) ? 16 : (uint16_t)alen;
-                        memcpy(b, aad, l);
-                        aad  += l;
-                        alen -= l;
+static void ccm_update(struct aes128ccm *ccm, const uint8_t *in,
+                       uint8_t *out, size_t len, int encrypt)
+{
+        uint8_t c;
+        int i;
 
-                        bxory(b, y, 16);
-                        AES128_ECB_encrypt(b, key, y);
+        while (len) {
+                if (ccm->s_used == 16) {
+                        ccm_generate_s(ccm, ++ccm->ctr, ccm->s);
+                        ccm->s_used = 0;
                 }
+                if (ccm->s_used == 0 && ccm->y_len == 0 && len >= 16) {
+                        /* a whole block, in may be out */
+                        for (i = 0; i < 16; i++) {
+                                c = in[i];
+                                if (encrypt) {
+                                        ccm->y[i] ^= c;
+                                        out[i] = c ^ ccm->s[i];
+                                } else {
+                                        out[i] = c ^ ccm->s[i];
+                                        ccm->y[i] ^= out[i];
+                                }
+                        }
+                        AES128_ECB_encrypt_expanded(ccm->y, ccm->round_keys,
+                                                    ccm->y);
+                        ccm->s_used = 16;
+                        in += 16;
+                        out += 16;
+                        len -= 16;
+                        continue;
+                }
+                c = *in++;
+                if (encrypt) {
+                        ccm_mac(ccm, &c, 1);
+                        *out++ = c ^ ccm->s[ccm->s_used++];
+                } else {
+                        c ^= ccm->s[ccm->s_used++];
+                        *out++ = c;
+                        ccm_mac(ccm, &c, 1);
+                }
+                len--;
         }
-
-        /* Create Payload */
-        while (plen) {
-                memset(b, 0, 16);
-                l = (plen > 16) ? 16 : (uint16_t)plen;
-                memcpy(b, p, l);
-                p    += l;
-                plen -= l;
-
-                bxory(b, y, 16);
-                AES128_ECB_encrypt(b, key, y);
-        }
-
-        memcpy(m, y, mlen);
 }
 
-static void ccm_generate_s(unsigned char *key, unsigned char *nonce, size_t nlen,
-                           size_t plen, int i, unsigned char *s)
+void aes128ccm_encrypt_update(struct aes128ccm *ccm, const uint8_t *in,
+                              uint8_t *out, size_t len)
 {
-        uint32_t l;
-
-        memset(s, 0, 16);
-        s[0] |= (15 - nlen - 1) & 0x07;
-
-        l = htobe32(i);
-        memcpy(&s[12], &l, 4);
-
-        memcpy(&s[1], nonce, nlen);
+        ccm_update(ccm, in, out, len, 1);
+}
 
-        AES128_ECB_encrypt(s, key, s);
+void aes128ccm_decrypt_update(struct aes128ccm *ccm, const uint8_t *in,
+                              uint8_t *out, size_t len)
+{
+        ccm_update(ccm, in, out, len, 0);
 }
 
-static void aes_ccm_crypt(unsigned char *key,
-                          unsigned char *nonce, size_t nlen,
-                          unsigned char *p, size_t plen)
+void aes128ccm_final(struct aes128ccm *ccm, uint8_t *m, size_t mlen)
 {
-        int j;
-        size_t l;
-        unsigned char s[16] _U_;
-
-        j = 0;
-        while (plen) {
-                l = (plen > 16) ? 16 : plen;
-                ccm_generate_s(key, nonce, nlen, plen, j + 1, &s[0]);
-                bxory(&p[j * 16], &s[0], l);
-
-                j++;
-                plen -= l;
+        size_t i;
+
+        ccm_mac_pad(ccm);
+        for (i = 0; i < mlen; i++) {
+                m[i] = ccm->y[i] ^ ccm->s0[i];
         }
 }
 
@@ -157,13 +200,13 @@ void aes128ccm_encrypt(unsigned char *key,
                        unsigned char *p, size_t plen,
                        unsigned char *m, size_t mlen)
 {
-        unsigned char s[16] _U_;
+        uint8_t round_keys[AES128_ROUND_KEYS_SIZE];
+        struct aes128ccm ccm;
 
-        ccm_generate_T(key, nonce, nlen, aad, alen, p, plen, m, mlen);
-        ccm_generate_s(key, nonce, nlen, plen, 0, &s[0]);
-        bxory(m, &s[0], mlen);
-
-        aes_ccm_crypt(key, nonce, nlen, p, plen);
+        AES128_expand_key(key, round_keys);
+        aes128ccm_init(&ccm, round_keys, nonce, nlen, aad, alen, plen, mlen);
+        aes128ccm_encrypt_update(&ccm, p, p, plen);
+        aes128ccm_final(&ccm, m, mlen);
 }
 
 int aes128ccm_decrypt(unsigned char *key,
@@ -172,14 +215,14 @@ int aes128ccm_decrypt(unsigned char *key,
                       unsigned char *p, size_t plen,
                       unsigned char *m, size_t mlen)
 {
-        unsigned char s[16] _U_;
+        uint8_t round_keys[AES128_ROUND_KEYS_SIZE];
+        struct aes128ccm ccm;
         unsigned char tmp[16];
 
-        aes_ccm_crypt(key, nonce, nlen, p, plen);
-
-        ccm_generate_T(key, nonce, nlen, aad, alen, p, plen, tmp, mlen);
-        ccm_generate_s(key, nonce, nlen, plen, 0, &s[0]);
-        bxory(tmp, &s[0], mlen);
+        AES128_expand_key(key, round_keys);
+        aes128ccm_init(&ccm, round_keys, nonce, nlen, aad, alen, plen, mlen);
+        aes128ccm_decrypt_update(&ccm, p, p, plen);
+        aes128ccm_final(&ccm, tmp, mlen);
 
         return memcmp(tmp, m, mlen);
 }
@@ -15,6 +15,29 @@
    You should have received a copy of the GNU Lesser General Public License
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
+/* A CCM operation in progress, see aes128ccm.c */
+struct aes128ccm {
+        const uint8_t *round_keys;
+        uint8_t y[16];          /* the CBC-MAC */
+        size_t y_len;           /* bytes added to y since it was encrypted */
+        uint8_t a[16];          /* the counter block */
+        uint32_t ctr;
+        uint8_t s[16];          /* key stream of counter ctr */
+        size_t s_used;
+        uint8_t s0[16];         /* encrypts the MAC */
+};
+
+void aes128ccm_init(struct aes128ccm *ccm, const uint8_t *round_keys,
+                    const uint8_t *nonce, size_t nlen,
+                    const uint8_t *aad, size_t alen,
+                    size_t plen, size_t mlen);
+/* in and out may be the same buffer */
+void aes128ccm_encrypt_update(struct aes128ccm *ccm, const uint8_t *in,
+                              uint8_t *out, size_t len);
+void aes128ccm_decrypt_update(struct aes128ccm *ccm, const uint8_t *in,
+                              uint8_t *out, size_t len);
+void aes128ccm_final(struct aes128ccm *ccm, uint8_t *m, size_t mlen);
+
 void aes128ccm_encrypt(unsigned char *key,
 		       unsigned char *nonce, size_t nlen,
 		       unsigned char *aad, size_t alen,
@@ -455,6 +455,18 @@ void AES128_ECB_encrypt_reference(uint8_t* input, const uint8_t* key, uint8_t* o
   Cipher(roundKey, (state_t*)output);
 }
 
+// For encrypting many blocks with one key: expand it once, into 176 bytes.
+void AES128_expand_key_reference(const uint8_t* key, uint8_t* roundKey)
+{
+  KeyExpansion(key, roundKey);
+}
+
+void AES128_ECB_encrypt_expanded_reference(const uint8_t* input, const uint8_t* roundKey, uint8_t* output)
+{
+  BlockCopy(output, (uint8_t*)input);
+  Cipher((uint8_t*)roundKey, (state_t*)output);
+}
+
 void AES128_ECB_decrypt_reference(uint8_t* input, const uint8_t* key, uint8_t *output)
 {
   // The array that stores the round keys.
@@ -33,6 +33,8 @@
 
 void AES128_ECB_encrypt_reference(uint8_t* input, const uint8_t* key, uint8_t *output);
 void AES128_ECB_decrypt_reference(uint8_t* input, const uint8_t* key, uint8_t *output);
+void AES128_expand_key_reference(const uint8_t* key, uint8_t* roundKey);
+void AES128_ECB_encrypt_expanded_reference(const uint8_t* input, const uint8_t* roundKey, uint8_t* output);
 
 #endif // #if defined(ECB) && ECB
 
@@ -341,17 +341,7 @@ int getlogin_r(char *buf, size_t size);
 #endif
 #define strncpy(a,b,c) strcpy(a,b)
 
-#define POLLIN      0x0001    /* There is data to read */
-#define POLLPRI     0x0002    /* There is urgent data to read */
-#define POLLOUT     0x0004    /* Writing now will not block */
-#define POLLERR     0x0008    /* Error condition */
-#define POLLHUP     0x0010    /* Hung up */
-
-struct pollfd {
-        int fd;
-        short events;
-        short revents;
-};
+#include "poll-compat.h"
 
 #ifndef HAVE_ADDRINFO
 
@@ -368,8 +358,6 @@ struct addrinfo {
 
 #endif
 
-int poll(struct pollfd *fds, unsigned int nfds, int timo);
-
 int smb2_getaddrinfo(const char *node, const char*service,
                 const struct addrinfo *hints,
                 struct addrinfo **res);
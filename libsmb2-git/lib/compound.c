@@ -0,0 +1,266 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * Compound requests in the server ([MS-SMB2] 3.3.5.2.7).
+ *
+ * The requests of a compound are decoded and handed to their handlers one
+ * after the other as before, but the replies to them are held back and go
+ * out together, chained in one frame, once the last request of the chain
+ * has been handled. A reply that is not ready by then (a handler that
+ * answers later) is sent on its own when it is.
+ *
+ * In a chain of related operations (SMB2_FLAGS_RELATED_OPERATIONS) a
+ * request with the file id 0xFFFFFFFFFFFFFFFF... works on the file the
+ * CREATE before it in the chain opened, and once a request in the chain
+ * has failed with an error all the related requests after it fail with the
+ * same status without reaching their handlers. This is what a
+ * CREATE+READ+CLOSE or CREATE+QUERY_INFO+CLOSE from a client relies on.
+ */
+
+/* Called for each request just before it is handed to its handler */
+void
+smb2_compound_begin(struct smb2_context *smb2)
+{
+        if (!(smb2->hdr.flags & SMB2_FLAGS_RELATED_OPERATIONS)) {
+                /* the first request of a chain, or one on its own */
+                smb2->compound_status = SMB2_STATUS_SUCCESS;
+                smb2->compound_have_fid = 0;
+        }
+        if (smb2->hdr.next_command) {
+                smb2->compound_open = 1;
+        }
+}
+
+/* Called after the request has been handled */
+void
+smb2_compound_end(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+
+        if (smb2->hdr.next_command || !smb2->compound_open) {
+                return;
+        }
+        smb2->compound_open = 0;
+
+        pdu = smb2->compound_replies;
+        smb2->compound_replies = NULL;
+        if (pdu != NULL) {
+                smb2_queue_pdu(smb2, pdu);
+        }
+}
+
+/*
+ * From smb2_queue_pdu(): keeps a reply to the request being handled for
+ * the chain. Returns 1 if it was kept.
+ */
+int
+smb2_compound_defer(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu *p;
+
+        if (!smb2->compound_open || pdu->next_compound != NULL ||
+            pdu->header.message_id != smb2->message_id) {
+                return 0;
+        }
+        /* an async reply to a request already answered in the chain */
+        for (p = smb2->compound_replies; p; p = p->next_compound) {
+                if (p->header.message_id == pdu->header.message_id) {
+                        return 0;
+                }
+        }
+
+        /* warnings such as STATUS_BUFFER_OVERFLOW do not stop the chain */
+        if ((pdu->header.status & SMB2_STATUS_SEVERITY_MASK) ==
+            SMB2_STATUS_SEVERITY_ERROR) {
+                smb2->compound_status = pdu->header.status;
+        }
+
+        if (smb2->compound_replies == NULL) {
+                smb2->compound_replies = pdu;
+                return 1;
+        }
+        smb2_add_compound_pdu(smb2, smb2->compound_replies, pdu);
+        /* the replies are related only if the requests were */
+        if (!(smb2->hdr.flags & SMB2_FLAGS_RELATED_OPERATIONS)) {
+                pdu->header.flags &= ~SMB2_FLAGS_RELATED_OPERATIONS;
+        }
+        return 1;
+}
+
+/* A CREATE in the chain opened file_id */
+void
+smb2_compound_opened(struct smb2_context *smb2, const smb2_file_id file_id)
+{
+        memcpy(smb2->compound_fid, file_id, SMB2_FD_SIZE);
+        smb2->compound_have_fid = 1;
+}
+
+/* Where the request keeps the file id it works on, if it has one */
+static uint8_t *
+smb2_compound_request_fid(uint16_t command, void *req)
+{
+        switch (command) {
+        case SMB2_CLOSE:
+                return ((struct smb2_close_request *)req)->file_id;
+        case SMB2_FLUSH:
+                return ((struct smb2_flush_request *)req)->file_id;
+        case SMB2_READ:
+                return ((struct smb2_read_request *)req)->file_id;
+        case SMB2_WRITE:
+                return ((struct smb2_write_request *)req)->file_id;
+        case SMB2_LOCK:
+                return ((struct smb2_lock_request *)req)->file_id;
+        case SMB2_IOCTL:
+                return ((struct smb2_ioctl_request *)req)->file_id;
+        case SMB2_QUERY_DIRECTORY:
+                return ((struct smb2_query_directory_request *)req)->file_id;
+        case SMB2_CHANGE_NOTIFY:
+                return ((struct smb2_change_notify_request *)req)->file_id;
+        case SMB2_QUERY_INFO:
+                return ((struct smb2_query_info_request *)req)->file_id;
+        case SMB2_SET_INFO:
+                return ((struct smb2_set_info_request *)req)->file_id;
+        default:
+                return NULL;
+        }
+}
+
+/*
+ * The data a handler would have taken over from the request. Only what the
+ * decoders smb2_alloc_init() themselves: in passthrough mode the input of
+ * other IOCTLs points into the receive buffer.
+ */
+static void
+smb2_compound_free_request(struct smb2_context *smb2, uint16_t command,
+                           void *req)
+{
+        struct smb2_ioctl_request *ioctl;
+
+        switch (command) {
+        case SMB2_CREATE:
+                smb2_free_data(smb2, discard_const(
+                        ((struct smb2_create_request *)req)->name));
+                break;
+        case SMB2_QUERY_DIRECTORY:
+                smb2_free_data(smb2, discard_const(
+                        ((struct smb2_query_directory_request *)req)->name));
+                break;
+        case SMB2_IOCTL:
+                ioctl = req;
+                switch (ioctl->ctl_code) {
+                case SMB2_FSCTL_VALIDATE_NEGOTIATE_INFO:
+                case SMB2_FSCTL_SRV_COPYCHUNK:
+                case SMB2_FSCTL_SRV_COPYCHUNK_WRITE:
+                        smb2_free_data(smb2, discard_const(ioctl->input));
+                        break;
+                default:
+                        break;
+                }
+                break;
+        case SMB2_LOCK:
+                smb2_free_data(smb2,
+                        ((struct smb2_lock_request *)req)->locks);
+                break;
+        default:
+                break;
+        }
+}
+
+/*
+ * Before a related request is handed to its handler: fills in the file id
+ * it inherits, or answers it with the status the chain failed with.
+ * Returns 1 if the request was answered and is not to be handled.
+ */
+int
+smb2_compound_failed(struct smb2_context *smb2, void *command_data,
+                     void *cb_data)
+{
+        struct smb2_error_reply err;
+        struct smb2_pdu *pdu;
+        uint32_t status;
+        uint8_t *fid;
+
+        if (!(smb2->hdr.flags & SMB2_FLAGS_RELATED_OPERATIONS) ||
+            command_data == NULL) {
+                return 0;
+        }
+
+        status = smb2->compound_status;
+        if (status == SMB2_STATUS_SUCCESS) {
+                fid = smb2_compound_request_fid(smb2->hdr.command,
+                                                command_data);
+                if (fid == NULL ||
+                    memcmp(fid, compound_file_id, SMB2_FD_SIZE)) {
+                        return 0;
+                }
+                if (smb2->compound_have_fid) {
+                        memcpy(fid, smb2->compound_fid, SMB2_FD_SIZE);
+                        return 0;
+                }
+                /* nothing before it in the chain opened a file */
+                status = SMB2_STATUS_INVALID_PARAMETER;
+        }
+
+        smb2_compound_free_request(smb2, smb2->hdr.command, command_data);
+
+        memset(&err, 0, sizeof(err));
+        pdu = smb2_cmd_error_reply_async(smb2, &err, smb2->hdr.command,
+                                         status, NULL, cb_data);
+        if (pdu != NULL) {
+                smb2_set_pdu_message_id(smb2, pdu, smb2->message_id);
+                smb2_queue_pdu(smb2, pdu);
+        }
+        return 1;
+}
+
+void
+smb2_compound_free(struct smb2_context *smb2)
+{
+        if (smb2->compound_replies != NULL) {
+                smb2_free_pdu(smb2, smb2->compound_replies);
+                smb2->compound_replies = NULL;
+        }
+        smb2->compound_open = 0;
+}
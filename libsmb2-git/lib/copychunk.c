@@ -0,0 +1,469 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+#include "slist.h"
+
+/*
+ * Server side copy ([MS-SMB2] 3.3.5.15.5 and 3.3.5.15.6).
+ *
+ * A client that copies a file on the share asks for a resume key for the
+ * source with FSCTL_SRV_REQUEST_RESUME_KEY and then sends
+ * FSCTL_SRV_COPYCHUNK(_WRITE) on the destination with a list of chunks to
+ * copy from it. With a copy_range_cmd handler the server answers these
+ * itself: it issues the keys, checks the chunks against the limits below
+ * and has the backend copy them one by one, so the data never crosses the
+ * network. Without the handler the IOCTLs go to ioctl_cmd as before.
+ *
+ * The opens of the connection are kept with the access they asked for (and
+ * were granted, or the CREATE would have failed), as [MS-SMB2] wants the
+ * source to be readable and the destination writable, and readable too for
+ * FSCTL_SRV_COPYCHUNK. These checks are made here, so copy_range_cmd only
+ * ever sees opens that passed them. An open asked for with MAXIMUM_ALLOWED
+ * only is not known to have either.
+ *
+ * A resume key is opaque: a number of the connection and random bytes,
+ * looked up in the table of the opens it was issued for. A key that is not
+ * there, from another connection or for an open that was closed, is no key.
+ */
+
+/* the defaults of Windows, which clients expect */
+#define SMB2_COPYCHUNK_MAX_CHUNKS     256
+#define SMB2_COPYCHUNK_MAX_CHUNK_SIZE (1024 * 1024)
+#define SMB2_COPYCHUNK_MAX_DATA_SIZE  (16 * 1024 * 1024)
+
+#define SMB2_RESUME_KEY_SIZE          24
+#define SMB2_COPYCHUNK_HEADER_SIZE    32
+#define SMB2_COPYCHUNK_CHUNK_SIZE     24
+#define SMB2_COPYCHUNK_REPLY_SIZE     12
+
+/* An open of the connection, see smb2_copychunk_opened() */
+struct smb2_copychunk_open {
+        struct smb2_copychunk_open *next;
+        smb2_file_id file_id;
+        uint32_t access;        /* FILE_READ_DATA and FILE_WRITE_DATA */
+        int have_key;
+        uint8_t key[SMB2_RESUME_KEY_SIZE];
+};
+
+static struct smb2_copychunk_open *
+smb2_copychunk_find_open(struct smb2_context *smb2, const smb2_file_id file_id)
+{
+        struct smb2_copychunk_open *open;
+
+        for (open = smb2->copychunk_opens; open; open = open->next) {
+                if (!memcmp(open->file_id, file_id, SMB2_FD_SIZE)) {
+                        return open;
+                }
+        }
+        return NULL;
+}
+
+static struct smb2_copychunk_open *
+smb2_copychunk_find_key(struct smb2_context *smb2, const uint8_t *key)
+{
+        struct smb2_copychunk_open *open;
+
+        for (open = smb2->copychunk_opens; open; open = open->next) {
+                if (open->have_key &&
+                    !memcmp(open->key, key, SMB2_RESUME_KEY_SIZE)) {
+                        return open;
+                }
+        }
+        return NULL;
+}
+
+void
+smb2_copychunk_opened(struct smb2_server *server, struct smb2_context *smb2,
+                      struct smb2_create_request *req,
+                      struct smb2_create_reply *rep)
+{
+        struct smb2_copychunk_open *open;
+        uint32_t access = req->desired_access;
+
+        if (server->handlers == NULL ||
+            server->handlers->copy_range_cmd == NULL) {
+                return;
+        }
+
+        open = calloc(1, sizeof(struct smb2_copychunk_open));
+        if (open == NULL) {
+                /* not in the table, so no copy will involve it */
+                return;
+        }
+        if (access & SMB2_GENERIC_ALL) {
+                access |= SMB2_FILE_READ_DATA | SMB2_FILE_WRITE_DATA;
+        }
+        if (access & SMB2_GENERIC_READ) {
+                access |= SMB2_FILE_READ_DATA;
+        }
+        if (access & SMB2_GENERIC_WRITE) {
+                access |= SMB2_FILE_WRITE_DATA;
+        }
+        memcpy(open->file_id, rep->file_id, SMB2_FD_SIZE);
+        open->access = access & (SMB2_FILE_READ_DATA | SMB2_FILE_WRITE_DATA);
+        SMB2_LIST_ADD(&smb2->copychunk_opens, open);
+}
+
+void
+smb2_copychunk_closed(struct smb2_context *smb2, const smb2_file_id file_id)
+{
+        struct smb2_copychunk_open *open;
+
+        open = smb2_copychunk_find_open(smb2, file_id);
+        if (open != NULL) {
+                SMB2_LIST_REMOVE(&smb2->copychunk_opens, open);
+                free(open);
+        }
+}
+
+/* The opens of a connection that is going away */
+void
+smb2_copychunk_free_opens(struct smb2_context *smb2)
+{
+        struct smb2_copychunk_open *open;
+
+        while ((open = smb2->copychunk_opens) != NULL) {
+                smb2->copychunk_opens = open->next;
+                free(open);
+        }
+}
+
+static uint32_t
+smb2_copychunk_status(int err)
+{
+        switch (err) {
+        case -EACCES:
+        case -EPERM:
+                return SMB2_STATUS_ACCESS_DENIED;
+        case -ENOSPC:
+                return SMB2_STATUS_DISK_FULL;
+        case -EBADF:
+                return SMB2_STATUS_INVALID_HANDLE;
+        default:
+                return SMB2_STATUS_UNEXPECTED_IO_ERROR;
+        }
+}
+
+static int
+smb2_copychunk_resume_key(struct smb2_context *smb2,
+                          struct smb2_ioctl_request *req,
+                          struct smb2_ioctl_reply *rep, uint8_t *out,
+                          uint32_t *status)
+{
+        struct smb2_copychunk_open *open;
+        struct smb2_iovec iov;
+        int i;
+
+        /* ResumeKey, ContextLength and 4 bytes of (empty) Context */
+        if (req->max_output_response < SMB2_RESUME_KEY_SIZE + 8) {
+                *status = SMB2_STATUS_INVALID_PARAMETER;
+                return -1;
+        }
+        open = smb2_copychunk_find_open(smb2, req->file_id);
+        if (open == NULL) {
+                *status = SMB2_STATUS_FILE_CLOSED;
+                return -1;
+        }
+
+        if (!open->have_key) {
+                iov.buf = open->key;
+                iov.len = SMB2_RESUME_KEY_SIZE;
+                iov.free = NULL;
+                smb2_set_uint64(&iov, 0, ++smb2->resume_key_counter);
+                for (i = 8; i < SMB2_RESUME_KEY_SIZE; i++) {
+                        open->key[i] = random() & 0xff;
+                }
+                open->have_key = 1;
+        }
+        memset(out, 0, SMB2_RESUME_KEY_SIZE + 8);
+        memcpy(out, open->key, SMB2_RESUME_KEY_SIZE);
+        rep->output = out;
+        rep->output_count = SMB2_RESUME_KEY_SIZE + 8;
+
+        return 0;
+}
+
+static void
+smb2_copychunk_reply(struct smb2_ioctl_reply *rep, uint8_t *out,
+                     uint32_t chunks, uint32_t chunk_bytes, uint32_t total)
+{
+        struct smb2_iovec iov;
+
+        iov.buf = out;
+        iov.len = SMB2_COPYCHUNK_REPLY_SIZE;
+        iov.free = NULL;
+        smb2_set_uint32(&iov, 0, chunks);
+        smb2_set_uint32(&iov, 4, chunk_bytes);
+        smb2_set_uint32(&iov, 8, total);
+
+        rep->output = out;
+        rep->output_count = SMB2_COPYCHUNK_REPLY_SIZE;
+}
+
+static int
+smb2_copychunk_copy(struct smb2_server *server, struct smb2_context *smb2,
+                    struct smb2_ioctl_request *req,
+                    struct smb2_ioctl_reply *rep, uint8_t *out,
+                    uint32_t *status)
+{
+        struct smb2_copychunk_open *src, *dst;
+        struct smb2_iovec iov;
+        uint32_t count, i, length, copied, total = 0;
+        uint64_t src_offset, dst_offset;
+        int ret;
+
+        if (req->max_output_response < SMB2_COPYCHUNK_REPLY_SIZE ||
+            req->input == NULL ||
+            req->input_count < SMB2_COPYCHUNK_HEADER_SIZE) {
+                *status = SMB2_STATUS_INVALID_PARAMETER;
+                return -1;
+        }
+        iov.buf = req->input;
+        iov.len = req->input_count;
+        iov.free = NULL;
+
+        /* [MS-SMB2] 3.3.5.15.6 */
+        dst = smb2_copychunk_find_open(smb2, req->file_id);
+        if (dst == NULL) {
+                *status = SMB2_STATUS_FILE_CLOSED;
+                return -1;
+        }
+        if (!(dst->access & SMB2_FILE_WRITE_DATA) ||
+            (req->ctl_code == SMB2_FSCTL_SRV_COPYCHUNK &&
+             !(dst->access & SMB2_FILE_READ_DATA))) {
+                *status = SMB2_STATUS_ACCESS_DENIED;
+                return -1;
+        }
+        src = smb2_copychunk_find_key(smb2, iov.buf);
+        if (src == NULL) {
+                *status = SMB2_STATUS_OBJECT_NAME_NOT_FOUND;
+                return -1;
+        }
+        if (!(src->access & SMB2_FILE_READ_DATA)) {
+                *status = SMB2_STATUS_ACCESS_DENIED;
+                return -1;
+        }
+
+        smb2_get_uint32(&iov, 24, &count);
+        if (count > (req->input_count - SMB2_COPYCHUNK_HEADER_SIZE) /
+            SMB2_COPYCHUNK_CHUNK_SIZE) {
+                *status = SMB2_STATUS_INVALID_PARAMETER;
+                return -1;
+        }
+
+        /* over the limits the reply tells the client what they are */
+        if (count == 0 || count > SMB2_COPYCHUNK_MAX_CHUNKS) {
+                goto limits;
+        }
+        for (i = 0; i < count; i++) {
+                smb2_get_uint32(&iov, SMB2_COPYCHUNK_HEADER_SIZE +
+                                i * SMB2_COPYCHUNK_CHUNK_SIZE + 16, &length);
+                if (length == 0 || length > SMB2_COPYCHUNK_MAX_CHUNK_SIZE) {
+                        goto limits;
+                }
+                total += length;
+                if (total > SMB2_COPYCHUNK_MAX_DATA_SIZE) {
+                        goto limits;
+                }
+        }
+
+        /* the destination is about to change under the read cache */
+        smb2_rcache_changed(server, smb2, req->file_id);
+
+        total = 0;
+        for (i = 0; i < count; i++) {
+                smb2_get_uint64(&iov, SMB2_COPYCHUNK_HEADER_SIZE +
+                                i * SMB2_COPYCHUNK_CHUNK_SIZE, &src_offset);
+                smb2_get_uint64(&iov, SMB2_COPYCHUNK_HEADER_SIZE +
+                                i * SMB2_COPYCHUNK_CHUNK_SIZE + 8,
+                                &dst_offset);
+                smb2_get_uint32(&iov, SMB2_COPYCHUNK_HEADER_SIZE +
+                                i * SMB2_COPYCHUNK_CHUNK_SIZE + 16, &length);
+
+                copied = 0;
+                ret = server->handlers->copy_range_cmd(server, smb2,
+                                src->file_id, src_offset, req->file_id, dst_offset,
+                                length, &copied);
+                if (ret < 0) {
+                        *status = smb2_copychunk_status(ret);
+                        return -1;
+                }
+                total += copied;
+                if (copied < length) {
+                        /* the source ended inside this chunk */
+                        smb2_copychunk_reply(rep, out, i, copied, total);
+                        return 0;
+                }
+        }
+        smb2_copychunk_reply(rep, out, count, 0, total);
+        return 0;
+
+ limits:
+        smb2_copychunk_reply(rep, out, SMB2_COPYCHUNK_MAX_CHUNKS,
+                             SMB2_COPYCHUNK_MAX_CHUNK_SIZE,
+                             SMB2_COPYCHUNK_MAX_DATA_SIZE);
+        *status = SMB2_STATUS_INVALID_PARAMETER;
+        return 0;
+}
+
+/*
+ * From the IOCTL dispatcher. Returns 1 if req is not a server side copy
+ * the library handles, 0 if rep holds the reply (which goes out with
+ * *status) or -1 to fail the request with *status. out must have room
+ * for 32 bytes.
+ */
+int
+smb2_copychunk_ioctl(struct smb2_server *server, struct smb2_context *smb2,
+                     struct smb2_ioctl_request *req,
+                     struct smb2_ioctl_reply *rep, uint8_t *out,
+                     uint32_t *status)
+{
+        int ret;
+
+        if (server->handlers == NULL ||
+            server->handlers->copy_range_cmd == NULL) {
+                return 1;
+        }
+
+        *status = SMB2_STATUS_SUCCESS;
+        switch (req->ctl_code) {
+        case SMB2_FSCTL_SRV_REQUEST_RESUME_KEY:
+                return smb2_copychunk_resume_key(smb2, req, rep, out, status);
+        case SMB2_FSCTL_SRV_COPYCHUNK:
+        case SMB2_FSCTL_SRV_COPYCHUNK_WRITE:
+                ret = smb2_copychunk_copy(server, smb2, req, rep, out, status);
+                smb2_free_data(smb2, req->input);
+                req->input = NULL;
+                return ret;
+        default:
+                return 1;
+        }
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* For files copy_file_range() can not copy between, e.g. across mounts */
+static int
+smb2_copy_fd_rw(int src_fd, off_t src_offset, int dst_fd, off_t dst_offset,
+                uint32_t length, uint32_t *copied)
+{
+        uint8_t *buf;
+        size_t len;
+        ssize_t count, written;
+
+        buf = malloc(64 * 1024);
+        if (buf == NULL) {
+                return -ENOMEM;
+        }
+        while (length > 0) {
+                len = length < 64 * 1024 ? length : 64 * 1024;
+                count = pread(src_fd, buf, len, src_offset);
+                if (count < 0) {
+                        free(buf);
+                        return -errno;
+                }
+                if (count == 0) {
+                        break;
+                }
+                written = pwrite(dst_fd, buf, count, dst_offset);
+                if (written < 0) {
+                        free(buf);
+                        return -errno;
+                }
+                src_offset += written;
+                dst_offset += written;
+                length -= written;
+                *copied += written;
+        }
+        free(buf);
+        return 0;
+}
+
+int
+smb2_server_copy_fd_range(int src_fd, uint64_t src_offset,
+                          int dst_fd, uint64_t dst_offset,
+                          uint32_t length, uint32_t *copied)
+{
+        off_t in = src_offset, out = dst_offset;
+        ssize_t count;
+
+        *copied = 0;
+        while (*copied < length) {
+                count = copy_file_range(src_fd, &in, dst_fd, &out,
+                                        length - *copied, 0);
+                if (count < 0) {
+                        if (errno == EXDEV || errno == ENOSYS ||
+                            errno == EOPNOTSUPP || errno == EINVAL) {
+                                return smb2_copy_fd_rw(src_fd, in, dst_fd,
+                                                       out, length - *copied,
+                                                       copied);
+                        }
+                        return -errno;
+                }
+                if (count == 0) {
+                        /* end of the source */
+                        break;
+                }
+                *copied += count;
+        }
+        return 0;
+}
+#else
+int
+smb2_server_copy_fd_range(int src_fd _U_, uint64_t src_offset _U_,
+                          int dst_fd _U_, uint64_t dst_offset _U_,
+                          uint32_t length _U_, uint32_t *copied)
+{
+        *copied = 0;
+        return -ENOSYS;
+}
+#endif
@@ -0,0 +1,722 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include <stdio.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include <errno.h>
+
+#if defined(_WIN32) || defined(_XBOX)
+#include "asprintf.h"
+#endif
+
+#include "compat.h"
+
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+#include <exec/semaphores.h>
+#include <proto/exec.h>
+#elif defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-raw.h"
+#include "libsmb2-private.h"
+
+/*
+ * DFS referrals ([MS-DFSC]).
+ *
+ * smb2_get_dfs_referral_async() asks the server of a connected context for
+ * the referral of a DFS path with FSCTL_DFS_GET_REFERRALS. The IOCTL has
+ * to go to the IPC$ share, so it is sent in one compound with a TREE_CONNECT
+ * to IPC$ before it and a TREE_DISCONNECT after it: one round trip, and the
+ * tree the context was using stays the current one.
+ *
+ * smb2_dfs_resolve_async() maps a path in a DFS namespace to the path it
+ * stands for on the share holding the data. Referrals are kept in a cache
+ * keyed by the part of the path they cover, for as long as their TTL says,
+ * so that resolving any path below a namespace link costs one referral per
+ * TTL. The cache is kept for the process, not the context: a referral
+ * from one server is good for every connection to the namespace, and a
+ * reconnect, which starts over with a new context, must not pay for a new
+ * one. It is locked while it is used, as contexts in several tasks (the
+ * mounts of a resident handler) share it, the same way as the resolver
+ * cache in resolver.c.
+ *
+ * Paths are in the form DFS uses, \server\share\path, with a single leading
+ * backslash (two are accepted as well).
+ */
+
+#define SMB2_DFS_MAX_REFERRAL_LEVEL 4
+
+/* ReferralEntryFlags */
+#define SMB2_DFS_NAME_LIST_REFERRAL 0x0002
+
+struct smb2_dfs_entry {
+        struct smb2_dfs_entry *next;
+        /* the part of the path the referral covers */
+        char *prefix;
+        time_t expires;
+        /* the target in use, moved on by smb2_dfs_target_failed() */
+        int cur;
+        int num_targets;
+        char **targets;
+};
+
+static struct smb2_dfs_entry *smb2_dfs_cache;
+
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+static struct SignalSemaphore smb2_dfs_sem;
+static int smb2_dfs_sem_ready;
+
+static void
+smb2_dfs_lock(void)
+{
+        Forbid();
+        if (!smb2_dfs_sem_ready) {
+                InitSemaphore(&smb2_dfs_sem);
+                smb2_dfs_sem_ready = 1;
+        }
+        Permit();
+        ObtainSemaphore(&smb2_dfs_sem);
+}
+
+static void
+smb2_dfs_unlock(void)
+{
+        ReleaseSemaphore(&smb2_dfs_sem);
+}
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t smb2_dfs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+smb2_dfs_lock(void)
+{
+        pthread_mutex_lock(&smb2_dfs_mutex);
+}
+
+static void
+smb2_dfs_unlock(void)
+{
+        pthread_mutex_unlock(&smb2_dfs_mutex);
+}
+#else
+#define smb2_dfs_lock()
+#define smb2_dfs_unlock()
+#endif
+
+struct dfs_referral_data {
+        smb2_command_cb cb;
+        void *cb_data;
+
+        /* the tree that was current when the request was sent */
+        uint32_t tree_id;
+        uint32_t status;
+        struct smb2_utf16 *unc;
+        uint8_t *input;
+        struct smb2_dfs_referral *ref;
+};
+
+struct dfs_resolve_data {
+        smb2_command_cb cb;
+        void *cb_data;
+        char *path;
+};
+
+void
+smb2_free_dfs_referral(struct smb2_dfs_referral *ref)
+{
+        int i;
+
+        if (ref == NULL) {
+                return;
+        }
+        for (i = 0; i < ref->num_targets; i++) {
+                free(ref->targets[i]);
+        }
+        free(ref->targets);
+        free(ref);
+}
+
+static int
+smb2_dfs_tolower(int c)
+{
+        return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* Does prefix cover path, up to a component boundary? */
+static int
+smb2_dfs_covers(const char *prefix, const char *path)
+{
+        while (*prefix) {
+                if (smb2_dfs_tolower((unsigned char)*prefix) !=
+                    smb2_dfs_tolower((unsigned char)*path)) {
+                        return 0;
+                }
+                prefix++;
+                path++;
+        }
+        return *path == '\0' || *path == '\\';
+}
+
+/* Reads a nul terminated UTF-16 string at offset in buf */
+static char *
+smb2_dfs_string(const uint8_t *buf, size_t len, size_t offset)
+{
+        size_t end;
+
+        if (offset >= len) {
+                return NULL;
+        }
+        for (end = offset; end + 1 < len; end += 2) {
+                if (buf[end] == 0 && buf[end + 1] == 0) {
+                        break;
+                }
+        }
+        if (end + 1 >= len) {
+                return NULL;
+        }
+        return discard_const(smb2_utf16_to_utf8(
+                        (const uint16_t *)(const void *)&buf[offset],
+                        (end - offset) / 2));
+}
+
+/* Decodes a RESP_GET_DFS_REFERRAL */
+static struct smb2_dfs_referral *
+smb2_dfs_decode(struct smb2_context *smb2, uint8_t *buf, size_t len)
+{
+        struct smb2_dfs_referral *ref;
+        struct smb2_iovec iov, eiov;
+        uint16_t path_consumed, count, version, size, flags, off;
+        uint32_t ttl;
+        size_t pos;
+        char *target;
+        int i;
+
+        if (len < 8) {
+                smb2_set_error(smb2, "DFS referral too short");
+                return NULL;
+        }
+        iov.buf = buf;
+        iov.len = len;
+        iov.free = NULL;
+        smb2_get_uint16(&iov, 0, &path_consumed);
+        smb2_get_uint16(&iov, 2, &count);
+
+        ref = calloc(1, sizeof(struct smb2_dfs_referral));
+        if (ref == NULL) {
+                smb2_set_error(smb2, "Failed to allocate DFS referral");
+                return NULL;
+        }
+        ref->targets = calloc(count ? count : 1, sizeof(char *));
+        if (ref->targets == NULL) {
+                free(ref);
+                smb2_set_error(smb2, "Failed to allocate DFS referral");
+                return NULL;
+        }
+        /* the server counts bytes of the UTF-16 request path */
+        ref->path_consumed = path_consumed / 2;
+        smb2_get_uint32(&iov, 4, &ref->flags);
+
+        for (i = 0, pos = 8; i < count && pos + 8 <= len; i++, pos += size) {
+                eiov.buf = buf + pos;
+                eiov.len = len - pos;
+                eiov.free = NULL;
+                smb2_get_uint16(&eiov, 0, &version);
+                smb2_get_uint16(&eiov, 2, &size);
+                smb2_get_uint16(&eiov, 6, &flags);
+                if (size < 8 || size > eiov.len) {
+                        break;
+                }
+
+                target = NULL;
+                ttl = 0;
+                switch (version) {
+                case 1:
+                        target = smb2_dfs_string(eiov.buf, eiov.len, 8);
+                        break;
+                case 2:
+                        if (eiov.len < 22) {
+                                break;
+                        }
+                        smb2_get_uint32(&eiov, 12, &ttl);
+                        smb2_get_uint16(&eiov, 20, &off);
+                        target = smb2_dfs_string(eiov.buf, eiov.len, off);
+                        break;
+                case 3:
+                case 4:
+                        /* name lists are for domain referrals, which
+                         * are not supported
+                         */
+                        if (eiov.len < 18 ||
+                            (flags & SMB2_DFS_NAME_LIST_REFERRAL)) {
+                                break;
+                        }
+                        smb2_get_uint32(&eiov, 8, &ttl);
+                        smb2_get_uint16(&eiov, 16, &off);
+                        target = smb2_dfs_string(eiov.buf, eiov.len, off);
+                        break;
+                default:
+                        break;
+                }
+                if (target == NULL) {
+                        continue;
+                }
+                if (ref->num_targets == 0 || ttl < ref->ttl) {
+                        ref->ttl = ttl;
+                }
+                ref->targets[ref->num_targets++] = target;
+        }
+
+        if (ref->num_targets == 0) {
+                smb2_set_error(smb2, "DFS referral has no usable target");
+                smb2_free_dfs_referral(ref);
+                return NULL;
+        }
+
+        return ref;
+}
+
+static void
+free_dfs_referral_data(struct dfs_referral_data *rd)
+{
+        free(rd->unc);
+        free(rd->input);
+        smb2_free_dfs_referral(rd->ref);
+        free(rd);
+}
+
+static void
+dfs_tree_connect_cb(struct smb2_context *smb2 _U_, int status,
+                    void *command_data _U_, void *private_data)
+{
+        struct dfs_referral_data *rd = private_data;
+
+        rd->status = status;
+}
+
+static void
+dfs_ioctl_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *private_data)
+{
+        struct dfs_referral_data *rd = private_data;
+        struct smb2_ioctl_reply *rep = command_data;
+
+        if (rd->status != SMB2_STATUS_SUCCESS) {
+                return;
+        }
+        rd->status = status;
+        if (status != SMB2_STATUS_SUCCESS) {
+                return;
+        }
+
+        rd->ref = smb2_dfs_decode(smb2, rep->output, rep->output_count);
+        if (rd->ref == NULL) {
+                rd->status = SMB2_STATUS_INVALID_NETWORK_RESPONSE;
+        }
+        smb2_free_data(smb2, rep->output);
+}
+
+static void
+dfs_tree_disconnect_cb(struct smb2_context *smb2, int status _U_,
+                       void *command_data _U_, void *private_data)
+{
+        struct dfs_referral_data *rd = private_data;
+        struct smb2_dfs_referral *ref = rd->ref;
+
+        /* back to the tree the context was using */
+        smb2_select_tree_id(smb2, rd->tree_id);
+
+        if (rd->status != SMB2_STATUS_SUCCESS) {
+                smb2_set_nterror(smb2, rd->status, "DFS referral failed "
+                                 "with (0x%08x) %s.", rd->status,
+                                 nterror_to_str(rd->status));
+                rd->cb(smb2, -nterror_to_errno(rd->status), NULL,
+                       rd->cb_data);
+                free_dfs_referral_data(rd);
+                return;
+        }
+
+        rd->ref = NULL;
+        rd->cb(smb2, 0, ref, rd->cb_data);
+        free_dfs_referral_data(rd);
+}
+
+int
+smb2_get_dfs_referral_async(struct smb2_context *smb2, const char *path,
+                            smb2_command_cb cb, void *cb_data)
+{
+        struct dfs_referral_data *rd;
+        struct smb2_tree_connect_request tc_req;
+        struct smb2_ioctl_request io_req;
+        struct smb2_utf16 *name;
+        struct smb2_pdu *pdu, *next_pdu;
+        char *unc = NULL;
+        int len;
+
+        if (smb2 == NULL || path == NULL) {
+                return -EINVAL;
+        }
+        if (smb2->server == NULL) {
+                smb2_set_error(smb2, "Not connected to a server");
+                return -EINVAL;
+        }
+        if (path[0] == '\\' && path[1] == '\\') {
+                path++;
+        }
+
+        rd = calloc(1, sizeof(struct dfs_referral_data));
+        if (rd == NULL) {
+                smb2_set_error(smb2, "Failed to allocate referral data");
+                return -ENOMEM;
+        }
+        rd->cb = cb;
+        rd->cb_data = cb_data;
+        rd->tree_id = smb2_tree_id(smb2);
+
+        if (asprintf(&unc, "\\\\%s\\IPC$", smb2->server) < 0) {
+                free_dfs_referral_data(rd);
+                return -ENOMEM;
+        }
+        rd->unc = smb2_utf8_to_utf16(unc);
+        free(unc);
+        name = smb2_utf8_to_utf16(path);
+        if (rd->unc == NULL || name == NULL) {
+                free(name);
+                free_dfs_referral_data(rd);
+                smb2_set_error(smb2, "Failed to convert DFS path to UTF-16");
+                return -ENOMEM;
+        }
+
+        /* REQ_GET_DFS_REFERRAL: the level and the nul terminated path */
+        len = 2 + 2 * (name->len + 1);
+        rd->input = calloc(1, len);
+        if (rd->input == NULL) {
+                free(name);
+                free_dfs_referral_data(rd);
+                return -ENOMEM;
+        }
+        rd->input[0] = SMB2_DFS_MAX_REFERRAL_LEVEL;
+        memcpy(rd->input + 2, name->val, 2 * name->len);
+        free(name);
+
+        memset(&tc_req, 0, sizeof(struct smb2_tree_connect_request));
+        tc_req.path_length = 2 * rd->unc->len;
+        tc_req.path = rd->unc->val;
+
+        pdu = smb2_cmd_tree_connect_async(smb2, &tc_req,
+                                          dfs_tree_connect_cb, rd);
+        if (pdu == NULL) {
+                free_dfs_referral_data(rd);
+                return -ENOMEM;
+        }
+
+        memset(&io_req, 0, sizeof(struct smb2_ioctl_request));
+        io_req.ctl_code = SMB2_FSCTL_DFS_GET_REFERRALS;
+        memcpy(io_req.file_id, compound_file_id, SMB2_FD_SIZE);
+        io_req.input_count = len;
+        io_req.input = rd->input;
+        io_req.flags = SMB2_0_IOCTL_IS_FSCTL;
+
+        next_pdu = smb2_cmd_ioctl_async(smb2, &io_req, dfs_ioctl_cb, rd);
+        if (next_pdu == NULL) {
+                smb2_free_pdu(smb2, pdu);
+                free_dfs_referral_data(rd);
+                return -ENOMEM;
+        }
+        next_pdu->header.sync.tree_id = 0xffffffff;
+        smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+        next_pdu = smb2_cmd_tree_disconnect_async(smb2, dfs_tree_disconnect_cb,
+                                                  rd);
+        if (next_pdu == NULL) {
+                smb2_free_pdu(smb2, pdu);
+                free_dfs_referral_data(rd);
+                return -ENOMEM;
+        }
+        next_pdu->header.sync.tree_id = 0xffffffff;
+        smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+/* The cache is locked by the callers of the functions below */
+static void
+smb2_dfs_free_entry(struct smb2_dfs_entry *e)
+{
+        int i;
+
+        SMB2_LIST_REMOVE(&smb2_dfs_cache, e);
+        for (i = 0; i < e->num_targets; i++) {
+                free(e->targets[i]);
+        }
+        free(e->targets);
+        free(e->prefix);
+        free(e);
+}
+
+/* The live entry with the longest prefix covering path */
+static struct smb2_dfs_entry *
+smb2_dfs_lookup(const char *path)
+{
+        struct smb2_dfs_entry *e, *next, *best = NULL;
+        time_t now = time(NULL);
+
+        for (e = smb2_dfs_cache; e; e = next) {
+                next = e->next;
+                if (now >= e->expires) {
+                        smb2_dfs_free_entry(e);
+                        continue;
+                }
+                if (smb2_dfs_covers(e->prefix, path) &&
+                    (best == NULL || strlen(e->prefix) > strlen(best->prefix))) {
+                        best = e;
+                }
+        }
+
+        return best;
+}
+
+/* Returns the target path for path through e, free() it when done */
+static char *
+smb2_dfs_map(struct smb2_dfs_entry *e, const char *path)
+{
+        const char *target = e->targets[e->cur];
+        const char *rest = path + strlen(e->prefix);
+        char *res;
+
+        if (target[0] == '\\' && target[1] == '\\') {
+                target++;
+        }
+        res = malloc(strlen(target) + strlen(rest) + 1);
+        if (res != NULL) {
+                strcpy(res, target);
+                strcat(res, rest);
+        }
+        return res;
+}
+
+/* path_consumed counts UTF-16 code units, returns the length of the
+ * UTF-8 path up to the same place
+ */
+static size_t
+smb2_dfs_consumed(const char *path, uint32_t units)
+{
+        size_t len = 0, max = strlen(path);
+        unsigned char c;
+
+        while (len < max && units > 0) {
+                c = path[len];
+                if (c < 0x80) {
+                        len += 1;
+                } else if (c < 0xe0) {
+                        len += 2;
+                } else if (c < 0xf0) {
+                        len += 3;
+                } else {
+                        /* a surrogate pair in UTF-16 */
+                        len += 4;
+                        units--;
+                }
+                if (units > 0) {
+                        units--;
+                }
+        }
+
+        return len < max ? len : max;
+}
+
+static struct smb2_dfs_entry *
+smb2_dfs_store(const char *path, struct smb2_dfs_referral *ref)
+{
+        struct smb2_dfs_entry *e;
+        size_t len;
+
+        e = calloc(1, sizeof(struct smb2_dfs_entry));
+        if (e == NULL) {
+                return NULL;
+        }
+        len = smb2_dfs_consumed(path, ref->path_consumed);
+        while (len > 1 && path[len - 1] == '\\') {
+                len--;
+        }
+        /* a server that claims nothing covers the whole path */
+        if (len == 0) {
+                len = strlen(path);
+        }
+        e->prefix = malloc(len + 1);
+        if (e->prefix == NULL) {
+                free(e);
+                return NULL;
+        }
+        memcpy(e->prefix, path, len);
+        e->prefix[len] = '\0';
+
+        e->expires = time(NULL) + ref->ttl;
+        e->num_targets = ref->num_targets;
+        e->targets = ref->targets;
+        ref->targets = NULL;
+        ref->num_targets = 0;
+
+        SMB2_LIST_ADD(&smb2_dfs_cache, e);
+        return e;
+}
+
+static void
+free_dfs_resolve_data(struct dfs_resolve_data *rs)
+{
+        free(rs->path);
+        free(rs);
+}
+
+static void
+dfs_resolve_cb(struct smb2_context *smb2, int status,
+               void *command_data, void *private_data)
+{
+        struct dfs_resolve_data *rs = private_data;
+        struct smb2_dfs_referral *ref = command_data;
+        struct smb2_dfs_entry *e;
+        char *target;
+
+        if (status < 0) {
+                rs->cb(smb2, status, NULL, rs->cb_data);
+                free_dfs_resolve_data(rs);
+                return;
+        }
+
+        smb2_dfs_lock();
+        e = smb2_dfs_store(rs->path, ref);
+        target = e ? smb2_dfs_map(e, rs->path) : NULL;
+        smb2_dfs_unlock();
+        smb2_free_dfs_referral(ref);
+        if (target == NULL) {
+                smb2_set_error(smb2, "Failed to allocate DFS target");
+                rs->cb(smb2, -ENOMEM, NULL, rs->cb_data);
+                free_dfs_resolve_data(rs);
+                return;
+        }
+        rs->cb(smb2, 0, target, rs->cb_data);
+        free(target);
+        free_dfs_resolve_data(rs);
+}
+
+int
+smb2_dfs_resolve_async(struct smb2_context *smb2, const char *path,
+                       smb2_command_cb cb, void *cb_data)
+{
+        struct dfs_resolve_data *rs;
+        struct smb2_dfs_entry *e;
+        char *target;
+        int rc;
+
+        if (smb2 == NULL || path == NULL) {
+                return -EINVAL;
+        }
+        if (path[0] == '\\' && path[1] == '\\') {
+                path++;
+        }
+
+        smb2_dfs_lock();
+        e = smb2_dfs_lookup(path);
+        target = e ? smb2_dfs_map(e, path) : NULL;
+        smb2_dfs_unlock();
+        if (e != NULL) {
+                if (target == NULL) {
+                        return -ENOMEM;
+                }
+                cb(smb2, 0, target, cb_data);
+                free(target);
+                return 0;
+        }
+
+        rs = calloc(1, sizeof(struct dfs_resolve_data));
+        if (rs == NULL) {
+                smb2_set_error(smb2, "Failed to allocate resolve data");
+                return -ENOMEM;
+        }
+        rs->cb = cb;
+        rs->cb_data = cb_data;
+        rs->path = strdup(path);
+        if (rs->path == NULL) {
+                free(rs);
+                return -ENOMEM;
+        }
+
+        rc = smb2_get_dfs_referral_async(smb2, path, dfs_resolve_cb, rs);
+        if (rc < 0) {
+                free_dfs_resolve_data(rs);
+        }
+        return rc;
+}
+
+void
+smb2_dfs_target_failed(const char *path)
+{
+        struct smb2_dfs_entry *e;
+
+        if (path[0] == '\\' && path[1] == '\\') {
+                path++;
+        }
+        smb2_dfs_lock();
+        e = smb2_dfs_lookup(path);
+        if (e != NULL && ++e->cur >= e->num_targets) {
+                /* All failed: the referral may be out of date, ask again */
+                smb2_dfs_free_entry(e);
+        }
+        smb2_dfs_unlock();
+}
+
+void
+smb2_dfs_flush_cache(void)
+{
+        smb2_dfs_lock();
+        while (smb2_dfs_cache) {
+                smb2_dfs_free_entry(smb2_dfs_cache);
+        }
+        smb2_dfs_unlock();
+}
@@ -0,0 +1,545 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Server side durable handles.
+ *
+ * A client asks for a durable open with a DHnQ (v1) or DH2Q (v2) create
+ * context. If the open got a batch oplock or a lease with handle caching
+ * and the backend agrees (durable_handle_cmd with SMB2_DURABLE_GRANT) the
+ * reply carries the matching context and the open is remembered here.
+ *
+ * When the connection of such an open is lost the backend is told with
+ * SMB2_DURABLE_DISCONNECT, before its destruction_event, and has to keep
+ * the file open instead of closing it with the rest of the connection. The
+ * open then waits for server->durable_timeout ms (or the shorter timeout a
+ * v2 client asked for) for the client to come back:
+ *
+ *  - a CREATE with a DHnC or DH2C context naming the open (by file id, and
+ *    for v2 also by create GUID and client GUID) from the same user hands it
+ *    to the new connection with SMB2_DURABLE_RECONNECT and gets the reply of
+ *    the original open, with the oplock level and lease state it had when
+ *    the connection was lost,
+ *  - otherwise the backend closes it on SMB2_DURABLE_EXPIRE.
+ *
+ * Persistent handles need continuously available shares and are not
+ * offered, the persistent flag of DH2Q is ignored.
+ */
+
+/* Large enough for a v2 lease context */
+#define SMB2_DURABLE_LEASE_MAX 52
+
+struct smb2_durable_open {
+        struct smb2_durable_open *next;
+        /* NULL while the client is disconnected */
+        struct smb2_context *smb2;
+        time_t expires;
+        smb2_file_id file_id;
+        int version;
+        uint8_t create_guid[SMB2_GUID_SIZE];
+        uint8_t client_guid[SMB2_GUID_SIZE];
+        uint32_t timeout;
+        char *user;
+        char *domain;
+        /* the reply to the original CREATE, without create contexts */
+        struct smb2_create_reply rep;
+        uint8_t lease[SMB2_DURABLE_LEASE_MAX];
+        uint32_t lease_len;
+};
+
+static int
+smb2_durable_enabled(struct smb2_server *server)
+{
+        return server->durable_timeout && server->handlers &&
+                server->handlers->durable_handle_cmd;
+}
+
+/* Returns the data of the create context named tag, NULL if there is none */
+static uint8_t *
+smb2_durable_find(uint8_t *buf, uint32_t len, const char *tag,
+                  uint32_t *data_len)
+{
+        struct smb2_iovec iov;
+        uint32_t off = 0, next, dlen;
+        uint16_t name_off, name_len, data_off;
+
+        if (buf == NULL) {
+                return NULL;
+        }
+        while (len - off >= 16) {
+                iov.buf = buf + off;
+                iov.len = len - off;
+                iov.free = NULL;
+                smb2_get_uint32(&iov, 0, &next);
+                smb2_get_uint16(&iov, 4, &name_off);
+                smb2_get_uint16(&iov, 6, &name_len);
+                smb2_get_uint16(&iov, 10, &data_off);
+                smb2_get_uint32(&iov, 12, &dlen);
+
+                if (name_len == 4 && name_off + 4 <= iov.len &&
+                    !memcmp(iov.buf + name_off, tag, 4)) {
+                        if (data_off + (uint64_t)dlen > iov.len) {
+                                return NULL;
+                        }
+                        *data_len = dlen;
+                        return iov.buf + data_off;
+                }
+                if (next == 0 || next > len - off) {
+                        break;
+                }
+                off += next;
+        }
+
+        return NULL;
+}
+
+/* Appends a create context to the chain in *buf, last is the offset of
+ * the last context already in it
+ */
+static int
+smb2_durable_append(uint8_t **buf, uint32_t *len, uint32_t *last,
+                    const char *tag, const uint8_t *data, uint32_t data_len)
+{
+        struct smb2_iovec iov;
+        uint32_t off = PAD_TO_64BIT(*len);
+        uint8_t *b;
+
+        b = realloc(*buf, off + 24 + data_len);
+        if (b == NULL) {
+                return -1;
+        }
+        memset(b + *len, 0, off + 24 + data_len - *len);
+        *buf = b;
+
+        if (off) {
+                iov.buf = b + *last;
+                iov.len = off - *last;
+                iov.free = NULL;
+                smb2_set_uint32(&iov, 0, off - *last);
+        }
+        iov.buf = b + off;
+        iov.len = 24 + data_len;
+        iov.free = NULL;
+        smb2_set_uint16(&iov, 4, 16);
+        smb2_set_uint16(&iov, 6, 4);
+        smb2_set_uint16(&iov, 10, 24);
+        smb2_set_uint32(&iov, 12, data_len);
+        memcpy(b + off + 16, tag, 4);
+        memcpy(b + off + 24, data, data_len);
+
+        *last = off;
+        *len = off + 24 + data_len;
+        return 0;
+}
+
+/* Can the open keep its handle cached, as it must to stay durable? */
+static int
+smb2_durable_caching(struct smb2_durable_open *open)
+{
+        struct smb2_iovec iov;
+        uint32_t state;
+
+        if (open->rep.oplock_level == SMB2_OPLOCK_LEVEL_BATCH) {
+                return 1;
+        }
+        if (open->rep.oplock_level != SMB2_OPLOCK_LEVEL_LEASE ||
+            open->lease_len < 20) {
+                return 0;
+        }
+        iov.buf = open->lease;
+        iov.len = open->lease_len;
+        iov.free = NULL;
+        smb2_get_uint32(&iov, 16, &state);
+
+        return !!(state & SMB2_LEASE_HANDLE_CACHING);
+}
+
+static void
+smb2_durable_free(struct smb2_server *server, struct smb2_durable_open *open)
+{
+        SMB2_LIST_REMOVE(&server->durable_opens, open);
+        free(open->user);
+        free(open->domain);
+        free(open);
+}
+
+static int
+smb2_durable_same(const char *a, const char *b)
+{
+        return !strcmp(a ? a : "", b ? b : "");
+}
+
+int
+smb2_durable_reconnect(struct smb2_server *server, struct smb2_context *smb2,
+                       struct smb2_create_request *req,
+                       struct smb2_create_reply *rep,
+                       uint8_t **contexts, uint32_t *status)
+{
+        struct smb2_durable_open *open;
+        uint8_t *dhnc, *dh2c, *dh2q, *rqls;
+        uint32_t dhnc_len, dh2c_len, dh2q_len, rqls_len;
+        uint32_t len = 0, last = 0;
+
+        if (!smb2_durable_enabled(server)) {
+                return 1;
+        }
+        dhnc = smb2_durable_find(req->create_context,
+                                 req->create_context_length, "DHnC", &dhnc_len);
+        dh2c = smb2_durable_find(req->create_context,
+                                 req->create_context_length, "DH2C", &dh2c_len);
+
+        if (dhnc == NULL && dh2c == NULL) {
+                /* A v2 create GUID may only be used once, unless the
+                 * client is replaying the CREATE it was used for
+                 */
+                dh2q = smb2_durable_find(req->create_context,
+                                         req->create_context_length,
+                                         "DH2Q", &dh2q_len);
+                if (dh2q == NULL || dh2q_len < 32) {
+                        return 1;
+                }
+                for (open = server->durable_opens; open; open = open->next) {
+                        if (open->version == 2 &&
+                            !memcmp(open->create_guid, dh2q + 16, SMB2_GUID_SIZE) &&
+                            !memcmp(open->client_guid, smb2->client_guid, SMB2_GUID_SIZE)) {
+                                break;
+                        }
+                }
+                if (open == NULL) {
+                        return 1;
+                }
+                if (!(smb2->hdr.flags & SMB2_FLAGS_REPLAY_OPERATION) ||
+                    open->smb2 != smb2) {
+                        *status = SMB2_STATUS_DUPLICATE_OBJECTID;
+                        return -1;
+                }
+        } else {
+                if ((dh2c && dh2c_len < 36) || (!dh2c && dhnc_len < 16)) {
+                        *status = SMB2_STATUS_INVALID_PARAMETER;
+                        return -1;
+                }
+                for (open = server->durable_opens; open; open = open->next) {
+                        if (dh2c) {
+                                if (open->version == 2 &&
+                                    !memcmp(open->file_id, dh2c, SMB2_FD_SIZE) &&
+                                    !memcmp(open->create_guid, dh2c + 16, SMB2_GUID_SIZE) &&
+                                    !memcmp(open->client_guid, smb2->client_guid, SMB2_GUID_SIZE)) {
+                                        break;
+                                }
+                        } else if (open->version == 1 &&
+                                   !memcmp(open->file_id, dhnc, SMB2_FD_SIZE)) {
+                                break;
+                        }
+                }
+                if (open == NULL || open->smb2 != NULL) {
+                        *status = SMB2_STATUS_OBJECT_NAME_NOT_FOUND;
+                        return -1;
+                }
+                if (!smb2_durable_same(open->user, smb2->user) ||
+                    !smb2_durable_same(open->domain, smb2->domain)) {
+                        *status = SMB2_STATUS_ACCESS_DENIED;
+                        return -1;
+                }
+
+                /* The client has to come back with the lease it had */
+                rqls = smb2_durable_find(req->create_context,
+                                         req->create_context_length,
+                                         "RqLs", &rqls_len);
+                if ((open->lease_len != 0) != (rqls != NULL) ||
+                    (rqls && (rqls_len < SMB2_LEASE_KEY_SIZE ||
+                              memcmp(rqls, open->lease, SMB2_LEASE_KEY_SIZE)))) {
+                        *status = SMB2_STATUS_OBJECT_NAME_NOT_FOUND;
+                        return -1;
+                }
+
+                if (server->handlers->durable_handle_cmd(server, smb2,
+                                open->file_id, SMB2_DURABLE_RECONNECT)) {
+                        *status = SMB2_STATUS_OBJECT_NAME_NOT_FOUND;
+                        return -1;
+                }
+                open->smb2 = smb2;
+                open->expires = 0;
+        }
+
+        *rep = open->rep;
+        rep->create_action = SMB2_FILE_OPENED;
+        if (open->lease_len) {
+                if (smb2_durable_append(contexts, &len, &last, "RqLs",
+                                        open->lease, open->lease_len)) {
+                        *status = SMB2_STATUS_NO_MEMORY;
+                        return -1;
+                }
+                rep->create_context = *contexts;
+                rep->create_context_length = len;
+        }
+
+        return 0;
+}
+
+void
+smb2_durable_opened(struct smb2_server *server, struct smb2_context *smb2,
+                    struct smb2_create_request *req,
+                    struct smb2_create_reply *rep,
+                    uint8_t **contexts)
+{
+        struct smb2_durable_open *open;
+        struct smb2_iovec iov;
+        uint8_t *dhnq, *dh2q, *lease, *buf = NULL;
+        uint32_t dhnq_len, dh2q_len, lease_len = 0;
+        uint32_t len, last, next, timeout;
+        uint8_t data[16];
+
+        if (!smb2_durable_enabled(server)) {
+                return;
+        }
+        dhnq = smb2_durable_find(req->create_context,
+                                 req->create_context_length, "DHnQ", &dhnq_len);
+        dh2q = smb2_durable_find(req->create_context,
+                                 req->create_context_length, "DH2Q", &dh2q_len);
+        if (dh2q ? dh2q_len < 32 : (dhnq == NULL || dhnq_len < 16)) {
+                return;
+        }
+
+        open = calloc(1, sizeof(struct smb2_durable_open));
+        if (open == NULL) {
+                return;
+        }
+        open->rep = *rep;
+        open->rep.create_context = NULL;
+        open->rep.create_context_length = 0;
+        open->rep.create_context_offset = 0;
+        memcpy(open->file_id, rep->file_id, SMB2_FD_SIZE);
+        lease = smb2_durable_find(rep->create_context,
+                                  rep->create_context_length, "RqLs", &lease_len);
+        if (lease && lease_len <= SMB2_DURABLE_LEASE_MAX) {
+                memcpy(open->lease, lease, lease_len);
+                open->lease_len = lease_len;
+        }
+        if (!smb2_durable_caching(open) ||
+            server->handlers->durable_handle_cmd(server, smb2,
+                                open->file_id, SMB2_DURABLE_GRANT)) {
+                free(open);
+                return;
+        }
+
+        open->smb2 = smb2;
+        open->timeout = server->durable_timeout;
+        memcpy(open->client_guid, smb2->client_guid, SMB2_GUID_SIZE);
+        if (dh2q) {
+                iov.buf = dh2q;
+                iov.len = dh2q_len;
+                iov.free = NULL;
+                smb2_get_uint32(&iov, 0, &timeout);
+                if (timeout && timeout < open->timeout) {
+                        open->timeout = timeout;
+                }
+                open->version = 2;
+                memcpy(open->create_guid, dh2q + 16, SMB2_GUID_SIZE);
+        } else {
+                open->version = 1;
+        }
+        if (smb2->user) {
+                open->user = strdup(smb2->user);
+        }
+        if (smb2->domain) {
+                open->domain = strdup(smb2->domain);
+        }
+
+        /* The backend's contexts followed by the durable one */
+        len = rep->create_context_length;
+        last = 0;
+        if (len) {
+                buf = malloc(len);
+                if (buf == NULL) {
+                        goto failed;
+                }
+                memcpy(buf, rep->create_context, len);
+                iov.buf = buf;
+                iov.len = len;
+                iov.free = NULL;
+                while (last + 16 <= len) {
+                        smb2_get_uint32(&iov, last, &next);
+                        if (next == 0 || next > len - last) {
+                                break;
+                        }
+                        last += next;
+                }
+        }
+        memset(data, 0, sizeof(data));
+        iov.buf = data;
+        iov.len = sizeof(data);
+        iov.free = NULL;
+        if (open->version == 2) {
+                /* no persistent flag, see above */
+                smb2_set_uint32(&iov, 0, open->timeout);
+        }
+        if (smb2_durable_append(&buf, &len, &last,
+                                open->version == 2 ? "DH2Q" : "DHnQ", data, 8)) {
+                free(buf);
+                goto failed;
+        }
+        *contexts = buf;
+        rep->create_context = buf;
+        rep->create_context_length = len;
+
+        SMB2_LIST_ADD(&server->durable_opens, open);
+        return;
+
+ failed:
+        /* the backend keeps the open, it just is not durable */
+        free(open->user);
+        free(open->domain);
+        free(open);
+}
+
+void
+smb2_durable_closed(struct smb2_server *server, struct smb2_context *smb2,
+                    const smb2_file_id file_id)
+{
+        struct smb2_durable_open *open;
+
+        for (open = server->durable_opens; open; open = open->next) {
+                if (open->smb2 == smb2 &&
+                    !memcmp(open->file_id, file_id, SMB2_FD_SIZE)) {
+                        smb2_durable_free(server, open);
+                        return;
+                }
+        }
+}
+
+/* The opens of a session that logs off are closed with it */
+void
+smb2_durable_logoff(struct smb2_server *server, struct smb2_context *smb2)
+{
+        struct smb2_durable_open *open, *next;
+
+        for (open = server->durable_opens; open; open = next) {
+                next = open->next;
+                if (open->smb2 == smb2) {
+                        smb2_durable_free(server, open);
+                }
+        }
+}
+
+/* Keeps the oplock level and lease state up to date through breaks */
+void
+smb2_durable_broken(struct smb2_server *server, struct smb2_context *smb2,
+                    struct smb2_oplock_or_lease_break_request *req)
+{
+        struct smb2_durable_open *open;
+        struct smb2_iovec iov;
+
+        for (open = server->durable_opens; open; open = open->next) {
+                if (open->smb2 != smb2) {
+                        continue;
+                }
+                if (req->struct_size == SMB2_OPLOCK_BREAK_NOTIFICATION_SIZE) {
+                        if (!memcmp(open->file_id, req->lock.oplock.file_id,
+                                    SMB2_FD_SIZE)) {
+                                open->rep.oplock_level =
+                                        req->lock.oplock.oplock_level;
+                        }
+                } else if (open->lease_len >= 20 &&
+                           !memcmp(open->lease, req->lock.lease.lease_key,
+                                   SMB2_LEASE_KEY_SIZE)) {
+                        iov.buf = open->lease;
+                        iov.len = open->lease_len;
+                        iov.free = NULL;
+                        smb2_set_uint32(&iov, 16, req->lock.lease.lease_state);
+                }
+        }
+}
+
+/* Called for a connection that is gone, before its destruction_event */
+void
+smb2_durable_disconnected(struct smb2_server *server, struct smb2_context *smb2)
+{
+        struct smb2_durable_open *open, *next;
+
+        for (open = server->durable_opens; open; open = next) {
+                next = open->next;
+                if (open->smb2 != smb2) {
+                        continue;
+                }
+                /* broken down to where it can not stay durable, so
+                 * destruction_event closes it like any other open
+                 */
+                if (!smb2_durable_caching(open)) {
+                        smb2_durable_free(server, open);
+                        continue;
+                }
+                server->handlers->durable_handle_cmd(server, smb2,
+                                open->file_id, SMB2_DURABLE_DISCONNECT);
+                open->smb2 = NULL;
+                open->expires = time(NULL) + (open->timeout + 999) / 1000;
+        }
+}
+
+/* Closes the disconnected opens that timed out, or all of them */
+void
+smb2_durable_expire(struct smb2_server *server, int all)
+{
+        struct smb2_durable_open *open, *next;
+        time_t now = time(NULL);
+
+        for (open = server->durable_opens; open; open = next) {
+                next = open->next;
+                if (open->smb2 == NULL && (all || now >= open->expires)) {
+                        server->handlers->durable_handle_cmd(server, NULL,
+                                        open->file_id, SMB2_DURABLE_EXPIRE);
+                        smb2_durable_free(server, open);
+                }
+                else if (all) {
+                        smb2_durable_free(server, open);
+                }
+        }
+}
@@ -292,6 +292,7 @@ struct smb2_context *smb2_init_context(void)
         ret = getlogin_r(buf, sizeof(buf));
         smb2_set_user(smb2, ret == 0 ? buf : "Guest");
         smb2->fd = SMB2_INVALID_SOCKET;
+        smb2->transport = &smb2_tcp_transport;
         smb2->connecting_fds = NULL;
         smb2->connecting_fds_count = 0;
         smb2->addrinfos = NULL;
@@ -322,14 +323,14 @@ void smb2_destroy_context(struct smb2_context *smb2)
                 return;
         }
 
-        if (SMB2_VALID_SOCKET(smb2->fd)) {
-                if (smb2->change_fd) {
-                        smb2->change_fd(smb2, smb2->fd, SMB2_DEL_FD);
-                }
-                close(smb2->fd);
-                smb2->fd = SMB2_INVALID_SOCKET;
+        if (SMB2_IS_CONNECTED(smb2)) {
+                smb2_transport_close(smb2);
         }
         else {
+                /* Given up on, e.g. after a connect timeout */
+                if (smb2->connect_cb) {
+                        smb2_connect_failed(smb2);
+                }
                 smb2_close_connecting_fds(smb2);
         }
 
@@ -362,7 +363,12 @@ void smb2_destroy_context(struct smb2_context *smb2)
                 }
                 smb2_free_pdu(smb2, pdu);
         }
+        smb2_compound_free(smb2);
         smb2_free_iovector(smb2, &smb2->in);
+        smb2_flight_free_all(smb2);
+        smb2_rcache_free_opens(smb2);
+        smb2_copychunk_free_opens(smb2);
+        smb2_notify_free_watches(smb2);
 
         if (smb2->fhs) {
                 smb2_free_all_fhs(smb2);
@@ -386,6 +392,7 @@ void smb2_destroy_context(struct smb2_context *smb2)
         free(discard_const(smb2->domain));
         free(discard_const(smb2->workstation));
         free(smb2->enc);
+        smb2_ntlm_key_clear(smb2);
 
 #ifdef HAVE_LIBKRB5
         if (smb2->cred_handle) {
@@ -658,6 +665,8 @@ const char *smb2_get_workstation(struct smb2_context *smb2)
 
 void smb2_set_password(struct smb2_context *smb2, const char *password)
 {
+        /* the key was derived from the old one */
+        smb2_ntlm_key_clear(smb2);
         if (smb2->password) {
                 free(discard_const(smb2->password));
                 smb2->password = NULL;
@@ -668,6 +677,69 @@ void smb2_set_password(struct smb2_context *smb2, const char *password)
         smb2->password = strdup(password);
 }
 
+void smb2_ntlm_key_clear(struct smb2_context *smb2)
+{
+        memset(smb2->ntlm_key, 0, sizeof(smb2->ntlm_key));
+        smb2->have_ntlm_key = 0;
+        free(smb2->ntlm_key_user);
+        smb2->ntlm_key_user = NULL;
+        free(smb2->ntlm_key_domain);
+        smb2->ntlm_key_domain = NULL;
+}
+
+static int
+smb2_ntlm_key_equal(const char *a, const char *b)
+{
+        if (a == NULL || b == NULL) {
+                return a == b;
+        }
+        return !strcmp(a, b);
+}
+
+/* The key for user and domain, or NULL if the context does not have it */
+const uint8_t *smb2_ntlm_key_find(struct smb2_context *smb2, const char *user,
+                                  const char *domain)
+{
+        if (!smb2->have_ntlm_key ||
+            !smb2_ntlm_key_equal(smb2->ntlm_key_user, user) ||
+            !smb2_ntlm_key_equal(smb2->ntlm_key_domain, domain)) {
+                return NULL;
+        }
+        return smb2->ntlm_key;
+}
+
+int smb2_get_ntlm_key(struct smb2_context *smb2, uint8_t key[16])
+{
+        if (!smb2->have_ntlm_key) {
+                return -1;
+        }
+        memcpy(key, smb2->ntlm_key, 16);
+        return 0;
+}
+
+int smb2_set_ntlm_key(struct smb2_context *smb2, const char *user,
+                      const char *domain, const uint8_t key[16])
+{
+        smb2_ntlm_key_clear(smb2);
+        if (user == NULL) {
+                return -1;
+        }
+        smb2->ntlm_key_user = strdup(user);
+        if (smb2->ntlm_key_user == NULL) {
+                return -ENOMEM;
+        }
+        if (domain) {
+                smb2->ntlm_key_domain = strdup(domain);
+                if (smb2->ntlm_key_domain == NULL) {
+                        smb2_ntlm_key_clear(smb2);
+                        return -ENOMEM;
+                }
+        }
+        memcpy(smb2->ntlm_key, key, 16);
+        smb2->have_ntlm_key = 1;
+        return 0;
+}
+
 void smb2_set_domain(struct smb2_context *smb2, const char *domain)
 {
         if (smb2->domain) {
@@ -0,0 +1,229 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Idle keepalive and dead peer detection.
+ *
+ * An ECHO is only sent once nothing has been received from the server for
+ * keepalive_idle seconds. The round trip time of each ECHO is fed into a
+ * smoothed RTT and RTT variance estimator (RFC 6298, alpha 1/8, beta 1/4)
+ * and the peer is declared dead once an ECHO has been outstanding, with no
+ * other data arriving, for SMB2_KEEPALIVE_RTO_MULT retransmission timeouts
+ * (but never less than the configured minimum).
+ */
+
+#define SMB2_KEEPALIVE_INITIAL_RTO_MS 1000
+#define SMB2_KEEPALIVE_RTO_MULT       8
+#define SMB2_KEEPALIVE_MIN_DEAD_MS    10000
+
+static uint64_t
+smb2_keepalive_now(void)
+{
+#ifdef HAVE_SYS_TIME_H
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#else
+        return (uint64_t)time(NULL) * 1000;
+#endif
+}
+
+static uint32_t
+smb2_keepalive_dead_timeout(struct smb2_context *smb2)
+{
+        uint32_t rto, dead;
+
+        if (smb2->srtt_ms == 0) {
+                rto = SMB2_KEEPALIVE_INITIAL_RTO_MS;
+        } else {
+                rto = smb2->srtt_ms + 4 * smb2->rttvar_ms;
+        }
+        dead = rto * SMB2_KEEPALIVE_RTO_MULT;
+        if (dead < smb2->keepalive_min_dead_ms) {
+                dead = smb2->keepalive_min_dead_ms;
+        }
+
+        return dead;
+}
+
+static void
+keepalive_echo_cb(struct smb2_context *smb2, int status,
+                  void *command_data _U_, void *private_data _U_)
+{
+        uint64_t now;
+        uint32_t sample, delta;
+
+        if (smb2->echo_sent_ms == 0) {
+                return;
+        }
+        if (status == -nterror_to_errno(SMB2_STATUS_IO_TIMEOUT)) {
+                /* Dropped locally, leave the verdict to the dead
+                 * peer check.
+                 */
+                return;
+        }
+        if (status != 0) {
+                /* An error reply still proves the peer is alive but
+                 * is not a clean RTT sample.
+                 */
+                smb2->echo_sent_ms = 0;
+                return;
+        }
+
+        now = smb2_keepalive_now();
+        sample = (uint32_t)(now - smb2->echo_sent_ms);
+        if (sample == 0) {
+                sample = 1;
+        }
+        smb2->echo_sent_ms = 0;
+
+        if (smb2->srtt_ms == 0) {
+                smb2->srtt_ms = sample;
+                smb2->rttvar_ms = sample / 2;
+        } else {
+                delta = sample > smb2->srtt_ms ? sample - smb2->srtt_ms :
+                                                 smb2->srtt_ms - sample;
+                smb2->rttvar_ms = (3 * smb2->rttvar_ms + delta) / 4;
+                smb2->srtt_ms = (7 * smb2->srtt_ms + sample) / 8;
+                if (smb2->srtt_ms == 0) {
+                        smb2->srtt_ms = 1;
+                }
+        }
+}
+
+void
+smb2_keepalive_rx(struct smb2_context *smb2)
+{
+        if (smb2->keepalive_idle) {
+                smb2->last_rx_ms = smb2_keepalive_now();
+        }
+}
+
+void smb2_set_keepalive(struct smb2_context *smb2, int idle_seconds,
+                        int min_dead_seconds,
+                        smb2_peer_dead_cb cb, void *cb_data)
+{
+        smb2->keepalive_idle = idle_seconds > 0 ? idle_seconds : 0;
+        if (min_dead_seconds > 0) {
+                smb2->keepalive_min_dead_ms = (uint32_t)min_dead_seconds * 1000;
+        } else {
+                smb2->keepalive_min_dead_ms = SMB2_KEEPALIVE_MIN_DEAD_MS;
+        }
+        smb2->peer_dead_cb = cb;
+        smb2->peer_dead_cb_data = cb_data;
+        smb2->peer_dead = 0;
+        smb2->echo_sent_ms = 0;
+        smb2->last_rx_ms = smb2_keepalive_now();
+}
+
+int smb2_get_rtt(struct smb2_context *smb2, uint32_t *srtt_ms,
+                 uint32_t *rttvar_ms)
+{
+        if (smb2->srtt_ms == 0) {
+                return -1;
+        }
+        if (srtt_ms) {
+                *srtt_ms = smb2->srtt_ms;
+        }
+        if (rttvar_ms) {
+                *rttvar_ms = smb2->rttvar_ms;
+        }
+        return 0;
+}
+
+int
+smb2_keepalive_service(struct smb2_context *smb2)
+{
+        uint64_t now, since;
+
+        if (smb2->keepalive_idle == 0 || smb2_is_server(smb2)) {
+                return 0;
+        }
+        if (smb2->peer_dead) {
+                return -1;
+        }
+        if (!SMB2_IS_CONNECTED(smb2) || smb2->dialect == 0) {
+                /* Still connecting or negotiating */
+                return 0;
+        }
+
+        now = smb2_keepalive_now();
+        if (smb2->last_rx_ms == 0 || smb2->last_rx_ms > now) {
+                smb2->last_rx_ms = now;
+        }
+
+        if (smb2->echo_sent_ms) {
+                /* Any data from the server proves it is still alive,
+                 * not just the ECHO reply.
+                 */
+                since = smb2->echo_sent_ms > smb2->last_rx_ms ?
+                        smb2->echo_sent_ms : smb2->last_rx_ms;
+                if (now - since < smb2_keepalive_dead_timeout(smb2)) {
+                        return 0;
+                }
+
+                smb2->peer_dead = 1;
+                smb2_set_error(smb2, "Server did not respond to keepalive "
+                               "within %u ms", (unsigned int)(now - since));
+                if (smb2->peer_dead_cb) {
+                        smb2->peer_dead_cb(smb2, smb2->peer_dead_cb_data);
+                }
+                return -1;
+        }
+
+        if (now - smb2->last_rx_ms < (uint64_t)smb2->keepalive_idle * 1000) {
+                return 0;
+        }
+
+        smb2->echo_sent_ms = now;
+        if (smb2_echo_async(smb2, keepalive_echo_cb, NULL) < 0) {
+                smb2->echo_sent_ms = 0;
+        }
+
+        return 0;
+}
@@ -158,6 +158,15 @@ struct connect_data {
 
         void *auth_data;
 
+        /* status of the TREE_CONNECT, reported when the compound is done */
+        uint32_t tcon_status;
+
+        /* smb2_connect_tree_async(): the session stays, the tree that was
+         * current before is disconnected once the new one is up
+         */
+        int tree_only;
+        uint32_t old_tree_id;
+
         /* if context is being served by our server */
         struct smb2_server *server_context;
 };
@@ -170,6 +179,7 @@ struct smb2fh {
         smb2_file_id file_id;
         int64_t offset;
         int64_t end_of_file;
+        uint8_t oplock_level;
 };
 
 void
@@ -179,12 +189,8 @@ smb2_close_context(struct smb2_context *smb2)
                 return;
         }
 
-        if (SMB2_VALID_SOCKET(smb2->fd)) {
-                if (smb2->change_fd) {
-                        smb2->change_fd(smb2, smb2->fd, SMB2_DEL_FD);
-                }
-                close(smb2->fd);
-                smb2->fd = SMB2_INVALID_SOCKET;
+        if (SMB2_IS_CONNECTED(smb2)) {
+                smb2_transport_close(smb2);
         }
 
         smb2->message_id = 0;
@@ -332,6 +338,10 @@ decode_dirents(struct smb2_context *smb2, struct smb2dir *dir,
                 }
                 ent->dirent.st.smb2_nlink = 0;
                 ent->dirent.st.smb2_ino = fs.file_id;
+                /* for reparse points this field holds the reparse tag */
+                if (!(fs.file_attributes & SMB2_FILE_ATTRIBUTE_REPARSE_POINT)) {
+                        ent->dirent.st.smb2_ea_size = fs.ea_size;
+                }
                 ent->dirent.st.smb2_size = fs.end_of_file;
                 ent->dirent.st.smb2_atime = fs.last_access_time.tv_sec;
                 ent->dirent.st.smb2_atime_nsec = fs.last_access_time.tv_usec * 1000;
@@ -542,26 +552,208 @@ free_c_data(struct smb2_context *smb2, struct connect_data *c_data)
         free(c_data);
 }
 
+/*
+ * The TREE_CONNECT is sent in one compound with a CREATE of the share root,
+ * queries for the size and the attributes of its file system and a CLOSE,
+ * so that a caller that wants to know these right after connecting does not
+ * need another round trip. The related requests take the tree id from the
+ * TREE_CONNECT before them. The queries are only a bonus: if the server
+ * fails them the share is connected anyway, and the connect completes once
+ * the reply to the CLOSE at the end of the chain has arrived.
+ */
 static void
 tree_connect_cb(struct smb2_context *smb2, int status,
                 void *command_data, void *private_data)
 {
         struct connect_data *c_data = private_data;
+        struct smb2_tree_connect_reply *rep = command_data;
+
+        c_data->tcon_status = status;
+        if (status == SMB2_STATUS_SUCCESS && rep != NULL) {
+                smb2->share_capabilities = rep->capabilities;
+        }
+}
+
+static void
+share_create_cb(struct smb2_context *smb2 _U_, int status _U_,
+                void *command_data _U_, void *private_data _U_)
+{
+}
+
+static void
+share_statvfs_cb(struct smb2_context *smb2, int status,
+                 void *command_data, void *private_data _U_)
+{
+        struct smb2_query_info_reply *rep = command_data;
+        struct smb2_file_fs_full_size_info *vfs;
+        struct smb2_statvfs *statvfs = &smb2->share_statvfs;
 
         if (status != SMB2_STATUS_SUCCESS) {
-                smb2_close_context(smb2);
-                smb2_set_nterror(smb2, status, "Tree Connect failed with (0x%08x) %s. %s",
-                               status, nterror_to_str(status),
+                return;
+        }
+
+        vfs = rep->output_buffer;
+        memset(statvfs, 0, sizeof(struct smb2_statvfs));
+        statvfs->f_bsize = statvfs->f_frsize =
+                vfs->bytes_per_sector *
+                vfs->sectors_per_allocation_unit;
+        statvfs->f_blocks = vfs->total_allocation_units;
+        statvfs->f_bfree = statvfs->f_bavail =
+                vfs->caller_available_allocation_units;
+        smb2->have_share_statvfs = 1;
+        smb2_free_data(smb2, rep->output_buffer);
+}
+
+static void
+share_fs_attributes_cb(struct smb2_context *smb2, int status,
+                       void *command_data, void *private_data _U_)
+{
+        struct smb2_query_info_reply *rep = command_data;
+        struct smb2_file_fs_attribute_info *fs;
+
+        if (status != SMB2_STATUS_SUCCESS) {
+                return;
+        }
+
+        fs = rep->output_buffer;
+        smb2->share_fs_attributes = fs->filesystem_attributes;
+        smb2->have_share_fs_attributes = 1;
+        smb2_free_data(smb2, rep->output_buffer);
+}
+
+static void
+old_tree_cb(struct smb2_context *smb2 _U_, int status _U_,
+            void *command_data _U_, void *private_data _U_)
+{
+}
+
+static void
+share_close_cb(struct smb2_context *smb2, int status _U_,
+               void *command_data _U_, void *private_data)
+{
+        struct connect_data *c_data = private_data;
+        uint32_t tcon_status = c_data->tcon_status;
+        struct smb2_pdu *pdu;
+
+        if (tcon_status != SMB2_STATUS_SUCCESS) {
+                smb2->have_share_statvfs = 0;
+                smb2->have_share_fs_attributes = 0;
+                if (!c_data->tree_only) {
+                        smb2_close_context(smb2);
+                }
+                smb2_set_nterror(smb2, tcon_status, "Tree Connect failed with (0x%08x) %s. %s",
+                               tcon_status, nterror_to_str(tcon_status),
                                smb2_get_error(smb2));
-                c_data->cb(smb2, -nterror_to_errno(status), NULL, c_data->cb_data);
+                c_data->cb(smb2, -nterror_to_errno(tcon_status), NULL, c_data->cb_data);
                 free_c_data(smb2, c_data);
                 return;
         }
 
+        if (c_data->tree_only) {
+                free(discard_const(smb2->share));
+                smb2->share = c_data->share;
+                c_data->share = NULL;
+
+                pdu = smb2_cmd_tree_disconnect_async(smb2, old_tree_cb,
+                                                     NULL);
+                if (pdu != NULL) {
+                        smb2_set_tree_id_for_pdu(smb2, pdu,
+                                                 c_data->old_tree_id);
+                        smb2_queue_pdu(smb2, pdu);
+                }
+        }
+
         c_data->cb(smb2, 0, NULL, c_data->cb_data);
         free_c_data(smb2, c_data);
 }
 
+/* Adds a request to the chain that works on the tree being connected */
+static int
+add_share_request(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                  struct smb2_pdu *next_pdu)
+{
+        if (next_pdu == NULL) {
+                smb2_free_pdu(smb2, pdu);
+                return -ENOMEM;
+        }
+        next_pdu->header.sync.tree_id = 0xffffffff;
+        smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+        return 0;
+}
+
+static int
+send_tree_connect_request(struct smb2_context *smb2,
+                          struct connect_data *c_data)
+{
+        struct smb2_tree_connect_request req;
+        struct smb2_create_request cr_req;
+        struct smb2_query_info_request qi_req;
+        struct smb2_close_request cl_req;
+        struct smb2_pdu *pdu, *next_pdu;
+
+        smb2->have_share_statvfs = 0;
+        smb2->have_share_fs_attributes = 0;
+        c_data->tcon_status = SMB2_STATUS_SUCCESS;
+
+        memset(&req, 0, sizeof(struct smb2_tree_connect_request));
+        req.flags       = 0;
+        req.path_length = 2 * c_data->utf16_unc->len;
+        req.path        = c_data->utf16_unc->val;
+
+        pdu = smb2_cmd_tree_connect_async(smb2, &req, tree_connect_cb, c_data);
+        if (pdu == NULL) {
+                return -ENOMEM;
+        }
+
+        memset(&cr_req, 0, sizeof(struct smb2_create_request));
+        cr_req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+        cr_req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+        cr_req.desired_access = SMB2_FILE_READ_ATTRIBUTES;
+        cr_req.file_attributes = 0;
+        cr_req.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE;
+        cr_req.create_disposition = SMB2_FILE_OPEN;
+        cr_req.create_options = 0;
+        cr_req.name = "";
+
+        next_pdu = smb2_cmd_create_async(smb2, &cr_req, share_create_cb,
+                                         c_data);
+        if (add_share_request(smb2, pdu, next_pdu) < 0) {
+                return -ENOMEM;
+        }
+
+        memset(&qi_req, 0, sizeof(struct smb2_query_info_request));
+        qi_req.info_type = SMB2_0_INFO_FILESYSTEM;
+        qi_req.file_info_class = SMB2_FILE_FS_FULL_SIZE_INFORMATION;
+        qi_req.output_buffer_length = DEFAULT_OUTPUT_BUFFER_LENGTH;
+        memcpy(qi_req.file_id, compound_file_id, SMB2_FD_SIZE);
+
+        next_pdu = smb2_cmd_query_info_async(smb2, &qi_req,
+                                             share_statvfs_cb, c_data);
+        if (add_share_request(smb2, pdu, next_pdu) < 0) {
+                return -ENOMEM;
+        }
+
+        qi_req.file_info_class = SMB2_FILE_FS_ATTRIBUTE_INFORMATION;
+        next_pdu = smb2_cmd_query_info_async(smb2, &qi_req,
+                                             share_fs_attributes_cb, c_data);
+        if (add_share_request(smb2, pdu, next_pdu) < 0) {
+                return -ENOMEM;
+        }
+
+        memset(&cl_req, 0, sizeof(struct smb2_close_request));
+        memcpy(cl_req.file_id, compound_file_id, SMB2_FD_SIZE);
+
+        next_pdu = smb2_cmd_close_async(smb2, &cl_req, share_close_cb, c_data);
+        if (add_share_request(smb2, pdu, next_pdu) < 0) {
+                return -ENOMEM;
+        }
+
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
 void smb2_derive_key(
     uint8_t     *derivation_key,
     uint32_t    derivation_key_len,
@@ -680,8 +872,6 @@ session_setup_cb(struct smb2_context *smb2, int status,
 {
         struct connect_data *c_data = private_data;
         struct smb2_session_setup_reply *rep = command_data;
-        struct smb2_tree_connect_request req;
-        struct smb2_pdu *pdu;
         int ret;
 
         if (status == SMB2_STATUS_MORE_PROCESSING_REQUIRED &&
@@ -764,19 +954,8 @@ session_setup_cb(struct smb2_context *smb2, int status,
                 smb2_create_signing_key(smb2);
 
                 if (smb2->hdr.flags & SMB2_FLAGS_SIGNED) {
-                        uint8_t signature[16] _U_;
-
-                        memcpy(&signature[0], &smb2->in.iov[1].buf[48], 16);
-                        if (smb2_calc_signature(smb2, &smb2->in.iov[1].buf[48],
-                                                &smb2->in.iov[1],
-                                                smb2->in.niov - 1) < 0) {
-                                c_data->cb(smb2, -EINVAL, NULL, c_data->cb_data);
-                                free_c_data(smb2, c_data);
-                                return;
-                        }
-                        if (memcmp(&signature[0], &smb2->in.iov[1].buf[48], 16)) {
-                                smb2_set_error(smb2, "Wrong signature in received "
-                                               "PDU");
+                        if (smb2_check_signature(smb2, &smb2->in.iov[1],
+                                                 smb2->in.niov - 1) < 0) {
                                 c_data->cb(smb2, -EINVAL, NULL, c_data->cb_data);
                                 free_c_data(smb2, c_data);
                                 return;
@@ -784,20 +963,13 @@ session_setup_cb(struct smb2_context *smb2, int status,
                 }
         }
 
-        memset(&req, 0, sizeof(struct smb2_tree_connect_request));
-        req.flags       = 0;
-        req.path_length = 2 * c_data->utf16_unc->len;
-        req.path        = c_data->utf16_unc->val;
-
         if (!smb2->passthrough) {
-                pdu = smb2_cmd_tree_connect_async(smb2, &req, tree_connect_cb, c_data);
-                if (pdu == NULL) {
+                if (send_tree_connect_request(smb2, c_data) < 0) {
                         smb2_close_context(smb2);
                         c_data->cb(smb2, -ENOMEM, NULL, c_data->cb_data);
                         free_c_data(smb2, c_data);
                         return;
                 }
-                smb2_queue_pdu(smb2, pdu);
         }
         else {
                 /* if user wants raw data she probably doesnt want us to
@@ -1219,6 +1391,59 @@ smb2_connect_share_async(struct smb2_context *smb2,
         return 0;
 }
 
+int
+smb2_connect_tree_async(struct smb2_context *smb2, const char *share,
+                        smb2_command_cb cb, void *cb_data)
+{
+        struct connect_data *c_data;
+
+        if (smb2 == NULL || share == NULL) {
+                return -EINVAL;
+        }
+        if (!SMB2_IS_CONNECTED(smb2) || smb2->server == NULL) {
+                smb2_set_error(smb2, "Not connected to a server");
+                return -EINVAL;
+        }
+
+        c_data = calloc(1, sizeof(struct connect_data));
+        if (c_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate connect_data");
+                return -ENOMEM;
+        }
+        c_data->tree_only = 1;
+        c_data->old_tree_id = smb2_tree_id(smb2);
+        c_data->server = strdup(smb2->server);
+        c_data->share = strdup(share);
+        if (c_data->server == NULL || c_data->share == NULL) {
+                free_c_data(smb2, c_data);
+                smb2_set_error(smb2, "Failed to strdup(share)");
+                return -ENOMEM;
+        }
+        if (asprintf(&c_data->utf8_unc, "\\\\%s\\%s", c_data->server,
+                     c_data->share) < 0) {
+                free_c_data(smb2, c_data);
+                smb2_set_error(smb2, "Failed to allocate unc string.");
+                return -ENOMEM;
+        }
+        c_data->utf16_unc = smb2_utf8_to_utf16(c_data->utf8_unc);
+        if (c_data->utf16_unc == NULL) {
+                smb2_set_error(smb2, "Count not convert UNC:[%s] into UTF-16",
+                               c_data->utf8_unc);
+                free_c_data(smb2, c_data);
+                return -ENOMEM;
+        }
+
+        c_data->cb = cb;
+        c_data->cb_data = cb_data;
+
+        if (send_tree_connect_request(smb2, c_data) < 0) {
+                free_c_data(smb2, c_data);
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
 static void
 free_smb2fh(struct smb2_context *smb2, struct smb2fh *fh)
 {
@@ -1250,6 +1475,7 @@ open_cb(struct smb2_context *smb2, int status,
 
         memcpy(fh->file_id, rep->file_id, SMB2_FD_SIZE);
         fh->end_of_file = rep->end_of_file;
+        fh->oplock_level = rep->oplock_level;
         fh->cb(smb2, 0, fh, fh->cb_data);
 }
 
@@ -1477,11 +1703,139 @@ smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
         return 0;
 }
 
+struct lock_cb_data {
+        smb2_command_cb cb;
+        void *cb_data;
+};
+
+static void
+lock_cb(struct smb2_context *smb2, int status,
+        void *command_data _U_, void *private_data)
+{
+        struct lock_cb_data *lock_data = private_data;
+
+        if (status != SMB2_STATUS_SUCCESS) {
+                smb2_set_nterror(smb2, status, "Lock failed with (0x%08x) %s",
+                               status, nterror_to_str(status));
+                status = -nterror_to_errno(status);
+        }
+
+        lock_data->cb(smb2, status, NULL, lock_data->cb_data);
+        free(lock_data);
+}
+
+int
+smb2_lock_async(struct smb2_context *smb2, struct smb2fh *fh,
+                const struct smb2_lock_element *locks, int count,
+                smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_lock_request req;
+        struct lock_cb_data *lock_data;
+        struct smb2_pdu *pdu;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (fh == NULL) {
+                smb2_set_error(smb2, "File handle was NULL");
+                return -EINVAL;
+        }
+        if (locks == NULL || count < 1 || count > SMB2_MAX_LOCK_ELEMENTS) {
+                smb2_set_error(smb2, "Invalid number of lock elements");
+                return -EINVAL;
+        }
+
+        lock_data = calloc(1, sizeof(struct lock_cb_data));
+        if (lock_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate lock_data");
+                return -ENOMEM;
+        }
+        lock_data->cb = cb;
+        lock_data->cb_data = cb_data;
+
+        /* The lock state is kept per element by the caller, so the request
+         * is never a replay and carries no lock sequence.
+         */
+        memset(&req, 0, sizeof(struct smb2_lock_request));
+        req.lock_count = count;
+        memcpy(req.file_id, fh->file_id, SMB2_FD_SIZE);
+        req.locks = discard_const(locks);
+
+        pdu = smb2_cmd_lock_async(smb2, &req, lock_cb, lock_data);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create lock command");
+                free(lock_data);
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+/*
+ * Limit a read or write to what the server accepts in one request and to
+ * the credits we have. The caller gets a short read or write for the rest.
+ */
+static uint32_t
+smb2_clamp_io_count(struct smb2_context *smb2, uint32_t count,
+                    uint32_t max_size)
+{
+        int needed_credits;
+
+        if (count > max_size) {
+                count = max_size;
+        }
+        needed_credits = (count - 1) / 65536 + 1;
+
+        if (smb2->dialect > SMB2_VERSION_0202) {
+                if (needed_credits > MAX_CREDITS - 16) {
+                        count =  (MAX_CREDITS - 16) * 65536;
+                }
+                needed_credits = (count - 1) / 65536 + 1;
+                if (needed_credits > smb2->credits) {
+                        count = smb2->credits * 65536;
+                }
+        } else {
+                if (count > 65536) {
+                        count = 65536;
+                }
+        }
+
+        return count;
+}
+
+static int
+smb2_iovec_length(struct smb2_context *smb2,
+                  const struct smb2_iovec *vec, int nvec, uint32_t *count)
+{
+        uint64_t total = 0;
+        int i;
+
+        if (nvec < 0 || nvec > SMB2_MAX_IO_SEGMENTS) {
+                smb2_set_error(smb2, "Invalid number of segments: %d", nvec);
+                return -EINVAL;
+        }
+        for (i = 0; i < nvec; i++) {
+                if (vec[i].len && vec[i].buf == NULL) {
+                        smb2_set_error(smb2, "Segment %d has no buffer", i);
+                        return -EINVAL;
+                }
+                total += vec[i].len;
+        }
+        if (total > 0xffffffff) {
+                total = 0xffffffff;
+        }
+        *count = (uint32_t)total;
+
+        return 0;
+}
+
 struct read_data {
         smb2_command_cb cb;
         void *cb_data;
 
         struct smb2_read_cb_data read_cb_data;
+        struct smb2_flight *flight;
 };
 
 static void
@@ -1494,6 +1848,8 @@ read_cb(struct smb2_context *smb2, int status,
         if (status && status != SMB2_STATUS_END_OF_FILE) {
                 smb2_set_nterror(smb2, status, "Read/Write failed with (0x%08x) %s",
                                status, nterror_to_str(status));
+                smb2_flight_end(smb2, rd->flight, -nterror_to_errno(status),
+                                NULL, 0);
                 rd->cb(smb2, -nterror_to_errno(status), &rd->read_cb_data, rd->cb_data);
                 free(rd);
                 return;
@@ -1503,6 +1859,8 @@ read_cb(struct smb2_context *smb2, int status,
                 rd->read_cb_data.fh->offset = rd->read_cb_data.offset + rep->data_length;
         }
 
+        smb2_flight_end(smb2, rd->flight, rep->data_length,
+                        rd->read_cb_data.buf, rep->data_length);
         rd->cb(smb2, rep->data_length, &rd->read_cb_data, rd->cb_data);
         free(rd);
 }
@@ -1515,7 +1873,6 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
         struct smb2_read_request req;
         struct read_data *rd;
         struct smb2_pdu *pdu;
-        int needed_credits;
 
         if (smb2 == NULL) {
                 return -EINVAL;
@@ -1525,6 +1882,11 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
                 return -EINVAL;
         }
 
+        if (smb2_flight_attach(smb2, SMB2_FLIGHT_READ, NULL, fh,
+                               offset, count, buf, cb, cb_data)) {
+                return 0;
+        }
+
         rd = calloc(1, sizeof(struct read_data));
         if (rd == NULL) {
                 smb2_set_error(smb2, "Failed to allocate read_data");
@@ -1538,25 +1900,7 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
         rd->read_cb_data.count = count;
         rd->read_cb_data.offset = offset;
 
-        if (count > smb2->max_read_size) {
-                count = smb2->max_read_size;
-        }
-        needed_credits = (count - 1) / 65536 + 1;
-
-        if (smb2->dialect > SMB2_VERSION_0202) {
-                if (needed_credits > MAX_CREDITS - 16) {
-                        count =  (MAX_CREDITS - 16) * 65536;
-                }
-                needed_credits = (count - 1) / 65536 + 1;
-                if (needed_credits > smb2->credits) {
-                        count = smb2->credits * 65536;
-                }
-        } else {
-                if (count > 65536) {
-                        count = 65536;
-                }
-        }
-        needed_credits = (count - 1) / 65536 + 1;
+        count = smb2_clamp_io_count(smb2, count, smb2->max_read_size);
 
         memset(&req, 0, sizeof(struct smb2_read_request));
         req.flags = 0;
@@ -1574,6 +1918,69 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
                 return -EINVAL;
         }
 
+        rd->flight = smb2_flight_begin(smb2, SMB2_FLIGHT_READ, NULL, fh,
+                                       offset, rd->read_cb_data.count);
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
+int
+smb2_preadv_async(struct smb2_context *smb2, struct smb2fh *fh,
+                  const struct smb2_iovec *vec, int nvec, uint64_t offset,
+                  smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_read_request req;
+        struct read_data *rd;
+        struct smb2_pdu *pdu;
+        uint32_t count;
+        int rc;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (fh == NULL) {
+                smb2_set_error(smb2, "File handle was NULL");
+                return -EINVAL;
+        }
+
+        rc = smb2_iovec_length(smb2, vec, nvec, &count);
+        if (rc < 0) {
+                return rc;
+        }
+
+        rd = calloc(1, sizeof(struct read_data));
+        if (rd == NULL) {
+                smb2_set_error(smb2, "Failed to allocate read_data");
+                return -ENOMEM;
+        }
+
+        rd->cb = cb;
+        rd->cb_data = cb_data;
+        rd->read_cb_data.fh = fh;
+        rd->read_cb_data.buf = NULL;
+        rd->read_cb_data.count = count;
+        rd->read_cb_data.offset = offset;
+
+        count = smb2_clamp_io_count(smb2, count, smb2->max_read_size);
+
+        memset(&req, 0, sizeof(struct smb2_read_request));
+        req.flags = 0;
+        req.length = count;
+        req.offset = offset;
+        memcpy(req.file_id, fh->file_id, SMB2_FD_SIZE);
+        req.minimum_count = 0;
+        req.channel = SMB2_CHANNEL_NONE;
+        req.remaining_bytes = 0;
+
+        pdu = smb2_cmd_readv_async(smb2, &req, vec, nvec, read_cb, rd);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create read command. %s",
+                               smb2_get_error(smb2));
+                free(rd);
+                return -EINVAL;
+        }
+
         smb2_queue_pdu(smb2, pdu);
 
         return 0;
@@ -1634,7 +2041,6 @@ smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
         struct smb2_write_request req;
         struct write_data *wr;
         struct smb2_pdu *pdu;
-        int needed_credits;
 
         if (smb2 == NULL) {
                 return -EINVAL;
@@ -1657,25 +2063,7 @@ smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
         wr->write_cb_data.count = count;
         wr->write_cb_data.offset = offset;
 
-        if (count > smb2->max_write_size) {
-                count = smb2->max_write_size;
-        }
-        needed_credits = (count - 1) / 65536 + 1;
-
-        if (smb2->dialect > SMB2_VERSION_0202) {
-                if (needed_credits > MAX_CREDITS - 16) {
-                        count =  (MAX_CREDITS - 16) * 65536;
-                }
-                needed_credits = (count - 1) / 65536 + 1;
-                if (needed_credits > smb2->credits) {
-                        count = smb2->credits * 65536;
-                }
-        } else {
-                if (count > 65536) {
-                        count = 65536;
-                }
-        }
-        needed_credits = (count - 1) / 65536 + 1;
+        count = smb2_clamp_io_count(smb2, count, smb2->max_write_size);
 
         memset(&req, 0, sizeof(struct smb2_write_request));
         req.length = count;
@@ -1696,6 +2084,65 @@ smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
         return 0;
 }
 
+int
+smb2_pwritev_async(struct smb2_context *smb2, struct smb2fh *fh,
+                   const struct smb2_iovec *vec, int nvec, uint64_t offset,
+                   smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_write_request req;
+        struct write_data *wr;
+        struct smb2_pdu *pdu;
+        uint32_t count;
+        int rc;
+
+        if (smb2 == NULL) {
+                return -EINVAL;
+        }
+        if (fh == NULL) {
+                smb2_set_error(smb2, "File handle was NULL");
+                return -EINVAL;
+        }
+
+        rc = smb2_iovec_length(smb2, vec, nvec, &count);
+        if (rc < 0) {
+                return rc;
+        }
+
+        wr = calloc(1, sizeof(struct write_data));
+        if (wr == NULL) {
+                smb2_set_error(smb2, "Failed to allocate write_data");
+                return -ENOMEM;
+        }
+
+        wr->cb = cb;
+        wr->cb_data = cb_data;
+        wr->write_cb_data.fh = fh;
+        wr->write_cb_data.buf = NULL;
+        wr->write_cb_data.count = count;
+        wr->write_cb_data.offset = offset;
+
+        count = smb2_clamp_io_count(smb2, count, smb2->max_write_size);
+
+        memset(&req, 0, sizeof(struct smb2_write_request));
+        req.length = count;
+        req.offset = offset;
+        memcpy(req.file_id, fh->file_id, SMB2_FD_SIZE);
+        req.channel = SMB2_CHANNEL_NONE;
+        req.remaining_bytes = 0;
+        req.flags = 0;
+
+        pdu = smb2_cmd_writev_async(smb2, &req, vec, nvec, write_cb, wr);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create write command. %s",
+                               smb2_get_error(smb2));
+                free(wr);
+                return -EINVAL;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        return 0;
+}
+
 int
 smb2_write_async(struct smb2_context *smb2, struct smb2fh *fh,
                  const uint8_t *buf, uint32_t count,
@@ -1937,6 +2384,7 @@ struct stat_cb_data {
         uint8_t info_type;
         uint8_t file_info_class;
         void *st;
+        struct smb2_flight *flight;
 };
 
 static void
@@ -1964,6 +2412,7 @@ fstat_cb_1(struct smb2_context *smb2, int status,
         }
         st->smb2_nlink      = fs->standard.number_of_links;
         st->smb2_ino        = fs->index_number;
+        st->smb2_ea_size    = fs->ea_size;
         st->smb2_size       = fs->standard.end_of_file;
         st->smb2_atime      = fs->basic.last_access_time.tv_sec;
         st->smb2_atime_nsec = fs->basic.last_access_time.tv_usec *
@@ -2040,6 +2489,11 @@ getinfo_cb_3(struct smb2_context *smb2, int status,
                 stat_data->status = status;
         }
 
+        smb2_flight_end(smb2, stat_data->flight,
+                        -nterror_to_errno(stat_data->status), stat_data->st,
+                        stat_data->info_type == SMB2_0_INFO_FILE ?
+                        sizeof(struct smb2_stat_64) :
+                        sizeof(struct smb2_statvfs));
         stat_data->cb(smb2, -nterror_to_errno(stat_data->status),
                       stat_data->st, stat_data->cb_data);
         free(stat_data);
@@ -2073,6 +2527,7 @@ getinfo_cb_2(struct smb2_context *smb2, int status,
                 }
                 st->smb2_nlink      = fs->standard.number_of_links;
                 st->smb2_ino        = fs->index_number;
+                st->smb2_ea_size    = fs->ea_size;
                 st->smb2_size       = fs->standard.end_of_file;
                 st->smb2_atime      = fs->basic.last_access_time.tv_sec;
                 st->smb2_atime_nsec = fs->basic.last_access_time.tv_usec *
@@ -2124,11 +2579,19 @@ smb2_getinfo_async(struct smb2_context *smb2, const char *path,
         struct smb2_query_info_request qi_req;
         struct smb2_close_request cl_req;
         struct smb2_pdu *pdu, *next_pdu;
+        int flight_type;
 
         if (smb2 == NULL) {
                 return -EINVAL;
         }
 
+        flight_type = info_type == SMB2_0_INFO_FILE ?
+                SMB2_FLIGHT_STAT : SMB2_FLIGHT_STATVFS;
+        if (smb2_flight_attach(smb2, flight_type, path, NULL, 0, 0,
+                               st, cb, cb_data)) {
+                return 0;
+        }
+
         stat_data = calloc(1, sizeof(struct stat_cb_data));
         if (stat_data == NULL) {
                 smb2_set_error(smb2, "Failed to allocate create_data");
@@ -2192,6 +2655,8 @@ smb2_getinfo_async(struct smb2_context *smb2, const char *path,
         }
         smb2_add_compound_pdu(smb2, pdu, next_pdu);
 
+        stat_data->flight = smb2_flight_begin(smb2, flight_type, path, NULL,
+                                              0, 0);
         smb2_queue_pdu(smb2, pdu);
 
         return 0;
@@ -2697,11 +3162,7 @@ disconnect_cb_2(struct smb2_context *smb2, int status,
 
         dc_data->cb(smb2, 0, NULL, dc_data->cb_data);
         free(dc_data);
-        if (smb2->change_fd) {
-                smb2->change_fd(smb2, smb2->fd, SMB2_DEL_FD);
-        }
-        close(smb2->fd);
-        smb2->fd = SMB2_INVALID_SOCKET;
+        smb2_transport_close(smb2);
 }
 
 static void
@@ -2737,7 +3198,7 @@ smb2_disconnect_share_async(struct smb2_context *smb2,
                 return -EINVAL;
         }
 
-        if (!SMB2_VALID_SOCKET(smb2->fd)) {
+        if (!SMB2_IS_CONNECTED(smb2)) {
                 smb2_set_error(smb2, "connection is alreeady disconnected or was never connected");
                 return -EINVAL;
         }
@@ -2819,12 +3280,51 @@ smb2_get_max_write_size(struct smb2_context *smb2)
         return smb2->max_write_size;
 }
 
+int
+smb2_get_share_statvfs(struct smb2_context *smb2,
+                       struct smb2_statvfs *statvfs)
+{
+        if (!smb2->have_share_statvfs) {
+                return -ENOENT;
+        }
+        *statvfs = smb2->share_statvfs;
+        return 0;
+}
+
+int
+smb2_get_share_fs_attributes(struct smb2_context *smb2, uint32_t *attributes)
+{
+        if (!smb2->have_share_fs_attributes) {
+                return -ENOENT;
+        }
+        *attributes = smb2->share_fs_attributes;
+        return 0;
+}
+
+uint32_t
+smb2_get_share_capabilities(struct smb2_context *smb2)
+{
+        return smb2->share_capabilities;
+}
+
 smb2_file_id *
 smb2_get_file_id(struct smb2fh *fh)
 {
         return &fh->file_id;
 }
 
+uint8_t
+smb2_get_oplock_level(struct smb2fh *fh)
+{
+        return fh->oplock_level;
+}
+
+void
+smb2_set_fh_offset(struct smb2fh *fh, int64_t offset)
+{
+        fh->offset = offset;
+}
+
 struct smb2fh *
 smb2_fh_from_file_id(struct smb2_context *smb2, smb2_file_id *fileid)
 {
@@ -2856,16 +3356,37 @@ smb2_oplock_break_notify(struct smb2_context *smb2, int status, void *command_da
         struct smb2_oplock_break_reply rep_oplock;
         struct smb2_lease_break_reply rep_lease;
         struct smb2_pdu *pdu = NULL;
-        uint8_t new_oplock_level;
-        uint32_t new_lease_state;
+        struct smb2fh *fh;
+        uint8_t new_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+        uint32_t new_lease_state = 0;
 
         rep= command_data;
 
+        /* Unless the application says otherwise, acknowledge the level
+         * or state the server is breaking to.
+         */
+        if (status == 0 && rep != NULL) {
+                if (rep->break_type == SMB2_BREAK_TYPE_OPLOCK_NOTIFICATION) {
+                        new_oplock_level = rep->lock.oplock.oplock_level;
+                } else if (rep->break_type == SMB2_BREAK_TYPE_LEASE_NOTIFICATION) {
+                        new_lease_state = rep->lock.lease.new_lease_state;
+                }
+        }
 
         if (smb2->oplock_or_lease_break_cb) {
                 smb2->oplock_or_lease_break_cb(smb2,
                                status, rep, &new_oplock_level, &new_lease_state);
         }
+
+        if (status == 0 && rep != NULL &&
+            rep->break_type == SMB2_BREAK_TYPE_OPLOCK_NOTIFICATION) {
+                for (fh = smb2->fhs; fh; fh = fh->next) {
+                        if (!memcmp(fh->file_id, rep->lock.oplock.file_id,
+                                    SMB2_FD_SIZE)) {
+                                fh->oplock_level = new_oplock_level;
+                        }
+                }
+        }
         /* for passthrough case assume the app callback will do everything needed
          */
         if (!smb2->passthrough) {
@@ -3051,6 +3572,7 @@ smb2_logoff_request_cb(struct smb2_server *server, struct smb2_context *smb2, vo
         struct smb2_error_reply err;
         int ret = -EINVAL;
 
+        smb2_durable_logoff(server, smb2);
         if (server->handlers && server->handlers->logoff_cmd) {
                 ret = server->handlers->logoff_cmd(server, smb2);
         }
@@ -3129,20 +3651,34 @@ smb2_create_request_cb(struct smb2_server *server, struct smb2_context *smb2, vo
         struct smb2_create_reply rep;
         struct smb2_error_reply err;
         struct smb2_pdu *pdu = NULL;
-        int ret = -1;
+        uint32_t status = SMB2_STATUS_NOT_IMPLEMENTED;
+        uint8_t *contexts = NULL;
+        int ret;
 
         memset(&rep, 0, sizeof(rep));
-        if (server->handlers && server->handlers->create_cmd) {
-                ret = server->handlers->create_cmd(server, smb2, req, &rep);
+        ret = smb2_durable_reconnect(server, smb2, req, &rep, &contexts, &status);
+        if (ret > 0) {
+                /* not a reconnect of a durable open */
+                ret = -1;
+                if (server->handlers && server->handlers->create_cmd) {
+                        ret = server->handlers->create_cmd(server, smb2, req, &rep);
+                }
+                if (!ret) {
+                        smb2_durable_opened(server, smb2, req, &rep, &contexts);
+                }
         }
         if (!ret) {
+                smb2_compound_opened(smb2, rep.file_id);
+                smb2_rcache_opened(server, smb2, req, &rep);
+                smb2_copychunk_opened(server, smb2, req, &rep);
                 pdu = smb2_cmd_create_reply_async(smb2, &rep, NULL, cb_data);
         }
         else if (ret < 0) {
                 memset(&err, 0, sizeof(err));
                 pdu = smb2_cmd_error_reply_async(smb2,
-                                &err, SMB2_CREATE, SMB2_STATUS_NOT_IMPLEMENTED, NULL, cb_data);
+                                &err, SMB2_CREATE, status, NULL, cb_data);
         }
+        free(contexts);
         if (pdu) {
                 if (req->name) {
                         smb2_free_data(smb2, discard_const(req->name));
@@ -3162,6 +3698,10 @@ smb2_close_request_cb(struct smb2_server *server, struct smb2_context *smb2, voi
         int ret = -1;
 
         memset(&rep, 0, sizeof(rep));
+        smb2_rcache_closed(server, smb2, req->file_id);
+        smb2_copychunk_closed(smb2, req->file_id);
+        smb2_notify_closed(server, smb2, req->file_id);
+        smb2_durable_closed(server, smb2, req->file_id);
         if (server->handlers && server->handlers->close_cmd) {
                 ret = server->handlers->close_cmd(server, smb2, req, &rep);
         }
@@ -3214,8 +3754,14 @@ smb2_read_request_cb(struct smb2_server *server, struct smb2_context *smb2, void
         int ret = -1;
 
         memset(&rep, 0, sizeof(rep));
-        if (server->handlers && server->handlers->read_cmd) {
+        if (smb2_rcache_read(server, smb2, req, &rep)) {
+                ret = 0;
+        }
+        else if (server->handlers && server->handlers->read_cmd) {
                 ret = server->handlers->read_cmd(server, smb2, req, &rep);
+                if (!ret) {
+                        smb2_rcache_store(server, smb2, req, &rep);
+                }
         }
         if (!ret) {
                 pdu = smb2_cmd_read_reply_async(smb2, &rep, NULL, cb_data);
@@ -3241,6 +3787,7 @@ smb2_write_request_cb(struct smb2_server *server, struct smb2_context *smb2, voi
         int ret = -1;
 
         memset(&rep, 0, sizeof(rep));
+        smb2_rcache_changed(server, smb2, req->file_id);
         if (server->handlers && server->handlers->write_cmd) {
                 ret = server->handlers->write_cmd(server, smb2, req, &rep);
         }
@@ -3291,6 +3838,9 @@ smb2_oplock_break_request_cb(struct smb2_server *server, struct smb2_context *sm
                         }
                 }
         }
+        if (!ret) {
+                smb2_durable_broken(server, smb2, req);
+        }
         if(ret < 0) {
                 memset(&err, 0, sizeof(err));
                 pdu = smb2_cmd_error_reply_async(smb2,
@@ -3313,6 +3863,9 @@ smb2_lock_request_cb(struct smb2_server *server, struct smb2_context *smb2, void
         if (server->handlers && server->handlers->lock_cmd) {
                 ret = server->handlers->lock_cmd(server, smb2, req);
         }
+        if (ret >= 0) {
+                smb2_rcache_locked(server, smb2, req);
+        }
         if (!ret) {
                 pdu = smb2_cmd_lock_reply_async(smb2, NULL, cb_data);
         }
@@ -3335,6 +3888,8 @@ smb2_ioctl_request_cb(struct smb2_server *server, struct smb2_context *smb2, voi
         struct smb2_error_reply err;
         struct smb2_pdu *pdu = NULL;
         struct smb2_ioctl_validate_negotiate_info out_info;
+        uint8_t copy_out[32];
+        uint32_t status = SMB2_STATUS_NOT_IMPLEMENTED;
         int ret = -1;
 
         memset(&rep, 0, sizeof(rep));
@@ -3356,16 +3911,34 @@ smb2_ioctl_request_cb(struct smb2_server *server, struct smb2_context *smb2, voi
                 }
         }
         else {
-                if (server->handlers && server->handlers->ioctl_cmd) {
-                        ret = server->handlers->ioctl_cmd(server, smb2, req, &rep);
+                /* resume keys and server side copies, see copychunk.c */
+                ret = smb2_copychunk_ioctl(server, smb2, req, &rep,
+                                           copy_out, &status);
+                if (ret > 0) {
+                        ret = -1;
+                        if (server->handlers && server->handlers->ioctl_cmd) {
+                                ret = server->handlers->ioctl_cmd(server, smb2, req, &rep);
+                        }
+                        if (req->ctl_code == SMB2_FSCTL_SRV_COPYCHUNK ||
+                            req->ctl_code == SMB2_FSCTL_SRV_COPYCHUNK_WRITE) {
+                                /* the decoder copied it for copychunk.c */
+                                smb2_free_data(smb2, req->input);
+                                req->input = NULL;
+                        }
+                        status = ret ? SMB2_STATUS_NOT_IMPLEMENTED :
+                                SMB2_STATUS_SUCCESS;
                 }
                 if (!ret) {
                         pdu = smb2_cmd_ioctl_reply_async(smb2, &rep, NULL, cb_data);
+                        /* the copy limits go out with INVALID_PARAMETER */
+                        if (pdu != NULL && status != SMB2_STATUS_SUCCESS) {
+                                smb2_set_pdu_status(smb2, pdu, status);
+                        }
                 }
                 else if (ret < 0) {
                         memset(&err, 0, sizeof(err));
                         pdu = smb2_cmd_error_reply_async(smb2,
-                                        &err, SMB2_IOCTL, SMB2_STATUS_NOT_IMPLEMENTED, NULL, cb_data);
+                                        &err, SMB2_IOCTL, status, NULL, cb_data);
                 }
         }
         if (pdu != NULL) {
@@ -3381,7 +3954,10 @@ smb2_cancel_request_cb(struct smb2_server *server, struct smb2_context *smb2, vo
         struct smb2_pdu *pdu = NULL;
         int ret = -1;
 
-        if (server->handlers && server->handlers->cancel_cmd) {
+        if (smb2_notify_cancel(server, smb2)) {
+                ret = 0;
+        }
+        else if (server->handlers && server->handlers->cancel_cmd) {
                 ret = server->handlers->cancel_cmd(server, smb2);
         }
         if (ret < 0) {
@@ -3393,6 +3969,14 @@ smb2_cancel_request_cb(struct smb2_server *server, struct smb2_context *smb2, vo
                 smb2_set_pdu_message_id(smb2, pdu, smb2->message_id);
                 smb2_queue_pdu(smb2, pdu);
         }
+        else {
+                /* a CANCEL is never answered, so nothing will take it off
+                 * the wait queue
+                 */
+                SMB2_LIST_REMOVE(&smb2->waitqueue, smb2->pdu);
+                smb2_free_pdu(smb2, smb2->pdu);
+                smb2->pdu = NULL;
+        }
 }
 
 static void
@@ -3535,6 +4119,7 @@ smb2_set_info_request_cb(struct smb2_server *server, struct smb2_context *smb2,
         int ret = -1;
 
         memset(&err, 0, sizeof(err));
+        smb2_rcache_changed(server, smb2, req->file_id);
 
         if (server->handlers && server->handlers->set_info_cmd) {
                 ret = server->handlers->set_info_cmd(server, smb2, req);
@@ -3572,6 +4157,13 @@ smb2_general_client_request_cb(struct smb2_context *smb2, int status, void *comm
                 return;
         }
 
+        /* a related request of a compound takes the file id from the one
+         * before it, and fails if that one did
+         */
+        if (smb2_compound_failed(smb2, command_data, cb_data)) {
+                goto next_request;
+        }
+
         switch (smb2->pdu->header.command) {
         case SMB2_SESSION_SETUP:
                 //printf("New session IN session\n");
@@ -3639,6 +4231,7 @@ smb2_general_client_request_cb(struct smb2_context *smb2, int status, void *comm
                 break;
         }
 
+next_request:
         if (next_cb) {
                 /* alloc a pdu for next request. note that we dont really expect a tree connect, its just to
                  * allow pdu reading to know to allow for any command above negotiate and session-setup
@@ -3826,8 +4419,8 @@ smb2_session_setup_request_cb(struct smb2_context *smb2, int status, void *comma
                 return;
         }
 
-        if (smb2->sign)  {
-                /* Derive the signing key from session key
+        if (smb2->sign || smb2->seal)  {
+                /* Derive the signing and encryption keys from session key
                 * This is based on negotiated protocol
                 */
                 smb2_create_signing_key(smb2);
@@ -4133,27 +4726,25 @@ int smb2_serve_port_async(const int fd, const int to_msecs, struct smb2_context
         return err;
 }
 
-int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_client_connection cb, void *cb_data)
+void
+smb2_server_set_defaults(struct smb2_server *server)
 {
-        struct smb2_context *smb2;
-        struct connect_data *c_data = cb_data;
-        fd_set rfds, wfds;
-        int maxfd;
-        int ready;
-        short events;
-        struct timeval timeout;
-        int err = -1;
         static const char *default_domain = "WORKGROUP";
-        time_t now;
-#ifdef HAVE_LIBKRB5
-        static time_t credential_renewal_time = 0;
-#endif
 
         if (!server->max_transact_size) {
                 server->max_transact_size = 0x100000;
                 server->max_read_size = 0x100000;
                 server->max_write_size = 0x100000;
         }
+        if (!server->sched_quantum) {
+                server->sched_quantum = 0x20000;
+        }
+        if (!server->max_requests) {
+                server->max_requests = 128;
+        }
+        if (!server->durable_timeout) {
+                server->durable_timeout = 60000;
+        }
         if (!server->guid[0]) {
                 memcpy(server->guid, "libsmb2-srvrguid", 16);
         }
@@ -4164,6 +4755,54 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                 strncpy(server->domain, default_domain,
                                MIN(sizeof(server->domain),strlen(default_domain) + 1));
         }
+}
+
+/* Make a new context with a connected client the server side of a session */
+int
+smb2_serve_context(struct smb2_server *server, struct smb2_context *smb2)
+{
+        struct connect_data *c_data;
+
+        c_data = calloc(1, sizeof(struct connect_data));
+        if (c_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate connect_data");
+                return -ENOMEM;
+        }
+        c_data->server_context = server;
+        smb2->connect_data = c_data;
+
+        /* alloc a pdu for first server request */
+        smb2->pdu = smb2_allocate_pdu(smb2, SMB2_NEGOTIATE, smb2_negotiate_request_cb, c_data);
+        if (!smb2->pdu) {
+                smb2_set_error(smb2, "can not alloc pdu for request");
+                return -ENOMEM;
+        }
+        smb2->owning_server = server;
+        smb2->max_transact_size = server->max_transact_size;
+        smb2->max_read_size     = server->max_read_size;
+        smb2->max_write_size    = server->max_write_size;
+        /* the credit for the NEGOTIATE every client starts out with */
+        smb2->sched_credits     = 1;
+
+        return 0;
+}
+
+int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_client_connection cb, void *cb_data)
+{
+        struct smb2_context *smb2;
+        fd_set rfds, wfds;
+        int maxfd;
+        int ready;
+        short events;
+        struct timeval timeout;
+        int err = -1;
+        int notify_fd;
+        time_t now;
+#ifdef HAVE_LIBKRB5
+        static time_t credential_renewal_time = 0;
+#endif
+
+        smb2_server_set_defaults(server);
 
 #ifdef HAVE_LIBKRB5
         err = krb5_init_server_credentials(server, server->keytab_path);
@@ -4186,9 +4825,22 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                 FD_SET(server->fd, &rfds);
                 maxfd = server->fd;
 
+                /* changes to post to CHANGE_NOTIFY watches */
+                notify_fd = smb2_notify_inotify_fd(server);
+                if (notify_fd >= 0) {
+                        FD_SET(notify_fd, &rfds);
+                        if (notify_fd > maxfd) {
+                                maxfd = notify_fd;
+                        }
+                }
+
                 for (smb2 = smb2_active_contexts(); smb2; smb2 = smb2->next) {
                         if (SMB2_VALID_SOCKET(smb2_get_fd(smb2))) {
                                 events = smb2_which_events(smb2);
+                                if (!smb2_sched_may_read(smb2)) {
+                                        /* too much in flight, let it drain */
+                                        events &= ~POLLIN;
+                                }
                                 if (events) {
                                         if (events & POLLIN) {
                                                 FD_SET(smb2_get_fd(smb2), &rfds);
@@ -4218,15 +4870,26 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                 if (ready > 0) {
                         now = time(NULL);
 
-                        /* for each client context ready to read, process that context */
+                        /* before reading requests, so replies to them see
+                         * the changes
+                         */
+                        if (notify_fd >= 0 && FD_ISSET(notify_fd, &rfds)) {
+                                smb2_notify_inotify_service(server);
+                        }
+
+                        /* for each client context ready to read, process that context
+                         * for as much as its turn allows, see sched.c
+                         */
                         for (smb2 = smb2_active_contexts(); smb2; smb2 = smb2->next) {
                                 if (SMB2_VALID_SOCKET(smb2_get_fd(smb2)) && FD_ISSET(smb2_get_fd(smb2), &rfds)) {
-                                        if (smb2_service(smb2, POLLIN) < 0) {
+                                        if (smb2_sched_service(smb2) < 0) {
                                                 smb2_set_error(smb2, "smb2_service (in) failed with : "
                                                                 "%s", smb2_get_error(smb2));
                                                 smb2_close_context(smb2);
                                         }
                                         err = 0;
+                                } else {
+                                        smb2_sched_idle(smb2);
                                 }
                                 if (SMB2_VALID_SOCKET(smb2_get_fd(smb2)) && FD_ISSET(smb2_get_fd(smb2), &wfds)) {
                                         if (smb2_service(smb2, POLLOUT) < 0) {
@@ -4235,7 +4898,7 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                                                 smb2_close_context(smb2);
                                         }
                                 }
-                                if (!SMB2_VALID_SOCKET(smb2->fd) && ((time(NULL) - now) > (smb2->timeout)))
+                                if (!SMB2_IS_CONNECTED(smb2) && ((time(NULL) - now) > (smb2->timeout)))
                                 {
                                         smb2_set_error(smb2, "Timeout expired and no connection exists");
                                         smb2_close_context(smb2);
@@ -4249,26 +4912,10 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                                 smb2 = NULL;
                                 err = smb2_serve_port_async(server->fd, 10, &smb2);
                                 if (!err && smb2) {
-                                        c_data = calloc(1, sizeof(struct connect_data));
-                                        if (c_data == NULL) {
-                                                smb2_set_error(smb2, "Failed to allocate connect_data");
-                                                smb2_close_context(smb2);
-                                        }
-                                        c_data->server_context = server;
-                                        smb2->connect_data = c_data;
-
-                                        /* alloc a pdu for first server request */
-                                        smb2->pdu = smb2_allocate_pdu(smb2, SMB2_NEGOTIATE, smb2_negotiate_request_cb, c_data);
-                                        if (!smb2->pdu) {
-                                                smb2_set_error(smb2, "can not alloc pdu for request");
+                                        if (smb2_serve_context(server, smb2) != 0) {
                                                 smb2_close_context(smb2);
                                         }
                                         /* got a new smb2 context with a connection, enlist it and tell user */
-                                        smb2->owning_server = server;
-                                        smb2->max_transact_size = server->max_transact_size;
-                                        smb2->max_read_size     = server->max_read_size;
-                                        smb2->max_write_size    = server->max_write_size;
-
                                         if (cb) {
                                                 cb(smb2, cb_data);
                                         }
@@ -4283,7 +4930,8 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                          */
                         for (smb2 = smb2_active_contexts(); smb2; smb2 = smb2->next) {
                                 if (smb2_is_server(smb2)) {
-                                        if (!SMB2_VALID_SOCKET(smb2_get_fd(smb2))) {
+                                        if (!SMB2_IS_CONNECTED(smb2)) {
+                                                smb2_durable_disconnected(server, smb2);
                                                 if (server->handlers && server->handlers->destruction_event) {
                                                         server->handlers->destruction_event(server, smb2);
                                                 }
@@ -4294,6 +4942,9 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                                 /* client connections are destroyed when they timeout or get disconnected */
                         }
                 }
+
+                /* close the durable opens whose clients did not come back */
+                smb2_durable_expire(server, 0);
 #ifdef HAVE_LIBKRB5
                 /* renew kerberos credentials daily */
                 time(&now);
@@ -4314,6 +4965,8 @@ int smb2_serve_port(struct smb2_server *server, const int max_connections, smb2_
                 smb2 = smb2_active_contexts();
                 smb2_destroy_context(smb2);
         }
+        smb2_rcache_free(server);
+        smb2_durable_expire(server, 1);
 #ifdef HAVE_LIBKRB5
         krb5_free_server_credentials(server);
 #endif
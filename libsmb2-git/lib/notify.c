@@ -0,0 +1,736 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#include <dirent.h>
+#endif
+
+#include <errno.h>
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+#include "libsmb2-raw.h"
+#include "portable-endian.h"
+#include "slist.h"
+
+/*
+ * Server side change notification.
+ *
+ * A backend that wants to support CHANGE_NOTIFY calls smb2_notify_watch()
+ * from its change_notify_cmd handler with the path of the directory the
+ * request is for, and returns 1. From then on the library keeps the
+ * request pending (after an interim STATUS_PENDING reply) and completes it
+ * once smb2_notify_post() reports a change that matches the completion
+ * filter of the request, below the directory itself or, with WATCH_TREE,
+ * anywhere in the tree below it.
+ *
+ * Changes are collected per open of the directory, also while no request
+ * is pending, and returned packed as FILE_NOTIFY_INFORMATION in the next
+ * reply. When they do not fit the output buffer of the client they are
+ * thrown away and the reply is STATUS_NOTIFY_ENUM_DIR instead, which tells
+ * the client to read the whole directory again. A CANCEL completes the
+ * request with STATUS_CANCELLED, a CLOSE of the directory with
+ * STATUS_NOTIFY_CLEANUP.
+ *
+ * Paths are whatever the backend likes as long as smb2_notify_watch() and
+ * smb2_notify_post() agree: '/' separated, without a leading '/', the root
+ * being "". On Linux smb2_notify_inotify_start() posts the changes made to
+ * a local directory tree, with paths relative to its root.
+ */
+
+struct smb2_notify_req {
+        struct smb2_notify_req *next;
+        uint64_t message_id;
+};
+
+struct smb2_notify_watch {
+        struct smb2_notify_watch *next;
+        struct smb2_context *smb2;
+        smb2_file_id file_id;
+        char *path;
+        uint32_t filter;
+        int tree;
+        /* waiting for changes, oldest first */
+        struct smb2_notify_req *reqs;
+        /* changes not reported yet, packed as FILE_NOTIFY_INFORMATION */
+        uint8_t *buf;
+        uint32_t len;
+        uint32_t last;          /* offset of the last entry */
+        uint32_t max_len;       /* output buffer of the last request */
+        int overflow;
+};
+
+static struct smb2_notify_watch *
+smb2_notify_find(struct smb2_server *server, struct smb2_context *smb2,
+                 const smb2_file_id file_id)
+{
+        struct smb2_notify_watch *watch;
+
+        for (watch = server->notify_watches; watch; watch = watch->next) {
+                if (watch->smb2 == smb2 &&
+                    !memcmp(watch->file_id, file_id, SMB2_FD_SIZE)) {
+                        return watch;
+                }
+        }
+        return NULL;
+}
+
+static void
+smb2_notify_free(struct smb2_server *server, struct smb2_notify_watch *watch)
+{
+        struct smb2_notify_req *req;
+
+        SMB2_LIST_REMOVE(&server->notify_watches, watch);
+        while ((req = watch->reqs) != NULL) {
+                watch->reqs = req->next;
+                free(req);
+        }
+        free(watch->path);
+        free(watch->buf);
+        free(watch);
+}
+
+/* Answers the oldest request of the watch */
+static void
+smb2_notify_reply(struct smb2_notify_watch *watch, uint32_t status)
+{
+        struct smb2_context *smb2 = watch->smb2;
+        struct smb2_notify_req *req = watch->reqs;
+        struct smb2_change_notify_reply rep;
+        struct smb2_error_reply err;
+        struct smb2_pdu *pdu;
+
+        watch->reqs = req->next;
+
+        if (status == SMB2_STATUS_SUCCESS) {
+                memset(&rep, 0, sizeof(rep));
+                rep.output_buffer_length = watch->len;
+                rep.output = watch->buf;
+                pdu = smb2_cmd_change_notify_reply_async(smb2, &rep,
+                                                         NULL, NULL);
+        } else {
+                memset(&err, 0, sizeof(err));
+                pdu = smb2_cmd_error_reply_async(smb2, &err,
+                                                 SMB2_CHANGE_NOTIFY, status,
+                                                 NULL, NULL);
+        }
+        if (pdu != NULL) {
+                smb2_set_pdu_message_id(smb2, pdu, req->message_id);
+                smb2_queue_pdu(smb2, pdu);
+        }
+        free(req);
+
+        if (status == SMB2_STATUS_SUCCESS ||
+            status == SMB2_STATUS_NOTIFY_ENUM_DIR) {
+                watch->len = 0;
+                watch->last = 0;
+                watch->overflow = 0;
+        }
+}
+
+static void
+smb2_notify_complete(struct smb2_notify_watch *watch)
+{
+        if (watch->reqs == NULL) {
+                return;
+        }
+        if (watch->overflow) {
+                smb2_notify_reply(watch, SMB2_STATUS_NOTIFY_ENUM_DIR);
+        } else if (watch->len > 0) {
+                smb2_notify_reply(watch, SMB2_STATUS_SUCCESS);
+        }
+}
+
+static void
+smb2_notify_append(struct smb2_notify_watch *watch, const char *name,
+                   uint32_t action)
+{
+        struct smb2_utf16 *utf16;
+        struct smb2_iovec iov;
+        uint32_t offset, size;
+        uint8_t *buf;
+        int i;
+
+        if (watch->overflow) {
+                return;
+        }
+
+        utf16 = smb2_utf8_to_utf16(name);
+        if (utf16 == NULL) {
+                watch->overflow = 1;
+                return;
+        }
+        for (i = 0; i < utf16->len; i++) {
+                if (utf16->val[i] == htole16('/')) {
+                        utf16->val[i] = htole16('\\');
+                }
+        }
+
+        offset = watch->len ? PAD_TO_32BIT(watch->len) : 0;
+        size = 12 + 2 * utf16->len;
+        if (offset + size > watch->max_len) {
+                /* the client has to look for itself */
+                watch->overflow = 1;
+                watch->len = 0;
+                free(utf16);
+                return;
+        }
+
+        buf = realloc(watch->buf, offset + size);
+        if (buf == NULL) {
+                watch->overflow = 1;
+                watch->len = 0;
+                free(utf16);
+                return;
+        }
+        watch->buf = buf;
+        memset(buf + watch->len, 0, offset + size - watch->len);
+
+        iov.buf = buf;
+        iov.len = offset + size;
+        iov.free = NULL;
+        if (watch->len) {
+                smb2_set_uint32(&iov, watch->last, offset - watch->last);
+        }
+        smb2_set_uint32(&iov, offset + 4, action);
+        smb2_set_uint32(&iov, offset + 8, 2 * utf16->len);
+        memcpy(buf + offset + 12, utf16->val, 2 * utf16->len);
+
+        watch->last = offset;
+        watch->len = offset + size;
+        free(utf16);
+}
+
+int
+smb2_notify_watch(struct smb2_server *server, struct smb2_context *smb2,
+                  struct smb2_change_notify_request *req, const char *path)
+{
+        struct smb2_notify_watch *watch;
+        struct smb2_notify_req *nreq;
+        struct smb2_error_reply err;
+        struct smb2_pdu *pdu;
+        char *p;
+
+        nreq = calloc(1, sizeof(struct smb2_notify_req));
+        if (nreq == NULL) {
+                return -ENOMEM;
+        }
+        nreq->message_id = smb2->message_id;
+
+        watch = smb2_notify_find(server, smb2, req->file_id);
+        if (watch == NULL) {
+                watch = calloc(1, sizeof(struct smb2_notify_watch));
+                if (watch == NULL) {
+                        free(nreq);
+                        return -ENOMEM;
+                }
+                watch->smb2 = smb2;
+                memcpy(watch->file_id, req->file_id, SMB2_FD_SIZE);
+                SMB2_LIST_ADD(&server->notify_watches, watch);
+        }
+        p = strdup(path);
+        if (p == NULL) {
+                if (watch->path == NULL) {
+                        smb2_notify_free(server, watch);
+                }
+                free(nreq);
+                return -ENOMEM;
+        }
+        free(watch->path);
+        watch->path = p;
+        watch->filter = req->completion_filter;
+        watch->tree = !!(req->flags & SMB2_CHANGE_NOTIFY_WATCH_TREE);
+        watch->max_len = MIN(req->output_buffer_length,
+                             server->max_transact_size);
+        SMB2_LIST_ADD_END(&watch->reqs, nreq);
+
+        /* changes from before this request are returned right away */
+        if (watch->len > watch->max_len) {
+                watch->overflow = 1;
+        }
+        if (watch->overflow || watch->len > 0) {
+                smb2_notify_complete(watch);
+                return 0;
+        }
+
+        memset(&err, 0, sizeof(err));
+        pdu = smb2_cmd_error_reply_async(smb2, &err, SMB2_CHANGE_NOTIFY,
+                                         SMB2_STATUS_PENDING, NULL, NULL);
+        if (pdu != NULL) {
+                smb2_set_pdu_message_id(smb2, pdu, nreq->message_id);
+                smb2_queue_pdu(smb2, pdu);
+        }
+
+        return 0;
+}
+
+/* The name of path as seen from the watch, or NULL if it does not see it */
+static const char *
+smb2_notify_relative(struct smb2_notify_watch *watch, const char *path)
+{
+        size_t len = strlen(watch->path);
+        const char *name;
+
+        if (len > 0) {
+                if (strncmp(path, watch->path, len) || path[len] != '/') {
+                        return NULL;
+                }
+                name = path + len + 1;
+        } else {
+                name = path;
+        }
+        if (*name == 0) {
+                return NULL;
+        }
+        if (!watch->tree && strchr(name, '/') != NULL) {
+                return NULL;
+        }
+        return name;
+}
+
+void
+smb2_notify_post(struct smb2_server *server, const char *path,
+                 uint32_t action, uint32_t filter)
+{
+        struct smb2_notify_watch *watch;
+        const char *name;
+
+        for (watch = server->notify_watches; watch; watch = watch->next) {
+                if (!(watch->filter & filter)) {
+                        continue;
+                }
+                name = smb2_notify_relative(watch, path);
+                if (name == NULL) {
+                        continue;
+                }
+                smb2_notify_append(watch, name, action);
+                smb2_notify_complete(watch);
+        }
+}
+
+/* Returns 1 if the CANCEL being served was for a pending notify */
+int
+smb2_notify_cancel(struct smb2_server *server, struct smb2_context *smb2)
+{
+        struct smb2_notify_watch *watch;
+        struct smb2_notify_req **req, *found;
+        struct smb2_pdu *pdu;
+
+        for (watch = server->notify_watches; watch; watch = watch->next) {
+                if (watch->smb2 != smb2) {
+                        continue;
+                }
+                for (req = &watch->reqs; *req; req = &(*req)->next) {
+                        if (smb2->hdr.flags & SMB2_FLAGS_ASYNC_COMMAND) {
+                                pdu = smb2_find_pdu(smb2, (*req)->message_id);
+                                if (pdu == NULL ||
+                                    pdu->header.async.async_id !=
+                                    smb2->hdr.async.async_id) {
+                                        continue;
+                                }
+                        } else if ((*req)->message_id !=
+                                   smb2->hdr.message_id) {
+                                continue;
+                        }
+                        /* answer this one, whatever its place */
+                        found = *req;
+                        *req = found->next;
+                        found->next = watch->reqs;
+                        watch->reqs = found;
+                        smb2_notify_reply(watch, SMB2_STATUS_CANCELLED);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+void
+smb2_notify_closed(struct smb2_server *server, struct smb2_context *smb2,
+                   const smb2_file_id file_id)
+{
+        struct smb2_notify_watch *watch;
+
+        watch = smb2_notify_find(server, smb2, file_id);
+        if (watch == NULL) {
+                return;
+        }
+        while (watch->reqs) {
+                smb2_notify_reply(watch, SMB2_STATUS_NOTIFY_CLEANUP);
+        }
+        smb2_notify_free(server, watch);
+}
+
+/* The watches of a connection that is going away */
+void
+smb2_notify_free_watches(struct smb2_context *smb2)
+{
+        struct smb2_server *server = smb2->owning_server;
+        struct smb2_notify_watch *watch, *next;
+
+        if (server == NULL) {
+                return;
+        }
+        for (watch = server->notify_watches; watch; watch = next) {
+                next = watch->next;
+                if (watch->smb2 == smb2) {
+                        smb2_notify_free(server, watch);
+                }
+        }
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+/*
+ * inotify adapter.
+ *
+ * Every directory below the root gets an inotify watch when the adapter
+ * starts, and directories that are created or moved in later get theirs
+ * when that is seen. A directory moved within the tree keeps its watch,
+ * adding it again under its new path just renames it. If the kernel
+ * queue overflows all watches are told to read their directory again.
+ */
+
+#define SMB2_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                           IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | \
+                           IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/* Too much happened to tell, every watch has to look for itself */
+static void
+smb2_notify_overflow(struct smb2_server *server)
+{
+        struct smb2_notify_watch *watch;
+
+        for (watch = server->notify_watches; watch; watch = watch->next) {
+                watch->overflow = 1;
+                watch->len = 0;
+                smb2_notify_complete(watch);
+        }
+}
+
+struct smb2_inotify_dir {
+        struct smb2_inotify_dir *next;
+        int wd;
+        char *path;
+};
+
+struct smb2_inotify {
+        int fd;
+        char *root;
+        struct smb2_inotify_dir *dirs;
+};
+
+static struct smb2_inotify_dir *
+smb2_inotify_find(struct smb2_inotify *ino, int wd)
+{
+        struct smb2_inotify_dir *dir;
+
+        for (dir = ino->dirs; dir; dir = dir->next) {
+                if (dir->wd == wd) {
+                        return dir;
+                }
+        }
+        return NULL;
+}
+
+static char *
+smb2_inotify_join(const char *dir, const char *name)
+{
+        size_t dlen = strlen(dir), nlen = strlen(name);
+        char *path;
+
+        path = malloc(dlen + nlen + 2);
+        if (path == NULL) {
+                return NULL;
+        }
+        memcpy(path, dir, dlen);
+        if (dlen && nlen) {
+                path[dlen++] = '/';
+        }
+        memcpy(path + dlen, name, nlen + 1);
+        return path;
+}
+
+/* Watches the directory path (relative to the root) and all below it */
+static void
+smb2_inotify_add_tree(struct smb2_inotify *ino, const char *path)
+{
+        struct smb2_inotify_dir *dir;
+        struct dirent *ent;
+        char *full, *sub;
+        DIR *d;
+        int wd;
+
+        full = smb2_inotify_join(ino->root, path);
+        if (full == NULL) {
+                return;
+        }
+        wd = inotify_add_watch(ino->fd, full, SMB2_INOTIFY_MASK);
+        if (wd < 0) {
+                free(full);
+                return;
+        }
+
+        sub = strdup(path);
+        dir = smb2_inotify_find(ino, wd);
+        if (dir == NULL && sub != NULL) {
+                dir = calloc(1, sizeof(struct smb2_inotify_dir));
+                if (dir != NULL) {
+                        dir->wd = wd;
+                        SMB2_LIST_ADD(&ino->dirs, dir);
+                }
+        }
+        if (dir == NULL || sub == NULL) {
+                free(sub);
+                free(full);
+                return;
+        }
+        free(dir->path);
+        dir->path = sub;
+
+        d = opendir(full);
+        free(full);
+        if (d == NULL) {
+                return;
+        }
+        while ((ent = readdir(d)) != NULL) {
+                if (ent->d_type != DT_DIR || !strcmp(ent->d_name, ".") ||
+                    !strcmp(ent->d_name, "..")) {
+                        continue;
+                }
+                sub = smb2_inotify_join(path, ent->d_name);
+                if (sub != NULL) {
+                        smb2_inotify_add_tree(ino, sub);
+                        free(sub);
+                }
+        }
+        closedir(d);
+}
+
+static void
+smb2_inotify_event(struct smb2_server *server, struct smb2_inotify *ino,
+                   const struct inotify_event *ev)
+{
+        struct smb2_inotify_dir *dir;
+        uint32_t action, filter, name_filter;
+        char *path;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+                smb2_notify_overflow(server);
+                return;
+        }
+        dir = smb2_inotify_find(ino, ev->wd);
+        if (dir == NULL) {
+                return;
+        }
+        if (ev->mask & IN_IGNORED) {
+                SMB2_LIST_REMOVE(&ino->dirs, dir);
+                free(dir->path);
+                free(dir);
+                return;
+        }
+        if (ev->len == 0) {
+                return;
+        }
+
+        name_filter = (ev->mask & IN_ISDIR) ?
+                SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_DIR_NAME :
+                SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_FILE_NAME;
+        if (ev->mask & IN_CREATE) {
+                action = SMB2_NOTIFY_CHANGE_FILE_ACTION_ADDED;
+                filter = name_filter;
+        } else if (ev->mask & IN_DELETE) {
+                action = SMB2_NOTIFY_CHANGE_FILE_ACTION_REMOVED;
+                filter = name_filter;
+        } else if (ev->mask & IN_MOVED_FROM) {
+                action = SMB2_NOTIFY_CHANGE_FILE_ACTION_RENAMED_OLD_NAME;
+                filter = name_filter;
+        } else if (ev->mask & IN_MOVED_TO) {
+                action = SMB2_NOTIFY_CHANGE_FILE_ACTION_RENAMED_NEW_NAME;
+                filter = name_filter;
+        } else if (ev->mask & IN_MODIFY) {
+                action = SMB2_NOTIFY_CHANGE_FILE_ACTION_MODIFIED;
+                filter = SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_LAST_WRITE |
+                        SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_SIZE;
+        } else if (ev->mask & IN_ATTRIB) {
+                action = SMB2_NOTIFY_CHANGE_FILE_ACTION_MODIFIED;
+                filter = SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_ATTRIBUTES |
+                        SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_SECURITY |
+                        SMB2_CHANGE_NOTIFY_FILE_NOTIFY_CHANGE_EA;
+        } else {
+                return;
+        }
+
+        path = smb2_inotify_join(dir->path, ev->name);
+        if (path == NULL) {
+                smb2_notify_overflow(server);
+                return;
+        }
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                smb2_inotify_add_tree(ino, path);
+        }
+        smb2_notify_post(server, path, action, filter);
+        free(path);
+}
+
+int
+smb2_notify_inotify_start(struct smb2_server *server, const char *root)
+{
+        struct smb2_inotify *ino;
+
+        if (server->inotify != NULL) {
+                return -EBUSY;
+        }
+        ino = calloc(1, sizeof(struct smb2_inotify));
+        if (ino == NULL) {
+                return -ENOMEM;
+        }
+        ino->root = strdup(root);
+        if (ino->root == NULL) {
+                free(ino);
+                return -ENOMEM;
+        }
+        ino->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ino->fd < 0) {
+                int err = errno;
+
+                free(ino->root);
+                free(ino);
+                return -err;
+        }
+
+        smb2_inotify_add_tree(ino, "");
+        if (ino->dirs == NULL) {
+                close(ino->fd);
+                free(ino->root);
+                free(ino);
+                return -ENOENT;
+        }
+        server->inotify = ino;
+
+        return 0;
+}
+
+void
+smb2_notify_inotify_stop(struct smb2_server *server)
+{
+        struct smb2_inotify *ino = server->inotify;
+        struct smb2_inotify_dir *dir;
+
+        if (ino == NULL) {
+                return;
+        }
+        close(ino->fd);
+        while ((dir = ino->dirs) != NULL) {
+                ino->dirs = dir->next;
+                free(dir->path);
+                free(dir);
+        }
+        free(ino->root);
+        free(ino);
+        server->inotify = NULL;
+}
+
+int
+smb2_notify_inotify_fd(struct smb2_server *server)
+{
+        return server->inotify ? server->inotify->fd : -1;
+}
+
+void
+smb2_notify_inotify_service(struct smb2_server *server)
+{
+        struct smb2_inotify *ino = server->inotify;
+        union {
+                struct inotify_event ev;
+                char buf[4096];
+        } u;
+        const struct inotify_event *ev;
+        ssize_t count, i;
+
+        /* stop if a posted change made the backend stop the adapter */
+        while (server->inotify == ino) {
+                count = read(ino->fd, u.buf, sizeof(u.buf));
+                if (count <= 0) {
+                        return;
+                }
+                i = 0;
+                while (i < count && server->inotify == ino) {
+                        ev = (const struct inotify_event *)(void *)&u.buf[i];
+                        smb2_inotify_event(server, ino, ev);
+                        i += sizeof(*ev) + ev->len;
+                }
+        }
+}
+
+#else /* no inotify */
+
+int
+smb2_notify_inotify_start(struct smb2_server *server _U_,
+                          const char *root _U_)
+{
+        return -ENOSYS;
+}
+
+void
+smb2_notify_inotify_stop(struct smb2_server *server _U_)
+{
+}
+
+int
+smb2_notify_inotify_fd(struct smb2_server *server _U_)
+{
+        return -1;
+}
+
+void
+smb2_notify_inotify_service(struct smb2_server *server _U_)
+{
+}
+
+#endif
@@ -559,6 +559,36 @@ NTOWFv2(const char *user, const char *password, const char *domain,
         return 0;
 }
 
+/*
+ * A client derives the same ResponseKeyNT on every connect and reconnect of
+ * a share, and the MD4 and HMAC-MD5 over the UTF-16 strings are not free on
+ * a slow CPU. The key is kept with the context, for the user and domain it
+ * was derived for, and an application that reconnects with a new context
+ * can carry it over with smb2_get_ntlm_key() and smb2_set_ntlm_key().
+ */
+static int
+cached_NTOWFv2(struct smb2_context *smb2, const char *user,
+               const char *password, const char *domain,
+               unsigned char ntlmv2_hash[16])
+{
+        const uint8_t *key;
+
+        key = smb2_ntlm_key_find(smb2, user, domain);
+        if (key != NULL) {
+                memcpy(ntlmv2_hash, key, 16);
+                return 0;
+        }
+
+        if (NTOWFv2(user, password, domain, ntlmv2_hash) < 0) {
+                return -1;
+        }
+
+        /* if this fails the key is simply derived again next time */
+        smb2_set_ntlm_key(smb2, user, domain, ntlmv2_hash);
+
+        return 0;
+}
+
 /* This is not the same temp as in MS-NLMP. This temp has an additional
  * 16 bytes at the start of the buffer.
  * Use &auth_data->val[16] if you want the temp from MS-NLMP
@@ -649,8 +679,8 @@ encode_ntlm_auth(struct smb2_context *smb2, time_t ti,
         /*
          * Generate Concatenation of(NTProofStr, temp)
          */
-        if (NTOWFv2(auth_data->user, auth_data->password,
-                    auth_data->domain, ResponseKeyNT) < 0) {
+        if (cached_NTOWFv2(smb2, auth_data->user, auth_data->password,
+                           auth_data->domain, ResponseKeyNT) < 0) {
                 goto finished;
         }
 
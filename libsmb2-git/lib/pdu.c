@@ -23,6 +23,10 @@
 #define _GNU_SOURCE
 #endif
 
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
@@ -54,6 +58,7 @@
 #include "slist.h"
 #include "smb2.h"
 #include "libsmb2.h"
+#include "libsmb2-raw.h"
 #include "libsmb2-private.h"
 #include "smb3-seal.h"
 #include "smb2-signing.h"
@@ -342,6 +347,8 @@ smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
                 smb2_free_pdu(smb2, pdu->next_compound);
         }
 
+        smb2->queued_bytes -= pdu->queued_bytes;
+
         smb2_free_iovector(smb2, &pdu->out);
         smb2_free_iovector(smb2, &pdu->in);
 
@@ -349,7 +356,9 @@ smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
             pdu->free_payload(smb2, pdu->payload);
         }
 
-        free(pdu->payload);
+        if (pdu->payload != &pdu->reply) {
+                free(pdu->payload);
+        }
         free(pdu->crypt);
         free(pdu);
 }
@@ -448,7 +457,8 @@ static void
 smb2_encode_header(struct smb2_context *smb2, struct smb2_iovec *iov,
                    struct smb2_header *hdr)
 {
-        if (!smb2_is_server(smb2)) {
+        /* A CANCEL carries the message id of the request it cancels */
+        if (!smb2_is_server(smb2) && hdr->command != SMB2_CANCEL) {
                 hdr->message_id = smb2->message_id++;
                 if (hdr->credit_charge > 1) {
                         smb2->message_id += (hdr->credit_charge - 1);
@@ -541,6 +551,14 @@ smb2_decode_header(struct smb2_context *smb2, struct smb2_iovec *iov,
                         case SMB2_TREE_CONNECT:
                                 break;
                         default:
+                                /* a related request uses the tree of the
+                                 * one before it, which may have just been
+                                 * connected by a TREE_CONNECT in the chain
+                                 */
+                                if ((hdr->flags & SMB2_FLAGS_RELATED_OPERATIONS) &&
+                                    hdr->sync.tree_id == 0xffffffff) {
+                                        break;
+                                }
                                 /* TODO - care about not having this already connected */
                                 smb2_select_tree_id(smb2, hdr->sync.tree_id);
                                 break;
@@ -598,6 +616,12 @@ smb2_correlate_reply(struct smb2_context *smb2, struct smb2_pdu *pdu)
                 } else {
                         pdu->header.credit_request_response = credit_grant;
                 }
+                if (smb2_is_server(smb2)) {
+                        /* but no more than the connection may use, sched.c */
+                        pdu->header.credit_request_response =
+                                smb2_sched_grant(smb2,
+                                        pdu->header.credit_request_response);
+                }
 
                 if (req_pdu->header.credit_charge > pdu->header.credit_charge) {
                         pdu->header.credit_charge = req_pdu->header.credit_charge;
@@ -646,21 +670,26 @@ smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
         struct smb2_pdu *p;
 
+        /* a reply to a request of a compound waits for the others */
+        if (smb2_is_server(smb2) && smb2_compound_defer(smb2, pdu)) {
+                return;
+        }
+
         /* Update all the PDU headers in this chain */
         for (p = pdu; p; p = p->next_compound) {
                 if (smb2_is_server(smb2)) {
                         /* set reply flag, servers will only reply */
-                        pdu->header.flags |= SMB2_FLAGS_SERVER_TO_REDIR;
+                        p->header.flags |= SMB2_FLAGS_SERVER_TO_REDIR;
 
                         /* set async flag for status==pending */
-                        if (pdu->header.status == SMB2_STATUS_PENDING) {
-                                pdu->header.flags |= SMB2_FLAGS_ASYNC_COMMAND;
+                        if (p->header.status == SMB2_STATUS_PENDING) {
+                                p->header.flags |= SMB2_FLAGS_ASYNC_COMMAND;
                         }
 
                         /* the server handler functions must set message id unless this
                          * is a negotiate request, in which case it should be 0
                          */
-                        if (!pdu->header.message_id && pdu->header.command != SMB2_NEGOTIATE) {
+                        if (!p->header.message_id && p->header.command != SMB2_NEGOTIATE) {
                                 smb2_set_error(smb2, "Queued pdu has no message id");
                                 smb2_free_pdu(smb2, pdu);
                                 return;
@@ -682,6 +711,15 @@ smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
 
         smb3_encrypt_pdu(smb2, pdu);
 
+        /* Charge the request buffers, and for replies the buffers the
+         * payload will be received into, until the pdu is freed.
+         */
+        for (p = pdu; p; p = p->next_compound) {
+                p->queued_bytes = p->out.total_size + p->in.total_size +
+                        p->crypt_len;
+                smb2->queued_bytes += p->queued_bytes;
+        }
+
         smb2_add_to_outqueue(smb2, pdu);
 }
 
@@ -1100,6 +1138,120 @@ smb2_process_payload_variable(struct smb2_context *smb2, struct smb2_pdu *pdu)
         }
 }
 
+static void
+smb2_cancel_unsent(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu *p;
+
+        SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
+        for (p = pdu; p; p = p->next_compound) {
+                if (p->cb) {
+                        p->cb(smb2, SMB2_STATUS_CANCELLED, NULL, p->cb_data);
+                }
+        }
+        smb2_free_pdu(smb2, pdu);
+
+        if (SMB2_VALID_SOCKET(smb2->fd)) {
+                smb2_change_events(smb2, smb2->fd, smb2_which_events(smb2));
+        }
+}
+
+/* Queue a CANCEL for req_pdu. If after is not NULL the CANCEL is moved
+ * from the tail of the outqueue to right behind *after, which is then
+ * updated to it so several CANCELs keep their order.
+ */
+static int
+smb2_queue_cancel(struct smb2_context *smb2, struct smb2_pdu *req_pdu,
+                  struct smb2_pdu **after)
+{
+        struct smb2_pdu *pdu;
+
+        pdu = smb2_cmd_cancel_async(smb2, req_pdu);
+        if (pdu == NULL) {
+                return -ENOMEM;
+        }
+        smb2_queue_pdu(smb2, pdu);
+
+        if (after != NULL) {
+                SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
+                pdu->next = (*after)->next;
+                (*after)->next = pdu;
+                *after = pdu;
+        }
+
+        return 0;
+}
+
+size_t
+smb2_get_queued_bytes(struct smb2_context *smb2)
+{
+        return smb2->queued_bytes;
+}
+
+int
+smb2_cancel(struct smb2_context *smb2, uint64_t message_id)
+{
+        struct smb2_pdu *pdu, *p;
+        int rc;
+
+        if (smb2_is_server(smb2)) {
+                smb2_set_error(smb2, "smb2_cancel() is for clients only");
+                return -EINVAL;
+        }
+
+        /* Still queued: the server never needs to hear about it, unless
+         * the chain has already been partially written to the socket.
+         */
+        for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                if (pdu->header.command == SMB2_CANCEL) {
+                        continue;
+                }
+                for (p = pdu; p; p = p->next_compound) {
+                        if (p->header.message_id == message_id) {
+                                break;
+                        }
+                }
+                if (p == NULL) {
+                        continue;
+                }
+                if (pdu->out.num_done == 0) {
+                        smb2_cancel_unsent(smb2, pdu);
+                        return 0;
+                }
+                /* The CANCELs go out right behind the request, ahead
+                 * of anything queued after it
+                 */
+                for (; p; p = p->next_compound) {
+                        rc = smb2_queue_cancel(smb2, p, &pdu);
+                        if (rc < 0) {
+                                return rc;
+                        }
+                }
+                return 0;
+        }
+
+        /* Sent: ask the server to cancel it, together with any related
+         * requests compounded after it. The server completes each of
+         * them, usually with STATUS_CANCELLED, and the replies are
+         * delivered to their callbacks as usual.
+         */
+        pdu = smb2_find_pdu(smb2, message_id);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "No request with message id %llu to "
+                               "cancel", (unsigned long long)message_id);
+                return -ENOENT;
+        }
+        do {
+                rc = smb2_queue_cancel(smb2, pdu, NULL);
+                if (rc < 0) {
+                        return rc;
+                }
+                pdu = pdu->next;
+        } while (pdu && (pdu->header.flags & SMB2_FLAGS_RELATED_OPERATIONS));
+
+        return 0;
+}
+
 void smb2_timeout_pdus(struct smb2_context *smb2)
 {
         struct smb2_pdu *pdu, *next;
@@ -1110,8 +1262,10 @@ void smb2_timeout_pdus(struct smb2_context *smb2)
                 next = pdu->next;
                 if (pdu->timeout && pdu->timeout < t) {
                         SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
-                        pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
-                                pdu->cb_data);
+                        if (pdu->cb) {
+                                pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
+                                        pdu->cb_data);
+                        }
                         smb2_free_pdu(smb2, pdu);
                 }
                 pdu = next;
@@ -1122,8 +1276,10 @@ void smb2_timeout_pdus(struct smb2_context *smb2)
                 next = pdu->next;
                 if (pdu->timeout && pdu->timeout < t) {
                         SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
-                        pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
-                                pdu->cb_data);
+                        if (pdu->cb) {
+                                pdu->cb(smb2, SMB2_STATUS_IO_TIMEOUT, NULL,
+                                        pdu->cb_data);
+                        }
                         smb2_free_pdu(smb2, pdu);
                 }
                 pdu = next;
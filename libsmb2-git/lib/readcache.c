@@ -0,0 +1,581 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+#include "libsmb2-raw.h"
+#include "slist.h"
+
+/*
+ * Server read cache.
+ *
+ * With server->read_cache_size set and a file_identity_cmd handler, the
+ * data of the READ replies the backend gives is kept in an LRU cache of at
+ * most that many bytes, shared by all connections of the server. A READ of
+ * the same range of the same file, from any client, is then answered from
+ * the cache without calling the backend at all, which is what makes
+ * netbooting a room full of machines from one server cheap.
+ *
+ * Files are told apart by the identity the backend gives for each open
+ * (an inode number or the like, equal for all opens of the same file), so
+ * the file ids of every open that was created through the server are
+ * remembered together with their identity.
+ *
+ * The cached data of a file is dropped when
+ *  - it is opened with a disposition that overwrites it,
+ *  - a WRITE or SET_INFO is done on an open of it,
+ *  - an open that was written to is closed, as the backend may only have
+ *    applied the changes then,
+ *  - the backend calls smb2_server_read_cache_invalidate(), for changes
+ *    that did not come through the server.
+ * READs on an open that was written to are not cached, and unbuffered
+ * READs always go to the backend.
+ *
+ * The cache does not know who may read what, so it only stores and serves
+ * the READs of opens that asked for read data access when they were
+ * created (and the backend granted that, or the CREATE would have failed).
+ * While any client holds a byte-range lock on a file, READs of it go to
+ * the backend too, which is the one that knows the ranges and owners.
+ */
+
+#define SMB2_RCACHE_BUCKETS 1024
+
+struct smb2_rcache_file;
+
+struct smb2_rcache_entry {
+        struct smb2_rcache_entry *next;         /* in its hash bucket */
+        struct smb2_rcache_entry *file_next;    /* of the same file */
+        struct smb2_rcache_entry *lru_prev;
+        struct smb2_rcache_entry *lru_next;
+        struct smb2_rcache_file *file;
+        uint64_t offset;
+        uint32_t asked;         /* length of the READ it answered */
+        uint32_t length;
+        uint8_t *data;
+};
+
+struct smb2_rcache_file {
+        struct smb2_rcache_file *next;
+        uint64_t identity;
+        struct smb2_rcache_entry *entries;
+};
+
+/* A file some open holds byte-range locks on */
+struct smb2_rcache_locked {
+        struct smb2_rcache_locked *next;
+        uint64_t identity;
+        int count;
+};
+
+struct smb2_read_cache {
+        size_t size;            /* bytes of data held */
+        /* most recently used first */
+        struct smb2_rcache_entry *lru_head;
+        struct smb2_rcache_entry *lru_tail;
+        struct smb2_rcache_entry *entries[SMB2_RCACHE_BUCKETS];
+        struct smb2_rcache_file *files[SMB2_RCACHE_BUCKETS];
+        struct smb2_rcache_locked *locked[SMB2_RCACHE_BUCKETS];
+};
+
+/* An open made through the server, see smb2_rcache_opened() */
+struct smb2_rcache_open {
+        struct smb2_rcache_open *next;
+        smb2_file_id file_id;
+        uint64_t identity;
+        int dirty;
+        int readable;           /* asked for FILE_READ_DATA */
+        int locks;              /* ranges locked through it */
+};
+
+static unsigned int
+smb2_rcache_hash(uint64_t identity, uint64_t offset)
+{
+        uint64_t h = (identity ^ offset) * 0x9e3779b97f4a7c15ULL;
+
+        return (unsigned int)(h >> 32) % SMB2_RCACHE_BUCKETS;
+}
+
+static struct smb2_read_cache *
+smb2_rcache_get(struct smb2_server *server)
+{
+        if (server->read_cache_size == 0 || server->handlers == NULL ||
+            server->handlers->file_identity_cmd == NULL) {
+                return NULL;
+        }
+        if (server->read_cache == NULL) {
+                server->read_cache = calloc(1, sizeof(struct smb2_read_cache));
+        }
+        return server->read_cache;
+}
+
+static struct smb2_rcache_file *
+smb2_rcache_find_file(struct smb2_read_cache *rc, uint64_t identity)
+{
+        struct smb2_rcache_file *file;
+
+        file = rc->files[smb2_rcache_hash(identity, 0)];
+        for (; file; file = file->next) {
+                if (file->identity == identity) {
+                        return file;
+                }
+        }
+        return NULL;
+}
+
+static void
+smb2_rcache_free_entry(struct smb2_read_cache *rc,
+                       struct smb2_rcache_entry *entry)
+{
+        struct smb2_rcache_file *file = entry->file;
+        struct smb2_rcache_entry **e;
+        unsigned int i;
+
+        i = smb2_rcache_hash(file->identity, entry->offset);
+        SMB2_LIST_REMOVE(&rc->entries[i], entry);
+
+        for (e = &file->entries; *e != entry; e = &(*e)->file_next) {
+        }
+        *e = entry->file_next;
+        if (file->entries == NULL) {
+                i = smb2_rcache_hash(file->identity, 0);
+                SMB2_LIST_REMOVE(&rc->files[i], file);
+                free(file);
+        }
+
+        if (entry->lru_prev) {
+                entry->lru_prev->lru_next = entry->lru_next;
+        } else {
+                rc->lru_head = entry->lru_next;
+        }
+        if (entry->lru_next) {
+                entry->lru_next->lru_prev = entry->lru_prev;
+        } else {
+                rc->lru_tail = entry->lru_prev;
+        }
+
+        rc->size -= entry->length;
+        free(entry->data);
+        free(entry);
+}
+
+static void
+smb2_rcache_drop(struct smb2_read_cache *rc, uint64_t identity)
+{
+        struct smb2_rcache_file *file;
+
+        /* the file goes away with its last entry */
+        while ((file = smb2_rcache_find_file(rc, identity)) != NULL) {
+                smb2_rcache_free_entry(rc, file->entries);
+        }
+}
+
+static struct smb2_rcache_entry *
+smb2_rcache_lookup(struct smb2_read_cache *rc, uint64_t identity,
+                   uint64_t offset, uint32_t length)
+{
+        struct smb2_rcache_entry *entry;
+
+        entry = rc->entries[smb2_rcache_hash(identity, offset)];
+        for (; entry; entry = entry->next) {
+                if (entry->file->identity != identity ||
+                    entry->offset != offset) {
+                        continue;
+                }
+                /* a short reply (at the end of the file) also answers the
+                 * same READ again
+                 */
+                if (length <= entry->length || length == entry->asked) {
+                        break;
+                }
+                return NULL;
+        }
+        if (entry == NULL || entry == rc->lru_head) {
+                return entry;
+        }
+
+        /* move it to the front */
+        entry->lru_prev->lru_next = entry->lru_next;
+        if (entry->lru_next) {
+                entry->lru_next->lru_prev = entry->lru_prev;
+        } else {
+                rc->lru_tail = entry->lru_prev;
+        }
+        entry->lru_prev = NULL;
+        entry->lru_next = rc->lru_head;
+        rc->lru_head->lru_prev = entry;
+        rc->lru_head = entry;
+
+        return entry;
+}
+
+static struct smb2_rcache_locked *
+smb2_rcache_find_locked(struct smb2_read_cache *rc, uint64_t identity)
+{
+        struct smb2_rcache_locked *locked;
+
+        locked = rc->locked[smb2_rcache_hash(identity, 0)];
+        for (; locked; locked = locked->next) {
+                if (locked->identity == identity) {
+                        return locked;
+                }
+        }
+        return NULL;
+}
+
+/* Counts delta more (or fewer) locked ranges on a file */
+static void
+smb2_rcache_lock_count(struct smb2_read_cache *rc, uint64_t identity,
+                       int delta)
+{
+        struct smb2_rcache_locked *locked;
+        unsigned int i = smb2_rcache_hash(identity, 0);
+
+        locked = smb2_rcache_find_locked(rc, identity);
+        if (locked == NULL) {
+                if (delta <= 0) {
+                        return;
+                }
+                locked = calloc(1, sizeof(struct smb2_rcache_locked));
+                if (locked == NULL) {
+                        /* can't tell it is locked, so forget the data */
+                        smb2_rcache_drop(rc, identity);
+                        return;
+                }
+                locked->identity = identity;
+                SMB2_LIST_ADD(&rc->locked[i], locked);
+        }
+        locked->count += delta;
+        if (locked->count <= 0) {
+                SMB2_LIST_REMOVE(&rc->locked[i], locked);
+                free(locked);
+        }
+}
+
+/* Related requests have had the id of their CREATE filled in by now (see
+ * smb2_compound_failed()), so the all-0xFF id is never a tracked open.
+ */
+static struct smb2_rcache_open *
+smb2_rcache_find_open(struct smb2_context *smb2, const smb2_file_id file_id)
+{
+        struct smb2_rcache_open *open;
+
+        for (open = smb2->rcache_opens; open; open = open->next) {
+                if (!memcmp(open->file_id, file_id, SMB2_FD_SIZE)) {
+                        return open;
+                }
+        }
+        return NULL;
+}
+
+void
+smb2_rcache_opened(struct smb2_server *server, struct smb2_context *smb2,
+                   struct smb2_create_request *req,
+                   struct smb2_create_reply *rep)
+{
+        struct smb2_read_cache *rc = smb2_rcache_get(server);
+        struct smb2_rcache_open *open;
+        uint64_t identity;
+
+        if (rc == NULL) {
+                return;
+        }
+        if (server->handlers->file_identity_cmd(server, smb2, rep->file_id,
+                                                &identity) != 0) {
+                return;
+        }
+
+        switch (req->create_disposition) {
+        case SMB2_FILE_SUPERSEDE:
+        case SMB2_FILE_OVERWRITE:
+        case SMB2_FILE_OVERWRITE_IF:
+                smb2_rcache_drop(rc, identity);
+                break;
+        default:
+                break;
+        }
+
+        open = calloc(1, sizeof(struct smb2_rcache_open));
+        if (open == NULL) {
+                return;
+        }
+        memcpy(open->file_id, rep->file_id, SMB2_FD_SIZE);
+        open->identity = identity;
+        open->readable = !!(req->desired_access & (SMB2_FILE_READ_DATA |
+                                                   SMB2_GENERIC_READ |
+                                                   SMB2_GENERIC_ALL));
+        SMB2_LIST_ADD(&smb2->rcache_opens, open);
+}
+
+/* A LOCK the backend granted, or is answering itself and may grant */
+void
+smb2_rcache_locked(struct smb2_server *server, struct smb2_context *smb2,
+                   struct smb2_lock_request *req)
+{
+        struct smb2_read_cache *rc = server->read_cache;
+        struct smb2_rcache_open *open;
+        int i;
+
+        open = smb2_rcache_find_open(smb2, req->file_id);
+        if (rc == NULL || open == NULL) {
+                return;
+        }
+        for (i = 0; i < req->lock_count; i++) {
+                if (req->locks[i].flags & SMB2_LOCKFLAG_UNLOCK) {
+                        if (open->locks > 0) {
+                                open->locks--;
+                                smb2_rcache_lock_count(rc, open->identity, -1);
+                        }
+                } else {
+                        open->locks++;
+                        smb2_rcache_lock_count(rc, open->identity, 1);
+                }
+        }
+}
+
+void
+smb2_rcache_changed(struct smb2_server *server, struct smb2_context *smb2,
+                    const smb2_file_id file_id)
+{
+        struct smb2_read_cache *rc = server->read_cache;
+        struct smb2_rcache_open *open;
+
+        open = smb2_rcache_find_open(smb2, file_id);
+        if (rc == NULL || open == NULL) {
+                return;
+        }
+        open->dirty = 1;
+        smb2_rcache_drop(rc, open->identity);
+}
+
+void
+smb2_rcache_closed(struct smb2_server *server, struct smb2_context *smb2,
+                   const smb2_file_id file_id)
+{
+        struct smb2_read_cache *rc = server->read_cache;
+        struct smb2_rcache_open *open;
+
+        open = smb2_rcache_find_open(smb2, file_id);
+        if (open == NULL) {
+                return;
+        }
+        if (rc && open->dirty) {
+                smb2_rcache_drop(rc, open->identity);
+        }
+        if (rc && open->locks) {
+                /* closing releases them */
+                smb2_rcache_lock_count(rc, open->identity, -open->locks);
+        }
+        SMB2_LIST_REMOVE(&smb2->rcache_opens, open);
+        free(open);
+}
+
+int
+smb2_rcache_read(struct smb2_server *server, struct smb2_context *smb2,
+                 struct smb2_read_request *req, struct smb2_read_reply *rep)
+{
+        struct smb2_read_cache *rc = server->read_cache;
+        struct smb2_rcache_entry *entry;
+        struct smb2_rcache_open *open;
+        uint32_t length;
+
+        if (rc == NULL || (req->flags & SMB2_READFLAG_READ_UNBUFFERED)) {
+                return 0;
+        }
+        open = smb2_rcache_find_open(smb2, req->file_id);
+        if (open == NULL || open->dirty || !open->readable ||
+            smb2_rcache_find_locked(rc, open->identity)) {
+                return 0;
+        }
+        entry = smb2_rcache_lookup(rc, open->identity, req->offset,
+                                   req->length);
+        if (entry == NULL) {
+                return 0;
+        }
+
+        length = req->length < entry->length ? req->length : entry->length;
+        if (length < req->minimum_count) {
+                /* let the backend report that */
+                return 0;
+        }
+
+        /* the reply frees the data once it is sent */
+        rep->data = malloc(length);
+        if (rep->data == NULL) {
+                return 0;
+        }
+        memcpy(rep->data, entry->data, length);
+        rep->data_length = length;
+        rep->data_remaining = 0;
+
+        return 1;
+}
+
+void
+smb2_rcache_store(struct smb2_server *server, struct smb2_context *smb2,
+                  struct smb2_read_request *req, struct smb2_read_reply *rep)
+{
+        struct smb2_read_cache *rc = server->read_cache;
+        struct smb2_rcache_entry *entry;
+        struct smb2_rcache_file *file;
+        struct smb2_rcache_open *open;
+        unsigned int i;
+
+        if (rc == NULL || rep->data == NULL || rep->data_length == 0 ||
+            (req->flags & SMB2_READFLAG_READ_UNBUFFERED)) {
+                return;
+        }
+        /* one large file must not wipe out everything else */
+        if (rep->data_length > server->read_cache_size / 8) {
+                return;
+        }
+        open = smb2_rcache_find_open(smb2, req->file_id);
+        if (open == NULL || open->dirty || !open->readable ||
+            smb2_rcache_find_locked(rc, open->identity)) {
+                return;
+        }
+
+        i = smb2_rcache_hash(open->identity, req->offset);
+        for (entry = rc->entries[i]; entry; entry = entry->next) {
+                if (entry->file->identity == open->identity &&
+                    entry->offset == req->offset) {
+                        smb2_rcache_free_entry(rc, entry);
+                        break;
+                }
+        }
+        while (rc->lru_tail &&
+               rc->size + rep->data_length > server->read_cache_size) {
+                smb2_rcache_free_entry(rc, rc->lru_tail);
+        }
+
+        entry = calloc(1, sizeof(struct smb2_rcache_entry));
+        if (entry == NULL) {
+                return;
+        }
+        entry->data = malloc(rep->data_length);
+        if (entry->data == NULL) {
+                free(entry);
+                return;
+        }
+        file = smb2_rcache_find_file(rc, open->identity);
+        if (file == NULL) {
+                file = calloc(1, sizeof(struct smb2_rcache_file));
+                if (file == NULL) {
+                        free(entry->data);
+                        free(entry);
+                        return;
+                }
+                file->identity = open->identity;
+                SMB2_LIST_ADD(&rc->files[smb2_rcache_hash(file->identity, 0)],
+                              file);
+        }
+
+        memcpy(entry->data, rep->data, rep->data_length);
+        entry->file = file;
+        entry->offset = req->offset;
+        entry->asked = req->length;
+        entry->length = rep->data_length;
+        SMB2_LIST_ADD(&rc->entries[i], entry);
+        entry->file_next = file->entries;
+        file->entries = entry;
+        entry->lru_next = rc->lru_head;
+        if (rc->lru_head) {
+                rc->lru_head->lru_prev = entry;
+        } else {
+                rc->lru_tail = entry;
+        }
+        rc->lru_head = entry;
+        rc->size += entry->length;
+}
+
+/* The opens of a connection that is going away */
+void
+smb2_rcache_free_opens(struct smb2_context *smb2)
+{
+        struct smb2_server *server = smb2->owning_server;
+        struct smb2_rcache_open *open;
+
+        while ((open = smb2->rcache_opens) != NULL) {
+                smb2->rcache_opens = open->next;
+                if (server && server->read_cache && open->dirty) {
+                        smb2_rcache_drop(server->read_cache, open->identity);
+                }
+                if (server && server->read_cache && open->locks) {
+                        smb2_rcache_lock_count(server->read_cache,
+                                               open->identity, -open->locks);
+                }
+                free(open);
+        }
+}
+
+void
+smb2_rcache_free(struct smb2_server *server)
+{
+        struct smb2_read_cache *rc = server->read_cache;
+        struct smb2_rcache_locked *locked;
+        int i;
+
+        if (rc == NULL) {
+                return;
+        }
+        while (rc->lru_head) {
+                smb2_rcache_free_entry(rc, rc->lru_head);
+        }
+        for (i = 0; i < SMB2_RCACHE_BUCKETS; i++) {
+                while ((locked = rc->locked[i]) != NULL) {
+                        rc->locked[i] = locked->next;
+                        free(locked);
+                }
+        }
+        free(rc);
+        server->read_cache = NULL;
+}
+
+void
+smb2_server_read_cache_invalidate(struct smb2_server *server,
+                                  uint64_t identity)
+{
+        if (server->read_cache) {
+                smb2_rcache_drop(server->read_cache, identity);
+        }
+}
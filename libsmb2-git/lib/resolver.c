@@ -0,0 +1,635 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+
+#include "compat.h"
+
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+#include <exec/semaphores.h>
+#include <dos/dostags.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+#ifdef __amigaos4__
+#include <proto/bsdsocket.h>
+#endif
+#elif defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Resolver cache.
+ *
+ * Server names are resolved with the platform's blocking getaddrinfo() (on
+ * AmigaOS a gethostbyname() in bsdsocket.library), which can stall the
+ * caller for the whole resolver timeout when DNS is slow or down. Since a
+ * reconnect tears down the whole context, the results are kept for the
+ * process rather than per context:
+ *
+ *  - a name resolved less than SMB2_RESOLVER_TTL seconds ago is not looked
+ *    up again, so a reconnect starts connecting immediately,
+ *  - an expired name is not looked up by the caller either: its stale
+ *    addresses are returned at once and a helper (a process of its own on
+ *    AmigaOS, a thread where there are pthreads) looks it up again in the
+ *    background. If the lookup fails the stale addresses stay, and the next
+ *    try is at most every SMB2_RESOLVER_RETRY seconds. Without a helper
+ *    the name is looked up in place, as before,
+ *  - smb2_resolve_forget() drops a name whose cached addresses could not
+ *    be connected to, so the next connect looks it up in place,
+ *  - only a name that is not cached at all is looked up by the caller, as
+ *    there is nothing to connect to before the answer,
+ *  - literal IPv4 and IPv6 addresses are never looked up or cached.
+ *
+ * smb2_resolve() always returns its own copy of the addresses, which must
+ * be freed with smb2_resolve_free(). The cache is locked while it is read
+ * or updated, as contexts in several tasks (several mounts of a resident
+ * handler) share it; the lookups themselves run without the lock. Before
+ * the code goes away, smb2_resolve_shutdown() waits for the helper.
+ */
+
+#define SMB2_RESOLVER_TTL       300
+#define SMB2_RESOLVER_RETRY     30
+#define SMB2_RESOLVER_ENTRIES   8
+#define SMB2_RESOLVER_MAX_ADDRS 4
+
+union smb2_resolved_sockaddr {
+        struct sockaddr sa;
+        struct sockaddr_in sin;
+#ifdef AF_INET6
+        struct sockaddr_in6 sin6;
+#endif
+};
+
+struct smb2_resolved_addr {
+        int family;
+        int socktype;
+        int protocol;
+        size_t addrlen;
+        union smb2_resolved_sockaddr addr;
+};
+
+struct smb2_resolved {
+        char *host;
+        char *port;
+        time_t time;
+        /* when the helper was last asked to look it up again */
+        time_t tried;
+        int refresh;
+        int count;
+        struct smb2_resolved_addr addrs[SMB2_RESOLVER_MAX_ADDRS];
+};
+
+static struct smb2_resolved smb2_resolver_cache[SMB2_RESOLVER_ENTRIES];
+/* Both under the cache lock */
+static int smb2_resolver_helper;
+static int smb2_resolver_closing;
+
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+static struct SignalSemaphore smb2_resolver_sem;
+static int smb2_resolver_sem_ready;
+
+static void
+smb2_resolve_lock(void)
+{
+        Forbid();
+        if (!smb2_resolver_sem_ready) {
+                InitSemaphore(&smb2_resolver_sem);
+                smb2_resolver_sem_ready = 1;
+        }
+        Permit();
+        ObtainSemaphore(&smb2_resolver_sem);
+}
+
+static void
+smb2_resolve_unlock(void)
+{
+        ReleaseSemaphore(&smb2_resolver_sem);
+}
+#elif defined(HAVE_PTHREAD)
+static pthread_mutex_t smb2_resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+smb2_resolve_lock(void)
+{
+        pthread_mutex_lock(&smb2_resolver_mutex);
+}
+
+static void
+smb2_resolve_unlock(void)
+{
+        pthread_mutex_unlock(&smb2_resolver_mutex);
+}
+#else
+#define smb2_resolve_lock()
+#define smb2_resolve_unlock()
+#endif
+
+static int
+smb2_resolve_is_literal(const char *host)
+{
+        const char *p;
+
+        /* IPv6 addresses are the only ones with a ':' */
+        if (strchr(host, ':') != NULL) {
+                return 1;
+        }
+        for (p = host; *p; p++) {
+                if ((*p < '0' || *p > '9') && *p != '.') {
+                        return 0;
+                }
+        }
+        return p != host;
+}
+
+/* Host names are case insensitive */
+static int
+smb2_resolve_host_equal(const char *a, const char *b)
+{
+        char ca, cb;
+
+        do {
+                ca = *a++;
+                cb = *b++;
+                if (ca >= 'A' && ca <= 'Z') {
+                        ca += 'a' - 'A';
+                }
+                if (cb >= 'A' && cb <= 'Z') {
+                        cb += 'a' - 'A';
+                }
+        } while (ca == cb && ca != 0);
+
+        return ca == cb;
+}
+
+static struct smb2_resolved *
+smb2_resolve_lookup(const char *host, const char *port)
+{
+        struct smb2_resolved *entry;
+        int i;
+
+        for (i = 0; i < SMB2_RESOLVER_ENTRIES; i++) {
+                entry = &smb2_resolver_cache[i];
+                if (entry->host && smb2_resolve_host_equal(entry->host, host) &&
+                    !strcmp(entry->port, port)) {
+                        return entry;
+                }
+        }
+        return NULL;
+}
+
+static void
+smb2_resolve_fill(struct smb2_resolved *entry, const struct addrinfo *ai)
+{
+        entry->count = 0;
+        for (; ai && entry->count < SMB2_RESOLVER_MAX_ADDRS; ai = ai->ai_next) {
+                struct smb2_resolved_addr *addr = &entry->addrs[entry->count];
+
+                if (ai->ai_addr == NULL ||
+                    ai->ai_addrlen > sizeof(union smb2_resolved_sockaddr)) {
+                        continue;
+                }
+                addr->family = ai->ai_family;
+                addr->socktype = ai->ai_socktype;
+                addr->protocol = ai->ai_protocol;
+                addr->addrlen = ai->ai_addrlen;
+                memcpy(&addr->addr, ai->ai_addr, ai->ai_addrlen);
+                entry->count++;
+        }
+        entry->time = time(NULL);
+}
+
+static struct smb2_resolved *
+smb2_resolve_store(const char *host, const char *port,
+                   const struct addrinfo *ai)
+{
+        struct smb2_resolved *entry;
+        int i;
+
+        entry = smb2_resolve_lookup(host, port);
+        if (entry == NULL) {
+                /* Reuse a free slot or else the oldest one */
+                entry = &smb2_resolver_cache[0];
+                for (i = 0; i < SMB2_RESOLVER_ENTRIES; i++) {
+                        if (smb2_resolver_cache[i].host == NULL) {
+                                entry = &smb2_resolver_cache[i];
+                                break;
+                        }
+                        if (smb2_resolver_cache[i].time < entry->time) {
+                                entry = &smb2_resolver_cache[i];
+                        }
+                }
+                free(entry->host);
+                free(entry->port);
+                memset(entry, 0, sizeof(struct smb2_resolved));
+                entry->host = strdup(host);
+                entry->port = strdup(port);
+                if (entry->host == NULL || entry->port == NULL) {
+                        free(entry->host);
+                        free(entry->port);
+                        entry->host = entry->port = NULL;
+                        return NULL;
+                }
+        }
+
+        smb2_resolve_fill(entry, ai);
+        return entry;
+}
+
+/* Build a list the caller owns from a cache entry */
+static int
+smb2_resolve_copy(const struct smb2_resolved *entry, struct addrinfo **res)
+{
+        struct addrinfo *head = NULL, **tail = &head;
+        int i;
+
+        for (i = 0; i < entry->count; i++) {
+                const struct smb2_resolved_addr *addr = &entry->addrs[i];
+                struct addrinfo *ai;
+
+                ai = calloc(1, sizeof(struct addrinfo) +
+                            sizeof(union smb2_resolved_sockaddr));
+                if (ai == NULL) {
+                        smb2_resolve_free(head);
+                        return EAI_MEMORY;
+                }
+                ai->ai_family = addr->family;
+                ai->ai_socktype = addr->socktype;
+                ai->ai_protocol = addr->protocol;
+                ai->ai_addrlen = addr->addrlen;
+                ai->ai_addr = (struct sockaddr *)(void *)(ai + 1);
+                memcpy(ai->ai_addr, &addr->addr, addr->addrlen);
+                *tail = ai;
+                tail = &ai->ai_next;
+        }
+        if (head == NULL) {
+                return EAI_FAIL;
+        }
+
+        *res = head;
+        return 0;
+}
+
+static int
+smb2_resolve_getaddrinfo(const char *host, const char *port,
+                         struct addrinfo **ai)
+{
+        struct addrinfo hints;
+
+        /* One entry per address, not one per socket type */
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+
+        return getaddrinfo(host, port, &hints, ai);
+}
+
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+/*
+ * The helper's lookup. bsdsocket.library bases belong to the task that
+ * opened them, so the helper cannot go through getaddrinfo() and the base
+ * of the handler, and opens one of its own (the local SocketBase and
+ * ISocket are what the bsdsocket calls below use).
+ */
+static void
+smb2_resolve_helper_lookup(const char *host, const char *port)
+{
+        struct Library *SocketBase;
+#ifdef __amigaos4__
+        struct SocketIFace *ISocket;
+#endif
+        struct addrinfo ai[SMB2_RESOLVER_MAX_ADDRS];
+        struct sockaddr_in sin[SMB2_RESOLVER_MAX_ADDRS];
+        struct hostent *he = NULL;
+        int i;
+
+        memset(ai, 0, sizeof(ai));
+        memset(sin, 0, sizeof(sin));
+
+        SocketBase = OpenLibrary("bsdsocket.library", 4);
+        if (SocketBase == NULL) {
+                return;
+        }
+#ifdef __amigaos4__
+        ISocket = (struct SocketIFace *)GetInterface(SocketBase, "main", 1,
+                                                     NULL);
+        if (ISocket != NULL) {
+                he = ISocket->gethostbyname((STRPTR)host);
+        }
+#else
+        he = gethostbyname((STRPTR)host);
+#endif
+
+        /* Same as smb2_getaddrinfo() builds them */
+        for (i = 0; he != NULL && he->h_addrtype == AF_INET &&
+                     i < SMB2_RESOLVER_MAX_ADDRS &&
+                     he->h_addr_list[i] != NULL; i++) {
+                sin[i].sin_len = sizeof(struct sockaddr_in);
+                sin[i].sin_family = AF_INET;
+                sin[i].sin_port = htons(atoi(port));
+                memcpy(&sin[i].sin_addr.s_addr, he->h_addr_list[i], 4);
+                ai[i].ai_family = AF_INET;
+                ai[i].ai_socktype = SOCK_STREAM;
+                ai[i].ai_addrlen = sizeof(struct sockaddr_in);
+                ai[i].ai_addr = (struct sockaddr *)&sin[i];
+                if (i > 0) {
+                        ai[i - 1].ai_next = &ai[i];
+                }
+        }
+
+        smb2_resolve_lock();
+        if (i > 0) {
+                smb2_resolve_store(host, port, ai);
+        }
+        smb2_resolve_unlock();
+
+#ifdef __amigaos4__
+        if (ISocket != NULL) {
+                DropInterface((struct Interface *)ISocket);
+        }
+#endif
+        CloseLibrary(SocketBase);
+}
+#else
+static void
+smb2_resolve_helper_lookup(const char *host, const char *port)
+{
+        struct addrinfo *ai = NULL;
+
+        if (smb2_resolve_getaddrinfo(host, port, &ai) != 0) {
+                return;
+        }
+        smb2_resolve_lock();
+        smb2_resolve_store(host, port, ai);
+        smb2_resolve_unlock();
+        freeaddrinfo(ai);
+}
+#endif
+
+/* Look up every name that wants it, then go away */
+static void
+smb2_resolve_helper_run(void)
+{
+        struct smb2_resolved *entry;
+        char *host, *port;
+        int i;
+
+        for (;;) {
+                smb2_resolve_lock();
+                entry = NULL;
+                for (i = 0; i < SMB2_RESOLVER_ENTRIES; i++) {
+                        if (smb2_resolver_cache[i].host &&
+                            smb2_resolver_cache[i].refresh) {
+                                entry = &smb2_resolver_cache[i];
+                                break;
+                        }
+                }
+                if (entry == NULL || smb2_resolver_closing) {
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+                        /* Not to be unloaded before this process is gone;
+                         * its exit ends the Forbid() */
+                        Forbid();
+#endif
+                        smb2_resolver_helper = 0;
+                        smb2_resolve_unlock();
+                        return;
+                }
+                host = strdup(entry->host);
+                port = strdup(entry->port);
+                if (host == NULL || port == NULL) {
+                        entry->refresh = 0;
+                        smb2_resolve_unlock();
+                        free(host);
+                        free(port);
+                        continue;
+                }
+                smb2_resolve_unlock();
+
+                smb2_resolve_helper_lookup(host, port);
+
+                /* Done, whether it was found or not */
+                smb2_resolve_lock();
+                entry = smb2_resolve_lookup(host, port);
+                if (entry != NULL) {
+                        entry->refresh = 0;
+                }
+                smb2_resolve_unlock();
+                free(host);
+                free(port);
+        }
+}
+
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+static void
+smb2_resolve_helper_proc(void)
+{
+        smb2_resolve_helper_run();
+}
+#elif defined(HAVE_PTHREAD)
+static void *
+smb2_resolve_helper_thread(void *arg _U_)
+{
+        smb2_resolve_helper_run();
+        return NULL;
+}
+#endif
+
+/* Start the helper unless it runs already. Called with the cache locked. */
+static int
+smb2_resolve_spawn(void)
+{
+#if defined(HAVE_PTHREAD) && !(defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__))
+        pthread_t thread;
+#endif
+
+        if (smb2_resolver_closing) {
+                return -1;
+        }
+        if (smb2_resolver_helper) {
+                return 0;
+        }
+
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+        /* It waits for the cache lock we hold, so it may start right away */
+        if (CreateNewProcTags(NP_Entry, (Tag)smb2_resolve_helper_proc,
+                              NP_Name, (Tag)"smb2 resolver",
+                              TAG_END) == NULL) {
+                return -1;
+        }
+#elif defined(HAVE_PTHREAD)
+        if (pthread_create(&thread, NULL, smb2_resolve_helper_thread,
+                           NULL) != 0) {
+                return -1;
+        }
+        pthread_detach(thread);
+#else
+        return -1;
+#endif
+        smb2_resolver_helper = 1;
+        return 0;
+}
+
+int
+smb2_resolve(const char *host, const char *port, struct addrinfo **res)
+{
+        struct smb2_resolved *entry;
+        struct smb2_resolved literal;
+        struct addrinfo *ai = NULL;
+        time_t now;
+        int is_literal;
+        int err;
+
+        *res = NULL;
+
+        is_literal = smb2_resolve_is_literal(host);
+        if (!is_literal) {
+                now = time(NULL);
+                smb2_resolve_lock();
+                entry = smb2_resolve_lookup(host, port);
+                if (entry && entry->count &&
+                    now - entry->time >= SMB2_RESOLVER_TTL &&
+                    !entry->refresh &&
+                    now - entry->tried >= SMB2_RESOLVER_RETRY) {
+                        /* Stale: hand it out and have it looked up again */
+                        entry->refresh = 1;
+                        entry->tried = now;
+                        if (smb2_resolve_spawn() != 0) {
+                                entry->refresh = 0;
+                                entry = NULL;
+                        }
+                }
+                if (entry && entry->count) {
+                        err = smb2_resolve_copy(entry, res);
+                        smb2_resolve_unlock();
+                        return err;
+                }
+                smb2_resolve_unlock();
+        }
+
+        err = smb2_resolve_getaddrinfo(host, port, &ai);
+        if (err != 0) {
+                if (!is_literal) {
+                        /* Better an old address than none at all */
+                        smb2_resolve_lock();
+                        entry = smb2_resolve_lookup(host, port);
+                        if (entry && entry->count) {
+                                err = smb2_resolve_copy(entry, res);
+                        }
+                        smb2_resolve_unlock();
+                }
+                return err;
+        }
+
+        if (!is_literal) {
+                smb2_resolve_lock();
+                entry = smb2_resolve_store(host, port, ai);
+                if (entry != NULL) {
+                        err = smb2_resolve_copy(entry, res);
+                        smb2_resolve_unlock();
+                        freeaddrinfo(ai);
+                        return err;
+                }
+                smb2_resolve_unlock();
+        }
+
+        /* A literal, or could not cache it: still hand out what we got */
+        memset(&literal, 0, sizeof(literal));
+        smb2_resolve_fill(&literal, ai);
+        freeaddrinfo(ai);
+
+        return smb2_resolve_copy(&literal, res);
+}
+
+void
+smb2_resolve_forget(const char *host, const char *port)
+{
+        struct smb2_resolved *entry;
+
+        smb2_resolve_lock();
+        entry = smb2_resolve_lookup(host, port);
+        if (entry != NULL) {
+                free(entry->host);
+                free(entry->port);
+                memset(entry, 0, sizeof(struct smb2_resolved));
+        }
+        smb2_resolve_unlock();
+}
+
+void
+smb2_resolve_shutdown(void)
+{
+        smb2_resolve_lock();
+        smb2_resolver_closing = 1;
+        smb2_resolve_unlock();
+
+#if defined(__amigaos4__) || defined(__AMIGA__) || defined(__AROS__)
+        /* It gives up once it is through with the lookup it is in */
+        while (smb2_resolver_helper) {
+                Delay(5);
+        }
+#endif
+}
+
+void
+smb2_resolve_free(struct addrinfo *ai)
+{
+        struct addrinfo *next;
+
+        while (ai) {
+                next = ai->ai_next;
+                free(ai);
+                ai = next;
+        }
+}
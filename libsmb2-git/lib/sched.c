@@ -0,0 +1,209 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Server request scheduling.
+ *
+ * smb2_serve_port() serves all its connections from one loop, and used to
+ * read one request chain from every readable connection per pass no matter
+ * what it cost: a 1 MiB WRITE from a client streaming data counted the same
+ * as a small CREATE from someone browsing the share. Instead the
+ * connections are now served by deficit round robin:
+ *
+ *  - each pass, a connection with input gets server->sched_quantum added to
+ *    its deficit and is read for as long as the deficit is positive,
+ *  - a request is charged the bytes it took on the wire, the data it asks
+ *    for in the reply (READ length, QUERY_DIRECTORY and QUERY_INFO output
+ *    buffer, IOCTL output) and SMB2_SCHED_REQUEST_COST for handling it at
+ *    all,
+ *  - a connection without input forfeits what is left of its deficit so it
+ *    can not save up for a burst, while the debt of a large request is
+ *    paid off over the next passes.
+ *
+ * The requests wait in the socket until they are served rather than in a
+ * queue of decoded requests per connection: a decoded request points into
+ * the receive buffers of its context and the requests of a compound have to
+ * be handled in order, so the socket buffer is the queue.
+ *
+ * Each connection (which carries one session) may also have at most
+ * server->max_requests requests in flight, counting both the ones still
+ * being answered and the replies not sent yet. The credits granted in the
+ * replies are trimmed so that a client playing by the rules never goes over
+ * that, and a connection at the limit is not read until its replies drain.
+ * A request that has had its interim STATUS_PENDING reply (a CHANGE_NOTIFY,
+ * a blocking LOCK) no longer counts: it may wait for a long time, and the
+ * CANCEL or CLOSE that ends it has to be read.
+ */
+
+#define SMB2_SCHED_REQUEST_COST 1024
+
+static int
+smb2_sched_in_flight(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu, *p;
+        int count = 0;
+
+        for (pdu = smb2->waitqueue; pdu; pdu = pdu->next) {
+                /* answered with STATUS_PENDING, see smb2_correlate_reply() */
+                if (pdu->header.flags & SMB2_FLAGS_ASYNC_COMMAND) {
+                        continue;
+                }
+                count++;
+        }
+        for (pdu = smb2->outqueue; pdu; pdu = pdu->next) {
+                for (p = pdu; p; p = p->next_compound) {
+                        count++;
+                }
+        }
+
+        return count;
+}
+
+/* Called for each request just before it is handed to its handler */
+void
+smb2_sched_charge(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        uint32_t cost = SMB2_SCHED_REQUEST_COST;
+
+        if (pdu->payload != NULL) {
+                switch (smb2->hdr.command) {
+                case SMB2_READ:
+                        cost += ((struct smb2_read_request *)
+                                 pdu->payload)->length;
+                        break;
+                case SMB2_QUERY_DIRECTORY:
+                        cost += ((struct smb2_query_directory_request *)
+                                 pdu->payload)->output_buffer_length;
+                        break;
+                case SMB2_QUERY_INFO:
+                        cost += ((struct smb2_query_info_request *)
+                                 pdu->payload)->output_buffer_length;
+                        break;
+                case SMB2_IOCTL:
+                        cost += ((struct smb2_ioctl_request *)
+                                 pdu->payload)->max_output_response;
+                        break;
+                default:
+                        break;
+                }
+        }
+        smb2->sched_deficit -= cost;
+
+        /* CANCEL is the one request that does not take a credit */
+        if (smb2->hdr.command != SMB2_CANCEL) {
+                smb2->sched_credits -= smb2->hdr.credit_charge ?
+                        smb2->hdr.credit_charge : 1;
+                if (smb2->sched_credits < 0) {
+                        smb2->sched_credits = 0;
+                }
+        }
+}
+
+/* Trims the credits granted in a reply to the room left under the limit */
+uint16_t
+smb2_sched_grant(struct smb2_context *smb2, uint16_t grant)
+{
+        int room;
+
+        room = smb2->owning_server->max_requests -
+                smb2_sched_in_flight(smb2) - smb2->sched_credits;
+        if (grant > room) {
+                grant = room > 0 ? room : 0;
+        }
+        /* the client must never be left without a credit at all */
+        if (grant == 0 && smb2->sched_credits == 0) {
+                grant = 1;
+        }
+        smb2->sched_credits += grant;
+
+        return grant;
+}
+
+int
+smb2_sched_may_read(struct smb2_context *smb2)
+{
+        if (!smb2_is_server(smb2)) {
+                return 1;
+        }
+        return smb2_sched_in_flight(smb2) <
+                smb2->owning_server->max_requests;
+}
+
+int
+smb2_sched_service(struct smb2_context *smb2)
+{
+        uint64_t rx;
+
+        if (!smb2_is_server(smb2)) {
+                return smb2_service(smb2, POLLIN);
+        }
+
+        smb2->sched_deficit += smb2->owning_server->sched_quantum;
+        while (smb2->sched_deficit > 0) {
+                rx = smb2->sched_rx;
+                if (smb2_service(smb2, POLLIN) < 0) {
+                        return -1;
+                }
+                smb2->sched_deficit -= (int64_t)(smb2->sched_rx - rx);
+
+                if (smb2->sched_rx == rx) {
+                        /* the socket is drained */
+                        smb2_sched_idle(smb2);
+                        break;
+                }
+                if (!SMB2_IS_CONNECTED(smb2) || !smb2_sched_may_read(smb2)) {
+                        break;
+                }
+        }
+
+        return 0;
+}
+
+/* For a connection that had nothing to read this pass */
+void
+smb2_sched_idle(struct smb2_context *smb2)
+{
+        if (smb2->sched_deficit > 0 && smb2->in.num_done == 0) {
+                smb2->sched_deficit = 0;
+        }
+}
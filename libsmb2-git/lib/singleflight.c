@@ -0,0 +1,279 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+#include "slist.h"
+
+/*
+ * Single-flight deduplication of identical requests.
+ *
+ * A stat, statvfs or read that is identical to one already in flight (same
+ * kind of request, same path or file id, same range) is not sent again.
+ * The caller is attached to the request in flight instead and gets its own
+ * copy of the result, or the same error, when that request completes.
+ *
+ * Anything that may change what such a request returns (a write, a set
+ * info, an ioctl or a create that is not a plain open) seals all flights,
+ * so that a request issued after the change never shares the reply of one
+ * issued before it.
+ */
+
+struct smb2_flight_waiter {
+        struct smb2_flight_waiter *next;
+        smb2_command_cb cb;
+        void *cb_data;
+        void *buf;
+        /* passed as command_data to read callbacks */
+        struct smb2_read_cb_data read_cb_data;
+};
+
+struct smb2_flight {
+        struct smb2_flight *next;
+        int type;
+        char *path;
+        smb2_file_id file_id;
+        uint64_t offset;
+        uint32_t length;
+        int sealed;
+        struct smb2_flight_waiter *waiters;
+};
+
+/* Paths are matched without leading or trailing separators and ignoring
+ * (ASCII) case, like the server does.
+ */
+static void
+smb2_flight_trim(const char **path, size_t *len)
+{
+        const char *p = *path;
+        size_t l;
+
+        while (*p == '/' || *p == '\\') {
+                p++;
+        }
+        l = strlen(p);
+        while (l > 0 && (p[l - 1] == '/' || p[l - 1] == '\\')) {
+                l--;
+        }
+        *path = p;
+        *len = l;
+}
+
+static int
+smb2_flight_path_equal(const char *a, const char *b)
+{
+        size_t alen, blen, i;
+        char ca, cb;
+
+        smb2_flight_trim(&a, &alen);
+        smb2_flight_trim(&b, &blen);
+        if (alen != blen) {
+                return 0;
+        }
+        for (i = 0; i < alen; i++) {
+                ca = a[i] == '\\' ? '/' : a[i];
+                cb = b[i] == '\\' ? '/' : b[i];
+                if (ca >= 'A' && ca <= 'Z') {
+                        ca += 'a' - 'A';
+                }
+                if (cb >= 'A' && cb <= 'Z') {
+                        cb += 'a' - 'A';
+                }
+                if (ca != cb) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+static struct smb2_flight *
+smb2_flight_find(struct smb2_context *smb2, int type, const char *path,
+                 smb2_file_id *file_id, uint64_t offset, uint32_t length)
+{
+        struct smb2_flight *flight;
+
+        for (flight = smb2->flights; flight; flight = flight->next) {
+                if (flight->sealed || flight->type != type ||
+                    flight->offset != offset || flight->length != length) {
+                        continue;
+                }
+                if (path) {
+                        if (flight->path &&
+                            smb2_flight_path_equal(flight->path, path)) {
+                                return flight;
+                        }
+                } else if (file_id && flight->path == NULL &&
+                           !memcmp(flight->file_id, file_id, SMB2_FD_SIZE)) {
+                        return flight;
+                }
+        }
+
+        return NULL;
+}
+
+int
+smb2_flight_attach(struct smb2_context *smb2, int type, const char *path,
+                   struct smb2fh *fh, uint64_t offset, uint32_t length,
+                   void *buf, smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_flight *flight;
+        struct smb2_flight_waiter *waiter;
+
+        flight = smb2_flight_find(smb2, type, path,
+                                  fh ? smb2_get_file_id(fh) : NULL,
+                                  offset, length);
+        if (flight == NULL) {
+                return 0;
+        }
+
+        waiter = calloc(1, sizeof(struct smb2_flight_waiter));
+        if (waiter == NULL) {
+                /* Just send a request of its own */
+                return 0;
+        }
+        waiter->cb = cb;
+        waiter->cb_data = cb_data;
+        waiter->buf = buf;
+        waiter->read_cb_data.fh = fh;
+        waiter->read_cb_data.buf = buf;
+        waiter->read_cb_data.count = length;
+        waiter->read_cb_data.offset = offset;
+        SMB2_LIST_ADD_END(&flight->waiters, waiter);
+
+        return 1;
+}
+
+struct smb2_flight *
+smb2_flight_begin(struct smb2_context *smb2, int type, const char *path,
+                  struct smb2fh *fh, uint64_t offset, uint32_t length)
+{
+        struct smb2_flight *flight;
+
+        flight = calloc(1, sizeof(struct smb2_flight));
+        if (flight == NULL) {
+                return NULL;
+        }
+        if (path) {
+                flight->path = strdup(path);
+                if (flight->path == NULL) {
+                        free(flight);
+                        return NULL;
+                }
+        } else {
+                memcpy(flight->file_id, smb2_get_file_id(fh), SMB2_FD_SIZE);
+        }
+        flight->type = type;
+        flight->offset = offset;
+        flight->length = length;
+        SMB2_LIST_ADD(&smb2->flights, flight);
+
+        return flight;
+}
+
+static void
+smb2_flight_free(struct smb2_flight *flight)
+{
+        struct smb2_flight_waiter *waiter;
+
+        while ((waiter = flight->waiters) != NULL) {
+                flight->waiters = waiter->next;
+                free(waiter);
+        }
+        free(flight->path);
+        free(flight);
+}
+
+void
+smb2_flight_end(struct smb2_context *smb2, struct smb2_flight *flight,
+                int status, const void *result, size_t len)
+{
+        struct smb2_flight_waiter *waiter;
+
+        if (flight == NULL) {
+                return;
+        }
+        SMB2_LIST_REMOVE(&smb2->flights, flight);
+
+        while ((waiter = flight->waiters) != NULL) {
+                flight->waiters = waiter->next;
+
+                if (flight->type == SMB2_FLIGHT_READ) {
+                        /* status is the number of bytes read */
+                        if (status > 0) {
+                                if (waiter->buf != result) {
+                                        memcpy(waiter->buf, result, status);
+                                }
+                                smb2_set_fh_offset(waiter->read_cb_data.fh,
+                                        waiter->read_cb_data.offset + status);
+                        }
+                        waiter->cb(smb2, status, &waiter->read_cb_data,
+                                   waiter->cb_data);
+                } else {
+                        if (status == 0 && waiter->buf != result) {
+                                memcpy(waiter->buf, result, len);
+                        }
+                        waiter->cb(smb2, status, status ? NULL : waiter->buf,
+                                   waiter->cb_data);
+                }
+                free(waiter);
+        }
+        smb2_flight_free(flight);
+}
+
+void
+smb2_flight_seal(struct smb2_context *smb2)
+{
+        struct smb2_flight *flight;
+
+        for (flight = smb2->flights; flight; flight = flight->next) {
+                flight->sealed = 1;
+        }
+}
+
+void
+smb2_flight_free_all(struct smb2_context *smb2)
+{
+        struct smb2_flight *flight;
+
+        while ((flight = smb2->flights) != NULL) {
+                smb2->flights = flight->next;
+                smb2_flight_free(flight);
+        }
+}
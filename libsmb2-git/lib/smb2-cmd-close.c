@@ -60,23 +60,11 @@ smb2_encode_close_request(struct smb2_context *smb2,
                           struct smb2_pdu *pdu,
                           struct smb2_close_request *req)
 {
-        int len;
-        uint8_t *buf;
-        struct smb2_iovec *iov;
-
-        len = SMB2_CLOSE_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
-                smb2_set_error(smb2, "Failed to allocate close buffer");
+        if (smb2_fixed_encode(smb2, pdu, SMB2_FIXED_CLOSE_REQUEST,
+                              req) == NULL) {
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
-        smb2_set_uint16(iov, 0, SMB2_CLOSE_REQUEST_SIZE);
-        smb2_set_uint16(iov, 2, req->flags);
-        memcpy(iov->buf + 8, req->file_id, SMB2_FD_SIZE);
-
         return 0;
 }
 
@@ -166,35 +154,13 @@ int
 smb2_process_close_fixed(struct smb2_context *smb2,
                          struct smb2_pdu *pdu)
 {
-        struct smb2_close_reply *rep;
         struct smb2_iovec *iov = &smb2->in.iov[smb2->in.niov - 1];
-        uint16_t struct_size;
-
-        smb2_get_uint16(iov, 0, &struct_size);
-        if (struct_size != SMB2_CLOSE_REPLY_SIZE ||
-            (struct_size & 0xfffe) != iov->len) {
-                smb2_set_error(smb2, "Unexpected size of Close "
-                               "reply. Expected %d, got %d",
-                               SMB2_CLOSE_REPLY_SIZE,
-                               (int)iov->len);
-                return -1;
-        }
 
-        rep = malloc(sizeof(*rep));
-        if (rep == NULL) {
-                smb2_set_error(smb2, "Failed to allocate close reply");
+        if (smb2_fixed_decode(smb2, SMB2_FIXED_CLOSE_REPLY, iov,
+                              &pdu->reply.close) < 0) {
                 return -1;
         }
-        pdu->payload = rep;
-
-        smb2_get_uint16(iov, 2, &rep->flags);
-        smb2_get_uint64(iov, 8, &rep->creation_time);
-        smb2_get_uint64(iov, 16, &rep->last_access_time);
-        smb2_get_uint64(iov, 24, &rep->last_write_time);
-        smb2_get_uint64(iov, 32, &rep->change_time);
-        smb2_get_uint64(iov, 40, &rep->allocation_size);
-        smb2_get_uint64(iov, 48, &rep->end_of_file);
-        smb2_get_uint32(iov, 56, &rep->file_attributes);
+        pdu->payload = &pdu->reply.close;
 
         return 0;
 }
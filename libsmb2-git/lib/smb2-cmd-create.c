@@ -177,6 +177,12 @@ smb2_cmd_create_async(struct smb2_context *smb2,
 {
         struct smb2_pdu *pdu;
 
+        /* Anything but a plain open may create, replace or delete */
+        if (req->create_disposition != SMB2_FILE_OPEN ||
+            (req->create_options & SMB2_FILE_DELETE_ON_CLOSE)) {
+                smb2_flight_seal(smb2);
+        }
+
         pdu = smb2_allocate_pdu(smb2, SMB2_CREATE, cb, cb_data);
         if (pdu == NULL) {
                 return NULL;
@@ -60,22 +60,11 @@ smb2_encode_flush_request(struct smb2_context *smb2,
                           struct smb2_pdu *pdu,
                           struct smb2_flush_request *req)
 {
-        int len;
-        uint8_t *buf;
-        struct smb2_iovec *iov;
-
-        len = SMB2_FLUSH_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
-                smb2_set_error(smb2, "Failed to allocate flush buffer");
+        if (smb2_fixed_encode(smb2, pdu, SMB2_FIXED_FLUSH_REQUEST,
+                              req) == NULL) {
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
-        smb2_set_uint16(iov, 0, SMB2_FLUSH_REQUEST_SIZE);
-        memcpy(iov->buf + 8, req->file_id, SMB2_FD_SIZE);
-
         return 0;
 }
 
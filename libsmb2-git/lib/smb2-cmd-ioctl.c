@@ -98,6 +98,8 @@ smb2_cmd_ioctl_async(struct smb2_context *smb2,
 {
         struct smb2_pdu *pdu;
 
+        smb2_flight_seal(smb2);
+
         pdu = smb2_allocate_pdu(smb2, SMB2_IOCTL, cb, cb_data);
         if (pdu == NULL) {
                 return NULL;
@@ -142,6 +144,12 @@ smb2_encode_ioctl_reply(struct smb2_context *smb2,
                         */
                         len = SMB2_IOCTL_VALIDIATE_NEGOTIATE_INFO_SIZE;
                         break;
+                case SMB2_FSCTL_SRV_REQUEST_RESUME_KEY:
+                case SMB2_FSCTL_SRV_COPYCHUNK:
+                case SMB2_FSCTL_SRV_COPYCHUNK_WRITE:
+                        /* coded by the server, see copychunk.c */
+                        len = rep->output_count;
+                        break;
                 default:
                         if (smb2->passthrough) {
                                 /* assume the replys output is already coded */
@@ -175,6 +183,11 @@ smb2_encode_ioctl_reply(struct smb2_context *smb2,
                         smb2_set_uint16(ioctlv, 22, info->dialect);
                         break;
                 }
+                case SMB2_FSCTL_SRV_REQUEST_RESUME_KEY:
+                case SMB2_FSCTL_SRV_COPYCHUNK:
+                case SMB2_FSCTL_SRV_COPYCHUNK_WRITE:
+                        memcpy(buf, rep->output, rep->output_count);
+                        break;
                 default:
                         if (smb2->passthrough) {
                                 memcpy(buf, rep->output, rep->output_count);
@@ -350,7 +363,8 @@ smb2_process_ioctl_request_fixed(struct smb2_context *smb2,
                 return -1;
         }
 
-        req = malloc(sizeof(*req));
+        /* zeroed: req->input stays NULL without input */
+        req = calloc(1, sizeof(*req));
         if (req == NULL) {
                 smb2_set_error(smb2, "Failed to allocate ioctl request");
                 return -1;
@@ -414,6 +428,16 @@ smb2_process_ioctl_request_variable(struct smb2_context *smb2,
                 smb2_get_uint16(&vec, 22, &info->dialect);
                 req->input_count = sizeof(struct smb2_ioctl_validate_negotiate_info);
                 break;
+        case SMB2_FSCTL_SRV_COPYCHUNK:
+        case SMB2_FSCTL_SRV_COPYCHUNK_WRITE:
+                /* decoded by the server, see copychunk.c */
+                ptr = smb2_alloc_init(smb2, vec.len);
+                if (ptr == NULL) {
+                        return -ENOMEM;
+                }
+                memcpy(ptr, vec.buf, vec.len);
+                req->input_count = vec.len;
+                break;
         default:
                 if (smb2->passthrough) {
                         /* dont know how to handle this, let user decode it */
@@ -127,7 +127,8 @@ smb2_encode_change_notify_reply(struct smb2_context *smb2,
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
 
         smb2_set_uint16(iov, 0, SMB2_CHANGE_NOTIFY_REPLY_SIZE);
-        rep->output_buffer_offset = SMB2_HEADER_SIZE + SMB2_CHANGE_NOTIFY_REQUEST_SIZE;
+        rep->output_buffer_offset = SMB2_HEADER_SIZE +
+                (SMB2_CHANGE_NOTIFY_REPLY_SIZE & 0xfffe);
         smb2_set_uint16(iov, 2, rep->output_buffer_offset);
         smb2_set_uint32(iov, 4, rep->output_buffer_length);
 
@@ -148,14 +149,15 @@ smb2_encode_change_notify_reply(struct smb2_context *smb2,
                                         len,
                                         free);
 
-        if (smb2->passthrough) {
+        /* passed through, or packed by notify.c */
+        if (rep->output != NULL) {
                 memcpy(buf, rep->output, rep->output_buffer_length);
                 memset(buf + rep->output_buffer_length, 0, len - rep->output_buffer_length);
                 iov->len = rep->output_buffer_length;
         }
         else {
-                smb2_set_error(smb2, "Change-notify buffer "
-                                "packing not implemented");
+                smb2_set_error(smb2, "Change-notify reply has no "
+                                "output buffer");
                 return -1;
         }
 
@@ -60,35 +60,17 @@ smb2_encode_query_info_request(struct smb2_context *smb2,
                                struct smb2_pdu *pdu,
                                struct smb2_query_info_request *req)
 {
-        int len;
-        uint8_t *buf;
-        struct smb2_iovec *iov;
-
         if (req->input_buffer_length > 0) {
                 smb2_set_error(smb2, "No support for input buffers, yet");
                 return -1;
         }
 
-        len = SMB2_QUERY_INFO_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
-                smb2_set_error(smb2, "Failed to allocate query buffer");
+        req->input_buffer_offset = SMB2_HEADER_SIZE + (SMB2_QUERY_INFO_REQUEST_SIZE & 0xfffe);
+        if (smb2_fixed_encode(smb2, pdu, SMB2_FIXED_QUERY_INFO_REQUEST,
+                              req) == NULL) {
                 return -1;
         }
 
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
-        smb2_set_uint16(iov, 0, SMB2_QUERY_INFO_REQUEST_SIZE);
-        smb2_set_uint8(iov, 2, req->info_type);
-        smb2_set_uint8(iov, 3, req->file_info_class);
-        smb2_set_uint32(iov,4, req->output_buffer_length);
-        req->input_buffer_offset = SMB2_HEADER_SIZE + (SMB2_QUERY_INFO_REQUEST_SIZE & 0xfffe);
-        smb2_set_uint16(iov,8, req->input_buffer_offset);
-        smb2_set_uint32(iov,12, req->input_buffer_length);
-        smb2_set_uint32(iov,16, req->additional_information);
-        smb2_set_uint32(iov,20, req->flags);
-        memcpy(iov->buf + 24, req->file_id, SMB2_FD_SIZE);
-
         /* Remember what we asked for so that we can unmarshall the reply */
         pdu->info_type       = req->info_type;
         pdu->file_info_class = req->file_info_class;
@@ -468,6 +450,15 @@ int smb2_process_query_info_variable(struct smb2_context *smb2,
                 case SMB2_FILE_EA_INFORMATION:
                         break;
                 case SMB2_FILE_FULL_EA_INFORMATION:
+                        /* every entry takes at least 9 bytes */
+                        ptr = smb2_alloc_init(smb2, (1 + (vec.len / 9)) * sizeof(struct smb2_file_full_ea_info));
+                        if (smb2_decode_file_full_ea_info(smb2, ptr, ptr,
+                                                          &vec)) {
+                                smb2_set_error(smb2, "could not decode file "
+                                               "full ea info. %s",
+                                               smb2_get_error(smb2));
+                                return -1;
+                        }
                         break;
                 case SMB2_FILE_ID_INFORMATION:
                         break;
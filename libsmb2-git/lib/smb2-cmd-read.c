@@ -64,28 +64,14 @@ smb2_encode_read_request(struct smb2_context *smb2,
         uint8_t *buf;
         struct smb2_iovec *iov;
 
-        len = SMB2_READ_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
-                smb2_set_error(smb2, "Failed to allocate read buffer");
-                return -1;
-        }
-
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         if (!smb2->supports_multi_credit && req->length > 64 * 1024) {
                 req->length = 64 * 1024;
                 req->minimum_count = 0;
         }
-        smb2_set_uint16(iov, 0, SMB2_READ_REQUEST_SIZE);
-        smb2_set_uint8(iov, 3, req->flags);
-        smb2_set_uint32(iov, 4, req->length);
-        smb2_set_uint64(iov, 8, req->offset);
-        memcpy(iov->buf + 16, req->file_id, SMB2_FD_SIZE);
-        smb2_set_uint32(iov, 32, req->minimum_count);
-        smb2_set_uint32(iov, 36, req->channel);
-        smb2_set_uint32(iov, 40, req->remaining_bytes);
-        smb2_set_uint16(iov, 46, req->read_channel_info_length);
+        iov = smb2_fixed_encode(smb2, pdu, SMB2_FIXED_READ_REQUEST, req);
+        if (iov == NULL) {
+                return -1;
+        }
 
         if (req->read_channel_info_length > 0 &&
             req->read_channel_info != NULL) {
@@ -126,12 +112,15 @@ smb2_encode_read_request(struct smb2_context *smb2,
         return 0;
 }
 
-struct smb2_pdu *
-smb2_cmd_read_async(struct smb2_context *smb2,
-                    struct smb2_read_request *req,
-                    smb2_command_cb cb, void *cb_data)
+static struct smb2_pdu *
+smb2_cmd_read_vec(struct smb2_context *smb2,
+                  struct smb2_read_request *req,
+                  const struct smb2_iovec *vec, int nvec,
+                  smb2_command_cb cb, void *cb_data)
 {
         struct smb2_pdu *pdu;
+        size_t len, remaining;
+        int i;
 
         pdu = smb2_allocate_pdu(smb2, SMB2_READ, cb, cb_data);
         if (pdu == NULL) {
@@ -143,16 +132,26 @@ smb2_cmd_read_async(struct smb2_context *smb2,
                 return NULL;
         }
 
-        /* Add a vector for the reply buffer that the application gave us */
-        if (req->length) {
-                if (!req->buf) {
-                        /* need a place to put read data, so fail if app doesn't supply one */
-                        smb2_set_error(smb2, "No buffer for read reply data");
-                        smb2_free_pdu(smb2, pdu);
-                        return NULL;
+        /* Add vectors for the reply buffers that the application gave us,
+         * the payload is scattered straight into them as it is received.
+         */
+        remaining = req->length;
+        for (i = 0; i < nvec && remaining; i++) {
+                len = vec[i].len;
+                if (len > remaining) {
+                        len = remaining;
                 }
-
-                smb2_add_iovector(smb2, &pdu->in, req->buf, req->length, NULL);
+                if (len == 0) {
+                        continue;
+                }
+                smb2_add_iovector(smb2, &pdu->in, vec[i].buf, len, NULL);
+                remaining -= len;
+        }
+        if (remaining) {
+                /* need a place to put read data, so fail if app doesn't supply one */
+                smb2_set_error(smb2, "No buffer for read reply data");
+                smb2_free_pdu(smb2, pdu);
+                return NULL;
         }
 
         if (smb2_pad_to_64bit(smb2, &pdu->out) != 0) {
@@ -168,6 +167,34 @@ smb2_cmd_read_async(struct smb2_context *smb2,
         return pdu;
 }
 
+struct smb2_pdu *
+smb2_cmd_read_async(struct smb2_context *smb2,
+                    struct smb2_read_request *req,
+                    smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_iovec vec;
+
+        vec.buf = req->buf;
+        vec.len = req->buf ? req->length : 0;
+        vec.free = NULL;
+
+        return smb2_cmd_read_vec(smb2, req, &vec, 1, cb, cb_data);
+}
+
+struct smb2_pdu *
+smb2_cmd_readv_async(struct smb2_context *smb2,
+                     struct smb2_read_request *req,
+                     const struct smb2_iovec *vec, int nvec,
+                     smb2_command_cb cb, void *cb_data)
+{
+        if (nvec < 0 || nvec > SMB2_MAX_IO_SEGMENTS) {
+                smb2_set_error(smb2, "Too many read segments: %d", nvec);
+                return NULL;
+        }
+
+        return smb2_cmd_read_vec(smb2, req, vec, nvec, cb, cb_data);
+}
+
 static int
 smb2_encode_read_reply(struct smb2_context *smb2,
                          struct smb2_pdu *pdu,
@@ -231,30 +258,14 @@ int
 smb2_process_read_fixed(struct smb2_context *smb2,
                         struct smb2_pdu *pdu)
 {
-        struct smb2_read_reply *rep;
+        struct smb2_read_reply *rep = &pdu->reply.read;
         struct smb2_iovec *iov = &smb2->in.iov[smb2->in.niov - 1];
-        uint16_t struct_size;
-
-        smb2_get_uint16(iov, 0, &struct_size);
-        if (struct_size > SMB2_READ_REPLY_SIZE) {
-                smb2_set_error(smb2, "Unexpected size of Read "
-                               "reply. Expected %d, got %d",
-                               SMB2_READ_REPLY_SIZE,
-                               (int)iov->len);
-                return -1;
-        }
 
-        rep = malloc(sizeof(*rep));
-        if (rep == NULL) {
-                smb2_set_error(smb2, "Failed to allocate read reply");
+        if (smb2_fixed_decode(smb2, SMB2_FIXED_READ_REPLY, iov, rep) < 0) {
                 return -1;
         }
         pdu->payload = rep;
 
-        smb2_get_uint8(iov, 2, &rep->data_offset);
-        smb2_get_uint32(iov, 4, &rep->data_length);
-        smb2_get_uint32(iov, 8, &rep->data_remaining);
-
         rep->data = NULL;
         if (rep->data_length == 0) {
                 return 0;
@@ -265,7 +276,6 @@ smb2_process_read_fixed(struct smb2_context *smb2,
                                "Expected %d, got %d",
                                SMB2_HEADER_SIZE + 16, rep->data_offset);
                 pdu->payload = NULL;
-                free(rep);
                 return -1;
         }
 
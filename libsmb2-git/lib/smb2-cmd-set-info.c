@@ -69,21 +69,11 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
         struct smb2_file_rename_info *rni;
         struct smb2_utf16 *name;
 
-        len = SMB2_SET_INFO_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
-                smb2_set_error(smb2, "Failed to allocate set info buffer");
+        iov = smb2_fixed_encode(smb2, pdu, SMB2_FIXED_SET_INFO_REQUEST, req);
+        if (iov == NULL) {
                 return -1;
         }
-
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
-        smb2_set_uint16(iov, 0, SMB2_SET_INFO_REQUEST_SIZE);
-        smb2_set_uint8(iov, 2, req->info_type);
-        smb2_set_uint8(iov, 3, req->file_info_class);
         smb2_set_uint16(iov,8, SMB2_HEADER_SIZE + 32); /* buffer offset */
-        smb2_set_uint32(iov,12, req->additional_information);
-        memcpy(iov->buf + 16, req->file_id, SMB2_FD_SIZE);
 
         if (smb2->passthrough) {
                 if (req->buffer_length) {
@@ -169,6 +159,23 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
                         memcpy(iov->buf + 20, name->val, name->len * 2);
                         free(name);
 
+                        break;
+                case SMB2_FILE_FULL_EA_INFORMATION:
+                        len = smb2_file_full_ea_info_length(req->input_data);
+                        smb2_set_uint32(iov, 4, len); /* buffer length */
+
+                        buf = calloc(len, sizeof(uint8_t));
+                        if (buf == NULL) {
+                                smb2_set_error(smb2, "Failed to allocate set "
+                                               "info data buffer");
+                                return -1;
+                        }
+                        iov = smb2_add_iovector(smb2, &pdu->out, buf, len,
+                                                free);
+                        if (smb2_encode_file_full_ea_info(smb2,
+                                        req->input_data, iov) < 0) {
+                                return -1;
+                        }
                         break;
                 case SMB2_FILE_DISPOSITION_INFORMATION:
                         len = 1;
@@ -211,6 +218,8 @@ smb2_cmd_set_info_async(struct smb2_context *smb2,
 {
         struct smb2_pdu *pdu;
 
+        smb2_flight_seal(smb2);
+
         pdu = smb2_allocate_pdu(smb2, SMB2_SET_INFO, cb, cb_data);
         if (pdu == NULL) {
                 return NULL;
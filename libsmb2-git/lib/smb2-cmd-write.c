@@ -64,27 +64,14 @@ smb2_encode_write_request(struct smb2_context *smb2,
         uint8_t *buf;
         struct smb2_iovec *iov;
 
-        len = SMB2_WRITE_REQUEST_SIZE & 0xfffffffe;
-        buf = calloc(len, sizeof(uint8_t));
-        if (buf == NULL) {
-                smb2_set_error(smb2, "Failed to allocate write buffer");
-                return -1;
-        }
-
-        iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
-
         if (!smb2->supports_multi_credit && req->length > 64 * 1024) {
                 req->length = 64 * 1024;
         }
-        smb2_set_uint16(iov, 0, SMB2_WRITE_REQUEST_SIZE);
+        iov = smb2_fixed_encode(smb2, pdu, SMB2_FIXED_WRITE_REQUEST, req);
+        if (iov == NULL) {
+                return -1;
+        }
         smb2_set_uint16(iov, 2, SMB2_HEADER_SIZE + 48);
-        smb2_set_uint32(iov, 4, req->length);
-        smb2_set_uint64(iov, 8, req->offset);
-        memcpy(iov->buf + 16, req->file_id, SMB2_FD_SIZE);
-        smb2_set_uint32(iov, 32, req->channel);
-        smb2_set_uint32(iov, 36, req->remaining_bytes);
-        smb2_set_uint16(iov, 42, req->write_channel_info_length);
-        smb2_set_uint32(iov, 44, req->flags);
 
         if (req->write_channel_info_length > 0 &&
             req->write_channel_info != NULL) {
@@ -124,6 +111,8 @@ smb2_cmd_write_async(struct smb2_context *smb2,
 {
         struct smb2_pdu *pdu;
 
+        smb2_flight_seal(smb2);
+
         pdu = smb2_allocate_pdu(smb2, SMB2_WRITE, cb, cb_data);
         if (pdu == NULL) {
                 return NULL;
@@ -141,6 +130,68 @@ smb2_cmd_write_async(struct smb2_context *smb2,
 
         smb2_add_iovector(smb2, &pdu->out, (uint8_t*)req->buf,
                         req->length, pass_buf_ownership ? free : NULL);
+        pdu->out_data_len = req->length;
+
+        /* Adjust credit charge for large payloads */
+        if (smb2->supports_multi_credit) {
+                pdu->header.credit_charge = (req->length - 1) / 65536 + 1; /* 3.1.5.2 of [MS-SMB2] */
+        }
+
+        return pdu;
+}
+
+struct smb2_pdu *
+smb2_cmd_writev_async(struct smb2_context *smb2,
+                      struct smb2_write_request *req,
+                      const struct smb2_iovec *vec, int nvec,
+                      smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_pdu *pdu;
+        size_t len, remaining;
+        int i;
+
+        if (nvec < 0 || nvec > SMB2_MAX_IO_SEGMENTS) {
+                smb2_set_error(smb2, "Too many write segments: %d", nvec);
+                return NULL;
+        }
+
+        smb2_flight_seal(smb2);
+
+        pdu = smb2_allocate_pdu(smb2, SMB2_WRITE, cb, cb_data);
+        if (pdu == NULL) {
+                return NULL;
+        }
+
+        if (smb2_encode_write_request(smb2, pdu, req)) {
+                smb2_free_pdu(smb2, pdu);
+                return NULL;
+        }
+
+        if (smb2_pad_to_64bit(smb2, &pdu->out) != 0) {
+                smb2_free_pdu(smb2, pdu);
+                return NULL;
+        }
+
+        /* Gather the payload straight from the application's buffers */
+        remaining = req->length;
+        for (i = 0; i < nvec && remaining; i++) {
+                len = vec[i].len;
+                if (len > remaining) {
+                        len = remaining;
+                }
+                if (len == 0) {
+                        continue;
+                }
+                smb2_add_iovector(smb2, &pdu->out, vec[i].buf, len, NULL);
+                remaining -= len;
+        }
+        if (remaining) {
+                smb2_set_error(smb2, "Write segments are shorter than "
+                               "the write length");
+                smb2_free_pdu(smb2, pdu);
+                return NULL;
+        }
+        pdu->out_data_len = req->length;
 
         /* Adjust credit charge for large payloads */
         if (smb2->supports_multi_credit) {
@@ -204,29 +255,13 @@ int
 smb2_process_write_fixed(struct smb2_context *smb2,
                          struct smb2_pdu *pdu)
 {
-        struct smb2_write_reply *rep;
         struct smb2_iovec *iov = &smb2->in.iov[smb2->in.niov - 1];
-        uint16_t struct_size;
 
-        smb2_get_uint16(iov, 0, &struct_size);
-        if (struct_size != SMB2_WRITE_REPLY_SIZE ||
-            (struct_size & 0xfffe) != iov->len) {
-                smb2_set_error(smb2, "Unexpected size of Write "
-                               "reply. Expected %d, got %d",
-                               SMB2_WRITE_REPLY_SIZE,
-                               (int)iov->len);
+        if (smb2_fixed_decode(smb2, SMB2_FIXED_WRITE_REPLY, iov,
+                              &pdu->reply.write) < 0) {
                 return -1;
         }
-
-        rep = malloc(sizeof(*rep));
-        if (rep == NULL) {
-                smb2_set_error(smb2, "Failed to allocate write reply");
-                return -1;
-        }
-        pdu->payload = rep;
-
-        smb2_get_uint32(iov, 4, &rep->count);
-        smb2_get_uint32(iov, 8, &rep->remaining);
+        pdu->payload = &pdu->reply.write;
 
         return 0;
 }
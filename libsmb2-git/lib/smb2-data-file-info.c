@@ -260,6 +260,130 @@ smb2_encode_file_stream_info(struct smb2_context *smb2,
         return (int)offset;
 }
 
+/* In the decoded array next_entry_offset is non-zero if another entry
+ * follows the current one.
+ */
+int
+smb2_decode_file_full_ea_info(struct smb2_context *smb2,
+                              void *memctx,
+                              struct smb2_file_full_ea_info *fs,
+                              struct smb2_iovec *vec)
+{
+        uint32_t offset = 0;
+        uint32_t next_offset;
+        uint8_t *name, *value;
+
+        do {
+                if (offset + 8 > vec->len) {
+                        smb2_set_error(smb2, "Malformed EA information");
+                        return -1;
+                }
+                smb2_get_uint32(vec, offset + 0, &next_offset);
+                smb2_get_uint8(vec, offset + 4, &fs->flags);
+                smb2_get_uint8(vec, offset + 5, &fs->ea_name_length);
+                smb2_get_uint16(vec, offset + 6, &fs->ea_value_length);
+
+                /* the name is followed by a NUL and then the value */
+                if (offset + 8 + fs->ea_name_length + 1 +
+                    fs->ea_value_length > vec->len) {
+                        smb2_set_error(smb2, "EA extends beyond end of "
+                                       "buffer");
+                        return -1;
+                }
+                if (next_offset && next_offset < 8U + fs->ea_name_length + 1 +
+                    fs->ea_value_length) {
+                        smb2_set_error(smb2, "EA overlaps the next one");
+                        return -1;
+                }
+
+                name = smb2_alloc_data(smb2, memctx, fs->ea_name_length + 1);
+                if (name == NULL) {
+                        return -1;
+                }
+                memcpy(name, &vec->buf[offset + 8], fs->ea_name_length);
+                name[fs->ea_name_length] = 0;
+                fs->ea_name = (const char *)name;
+
+                value = NULL;
+                if (fs->ea_value_length) {
+                        value = smb2_alloc_data(smb2, memctx,
+                                                fs->ea_value_length);
+                        if (value == NULL) {
+                                return -1;
+                        }
+                        memcpy(value,
+                               &vec->buf[offset + 8 + fs->ea_name_length + 1],
+                               fs->ea_value_length);
+                }
+                fs->ea_value = value;
+
+                fs->next_entry_offset = next_offset ?
+                        sizeof(struct smb2_file_full_ea_info) : 0;
+                offset += next_offset;
+                fs++;
+        } while (next_offset);
+
+        return 0;
+}
+
+/* The number of bytes smb2_encode_file_full_ea_info() needs */
+int
+smb2_file_full_ea_info_length(struct smb2_file_full_ea_info *fs)
+{
+        int len = 0;
+
+        for (;;) {
+                len += 8 + fs->ea_name_length + 1 + fs->ea_value_length;
+                if (fs->next_entry_offset == 0) {
+                        break;
+                }
+                len = PAD_TO_32BIT(len);
+                fs++;
+        }
+
+        return len;
+}
+
+int
+smb2_encode_file_full_ea_info(struct smb2_context *smb2,
+                              struct smb2_file_full_ea_info *fs,
+                              struct smb2_iovec *vec)
+{
+        uint32_t offset = 0;
+        uint32_t len;
+
+        for (;;) {
+                len = 8 + fs->ea_name_length + 1 + fs->ea_value_length;
+                if (offset + len > vec->len) {
+                        smb2_set_error(smb2, "EA list does not fit the "
+                                       "buffer");
+                        return -1;
+                }
+                smb2_set_uint8(vec, offset + 4, fs->flags);
+                smb2_set_uint8(vec, offset + 5, fs->ea_name_length);
+                smb2_set_uint16(vec, offset + 6, fs->ea_value_length);
+                memcpy(&vec->buf[offset + 8], fs->ea_name,
+                       fs->ea_name_length);
+                vec->buf[offset + 8 + fs->ea_name_length] = 0;
+                if (fs->ea_value_length) {
+                        memcpy(&vec->buf[offset + 8 + fs->ea_name_length + 1],
+                               fs->ea_value, fs->ea_value_length);
+                }
+
+                if (fs->next_entry_offset == 0) {
+                        smb2_set_uint32(vec, offset + 0, 0);
+                        offset += len;
+                        break;
+                }
+                len = PAD_TO_32BIT(len);
+                smb2_set_uint32(vec, offset + 0, len);
+                offset += len;
+                fs++;
+        }
+
+        return (int)offset;
+}
+
 int
 smb2_decode_file_position_info(struct smb2_context *smb2,
                                void *memctx,
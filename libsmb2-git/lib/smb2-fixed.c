@@ -0,0 +1,271 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+#include "portable-endian.h"
+
+/*
+ * Table driven encoding and decoding of the fixed part of requests and
+ * replies.
+ *
+ * Each layout lists where the members of the request or reply struct go in
+ * the fixed part on the wire. Encoding writes straight into the buffer in
+ * the pdu and decoding reads straight into the reply storage in the pdu, so
+ * neither allocates anything, and the length is checked once per structure
+ * instead of once per field.
+ *
+ * Only the structures on the data path are described here, the others are
+ * still encoded and decoded by hand in their smb2-cmd-*.c file.
+ */
+
+struct smb2_field {
+        uint8_t wire;           /* offset in the fixed part */
+        uint8_t size;           /* 1, 2, 4, 8 or SMB2_FD_SIZE bytes */
+        uint16_t member;        /* offsetof() the member */
+};
+
+struct smb2_fixed_layout {
+        const char *name;
+        uint16_t struct_size;   /* the StructureSize of the command */
+        uint16_t nfields;
+        const struct smb2_field *fields;
+};
+
+#define FIELD(wire, type, member, size) \
+        { wire, size, offsetof(struct type, member) }
+#define LAYOUT(name, size, fields) \
+        { name, size, sizeof(fields) / sizeof(fields[0]), fields }
+
+static const struct smb2_field close_request[] = {
+        FIELD( 2, smb2_close_request, flags,            2),
+        FIELD( 8, smb2_close_request, file_id,          SMB2_FD_SIZE),
+};
+
+static const struct smb2_field close_reply[] = {
+        FIELD( 2, smb2_close_reply, flags,              2),
+        FIELD( 8, smb2_close_reply, creation_time,      8),
+        FIELD(16, smb2_close_reply, last_access_time,   8),
+        FIELD(24, smb2_close_reply, last_write_time,    8),
+        FIELD(32, smb2_close_reply, change_time,        8),
+        FIELD(40, smb2_close_reply, allocation_size,    8),
+        FIELD(48, smb2_close_reply, end_of_file,        8),
+        FIELD(56, smb2_close_reply, file_attributes,    4),
+};
+
+static const struct smb2_field flush_request[] = {
+        FIELD( 8, smb2_flush_request, file_id,          SMB2_FD_SIZE),
+};
+
+static const struct smb2_field read_request[] = {
+        FIELD( 3, smb2_read_request, flags,             1),
+        FIELD( 4, smb2_read_request, length,            4),
+        FIELD( 8, smb2_read_request, offset,            8),
+        FIELD(16, smb2_read_request, file_id,           SMB2_FD_SIZE),
+        FIELD(32, smb2_read_request, minimum_count,     4),
+        FIELD(36, smb2_read_request, channel,           4),
+        FIELD(40, smb2_read_request, remaining_bytes,   4),
+        FIELD(46, smb2_read_request, read_channel_info_length, 2),
+};
+
+static const struct smb2_field read_reply[] = {
+        FIELD( 2, smb2_read_reply, data_offset,         1),
+        FIELD( 4, smb2_read_reply, data_length,         4),
+        FIELD( 8, smb2_read_reply, data_remaining,      4),
+};
+
+static const struct smb2_field write_request[] = {
+        FIELD( 4, smb2_write_request, length,           4),
+        FIELD( 8, smb2_write_request, offset,           8),
+        FIELD(16, smb2_write_request, file_id,          SMB2_FD_SIZE),
+        FIELD(32, smb2_write_request, channel,          4),
+        FIELD(36, smb2_write_request, remaining_bytes,  4),
+        FIELD(42, smb2_write_request, write_channel_info_length, 2),
+        FIELD(44, smb2_write_request, flags,            4),
+};
+
+static const struct smb2_field write_reply[] = {
+        FIELD( 4, smb2_write_reply, count,              4),
+        FIELD( 8, smb2_write_reply, remaining,          4),
+};
+
+static const struct smb2_field query_info_request[] = {
+        FIELD( 2, smb2_query_info_request, info_type,   1),
+        FIELD( 3, smb2_query_info_request, file_info_class, 1),
+        FIELD( 4, smb2_query_info_request, output_buffer_length, 4),
+        FIELD( 8, smb2_query_info_request, input_buffer_offset, 2),
+        FIELD(12, smb2_query_info_request, input_buffer_length, 4),
+        FIELD(16, smb2_query_info_request, additional_information, 4),
+        FIELD(20, smb2_query_info_request, flags,       4),
+        FIELD(24, smb2_query_info_request, file_id,     SMB2_FD_SIZE),
+};
+
+static const struct smb2_field set_info_request[] = {
+        FIELD( 2, smb2_set_info_request, info_type,     1),
+        FIELD( 3, smb2_set_info_request, file_info_class, 1),
+        FIELD(12, smb2_set_info_request, additional_information, 4),
+        FIELD(16, smb2_set_info_request, file_id,       SMB2_FD_SIZE),
+};
+
+/* In the order of enum smb2_fixed_type */
+static const struct smb2_fixed_layout smb2_fixed_layouts[SMB2_FIXED_MAX] = {
+        LAYOUT("Close request", SMB2_CLOSE_REQUEST_SIZE, close_request),
+        LAYOUT("Close reply", SMB2_CLOSE_REPLY_SIZE, close_reply),
+        LAYOUT("Flush request", SMB2_FLUSH_REQUEST_SIZE, flush_request),
+        LAYOUT("Read request", SMB2_READ_REQUEST_SIZE, read_request),
+        LAYOUT("Read reply", SMB2_READ_REPLY_SIZE, read_reply),
+        LAYOUT("Write request", SMB2_WRITE_REQUEST_SIZE, write_request),
+        LAYOUT("Write reply", SMB2_WRITE_REPLY_SIZE, write_reply),
+        LAYOUT("Query Info request", SMB2_QUERY_INFO_REQUEST_SIZE,
+               query_info_request),
+        LAYOUT("Set Info request", SMB2_SET_INFO_REQUEST_SIZE,
+               set_info_request),
+};
+
+struct smb2_iovec *
+smb2_fixed_encode(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                  enum smb2_fixed_type type, const void *src)
+{
+        const struct smb2_fixed_layout *layout = &smb2_fixed_layouts[type];
+        const struct smb2_field *field;
+        const uint8_t *s = src;
+        uint8_t *buf = pdu->fixed;
+        size_t len = layout->struct_size & 0xfffe;
+        uint16_t u16;
+        uint32_t u32;
+        uint64_t u64;
+        int i;
+
+        if (len > sizeof(pdu->fixed)) {
+                smb2_set_error(smb2, "Fixed part of %d bytes does not fit "
+                               "the pdu", (int)len);
+                return NULL;
+        }
+
+        memset(buf, 0, len);
+        u16 = htole16(layout->struct_size);
+        memcpy(buf, &u16, 2);
+
+        /* The wire buffer need not be aligned, so go through memcpy() like
+         * smb2_get_uint*() do, the compiler turns these into plain moves.
+         */
+        for (i = 0, field = layout->fields; i < layout->nfields; i++, field++) {
+                uint8_t *d = buf + field->wire;
+                const uint8_t *m = s + field->member;
+
+                switch (field->size) {
+                case 1:
+                        *d = *m;
+                        break;
+                case 2:
+                        u16 = htole16(*(const uint16_t *)(const void *)m);
+                        memcpy(d, &u16, 2);
+                        break;
+                case 4:
+                        u32 = htole32(*(const uint32_t *)(const void *)m);
+                        memcpy(d, &u32, 4);
+                        break;
+                case 8:
+                        u64 = htole64(*(const uint64_t *)(const void *)m);
+                        memcpy(d, &u64, 8);
+                        break;
+                default:
+                        memcpy(d, m, field->size);
+                        break;
+                }
+        }
+
+        return smb2_add_iovector(smb2, &pdu->out, buf, len, NULL);
+}
+
+int
+smb2_fixed_decode(struct smb2_context *smb2, enum smb2_fixed_type type,
+                  const struct smb2_iovec *iov, void *dst)
+{
+        const struct smb2_fixed_layout *layout = &smb2_fixed_layouts[type];
+        const struct smb2_field *field;
+        uint8_t *d = dst;
+        size_t len = layout->struct_size & 0xfffe;
+        uint16_t u16 = 0;
+        uint32_t u32;
+        uint64_t u64;
+        int i;
+
+        if (iov->len >= 2) {
+                memcpy(&u16, iov->buf, 2);
+        }
+        if (iov->len < len || le16toh(u16) != layout->struct_size) {
+                smb2_set_error(smb2, "Unexpected size of %s. "
+                               "Expected %d, got %d",
+                               layout->name,
+                               (int)layout->struct_size, (int)iov->len);
+                return -1;
+        }
+
+        for (i = 0, field = layout->fields; i < layout->nfields; i++, field++) {
+                const uint8_t *s = iov->buf + field->wire;
+                uint8_t *m = d + field->member;
+
+                switch (field->size) {
+                case 1:
+                        *m = *s;
+                        break;
+                case 2:
+                        memcpy(&u16, s, 2);
+                        *(uint16_t *)(void *)m = le16toh(u16);
+                        break;
+                case 4:
+                        memcpy(&u32, s, 4);
+                        *(uint32_t *)(void *)m = le32toh(u32);
+                        break;
+                case 8:
+                        memcpy(&u64, s, 8);
+                        *(uint64_t *)(void *)m = le64toh(u64);
+                        break;
+                default:
+                        memcpy(m, s, field->size);
+                        break;
+                }
+        }
+
+        return 0;
+}
@@ -98,9 +98,23 @@ void aes_cmac_xor(
         }
 }
 
+/*
+ * AES-CMAC ([RFC 4493]) over the vectors of a PDU as they are, without
+ * copying them into one buffer first. The last block of a message is
+ * treated differently, so the final 1-16 bytes seen are held back until it
+ * is known whether more follow. Every whole block before them goes through
+ * straight from the vector it is in.
+ */
+struct aes_cmac {
+        const uint8_t *round_keys;
+        uint8_t mac[AES_BLOCK_SIZE];
+        uint8_t last[AES_BLOCK_SIZE];
+        size_t last_len;
+};
+
 static
 void aes_cmac_sub_keys(
-    uint8_t key[AES128_KEY_LEN],
+    const uint8_t *round_keys,
     uint8_t sub_key1[AES128_KEY_LEN],
     uint8_t sub_key2[AES128_KEY_LEN]
     )
@@ -108,7 +122,7 @@ void aes_cmac_sub_keys(
         uint8_t zero[AES128_KEY_LEN] = {0};
         static const uint8_t rb[AES128_KEY_LEN] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x87};
 
-        AES128_ECB_encrypt(zero, key, sub_key1);
+        AES128_ECB_encrypt_expanded(zero, round_keys, sub_key1);
         if (aes_cmac_shift_left(sub_key1)) {
                 aes_cmac_xor(sub_key1, rb);
         }
@@ -120,47 +134,98 @@ void aes_cmac_sub_keys(
         }
 }
 
-void smb3_aes_cmac_128(uint8_t key[AES128_KEY_LEN],
-                   uint8_t * msg,
-                   uint64_t msg_len,
-                   uint8_t mac[AES128_KEY_LEN]
-                  )
+static void
+aes_cmac_init(struct aes_cmac *cmac, const uint8_t *round_keys)
+{
+        cmac->round_keys = round_keys;
+        memset(cmac->mac, 0, AES_BLOCK_SIZE);
+        cmac->last_len = 0;
+}
+
+static void
+aes_cmac_update(struct aes_cmac *cmac, const uint8_t *msg, size_t len)
+{
+        size_t n;
+
+        while (len) {
+                if (cmac->last_len == AES_BLOCK_SIZE) {
+                        /* more follows, so it was not the last block */
+                        aes_cmac_xor(cmac->mac, cmac->last);
+                        AES128_ECB_encrypt_expanded(cmac->mac,
+                                                    cmac->round_keys,
+                                                    cmac->mac);
+                        cmac->last_len = 0;
+                }
+                if (cmac->last_len == 0 && len > AES_BLOCK_SIZE) {
+                        aes_cmac_xor(cmac->mac, msg);
+                        AES128_ECB_encrypt_expanded(cmac->mac,
+                                                    cmac->round_keys,
+                                                    cmac->mac);
+                        msg += AES_BLOCK_SIZE;
+                        len -= AES_BLOCK_SIZE;
+                        continue;
+                }
+                n = AES_BLOCK_SIZE - cmac->last_len;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(&cmac->last[cmac->last_len], msg, n);
+                cmac->last_len += n;
+                msg += n;
+                len -= n;
+        }
+}
+
+static void
+aes_cmac_final(struct aes_cmac *cmac, uint8_t mac[AES128_KEY_LEN])
 {
         uint8_t sub_key1[AES128_KEY_LEN] = {0};
         uint8_t sub_key2[AES128_KEY_LEN] = {0};
-        uint8_t scratch[AES128_KEY_LEN] = {0};
-        uint64_t n = (msg_len + AES128_KEY_LEN - 1) / AES128_KEY_LEN;
-        uint64_t rem = msg_len % AES128_KEY_LEN;
-        uint64_t i = 0;
-        int is_last_block_complete = n != 0 && rem == 0;
-
-        if (n == 0) {
-                n = 1;
+
+        aes_cmac_sub_keys(cmac->round_keys, sub_key1, sub_key2);
+
+        if (cmac->last_len == AES_BLOCK_SIZE) {
+                aes_cmac_xor(cmac->last, sub_key1);
+        } else {
+                cmac->last[cmac->last_len] = 0x80;
+                memset(&cmac->last[cmac->last_len + 1], 0,
+                       AES_BLOCK_SIZE - (cmac->last_len + 1));
+                aes_cmac_xor(cmac->last, sub_key2);
         }
 
-        aes_cmac_sub_keys(key, sub_key1, sub_key2);
+        aes_cmac_xor(cmac->mac, cmac->last);
+        AES128_ECB_encrypt_expanded(cmac->mac, cmac->round_keys, mac);
+}
 
-        memset(mac, 0, AES128_KEY_LEN);
+void smb3_aes_cmac_128(uint8_t key[AES128_KEY_LEN],
+                   uint8_t * msg,
+                   uint64_t msg_len,
+                   uint8_t mac[AES128_KEY_LEN]
+                  )
+{
+        uint8_t round_keys[AES128_ROUND_KEYS_SIZE];
+        struct aes_cmac cmac;
 
-        for (i = 0; i < n - 1; i++) {
-                aes_cmac_xor(mac, &msg[i*AES128_KEY_LEN]);
-                AES128_ECB_encrypt(mac, key, scratch);
-                memcpy(mac, scratch, AES128_KEY_LEN);
-        }
+        AES128_expand_key(key, round_keys);
+        aes_cmac_init(&cmac, round_keys);
+        aes_cmac_update(&cmac, msg, (size_t)msg_len);
+        aes_cmac_final(&cmac, mac);
+}
 
-        if (is_last_block_complete) {
-                memcpy(scratch, &msg[i*AES128_KEY_LEN], AES128_KEY_LEN);
-                aes_cmac_xor(scratch, sub_key1);
-        } else {
-                memcpy(scratch, &msg[i*AES128_KEY_LEN], (size_t)rem);
-                scratch[rem] = 0x80;
-                memset(&scratch[rem + 1], 0, AES128_KEY_LEN - ((size_t)rem + 1));
-                aes_cmac_xor(scratch, sub_key2);
+/*
+ * The round keys of key. They are kept with the context and expanded again
+ * only when the key changes, i.e. once a session rather than for every
+ * block of every PDU.
+ */
+const uint8_t *
+smb2_aes_round_keys(struct smb2_aes_key *k, const uint8_t *key)
+{
+        if (!k->valid || memcmp(k->key, key, SMB2_KEY_SIZE)) {
+                memcpy(k->key, key, SMB2_KEY_SIZE);
+                AES128_expand_key(k->key, k->round_keys);
+                k->valid = 1;
         }
-
-        aes_cmac_xor(mac, scratch);
-        AES128_ECB_encrypt(mac, key, scratch);
-        memcpy(mac, scratch, AES128_KEY_LEN);
+        return k->round_keys;
 }
 
 int
@@ -173,27 +238,15 @@ smb2_calc_signature(struct smb2_context *smb2, uint8_t *signature,
 
         if (smb2->dialect > SMB2_VERSION_0210) {
                 size_t i = 0;
-                size_t len = 0, offset = 0;
                 uint8_t aes_mac[AES_BLOCK_SIZE];
-                /* combine the buffers into one */
-                uint8_t *msg = NULL;
-
-                for (i=0; i < niov; i++) {
-                        len += iov[i].len;
-                }
-                msg = (uint8_t *) malloc(len);
-                if (msg == NULL) {
-                        smb2_set_error(smb2, "Failed to allocate buffer for "
-                                       "signature calculation");
-                        return -1;
-                }
+                struct aes_cmac cmac;
 
+                aes_cmac_init(&cmac, smb2_aes_round_keys(&smb2->sign_key,
+                                                         smb2->signing_key));
                 for (i=0; i < niov; i++) {
-                        memcpy(msg + offset, iov[i].buf, iov[i].len);
-                        offset += iov[i].len;
+                        aes_cmac_update(&cmac, iov[i].buf, iov[i].len);
                 }
-                smb3_aes_cmac_128(smb2->signing_key, msg, offset, aes_mac);
-                free(msg);
+                aes_cmac_final(&cmac, aes_mac);
                 memcpy(&signature[0], aes_mac, SMB2_SIGNATURE_SIZE);
         } else {
                 HMACContext ctx;
@@ -211,6 +264,34 @@ smb2_calc_signature(struct smb2_context *smb2, uint8_t *signature,
         return 0;
 }
 
+/*
+ * Checks the signature of a received PDU, iov[0] being its header, in one
+ * pass over the vectors it was read into.
+ */
+int
+smb2_check_signature(struct smb2_context *smb2,
+                     struct smb2_iovec *iov, size_t niov)
+{
+        uint8_t signature[SMB2_SIGNATURE_SIZE];
+        uint8_t diff = 0;
+        int i;
+
+        memcpy(&signature[0], iov[0].buf + 48, SMB2_SIGNATURE_SIZE);
+        if (smb2_calc_signature(smb2, iov[0].buf + 48, iov, niov) < 0) {
+                smb2_set_error(smb2, "Signature calc failed.");
+                return -1;
+        }
+        /* not memcmp(), which would tell how much of it was right */
+        for (i = 0; i < SMB2_SIGNATURE_SIZE; i++) {
+                diff |= signature[i] ^ iov[0].buf[48 + i];
+        }
+        if (diff) {
+                smb2_set_error(smb2, "Wrong signature in received PDU");
+                return -1;
+        }
+        return 0;
+}
+
 int
 smb2_pdu_add_signature(struct smb2_context *smb2,
                        struct smb2_pdu *pdu
@@ -67,11 +67,34 @@
 
 static const char xfer[4] = {0xFD, 'S', 'M', 'B'};
 
+/*
+ * The client seals with the ServerIn key and opens with the ServerOut key,
+ * a server the other way round. Their round keys are kept in the context.
+ */
+static const uint8_t *
+smb3_encrypt_key(struct smb2_context *smb2)
+{
+        return smb2_aes_round_keys(&smb2->encrypt_key, smb2_is_server(smb2) ?
+                                   smb2->serverout_key : smb2->serverin_key);
+}
+
+static const uint8_t *
+smb3_decrypt_key(struct smb2_context *smb2)
+{
+        return smb2_aes_round_keys(&smb2->decrypt_key, smb2_is_server(smb2) ?
+                                   smb2->serverin_key : smb2->serverout_key);
+}
+
+/*
+ * The vectors of the compound are encrypted straight into the buffer that
+ * is sent, behind the transform header, in a single pass.
+ */
 int
 smb3_encrypt_pdu(struct smb2_context *smb2,
                  struct smb2_pdu *pdu)
 {
         struct smb2_pdu *tmp_pdu;
+        struct aes128ccm ccm;
         uint32_t spl, u32;
         int i;
         uint16_t u16;
@@ -89,12 +112,13 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
                         spl += (uint32_t)tmp_pdu->out.iov[i].len;
                 }
         }
-        pdu->crypt = calloc(spl, sizeof(uint8_t));
+        pdu->crypt = malloc(spl);
         if (pdu->crypt == NULL) {
                 pdu->seal = 0;
                 return -1;
         }
 
+        memset(&pdu->crypt[0], 0, 52);
         memcpy(&pdu->crypt[0], xfer, 4);
         for (i = 20; i < 31; i++) {
                 pdu->crypt[i] = random()&0xff;
@@ -105,36 +129,58 @@ smb3_encrypt_pdu(struct smb2_context *smb2,
         memcpy(&pdu->crypt[42], &u16, 2);
         memcpy(&pdu->crypt[44], &smb2->session_id, 8);
 
+        aes128ccm_init(&ccm, smb3_encrypt_key(smb2),
+                       &pdu->crypt[20], 11,
+                       &pdu->crypt[20], 32,
+                       spl - 52, 16);
         spl = 52;  /* transform header */
         for (tmp_pdu = pdu; tmp_pdu; tmp_pdu = tmp_pdu->next_compound) {
                 for (i = 0; i < tmp_pdu->out.niov; i++) {
-                        memcpy(&pdu->crypt[spl], tmp_pdu->out.iov[i].buf,
-                               tmp_pdu->out.iov[i].len);
+                        aes128ccm_encrypt_update(&ccm,
+                                                 tmp_pdu->out.iov[i].buf,
+                                                 &pdu->crypt[spl],
+                                                 tmp_pdu->out.iov[i].len);
                         spl += (uint32_t)tmp_pdu->out.iov[i].len;
                 }
         }
-
-        aes128ccm_encrypt(smb2->serverin_key,
-                          &pdu->crypt[20], 11,
-                          &pdu->crypt[20], 32,
-                          &pdu->crypt[52], spl - 52,
-                          &pdu->crypt[4], 16);
+        aes128ccm_final(&ccm, &pdu->crypt[4], 16);
         pdu->crypt_len = spl;
 
         return 0;
 }
 
+/*
+ * The payload is decrypted where it was received and the signature checked
+ * in the same pass.
+ */
 int
 smb3_decrypt_pdu(struct smb2_context *smb2)
 {
-        int rc;
-
-        if (aes128ccm_decrypt(smb2->serverout_key,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[20], 11,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[20], 32,
-                              &smb2->in.iov[smb2->in.niov - 1].buf[0],
-                              smb2->in.iov[smb2->in.niov - 1].len,
-                              &smb2->in.iov[smb2->in.niov - 2].buf[4], 16)) {
+        struct aes128ccm ccm;
+        uint8_t *hdr = smb2->in.iov[smb2->in.niov - 2].buf;
+        uint8_t *payload = smb2->in.iov[smb2->in.niov - 1].buf;
+        size_t len = smb2->in.iov[smb2->in.niov - 1].len;
+        uint8_t signature[16], diff = 0;
+        uint32_t u32;
+        int i, rc;
+
+        memcpy(&u32, &hdr[36], 4);
+        if (le32toh(u32) != len) {
+                smb2_set_error(smb2, "Wrong message size in transform "
+                               "header");
+                return -1;
+        }
+
+        aes128ccm_init(&ccm, smb3_decrypt_key(smb2),
+                       &hdr[20], 11,
+                       &hdr[20], 32,
+                       len, 16);
+        aes128ccm_decrypt_update(&ccm, payload, payload, len);
+        aes128ccm_final(&ccm, signature, 16);
+        for (i = 0; i < 16; i++) {
+                diff |= signature[i] ^ hdr[4 + i];
+        }
+        if (diff) {
                 smb2_set_error(smb2, "Failed to decrypt PDU");
                 return -1;
         }
@@ -99,6 +99,10 @@
 #include <sys/socket.h>
 #endif
 
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
+
 #include <errno.h>
 
 #ifndef __amigaos4__
@@ -153,10 +157,23 @@ smb2_close_connecting_fds(struct smb2_context *smb2)
         smb2->connecting_fds_count = 0;
 
         if (smb2->addrinfos != NULL) {
-                freeaddrinfo(smb2->addrinfos);
+                smb2_resolve_free(smb2->addrinfos);
                 smb2->addrinfos = NULL;
         }
         smb2->next_addrinfo = NULL;
+        free(smb2->connect_host);
+        smb2->connect_host = NULL;
+        free(smb2->connect_port);
+        smb2->connect_port = NULL;
+}
+
+/* None of the addresses could be connected: do not hand them out again */
+void
+smb2_connect_failed(struct smb2_context *smb2)
+{
+        if (smb2->connect_host != NULL && smb2->connect_port != NULL) {
+                smb2_resolve_forget(smb2->connect_host, smb2->connect_port);
+        }
 }
 
 static int
@@ -175,7 +192,7 @@ smb2_get_credit_charge(struct smb2_context *smb2, struct smb2_pdu *pdu)
 int
 smb2_which_events(struct smb2_context *smb2)
 {
-        int events = SMB2_VALID_SOCKET(smb2->fd) ? POLLIN : POLLOUT;
+        int events = SMB2_IS_CONNECTED(smb2) ? POLLIN : POLLOUT;
 
         if (smb2->outqueue != NULL &&
             smb2_get_credit_charge(smb2, smb2->outqueue) <= smb2->credits) {
@@ -215,7 +232,7 @@ smb2_write_to_socket(struct smb2_context *smb2)
 {
         struct smb2_pdu *pdu;
 
-        if (!SMB2_VALID_SOCKET(smb2->fd)) {
+        if (!SMB2_IS_CONNECTED(smb2)) {
                 smb2_set_error(smb2, "trying to write but not connected");
                 return -1;
         }
@@ -224,7 +241,8 @@ smb2_write_to_socket(struct smb2_context *smb2)
                 struct iovec *tmpiov;
                 struct smb2_pdu *tmp_pdu;
                 size_t num_done = pdu->out.num_done;
-                int i, niov = 1;
+                size_t head;
+                int i, niov = 1, nhead = 0, zc;
                 ssize_t count;
                 uint32_t spl = 0, tmp_spl, credit_charge = 0;
 
@@ -266,6 +284,17 @@ smb2_write_to_socket(struct smb2_context *smb2)
                 iov[0].iov_base = &tmp_spl;
                 iov[0].iov_len = SMB2_SPL_SIZE;
 
+                /* The headers are copied as usual, only the caller's
+                 * data goes out with zerocopy.
+                 */
+                zc = smb2_zerocopy_wanted(smb2, pdu);
+                if (zc) {
+                        head = SMB2_SPL_SIZE + spl - pdu->out_data_len;
+                        while (head > 0) {
+                                head -= iov[nhead++].iov_len;
+                        }
+                }
+
                 tmpiov = iov;
 
                 /* Skip the vectors we have already written */
@@ -282,7 +311,17 @@ smb2_write_to_socket(struct smb2_context *smb2)
 #else
                 tmpiov->iov_len -= (size_t)num_done;
 #endif
-                count = writev(smb2->fd, tmpiov, niov);
+                if (zc) {
+                        if (tmpiov - iov < nhead) {
+                                count = smb2->transport->writev(smb2, tmpiov,
+                                        nhead - (int)(tmpiov - iov));
+                        } else {
+                                count = smb2_zerocopy_send(smb2, pdu, tmpiov,
+                                                           niov);
+                        }
+                } else {
+                        count = smb2->transport->writev(smb2, tmpiov, niov);
+                }
 
                 if (count == -1) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -309,7 +348,12 @@ smb2_write_to_socket(struct smb2_context *smb2)
                                  */
                                 pdu->next_compound = NULL;
 
-                                if (!smb2_is_server(smb2)) {
+                                if (pdu->header.command == SMB2_CANCEL &&
+                                    !smb2_is_server(smb2)) {
+                                        /* never answered */
+                                        smb2_free_pdu(smb2, pdu);
+                                }
+                                else if (!smb2_is_server(smb2)) {
                                         smb2->credits -= pdu->header.credit_charge;
                                         /* queue requests we send to correlate replies with */
                                         SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
@@ -395,6 +439,8 @@ read_more_data:
                 return -1;
         }
         smb2->in.num_done += (size_t)count;
+        smb2->sched_rx += (uint64_t)count;
+        smb2_keepalive_rx(smb2);
 
         if (smb2->in.num_done < smb2->in.total_size) {
                 goto read_more_data;
@@ -512,6 +558,13 @@ read_more_data:
                         pdu->header.message_id = smb2->hdr.message_id;
                         if (!(smb2->hdr.flags & SMB2_FLAGS_ASYNC_COMMAND)) {
                                 pdu->header.sync.tree_id = smb2->hdr.sync.tree_id;
+                                /* a related request works on the tree of
+                                 * the one before it, so its reply does too
+                                 */
+                                if ((smb2->hdr.flags & SMB2_FLAGS_RELATED_OPERATIONS) &&
+                                    smb2->hdr.sync.tree_id == 0xffffffff) {
+                                        pdu->header.sync.tree_id = smb2_tree_id(smb2);
+                                }
                         }
                         /* if the session is properly opened then we could get
                          * any request from the client, so use the header's command
@@ -697,9 +750,19 @@ read_more_data:
         }
 
         if (smb2->hdr.status == SMB2_STATUS_PENDING) {
-                /* This was a pending command. Just ignore it and proceed
-                 * to read the next chain.
+                /* This was a pending command. Remember the async id the
+                 * server gave it, so that it can still be cancelled, and
+                 * proceed to read the next chain.
                  */
+                if (!smb2_is_server(smb2) &&
+                    (smb2->hdr.flags & SMB2_FLAGS_ASYNC_COMMAND)) {
+                        pdu = smb2_find_pdu(smb2, smb2->hdr.message_id);
+                        if (pdu != NULL) {
+                                pdu->header.flags |= SMB2_FLAGS_ASYNC_COMMAND;
+                                pdu->header.async.async_id =
+                                        smb2->hdr.async.async_id;
+                        }
+                }
                 if (smb2->passthrough) {
                         pdu = smb2_find_pdu(smb2, smb2->hdr.message_id);
                         if (pdu == NULL) {
@@ -726,17 +789,8 @@ read_more_data:
         if (smb2->sign &&
             (smb2->hdr.flags & SMB2_FLAGS_SIGNED) &&
             (smb2->hdr.command != SMB2_SESSION_SETUP) ) {
-                uint8_t signature[16] _U_;
-                memcpy(&signature[0], &smb2->in.iov[1 + iov_offset].buf[48], 16);
-                if (smb2_calc_signature(smb2, &smb2->in.iov[1 + iov_offset].buf[48],
-                                        &smb2->in.iov[1 + iov_offset],
-                                        smb2->in.niov - 1 - iov_offset) < 0) {
-                        smb2_set_error(smb2, "Signature calc failed.");
-                        return -1;
-                }
-                if (memcmp(&signature[0], &smb2->in.iov[1 + iov_offset].buf[48], 16)) {
-                        smb2_set_error(smb2, "Wrong signature in received "
-                                       "PDU");
+                if (smb2_check_signature(smb2, &smb2->in.iov[1 + iov_offset],
+                                         smb2->in.niov - 1 - iov_offset) < 0) {
                         return -1;
                 }
         }
@@ -746,9 +800,17 @@ read_more_data:
         if (smb2_is_server(smb2)) {
                 /* queue requests to correlate our replies we send back later */
                 SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
+                smb2_sched_charge(smb2, pdu);
+                smb2_compound_begin(smb2);
                 pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
                 smb2->pdu = smb2->next_pdu;
                 smb2->next_pdu = NULL;
+                /* the replies to a chain go out together, compound.c */
+                smb2_compound_end(smb2);
+        }
+        else if (pdu->zc && smb2_zerocopy_defer(smb2, pdu)) {
+                /* completed once the kernel is done with the data */
+                smb2->pdu = NULL;
         }
         else {
                 pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
@@ -780,6 +842,50 @@ static ssize_t smb2_readv_from_socket(struct smb2_context *smb2,
         return rc;
 }
 
+static ssize_t smb2_writev_to_socket(struct smb2_context *smb2,
+                                     const struct iovec *iov, int iovcnt)
+{
+        return writev(smb2->fd, (struct iovec*) iov, iovcnt);
+}
+
+static int
+smb2_socket_is_connected(struct smb2_context *smb2)
+{
+        return SMB2_VALID_SOCKET(smb2->fd);
+}
+
+static void
+smb2_socket_close(struct smb2_context *smb2)
+{
+        if (SMB2_VALID_SOCKET(smb2->fd)) {
+                if (smb2->change_fd) {
+                        smb2->change_fd(smb2, smb2->fd, SMB2_DEL_FD);
+                }
+                close(smb2->fd);
+                smb2->fd = SMB2_INVALID_SOCKET;
+        }
+        smb2_zerocopy_flush(smb2);
+}
+
+const struct smb2_transport smb2_tcp_transport = {
+        "tcp",
+        smb2_socket_is_connected,
+        smb2_writev_to_socket,
+        smb2_readv_from_socket,
+        smb2_socket_close,
+        NULL
+};
+
+/* A Unix-domain stream socket carries the same byte stream as TCP */
+const struct smb2_transport smb2_unix_transport = {
+        "unix",
+        smb2_socket_is_connected,
+        smb2_writev_to_socket,
+        smb2_readv_from_socket,
+        smb2_socket_close,
+        NULL
+};
+
 static int
 smb2_read_from_socket(struct smb2_context *smb2)
 {
@@ -797,7 +903,7 @@ smb2_read_from_socket(struct smb2_context *smb2)
                                   SMB2_SPL_SIZE, NULL);
         }
 
-        return smb2_read_data(smb2, smb2_readv_from_socket, 0);
+        return smb2_read_data(smb2, smb2->transport->readv, 0);
 }
 
 static ssize_t smb2_readv_from_buf(struct smb2_context *smb2,
@@ -874,6 +980,11 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
                 }
         }
 
+        if (fd == smb2->fd) {
+                /* completions of zerocopy sends also raise POLLERR */
+                revents = smb2_zerocopy_service(smb2, revents);
+        }
+
         if (revents & POLLERR) {
                 int err = 0;
                 socklen_t err_size = sizeof(err);
@@ -899,6 +1010,9 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
                                         "Unknown socket error.");
                 }
 
+                if (!SMB2_VALID_SOCKET(smb2->fd)) {
+                        smb2_connect_failed(smb2);
+                }
                 if (smb2->connect_cb) {
                         smb2->connect_cb(smb2, err, NULL, smb2->connect_data);
                         smb2->connect_cb = NULL;
@@ -935,6 +1049,7 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
                                                 "%s(%d) while connecting.",
                                                 strerror(err), err);
                         }
+                        smb2_connect_failed(smb2);
 
                         if (smb2->connect_cb) {
                                 smb2->connect_cb(smb2, err,
@@ -956,6 +1071,26 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
                 goto out;
         }
 
+        return smb2_service_stream(smb2, revents);
+
+ out:
+        if (smb2->timeout) {
+                smb2_timeout_pdus(smb2);
+        }
+        if (ret == 0 && smb2_keepalive_service(smb2) < 0) {
+                ret = -1;
+        }
+        return ret;
+}
+
+/* Move the byte stream of a connected context in whichever directions
+ * revents allows, whatever the transport.
+ */
+int
+smb2_service_stream(struct smb2_context *smb2, int revents)
+{
+        int ret = 0;
+
         if (revents & POLLIN) {
                 if (smb2_read_from_socket(smb2) != 0) {
                         ret = -1;
@@ -974,12 +1109,18 @@ smb2_service_fd(struct smb2_context *smb2, t_socket fd, int revents)
         if (smb2->timeout) {
                 smb2_timeout_pdus(smb2);
         }
+        if (ret == 0 && smb2_keepalive_service(smb2) < 0) {
+                ret = -1;
+        }
         return ret;
 }
 
 int
 smb2_service(struct smb2_context *smb2, int revents)
 {
+        if (smb2->transport->service != NULL) {
+                return smb2->transport->service(smb2, revents);
+        }
         if (smb2->connecting_fds_count > 0) {
                 return smb2_service_fd(smb2, smb2->connecting_fds[0], revents);
         } else {
@@ -1404,12 +1545,23 @@ smb2_connect_async(struct smb2_context *smb2, const char *server,
         size_t addr_count = 0;
         const struct addrinfo *ai;
 
-        if (SMB2_VALID_SOCKET(smb2->fd)) {
+        if (SMB2_IS_CONNECTED(smb2)) {
                 smb2_set_error(smb2, "Trying to connect but already "
                                "connected.");
                 return -EINVAL;
         }
 
+        if (smb2->pipe_server != NULL) {
+                return smb2_connect_pipe_async(smb2, smb2->pipe_server,
+                                               cb, private_data);
+        }
+#ifdef HAVE_SYS_UN_H
+        if (!strncmp(server, "unix:", 5)) {
+                return smb2_connect_unix_async(smb2, server + 5,
+                                               cb, private_data);
+        }
+#endif
+
         addr = strdup(server);
         if (addr == NULL) {
                 smb2_set_error(smb2, "Out-of-memory: "
@@ -1442,8 +1594,8 @@ smb2_connect_async(struct smb2_context *smb2, const char *server,
                 port = (char*)"445";
         }
 
-        /* is it a hostname ? */
-        err = getaddrinfo(host, port, NULL, &smb2->addrinfos);
+        /* is it a hostname ? (see resolver.c) */
+        err = smb2_resolve(host, port, &smb2->addrinfos);
         if (err != 0) {
                 free(addr);
 #if defined(_WINDOWS) || defined(_XBOX)
@@ -1484,6 +1636,8 @@ smb2_connect_async(struct smb2_context *smb2, const char *server,
                         return -EINVAL;
                 }
         }
+        smb2->connect_host = strdup(host);
+        smb2->connect_port = strdup(port);
         free(addr);
 
         /* CRITICAL: Debug addrinfo BEFORE interleave_addrinfo */
@@ -1507,8 +1661,7 @@ smb2_connect_async(struct smb2_context *smb2, const char *server,
                 addr_count++;
         smb2->connecting_fds = malloc(sizeof(t_socket) * addr_count);
         if (smb2->connecting_fds == NULL) {
-                freeaddrinfo(smb2->addrinfos);
-                smb2->addrinfos = NULL;
+                smb2_close_connecting_fds(smb2);
                 return -ENOMEM;
         }
 
@@ -1518,15 +1671,86 @@ smb2_connect_async(struct smb2_context *smb2, const char *server,
                 smb2->connect_cb   = cb;
                 smb2->connect_data = private_data;
         } else {
+                smb2_connect_failed(smb2);
+                smb2_close_connecting_fds(smb2);
+        }
+
+        return err;
+}
+
+#ifdef HAVE_SYS_UN_H
+int
+smb2_connect_unix_async(struct smb2_context *smb2, const char *path,
+                        smb2_command_cb cb, void *private_data)
+{
+        struct sockaddr_un sun;
+        t_socket fd;
+
+        if (SMB2_IS_CONNECTED(smb2)) {
+                smb2_set_error(smb2, "Trying to connect but already "
+                               "connected.");
+                return -EINVAL;
+        }
+        if (strlen(path) >= sizeof(sun.sun_path)) {
+                smb2_set_error(smb2, "Invalid address:%s  "
+                               "Unix socket path too long.", path);
+                return -EINVAL;
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, path);
+
+        smb2->connecting_fds = malloc(sizeof(t_socket));
+        if (smb2->connecting_fds == NULL) {
+                return -ENOMEM;
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (!SMB2_VALID_SOCKET(fd)) {
+                smb2_set_error(smb2, "Failed to open smb2 socket. "
+                               "Errno:%s(%d).", strerror(errno), errno);
                 free(smb2->connecting_fds);
                 smb2->connecting_fds = NULL;
-                freeaddrinfo(smb2->addrinfos);
-                smb2->addrinfos = NULL;
-                smb2->next_addrinfo = NULL;
+                return -EIO;
         }
+        set_nonblocking(fd);
 
-        return err;
+        /* Completes in smb2_service_fd() once the socket is writable,
+         * like a TCP connect does.
+         */
+        if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 &&
+            errno != EINPROGRESS && errno != EAGAIN) {
+                smb2_set_error(smb2, "Connect failed with errno : "
+                               "%s(%d)", strerror(errno), errno);
+                close(fd);
+                free(smb2->connecting_fds);
+                smb2->connecting_fds = NULL;
+                return -EIO;
+        }
+
+        smb2->transport = &smb2_unix_transport;
+        smb2->connecting_fds[0] = fd;
+        smb2->connecting_fds_count = 1;
+        if (smb2->change_fd) {
+                smb2->change_fd(smb2, fd, SMB2_ADD_FD);
+                smb2_change_events(smb2, fd, POLLOUT);
+        }
+        smb2->connect_cb   = cb;
+        smb2->connect_data = private_data;
+
+        return 0;
 }
+#else
+int
+smb2_connect_unix_async(struct smb2_context *smb2, const char *path _U_,
+                        smb2_command_cb cb _U_, void *private_data _U_)
+{
+        smb2_set_error(smb2, "Unix-domain sockets are not supported "
+                       "on this platform.");
+        return -EINVAL;
+}
+#endif
 
 int
 smb2_bind_and_listen(const uint16_t port, const int max_connections, int *out_fd)
@@ -71,14 +71,20 @@ static int wait_for_reply(struct smb2_context *smb2,
 		pfd.fd = smb2_get_fd(smb2);
 		pfd.events = smb2_which_events(smb2);
 
-		if (poll(&pfd, 1, 1000) < 0) {
+		if (smb2->transport->service != NULL) {
+			/* nothing to poll, the transport services itself */
+			pfd.revents = pfd.events;
+		} else if (poll(&pfd, 1, 1000) < 0) {
 			smb2_set_error(smb2, "Poll failed");
 			return -1;
 		}
                 if (smb2->timeout) {
                         smb2_timeout_pdus(smb2);
                 }
-		if (!SMB2_VALID_SOCKET(smb2->fd) && ((time(NULL) - t) > (smb2->timeout)))
+                if (smb2_keepalive_service(smb2) < 0) {
+                        return -1;
+                }
+		if (!SMB2_IS_CONNECTED(smb2) && ((time(NULL) - t) > (smb2->timeout)))
 		{
 			smb2_set_error(smb2, "Timeout expired and no connection exists\n");
 			return -1;
@@ -257,6 +263,13 @@ struct smb2fh *smb2_open(struct smb2_context *smb2, const char *path, int flags)
 }
 
 struct smb2fh *smb2_open_r2(struct smb2_context *smb2, const char *path, int flags, int *r2)
+{
+        return smb2_open_oplock_r2(smb2, path, flags,
+                                   SMB2_OPLOCK_LEVEL_NONE, r2);
+}
+
+struct smb2fh *smb2_open_oplock_r2(struct smb2_context *smb2, const char *path,
+                                   int flags, uint8_t oplock_level, int *r2)
 {
         struct sync_cb_data *cb_data;
         void *ptr;
@@ -268,7 +281,8 @@ struct smb2fh *smb2_open_r2(struct smb2_context *smb2, const char *path, int fla
                 return NULL;
         }
 
-	if (smb2_open_async(smb2, path, flags,
+	if (smb2_open_async_with_oplock_or_lease(smb2, path, flags,
+                               oplock_level, 0, NULL,
                                open_cb, cb_data) != 0) {
 		smb2_set_error(smb2, "smb2_open_async failed");
                 free(cb_data);
@@ -400,6 +414,104 @@ static void generic_status_cb(struct smb2_context *smb2, int status,
         cb_data->status = status;
 }
 
+/*
+ * Connect another share on the same session
+ */
+int smb2_connect_tree(struct smb2_context *smb2, const char *share)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+	rc = smb2_connect_tree_async(smb2, share, generic_status_cb, cb_data);
+        if (rc < 0) {
+                goto out;
+	}
+
+	rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+	}
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+	return rc;
+}
+
+/*
+ * DFS path resolution
+ */
+struct dfs_resolve_cb_data {
+        char *buf;
+        size_t len;
+};
+
+static void dfs_resolve_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct sync_cb_data *cb_data = private_data;
+        struct dfs_resolve_cb_data *rs_data = cb_data->ptr;
+
+        if (cb_data->status == SMB2_STATUS_CANCELLED) {
+                free(cb_data);
+                return;
+        }
+
+        cb_data->is_finished = 1;
+        cb_data->status = status;
+        if (status == 0) {
+                if (strlen(command_data) >= rs_data->len) {
+                        cb_data->status = -ENAMETOOLONG;
+                        return;
+                }
+                strcpy(rs_data->buf, command_data);
+        }
+}
+
+int smb2_dfs_resolve(struct smb2_context *smb2, const char *path,
+                     char *buf, size_t len)
+{
+        struct sync_cb_data *cb_data;
+        struct dfs_resolve_cb_data rs_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+        rs_data.buf = buf;
+        rs_data.len = len;
+
+        cb_data->ptr = &rs_data;
+
+	rc = smb2_dfs_resolve_async(smb2, path, dfs_resolve_cb, cb_data);
+        if (rc < 0) {
+                goto out;
+	}
+
+	rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+	}
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+	return rc;
+}
+
 int smb2_pread(struct smb2_context *smb2, struct smb2fh *fh,
                uint8_t *buf, uint32_t count, uint64_t offset)
 {
@@ -462,6 +574,68 @@ int smb2_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
 	return rc;
 }
 
+int smb2_preadv(struct smb2_context *smb2, struct smb2fh *fh,
+                const struct smb2_iovec *vec, int nvec, uint64_t offset)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+        rc = smb2_preadv_async(smb2, fh, vec, nvec, offset,
+                               generic_status_cb, cb_data);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
+int smb2_pwritev(struct smb2_context *smb2, struct smb2fh *fh,
+                 const struct smb2_iovec *vec, int nvec, uint64_t offset)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+        rc = smb2_pwritev_async(smb2, fh, vec, nvec, offset,
+                                generic_status_cb, cb_data);
+        if (rc < 0) {
+                goto out;
+        }
+
+        rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+        }
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+        return rc;
+}
+
 int smb2_read(struct smb2_context *smb2, struct smb2fh *fh,
               uint8_t *buf, uint32_t count)
 {
@@ -800,6 +974,40 @@ int smb2_ftruncate(struct smb2_context *smb2, struct smb2fh *fh,
 	return rc;
 }
 
+/*
+ * lock()
+ */
+int smb2_lock(struct smb2_context *smb2, struct smb2fh *fh,
+              const struct smb2_lock_element *locks, int count)
+{
+        struct sync_cb_data *cb_data;
+        int rc = 0;
+
+        cb_data = calloc(1, sizeof(struct sync_cb_data));
+        if (cb_data == NULL) {
+                smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+                return -ENOMEM;
+        }
+
+	rc = smb2_lock_async(smb2, fh, locks, count,
+                             generic_status_cb, cb_data);
+        if (rc < 0) {
+                goto out;
+	}
+
+	rc = wait_for_reply(smb2, cb_data);
+        if (rc < 0) {
+                cb_data->status = SMB2_STATUS_CANCELLED;
+                return rc;
+	}
+
+        rc = cb_data->status;
+ out:
+        free(cb_data);
+
+	return rc;
+}
+
 struct readlink_cb_data {
 	char *buf;
         int len;
@@ -879,7 +1087,7 @@ int smb2_echo(struct smb2_context *smb2)
         struct sync_cb_data *cb_data;
         int rc = 0;
 
-        if (!SMB2_VALID_SOCKET(smb2->fd)) {
+        if (!SMB2_IS_CONNECTED(smb2)) {
                 smb2_set_error(smb2, "Not Connected to Server");
                 return -ENOMEM;
         }
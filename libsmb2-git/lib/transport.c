@@ -0,0 +1,362 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS__IOVEC_H
+#include <sys/_iovec.h>
+#endif
+
+#include <errno.h>
+
+#include "compat.h"
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Transports.
+ *
+ * Every context starts out on the TCP transport. smb2_connect_unix_async()
+ * switches it to a Unix-domain socket (see socket.c) and
+ * smb2_connect_pipe_async() to the in-process pipe below. Closing the
+ * connection always returns the context to TCP, so that it can be
+ * reconnected any way it likes.
+ */
+
+void
+smb2_transport_close(struct smb2_context *smb2)
+{
+        smb2->transport->disconnect(smb2);
+        smb2->transport = &smb2_tcp_transport;
+        smb2->transport_data = NULL;
+}
+
+/*
+ * In-process pipe.
+ *
+ * Connects a client context directly to a server side context of an
+ * smb2_server in the same process. Whatever one end writes is appended to
+ * the buffer the other end reads from, there is no socket and no fd to
+ * poll: servicing either end moves the bytes both ways until neither end
+ * has anything left to do, so a request queued on the client has been
+ * answered by the server handlers when smb2_service() returns.
+ */
+
+#define SMB2_PIPE_MIN_SIZE 4096
+
+struct smb2_pipe_buf {
+        uint8_t *data;
+        size_t size;
+        size_t head;            /* first byte not read yet */
+        size_t tail;            /* end of the bytes written */
+};
+
+struct smb2_pipe {
+        struct smb2_context *end[2];
+        /* buf[i] holds what end[i] has to read */
+        struct smb2_pipe_buf buf[2];
+        /* bytes moved so far, to tell when servicing is done */
+        size_t moved;
+};
+
+static int
+smb2_pipe_end(struct smb2_pipe *pipe, struct smb2_context *smb2)
+{
+        return pipe->end[1] == smb2;
+}
+
+static int
+smb2_pipe_reserve(struct smb2_pipe_buf *buf, size_t len)
+{
+        uint8_t *data;
+        size_t size;
+
+        if (buf->size - buf->tail >= len) {
+                return 0;
+        }
+        if (buf->head > 0) {
+                memmove(buf->data, buf->data + buf->head,
+                        buf->tail - buf->head);
+                buf->tail -= buf->head;
+                buf->head = 0;
+                if (buf->size - buf->tail >= len) {
+                        return 0;
+                }
+        }
+
+        size = buf->size ? buf->size : SMB2_PIPE_MIN_SIZE;
+        while (size - buf->tail < len) {
+                size *= 2;
+        }
+        data = realloc(buf->data, size);
+        if (data == NULL) {
+                return -1;
+        }
+        buf->data = data;
+        buf->size = size;
+
+        return 0;
+}
+
+static int
+smb2_pipe_is_connected(struct smb2_context *smb2)
+{
+        return smb2->transport_data != NULL;
+}
+
+static ssize_t
+smb2_pipe_writev(struct smb2_context *smb2, const struct iovec *iov,
+                 int iovcnt)
+{
+        struct smb2_pipe *pipe = smb2->transport_data;
+        int peer = !smb2_pipe_end(pipe, smb2);
+        struct smb2_pipe_buf *buf = &pipe->buf[peer];
+        size_t len = 0;
+        int i;
+
+        if (pipe->end[peer] == NULL) {
+                errno = EPIPE;
+                return -1;
+        }
+
+        for (i = 0; i < iovcnt; i++) {
+                len += iov[i].iov_len;
+        }
+        if (smb2_pipe_reserve(buf, len) != 0) {
+                errno = ENOMEM;
+                return -1;
+        }
+        for (i = 0; i < iovcnt; i++) {
+                memcpy(buf->data + buf->tail, iov[i].iov_base,
+                       iov[i].iov_len);
+                buf->tail += iov[i].iov_len;
+        }
+        pipe->moved += len;
+
+        return (ssize_t)len;
+}
+
+static ssize_t
+smb2_pipe_readv(struct smb2_context *smb2, const struct iovec *iov,
+                int iovcnt)
+{
+        struct smb2_pipe *pipe = smb2->transport_data;
+        int me = smb2_pipe_end(pipe, smb2);
+        struct smb2_pipe_buf *buf = &pipe->buf[me];
+        size_t len, count = 0;
+        int i;
+
+        if (buf->head == buf->tail) {
+                if (pipe->end[!me] == NULL) {
+                        /* like a socket the peer has closed */
+                        return 0;
+                }
+                errno = EAGAIN;
+                return -1;
+        }
+
+        for (i = 0; i < iovcnt && buf->head < buf->tail; i++) {
+                len = iov[i].iov_len;
+                if (len > buf->tail - buf->head) {
+                        len = buf->tail - buf->head;
+                }
+                memcpy(iov[i].iov_base, buf->data + buf->head, len);
+                buf->head += len;
+                count += len;
+        }
+        if (buf->head == buf->tail) {
+                buf->head = buf->tail = 0;
+        }
+        pipe->moved += count;
+
+        return (ssize_t)count;
+}
+
+/* Nobody is left to drive a server end once its client is gone */
+static void
+smb2_pipe_drop_server(struct smb2_context *smb2)
+{
+        struct smb2_server *server = smb2->owning_server;
+
+        if (server->handlers && server->handlers->destruction_event) {
+                server->handlers->destruction_event(server, smb2);
+        }
+        smb2_destroy_context(smb2);
+}
+
+static void
+smb2_pipe_close(struct smb2_context *smb2)
+{
+        struct smb2_pipe *pipe = smb2->transport_data;
+        int me = smb2_pipe_end(pipe, smb2);
+        struct smb2_context *peer = pipe->end[!me];
+
+        pipe->end[me] = NULL;
+        smb2->transport_data = NULL;
+
+        if (peer == NULL) {
+                free(pipe->buf[0].data);
+                free(pipe->buf[1].data);
+                free(pipe);
+                return;
+        }
+        if (smb2_is_server(peer) && !smb2_is_server(smb2)) {
+                /* frees the pipe when it closes its end */
+                smb2_pipe_drop_server(peer);
+        }
+        /* otherwise the peer reads end of file once it has read the rest */
+}
+
+static int
+smb2_pipe_service(struct smb2_context *smb2, int revents _U_)
+{
+        struct smb2_pipe *pipe;
+        struct smb2_context *peer;
+        smb2_command_cb cb;
+        size_t moved;
+
+        if (smb2->connect_cb) {
+                cb = smb2->connect_cb;
+                smb2->connect_cb = NULL;
+                cb(smb2, 0, NULL, smb2->connect_data);
+        }
+
+        /* Either end may close its side (and a client closing frees the
+         * server end) while it is serviced, so look everything up again
+         * after each step.
+         */
+        do {
+                pipe = smb2->transport_data;
+                if (pipe == NULL) {
+                        return 0;
+                }
+                moved = pipe->moved;
+
+                if (smb2_service_stream(smb2, smb2_which_events(smb2)) < 0) {
+                        return -1;
+                }
+
+                pipe = smb2->transport_data;
+                if (pipe == NULL) {
+                        return 0;
+                }
+                peer = pipe->end[!smb2_pipe_end(pipe, smb2)];
+                if (peer != NULL &&
+                    smb2_service_stream(peer, smb2_which_events(peer)) < 0) {
+                        if (smb2_is_server(peer)) {
+                                smb2_pipe_drop_server(peer);
+                        } else {
+                                smb2_close_context(peer);
+                        }
+                }
+
+                pipe = smb2->transport_data;
+        } while (pipe != NULL && pipe->moved != moved);
+
+        return 0;
+}
+
+const struct smb2_transport smb2_pipe_transport = {
+        "pipe",
+        smb2_pipe_is_connected,
+        smb2_pipe_writev,
+        smb2_pipe_readv,
+        smb2_pipe_close,
+        smb2_pipe_service
+};
+
+int
+smb2_connect_pipe_async(struct smb2_context *smb2,
+                        struct smb2_server *server,
+                        smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_context *peer;
+        struct smb2_pipe *pipe;
+
+        if (SMB2_IS_CONNECTED(smb2)) {
+                smb2_set_error(smb2, "Trying to connect but already "
+                               "connected.");
+                return -EINVAL;
+        }
+
+        pipe = calloc(1, sizeof(struct smb2_pipe));
+        if (pipe == NULL) {
+                smb2_set_error(smb2, "Failed to allocate pipe");
+                return -ENOMEM;
+        }
+        peer = smb2_init_context();
+        if (peer == NULL) {
+                smb2_set_error(smb2, "Failed to create server context");
+                free(pipe);
+                return -ENOMEM;
+        }
+
+        smb2_server_set_defaults(server);
+        if (smb2_serve_context(server, peer) != 0) {
+                smb2_set_error(smb2, "%s", smb2_get_error(peer));
+                smb2_destroy_context(peer);
+                free(pipe);
+                return -ENOMEM;
+        }
+
+        pipe->end[0] = smb2;
+        pipe->end[1] = peer;
+        smb2->transport = &smb2_pipe_transport;
+        smb2->transport_data = pipe;
+        peer->transport = &smb2_pipe_transport;
+        peer->transport_data = pipe;
+
+        /* reported from the first smb2_service() like a socket connect */
+        smb2->connect_cb   = cb;
+        smb2->connect_data = cb_data;
+
+        return 0;
+}
+
+void
+smb2_set_pipe_server(struct smb2_context *smb2, struct smb2_server *server)
+{
+        smb2->pipe_server = server;
+}
@@ -0,0 +1,304 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2025 by the smb2-handler authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+
+#include <errno.h>
+
+#include "compat.h"
+
+#include "slist.h"
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+/*
+ * Zero-copy sends of write data.
+ *
+ * With a threshold set by smb2_set_zerocopy_threshold(), the data of a
+ * WRITE request of at least that many bytes is sent with MSG_ZEROCOPY: the
+ * kernel sends it straight from the caller's buffer instead of copying it
+ * into the socket buffers first. The headers in front of it are small and
+ * are still copied.
+ *
+ * The kernel numbers the zerocopy sends on a socket from 0 and reports on
+ * the socket error queue (which makes poll() return POLLERR) once it no
+ * longer needs the memory of a range of them. Until then the buffer must
+ * stay as it is, so a reply that arrives before that (the server may well
+ * answer before the last ACK has been processed) is parked in zc_waitqueue
+ * and only passed to the callback once the kernel is done with the data.
+ *
+ * Sealed requests are encrypted into a buffer of our own, so there is
+ * nothing to gain for them. If the kernel reports that it had to copy the
+ * data after all (no scatter-gather on the interface, loopback) zerocopy is
+ * turned off for the rest of the connection, as it is only slower then.
+ */
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && \
+        defined(SO_ZEROCOPY)
+
+/* Has the kernel released the data of send number seq? */
+static int
+smb2_zerocopy_done(struct smb2_context *smb2, uint32_t seq)
+{
+        return (int32_t)(smb2->zc_done - seq) > 0;
+}
+
+int
+smb2_zerocopy_wanted(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        int one = 1;
+
+        if (smb2->zc_threshold == 0 ||
+            pdu->out_data_len < smb2->zc_threshold ||
+            pdu->seal || pdu->next_compound != NULL ||
+            smb2->transport != &smb2_tcp_transport ||
+            smb2_is_server(smb2) || smb2->zc_state < 0) {
+                return 0;
+        }
+
+        if (smb2->zc_state == 0) {
+                if (setsockopt(smb2->fd, SOL_SOCKET, SO_ZEROCOPY,
+                               &one, sizeof(one)) != 0) {
+                        smb2->zc_state = -1;
+                        return 0;
+                }
+                smb2->zc_state = 1;
+        }
+
+        return 1;
+}
+
+ssize_t
+smb2_zerocopy_send(struct smb2_context *smb2, struct smb2_pdu *pdu,
+                   const struct iovec *iov, int iovcnt)
+{
+        struct msghdr msg;
+        ssize_t count;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+
+        count = sendmsg(smb2->fd, &msg, MSG_ZEROCOPY);
+        if (count == -1 && errno == ENOBUFS) {
+                /* Out of locked memory for pinning pages, just copy */
+                count = sendmsg(smb2->fd, &msg, 0);
+        } else if (count > 0) {
+                /* Only sends that took some data get a number */
+                pdu->zc = 1;
+                pdu->zc_seq = smb2->zc_next++;
+        }
+
+        return count;
+}
+
+/* Completes the parked replies whose data the kernel has released */
+static void
+smb2_zerocopy_complete(struct smb2_context *smb2, int all)
+{
+        struct smb2_pdu *pdu, *next;
+
+        for (pdu = smb2->zc_waitqueue; pdu; pdu = next) {
+                next = pdu->next;
+                if (!all && !smb2_zerocopy_done(smb2, pdu->zc_seq)) {
+                        continue;
+                }
+                SMB2_LIST_REMOVE(&smb2->zc_waitqueue, pdu);
+                pdu->cb(smb2, pdu->zc_status, pdu->payload, pdu->cb_data);
+                smb2_free_pdu(smb2, pdu);
+        }
+}
+
+/* Reads the completions from the error queue, returns -1 on errors */
+static int
+smb2_zerocopy_reap(struct smb2_context *smb2)
+{
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct sock_extended_err *serr;
+        struct cmsghdr *cm;
+        struct msghdr msg;
+
+        for (;;) {
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                if (recvmsg(smb2->fd, &msg, MSG_ERRQUEUE) == -1) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                                return 0;
+                        }
+                        smb2_set_error(smb2, "Failed to read zerocopy "
+                                       "completions: %s", strerror(errno));
+                        return -1;
+                }
+
+                for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                        if (!(cm->cmsg_level == SOL_IP &&
+                              cm->cmsg_type == IP_RECVERR) &&
+                            !(cm->cmsg_level == SOL_IPV6 &&
+                              cm->cmsg_type == IPV6_RECVERR)) {
+                                continue;
+                        }
+                        serr = (struct sock_extended_err *)(void *)CMSG_DATA(cm);
+                        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+                            serr->ee_errno != 0) {
+                                continue;
+                        }
+                        /* sends ee_info to ee_data are done, TCP
+                         * completes them in order
+                         */
+                        if (!smb2_zerocopy_done(smb2, serr->ee_data)) {
+                                smb2->zc_done = serr->ee_data + 1;
+                        }
+                        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                                smb2->zc_state = -1;
+                        }
+                }
+        }
+}
+
+int
+smb2_zerocopy_defer(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        if (!smb2_zerocopy_done(smb2, pdu->zc_seq)) {
+                /* the completion is usually already queued */
+                smb2_zerocopy_reap(smb2);
+        }
+        if (smb2_zerocopy_done(smb2, pdu->zc_seq)) {
+                return 0;
+        }
+
+        pdu->zc_status = smb2->hdr.status;
+        SMB2_LIST_ADD_END(&smb2->zc_waitqueue, pdu);
+        return 1;
+}
+
+int
+smb2_zerocopy_service(struct smb2_context *smb2, int revents)
+{
+        struct pollfd pfd;
+
+        if (!(revents & POLLERR) || smb2->zc_next == smb2->zc_done ||
+            !SMB2_VALID_SOCKET(smb2->fd)) {
+                return revents;
+        }
+
+        if (smb2_zerocopy_reap(smb2) < 0) {
+                return revents;
+        }
+        smb2_zerocopy_complete(smb2, 0);
+
+        /* Was that all, or is there a real error as well? */
+        pfd.fd = smb2->fd;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) >= 0 && !(pfd.revents & POLLERR)) {
+                revents &= ~POLLERR;
+        }
+
+        return revents;
+}
+
+void
+smb2_zerocopy_flush(struct smb2_context *smb2)
+{
+        /* The socket is gone and with it any completions still due */
+        smb2_zerocopy_complete(smb2, 1);
+        smb2->zc_state = 0;
+        smb2->zc_next = 0;
+        smb2->zc_done = 0;
+}
+
+#else /* no MSG_ZEROCOPY */
+
+int
+smb2_zerocopy_wanted(struct smb2_context *smb2 _U_, struct smb2_pdu *pdu _U_)
+{
+        return 0;
+}
+
+ssize_t
+smb2_zerocopy_send(struct smb2_context *smb2 _U_, struct smb2_pdu *pdu _U_,
+                   const struct iovec *iov _U_, int iovcnt _U_)
+{
+        errno = EINVAL;
+        return -1;
+}
+
+int
+smb2_zerocopy_defer(struct smb2_context *smb2 _U_, struct smb2_pdu *pdu _U_)
+{
+        return 0;
+}
+
+int
+smb2_zerocopy_service(struct smb2_context *smb2 _U_, int revents)
+{
+        return revents;
+}
+
+void
+smb2_zerocopy_flush(struct smb2_context *smb2 _U_)
+{
+}
+
+#endif
+
+void
+smb2_set_zerocopy_threshold(struct smb2_context *smb2, size_t threshold)
+{
+        smb2->zc_threshold = threshold;
+}
@@ -0,0 +1,474 @@
+/*
+ * smb2-handler - SMB2 file system client
+ *
+ * Copyright (C) 2025 by the smb2-handler authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the smb2-handler
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "dircache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Directory listings are kept in hash tables keyed on the case folded name,
+ * so that both "is there such a name" and "there is no such name" can be
+ * answered without a round trip to the server, however big the directory.
+ *
+ * A listing also remembers the LastWriteTime and ChangeTime of the directory
+ * itself. Adding, removing or renaming an entry changes them, so when they
+ * are still the same the listing can be handed out again in place of a full
+ * enumeration, for up to maxAge seconds (changes to the contents of a file
+ * in the directory do not touch its times).
+ *
+ * Names are UTF-8. Folding covers ASCII, Latin-1, Latin Extended-A, Greek
+ * and Cyrillic, which are the scripts where the case insensitive matching
+ * of AmigaDOS and the SMB server can be reproduced with a simple mapping.
+ */
+
+static uint32_t FoldChar(uint32_t c) {
+    if (c < 0x80) {
+        if (c >= 'A' && c <= 'Z')
+            c += 0x20;
+    } else if (c >= 0xC0 && c <= 0xDE && c != 0xD7) {
+        c += 0x20;
+    } else if ((c >= 0x100 && c <= 0x12F) || (c >= 0x132 && c <= 0x137) ||
+               (c >= 0x14A && c <= 0x177)) {
+        c |= 1;
+    } else if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E)) {
+        if (c & 1)
+            c += 1;
+    } else if (c == 0x178) {
+        c = 0xFF;
+    } else if (c >= 0x391 && c <= 0x3AB && c != 0x3A2) {
+        c += 0x20;
+    } else if (c >= 0x400 && c <= 0x40F) {
+        c += 0x50;
+    } else if (c >= 0x410 && c <= 0x42F) {
+        c += 0x20;
+    }
+
+    return c;
+}
+
+// Decode one UTF-8 character and fold it, invalid bytes are passed through
+static uint32_t NextFoldedChar(const unsigned char** p, const unsigned char* end) {
+    const unsigned char* s = *p;
+    uint32_t c = *s++;
+    int extra = 0;
+
+    if (c >= 0xF0 && c < 0xF8) {
+        c &= 0x07;
+        extra = 3;
+    } else if (c >= 0xE0 && c < 0xF0) {
+        c &= 0x0F;
+        extra = 2;
+    } else if (c >= 0xC0 && c < 0xE0) {
+        c &= 0x1F;
+        extra = 1;
+    }
+
+    if (s + extra > end) {
+        extra = 0;
+        c = **p;
+    }
+    while (extra-- > 0) {
+        if ((*s & 0xC0) != 0x80) {
+            s = *p + 1;
+            c = **p;
+            break;
+        }
+        c = (c << 6) | (*s++ & 0x3F);
+    }
+
+    *p = s;
+    return FoldChar(c);
+}
+
+static uint32_t FoldedHash(const char* name, size_t len) {
+    const unsigned char* p = (const unsigned char*)name;
+    const unsigned char* end = p + len;
+    uint32_t hash = 2166136261UL; // FNV-1a
+
+    while (p < end) {
+        uint32_t c = NextFoldedChar(&p, end);
+
+        hash = (hash ^ (c & 0xFF)) * 16777619UL;
+        hash = (hash ^ (c >> 8)) * 16777619UL;
+    }
+
+    return hash;
+}
+
+static int FoldedEqual(const char* a, size_t alen, const char* b, size_t blen) {
+    const unsigned char* pa = (const unsigned char*)a;
+    const unsigned char* pb = (const unsigned char*)b;
+    const unsigned char* aend = pa + alen;
+    const unsigned char* bend = pb + blen;
+
+    while (pa < aend && pb < bend) {
+        if (NextFoldedChar(&pa, aend) != NextFoldedChar(&pb, bend))
+            return 0;
+    }
+
+    return pa == aend && pb == bend;
+}
+
+// Length of a directory path without any trailing slash (except for the root)
+static size_t DirPathLength(const char* path) {
+    size_t len = strlen(path);
+
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+
+    return len;
+}
+
+static void FreeDirListing(struct DirCacheDir* dir) {
+    size_t i;
+
+    for (i = 0; i < dir->numBuckets; i++) {
+        struct DirCacheEntry* entry = dir->buckets[i];
+        while (entry != NULL) {
+            struct DirCacheEntry* temp = entry;
+            entry = entry->next;
+            free(temp);
+        }
+    }
+
+    free(dir->buckets);
+    free(dir->path);
+    free(dir);
+}
+
+static void RemoveDirListing(struct DirCache* cache, struct DirCacheDir** link) {
+    struct DirCacheDir* dir = *link;
+
+    *link = dir->next;
+    cache->numDirs--;
+    cache->bytes -= dir->bytes;
+    FreeDirListing(dir);
+}
+
+static struct DirCacheDir** FindDirListing(struct DirCache* cache, const char* path, size_t len) {
+    uint32_t hash = FoldedHash(path, len);
+    struct DirCacheDir** link;
+
+    for (link = &cache->dirs; *link != NULL; link = &(*link)->next) {
+        struct DirCacheDir* dir = *link;
+        if (dir->hash == hash && FoldedEqual(dir->path, strlen(dir->path), path, len))
+            return link;
+    }
+
+    return NULL;
+}
+
+struct DirCache* AllocateDirCache(size_t maxDirs, int ttl, int maxAge) {
+    struct DirCache* cache = calloc(1, sizeof(struct DirCache));
+    if (cache == NULL)
+        return NULL;
+
+    cache->maxDirs = maxDirs;
+    cache->ttl = ttl;
+    cache->maxAge = maxAge;
+
+    return cache;
+}
+
+void FreeDirCache(struct DirCache* cache) {
+    while (cache->dirs != NULL)
+        RemoveDirListing(cache, &cache->dirs);
+
+    free(cache);
+}
+
+struct DirCacheDir* BeginDirListing(const char* path) {
+    size_t len = DirPathLength(path);
+
+    struct DirCacheDir* dir = calloc(1, sizeof(struct DirCacheDir));
+    if (dir == NULL)
+        return NULL;
+
+    dir->path = malloc(len + 1);
+    dir->numBuckets = DIRCACHE_MIN_BUCKETS;
+    dir->buckets = calloc(dir->numBuckets, sizeof(struct DirCacheEntry*));
+    if (dir->path == NULL || dir->buckets == NULL) {
+        free(dir->buckets);
+        free(dir->path);
+        free(dir);
+        return NULL;
+    }
+
+    memcpy(dir->path, path, len);
+    dir->path[len] = '\0';
+    dir->bytes = sizeof(struct DirCacheDir) + len + 1 + dir->numBuckets * sizeof(struct DirCacheEntry*);
+    dir->hash = FoldedHash(dir->path, len);
+    dir->time = time(NULL);
+    dir->listed = dir->time;
+
+    return dir;
+}
+
+// Double the number of buckets once the average chain would exceed one
+static int GrowDirListing(struct DirCacheDir* dir) {
+    size_t newNumBuckets = dir->numBuckets * 2;
+    size_t i;
+
+    struct DirCacheEntry** newBuckets = calloc(newNumBuckets, sizeof(struct DirCacheEntry*));
+    if (newBuckets == NULL)
+        return -1;
+
+    for (i = 0; i < dir->numBuckets; i++) {
+        struct DirCacheEntry* entry = dir->buckets[i];
+        while (entry != NULL) {
+            struct DirCacheEntry* next = entry->next;
+            size_t index = entry->hash & (newNumBuckets - 1);
+            entry->next = newBuckets[index];
+            newBuckets[index] = entry;
+            entry = next;
+        }
+    }
+
+    free(dir->buckets);
+    dir->buckets = newBuckets;
+    dir->bytes += (newNumBuckets - dir->numBuckets) * sizeof(struct DirCacheEntry*);
+    dir->numBuckets = newNumBuckets;
+
+    return 0;
+}
+
+int AddDirListingEntry(struct DirCacheDir* dir, const char* name, const struct smb2_stat_64* st) {
+    size_t len = strlen(name);
+    size_t index;
+
+    if (dir->count >= dir->numBuckets && GrowDirListing(dir) != 0)
+        return -1;
+
+    struct DirCacheEntry* entry = malloc(sizeof(struct DirCacheEntry) + len);
+    if (entry == NULL)
+        return -1;
+
+    memcpy(entry->name, name, len + 1);
+    entry->hash = FoldedHash(name, len);
+    entry->st = *st;
+
+    index = entry->hash & (dir->numBuckets - 1);
+    entry->next = dir->buckets[index];
+    dir->buckets[index] = entry;
+    dir->count++;
+    dir->bytes += sizeof(struct DirCacheEntry) + len;
+
+    return 0;
+}
+
+// Record the times of the directory itself, from its "." entry
+void SetDirListingStamp(struct DirCacheDir* dir, const struct smb2_stat_64* st) {
+    dir->stamped = 1;
+    dir->mtime = st->smb2_mtime;
+    dir->mtime_nsec = st->smb2_mtime_nsec;
+    dir->ctime = st->smb2_ctime;
+    dir->ctime_nsec = st->smb2_ctime_nsec;
+}
+
+void AbortDirListing(struct DirCacheDir* dir) {
+    FreeDirListing(dir);
+}
+
+void CommitDirListing(struct DirCache* cache, struct DirCacheDir* dir) {
+    struct DirCacheDir** link;
+
+    link = FindDirListing(cache, dir->path, strlen(dir->path));
+    if (link != NULL)
+        RemoveDirListing(cache, link);
+
+    // Evict the least recently used listing
+    if (cache->numDirs >= cache->maxDirs && cache->dirs != NULL) {
+        for (link = &cache->dirs; (*link)->next != NULL; link = &(*link)->next)
+            ;
+        RemoveDirListing(cache, link);
+    }
+
+    dir->next = cache->dirs;
+    cache->dirs = dir;
+    cache->numDirs++;
+    cache->bytes += dir->bytes;
+}
+
+int LookupDirCache(struct DirCache* cache, const char* path, struct smb2_stat_64* st) {
+    const char* name;
+    const char* slash;
+    size_t dirLen, nameLen;
+    struct DirCacheDir** link;
+    struct DirCacheDir* dir;
+    struct DirCacheEntry* entry;
+    uint32_t hash;
+
+    if (cache->dirs == NULL)
+        return DIRCACHE_UNKNOWN;
+
+    slash = strrchr(path, '/');
+    if (slash == NULL || slash[1] == '\0')
+        return DIRCACHE_UNKNOWN;
+
+    name = slash + 1;
+    nameLen = strlen(name);
+    dirLen = slash - path;
+    if (dirLen == 0)
+        dirLen = 1; // root directory
+
+    link = FindDirListing(cache, path, dirLen);
+    if (link == NULL)
+        return DIRCACHE_UNKNOWN;
+
+    dir = *link;
+    if (time(NULL) - dir->time >= cache->ttl) {
+        // Keep it around for SnapshotDirListing() while it may be reused
+        if (!dir->stamped || time(NULL) - dir->listed >= cache->maxAge)
+            RemoveDirListing(cache, link);
+        return DIRCACHE_UNKNOWN;
+    }
+
+    // Move to the front of the list
+    *link = dir->next;
+    dir->next = cache->dirs;
+    cache->dirs = dir;
+
+    hash = FoldedHash(name, nameLen);
+    for (entry = dir->buckets[hash & (dir->numBuckets - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && FoldedEqual(entry->name, strlen(entry->name), name, nameLen)) {
+            if (st != NULL)
+                *st = entry->st;
+            return DIRCACHE_FOUND;
+        }
+    }
+
+    return DIRCACHE_NOT_FOUND;
+}
+
+// Forget the listing that contains path, and path itself and anything below it
+void InvalidateDirCache(struct DirCache* cache, const char* path) {
+    struct DirCacheDir** link;
+    const char* slash;
+    size_t len, dirLen;
+
+    if (path == NULL || cache->dirs == NULL)
+        return;
+
+    len = DirPathLength(path);
+    slash = strrchr(path, '/');
+    dirLen = slash != NULL ? (size_t)(slash - path) : 0;
+    if (dirLen == 0)
+        dirLen = 1;
+
+    link = &cache->dirs;
+    while (*link != NULL) {
+        struct DirCacheDir* dir = *link;
+        size_t pathLen = strlen(dir->path);
+
+        if (FoldedEqual(dir->path, pathLen, path, dirLen) ||
+            (pathLen >= len && (pathLen == len || dir->path[len] == '/') &&
+             FoldedEqual(dir->path, len, path, len))) {
+            RemoveDirListing(cache, link);
+        } else {
+            link = &dir->next;
+        }
+    }
+}
+
+// Evict the least recently used listings until at most maxBytes are used
+size_t TrimDirCache(struct DirCache* cache, size_t maxBytes) {
+    size_t before = cache->bytes;
+    struct DirCacheDir** link;
+
+    while (cache->bytes > maxBytes && cache->dirs != NULL) {
+        for (link = &cache->dirs; (*link)->next != NULL; link = &(*link)->next)
+            ;
+        RemoveDirListing(cache, link);
+    }
+
+    return before - cache->bytes;
+}
+
+// Whether SnapshotDirListing() might reuse the listing of path
+int CanSnapshotDirListing(struct DirCache* cache, const char* path) {
+    struct DirCacheDir** link = FindDirListing(cache, path, DirPathLength(path));
+
+    return link != NULL && (*link)->stamped && time(NULL) - (*link)->listed < cache->maxAge;
+}
+
+/*
+ * Copy the listing of path if st, the current times of the directory, shows
+ * that it has not changed since it was read. A listing that turns out to be
+ * out of date is dropped.
+ */
+struct DirSnapshot* SnapshotDirListing(struct DirCache* cache, const char* path, const struct smb2_stat_64* st) {
+    struct DirCacheDir** link;
+    struct DirCacheDir* dir;
+    struct DirSnapshot* snap;
+    struct DirSnapshotEntry* out;
+    size_t i, names = 0;
+    char* p;
+
+    link = FindDirListing(cache, path, DirPathLength(path));
+    if (link == NULL)
+        return NULL;
+
+    dir = *link;
+    if (!dir->stamped || time(NULL) - dir->listed >= cache->maxAge ||
+        dir->mtime != st->smb2_mtime || dir->mtime_nsec != st->smb2_mtime_nsec ||
+        dir->ctime != st->smb2_ctime || dir->ctime_nsec != st->smb2_ctime_nsec) {
+        RemoveDirListing(cache, link);
+        return NULL;
+    }
+
+    for (i = 0; i < dir->numBuckets; i++) {
+        struct DirCacheEntry* entry;
+        for (entry = dir->buckets[i]; entry != NULL; entry = entry->next)
+            names += strlen(entry->name) + 1;
+    }
+
+    snap = malloc(sizeof(struct DirSnapshot) + dir->count * sizeof(struct DirSnapshotEntry) + names);
+    if (snap == NULL)
+        return NULL;
+
+    snap->count = dir->count;
+    out = snap->entries;
+    p = (char*)&snap->entries[dir->count];
+    for (i = 0; i < dir->numBuckets; i++) {
+        struct DirCacheEntry* entry;
+        for (entry = dir->buckets[i]; entry != NULL; entry = entry->next) {
+            size_t len = strlen(entry->name) + 1;
+            memcpy(p, entry->name, len);
+            out->name = p;
+            out->st = entry->st;
+            out++;
+            p += len;
+        }
+    }
+
+    // Still current, so it is good for lookups again too
+    dir->time = time(NULL);
+    *link = dir->next;
+    dir->next = cache->dirs;
+    cache->dirs = dir;
+
+    return snap;
+}
+
+void FreeDirSnapshot(struct DirSnapshot* snap) {
+    free(snap);
+}
@@ -0,0 +1,97 @@
+/*
+ * smb2-handler - SMB2 file system client
+ *
+ * Copyright (C) 2025 by the smb2-handler authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the smb2-handler
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DIRCACHE_H
+#define DIRCACHE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+
+#define DIRCACHE_MIN_BUCKETS 16
+
+// Results of LookupDirCache()
+#define DIRCACHE_UNKNOWN   -1  // parent directory not cached (or stale)
+#define DIRCACHE_NOT_FOUND 0   // parent directory cached, no such name
+#define DIRCACHE_FOUND     1
+
+struct DirCacheEntry {
+    struct DirCacheEntry* next; // Next entry in the same bucket
+    uint32_t hash;              // Hash of the case folded name
+    struct smb2_stat_64 st;
+    char name[1];
+};
+
+struct DirCacheDir {
+    struct DirCacheDir* next;   // Next directory, least recently used last
+    char* path;
+    uint32_t hash;              // Hash of the case folded path
+    time_t time;                // When the listing was read or last found unchanged
+    time_t listed;              // When the listing was read
+    int stamped;                // The times of the directory itself are known
+    uint64_t mtime, mtime_nsec; // LastWriteTime of the directory
+    uint64_t ctime, ctime_nsec; // ChangeTime of the directory
+    size_t count;               // Number of entries
+    size_t numBuckets;          // Always a power of two
+    struct DirCacheEntry** buckets;
+    size_t bytes;               // Memory used by the listing
+};
+
+struct DirCache {
+    struct DirCacheDir* dirs;
+    size_t numDirs;
+    size_t maxDirs;             // Number of listings to keep
+    int ttl;                    // Seconds a listing is trusted
+    int maxAge;                 // Seconds an unchanged listing may be reused
+    size_t bytes;               // Memory used by all listings
+};
+
+struct DirSnapshotEntry {
+    struct smb2_stat_64 st;
+    const char* name;
+};
+
+// A copy of a listing, which stays valid whatever happens to the cache
+struct DirSnapshot {
+    size_t count;
+    struct DirSnapshotEntry entries[1];
+};
+
+
+// Prototypes
+struct DirCache* AllocateDirCache(size_t maxDirs, int ttl, int maxAge);
+void FreeDirCache(struct DirCache* cache);
+struct DirCacheDir* BeginDirListing(const char* path);
+int AddDirListingEntry(struct DirCacheDir* dir, const char* name, const struct smb2_stat_64* st);
+void SetDirListingStamp(struct DirCacheDir* dir, const struct smb2_stat_64* st);
+void AbortDirListing(struct DirCacheDir* dir);
+void CommitDirListing(struct DirCache* cache, struct DirCacheDir* dir);
+int LookupDirCache(struct DirCache* cache, const char* path, struct smb2_stat_64* st);
+void InvalidateDirCache(struct DirCache* cache, const char* path);
+size_t TrimDirCache(struct DirCache* cache, size_t maxBytes);
+int CanSnapshotDirListing(struct DirCache* cache, const char* path);
+struct DirSnapshot* SnapshotDirListing(struct DirCache* cache, const char* path, const struct smb2_stat_64* st);
+void FreeDirSnapshot(struct DirSnapshot* snap);
+
+#endif /* DIRCACHE_H */
@@ -24,6 +24,7 @@
 
 #include "smb2fs.h"
 #include "marshalling.h"
+#include "dircache.h"
 
 #include <dos/filehandler.h>
 #ifndef __amigaos4__
@@ -65,7 +66,10 @@ static const char cmd_template[] =
 	"READONLY/S,"
 	"NOPASSWORDREQ/S,"
 	"NOHANDLESRCV/S,"
-	"RECONNECTREQ/S";
+	"RECONNECTREQ/S,"
+	"STATFSCACHE/K/N,"
+	"MEMBUDGET/K/N,"
+	"LOCALLOCKS/S";
 
 enum {
 	ARG_URL,
@@ -77,6 +81,9 @@ enum {
 	ARG_NOPASSWORDREQ,
 	ARG_NO_HANDLES_RCV,
 	ARG_RECONNECT_REQ,
+	ARG_STATFS_CACHE,
+	ARG_MEM_BUDGET,
+	ARG_LOCAL_LOCKS,
 	NUM_ARGS
 };
 
@@ -90,12 +97,158 @@ struct smb2fs_mount_data {
 #endif
 };
 
+/*
+ * Small companion files (icons) are read in the background when they show up
+ * in a directory listing, so that Workbench opening a drawer doesn't need an
+ * open/read/close round trip sequence for every single icon.
+ */
+#define PREFETCH_MAX_FILE  (32 * 1024)  // largest file that is prefetched
+#define PREFETCH_MAX_BYTES (512 * 1024) // total size of the prefetch cache
+#define PREFETCH_TTL       10           // seconds before cached data is stale
+
+/*
+ * Listings of recently read directories, used to answer getattr and open
+ * on names in them (or prove that there is no such name) locally. Listing a
+ * directory again only checks its times, and if they haven't changed hands
+ * out the cached listing instead of enumerating the directory once more.
+ */
+#define DIRCACHE_MAX_DIRS  16
+#define DIRCACHE_TTL       5
+#define DIRCACHE_MAX_AGE   60 // seconds before a directory is enumerated anyway
+
+/*
+ * The prefetch cache, the directory cache and the requests queued in libsmb2
+ * are all charged against one memory budget (see smb2fs_mem_admit()).
+ */
+#define MEM_BUDGET_MIN      256 // KB
+#define MEM_STALL_TIMEOUT   2   // seconds to wait for queued requests to drain
+
+/*
+ * Work done from the filesysbox event loop, between packets, where no
+ * operation holds pointers into the caches.
+ */
+#define HOUSEKEEPING_PERIOD 1000 // milliseconds
+
+/*
+ * Record locks are SMB2 byte range locks. With LOCALLOCKS files are opened
+ * with an exclusive oplock, and while it is held no one else can have the
+ * file open, so locks are granted locally and only sent to the server (in
+ * one batch) when the oplock is broken.
+ */
+#define LOCK_WAIT_TIMEOUT   5   // seconds a blocking lock request is retried
+#define LOCK_RETRY_DELAY    10  // ticks between attempts
+
+/*
+ * AmigaDOS protection bits and file comments are kept in extended attributes
+ * on the server. Directory listings carry the EA size of every entry, so
+ * only entries that have EAs at all are queried, and those of a whole
+ * listing all at once.
+ */
+#define META_EA_MODE        "AMIGA.MODE"    // protection bits, 4 bytes big endian
+#define META_EA_COMMENT     "AMIGA.COMMENT"
+#define META_XATTR_COMMENT  "user.amiga.comment"
+#define META_MAX_ENTRIES    256
+#define META_COMMENT_MAX    79  // longest comment AmigaDOS allows
+#define META_WAIT_TIMEOUT   5   // seconds to wait for the queried EAs
+
+/*
+ * The protection bits that a mode carries. filesysbox hands SetProtection()
+ * to chmod() as a mode and makes the protection of Examine() from st_mode,
+ * so these are all the handler ever gets or gives. The delete, script,
+ * pure, archive and hold bits in AMIGA.MODE (set by other clients, say)
+ * are kept as they are, but can neither be set nor seen through here.
+ */
+#define META_PROT_MODE_BITS (FIBF_READ|FIBF_WRITE|FIBF_EXECUTE| \
+                             FIBF_GRP_READ|FIBF_GRP_WRITE|FIBF_GRP_EXECUTE| \
+                             FIBF_OTR_READ|FIBF_OTR_WRITE|FIBF_OTR_EXECUTE)
+
+#ifndef ENODATA
+#define ENODATA ENOENT
+#endif
+
+enum {
+	PREFETCH_PENDING,
+	PREFETCH_READY,
+	PREFETCH_FAILED
+};
+
+struct smb2fs_prefetch {
+	struct smb2fs_prefetch *next;
+	char                   *path;    /* handler path, with initial slash */
+	uint8_t                *data;
+	uint32_t                size;    /* size from the directory entry */
+	uint32_t                length;  /* bytes actually read */
+	uint64_t                mtime;   /* modification time from the directory entry */
+	time_t                  time;    /* when the read was sent */
+	uint64_t                msgid;   /* message id of the compound, to cancel it */
+	int                     state;
+	int                     users;   /* open handles and waiters */
+	BOOL                    discard; /* free as soon as it is unused */
+};
+
+enum {
+	META_PENDING,
+	META_READY,
+	META_FAILED
+};
+
+/* What the EAs of a file say about it */
+struct smb2fs_meta {
+	struct smb2fs_meta     *next;
+	char                   *path;       /* handler path, with initial slash */
+	uint64_t                ctime;      /* change time the EAs were read at */
+	uint64_t                ctime_nsec;
+	int                     state;
+	BOOL                    discard;    /* free as soon as the query is done */
+	BOOL                    expired;    /* given up on, no longer in meta_pending */
+	BOOL                    has_prot;
+	uint32_t                prot;       /* AmigaDOS protection bits */
+	char                   *comment;    /* NULL if there is none */
+	size_t                  bytes;      /* counted in meta_bytes */
+};
+
+/* A record lock held through an open file */
+struct smb2fs_reclock {
+	struct smb2fs_reclock  *next;
+	uint64_t                offset;
+	uint64_t                length;
+	uint32_t                flags;    /* SMB2_LOCKFLAG_SHARED_LOCK or _EXCLUSIVE_LOCK */
+	BOOL                    local;    /* granted under the oplock, not sent yet */
+};
+
+/* An open file, so that metadata operations by path can use its handle */
+struct smb2fs_openfile {
+	struct smb2fs_openfile *next;
+	char                   *path;     /* handler path, with initial slash */
+	struct smb2fh          *smb2fh;
+	BOOL                    writable; /* opened with write attribute access */
+	int64_t                 eof;      /* size as far as we know it, -1 if not yet */
+	struct smb2fs_reclock  *locks;
+};
+
 struct smb2fs {
 	struct smb2_context *smb2;
 	struct PointerHandleRegistry *phr;
 	BOOL                 rdonly:1;
 	BOOL                 connected:1;
+	BOOL                 peer_dead:1;
+	BOOL                 sfs_refreshing:1;
+	BOOL                 sfs_stale:1;
 	char                *rootdir;
+	char                *dfspath;     /* DFS path the mount was redirected for */
+	struct smb2_statvfs  sfs_cache;   /* last statfs result, adjusted locally */
+	struct smb2_statvfs  sfs_refresh; /* target of the background refresh */
+	time_t               sfs_time;    /* when sfs_cache was fetched, 0 if never */
+	struct DirCache     *dc;          /* recent directory listings */
+	struct PointerHandleRegistry *ds_phr; /* directories listed from dc */
+	struct PointerHandleRegistry *pf_phr; /* handles served from pf_list */
+	struct smb2fs_prefetch *pf_list;  /* most recently used first */
+	size_t               pf_bytes;
+	struct smb2fs_openfile *of_list;
+	struct smb2fs_meta  *meta_list;   /* most recently used first */
+	size_t               meta_count;
+	size_t               meta_bytes;
+	int                  meta_pending; /* EA queries in flight */
 };
 
 struct smb2fs *fsd;
@@ -103,8 +256,138 @@ uint32_t phr_incarnation = 1;
 BOOL cfg_reconnect_req = FALSE;
 BOOL cfg_handles_rcv = TRUE; // recover handles (experimental)
 char last_server[128];
+LONG cfg_statfs_age = 5; // seconds before cached statfs data is refreshed
+LONG cfg_mem_budget = 2048; // KB of caches and queued requests
+BOOL cfg_local_locks = FALSE; // open files with an exclusive oplock
+
+/* Send an ECHO after this many seconds without traffic from the server */
+#define KEEPALIVE_IDLE 20
+
+/* DFS targets tried before giving up on a referral */
+#define DFS_MAX_TRIES 4
+
+/* The NTLMv2 key of the last login, handed to the context of a reconnect */
+static uint8_t ntlm_key[16];
+static BOOL    have_ntlm_key;
 
 static void smb2fs_destroy(void *initret);
+static void smb2fs_prefetch_flush(void);
+static void smb2fs_openfile_flush(void);
+static void smb2fs_meta_flush(void);
+static void smb2fs_oplock_break(struct smb2_context *smb2, int status,
+                                struct smb2_oplock_or_lease_break_reply *rep,
+                                uint8_t *new_oplock_level, uint32_t *new_lease_state);
+static void smb2fs_path_changed(const char *path);
+#ifndef __amigaos4__
+static int smb2fs_mem_emergency(void);
+static volatile BOOL mem_emergency; /* an allocation failed */
+static struct Task  *mem_task;      /* the one that may evict from inside malloc() */
+static int           pf_walking;    /* pf_list is being walked with a saved next */
+#endif
+
+static void smb2fs_peer_dead(struct smb2_context *smb2, void *cb_data)
+{
+	KPrintF((STRPTR)"[smb2fs] server stopped responding: %s\n", smb2_get_error(smb2));
+	if (fsd != NULL && fsd->smb2 == smb2)
+		fsd->peer_dead = TRUE;
+}
+
+/*
+ * If the share is a DFS namespace, move the mount to the share that holds
+ * the data. A target on the server we are connected to is reached over the
+ * session we already have, one on another server needs a connection of its
+ * own. Only shares that say they are in a namespace are asked about, so
+ * other mounts do not pay for the referral. If link is set the share is a
+ * DFS link, connected to through IPC$, and a target must be found. On a
+ * redirect *dfsroot is set to the path on the target share the mount starts
+ * at ('/' separated, possibly empty); it stays NULL if the share is not in
+ * a DFS namespace and the mount stays where it is. The DFS path is kept in
+ * fsd->dfspath, see smb2fs_dfs_moved(). Returns -1 if no connection is
+ * left.
+ */
+static int smb2fs_dfs_redirect(struct smb2_url *url, const char *username, char **dfsroot, BOOL link)
+{
+	char  dfspath[MAXPATHLEN];
+	char  target[MAXPATHLEN];
+	char *server, *share, *rest, *p;
+	int   tries;
+
+	if (!link && !(smb2_get_share_capabilities(fsd->smb2) & SMB2_SHARE_CAP_DFS))
+		return 0;
+
+	snprintf(dfspath, sizeof(dfspath), "\\%s\\%s", url->server, url->share);
+	if (url->path != NULL && url->path[0] != '\0')
+	{
+		strlcat(dfspath, "\\", sizeof(dfspath));
+		strlcat(dfspath, url->path, sizeof(dfspath));
+	}
+	for (p = dfspath; *p != '\0'; p++)
+	{
+		if (*p == '/')
+			*p = '\\';
+	}
+
+	for (tries = 0; tries < DFS_MAX_TRIES; tries++)
+	{
+		if (smb2_dfs_resolve(fsd->smb2, dfspath, target, sizeof(target)) < 0)
+			break;
+
+		server = target + 1;
+		share = strchr(server, '\\');
+		if (share == NULL)
+			break;
+		*share++ = '\0';
+		rest = strchr(share, '\\');
+		if (rest != NULL)
+			*rest++ = '\0';
+		else
+			rest = share + strlen(share);
+
+		KPrintF((STRPTR)"[smb2fs] DFS: %s -> \\%s\\%s\\%s\n", dfspath, server, share, rest);
+
+		if (strcasecmp(server, url->server) == 0)
+		{
+			// A root referral back to the share we are on
+			if (strcasecmp(share, url->share) == 0)
+				break;
+			if (smb2_connect_tree(fsd->smb2, share) == 0)
+				goto redirected;
+		}
+		else
+		{
+			smb2_disconnect_share(fsd->smb2);
+			if (smb2_connect_share(fsd->smb2, server, share, username) == 0)
+				goto redirected;
+			// The referral stays cached, so the namespace server is not
+			// needed for the next target.
+		}
+
+		KPrintF((STRPTR)"[smb2fs] DFS target failed: %s\n", smb2_get_error(fsd->smb2));
+		smb2_dfs_target_failed(dfspath);
+	}
+
+	// A link has nothing of its own to stay on
+	if (link)
+		return -1;
+
+	// Stay on the namespace share, which is better than nothing
+	if (smb2_get_fd(fsd->smb2) < 0 &&
+	    smb2_connect_share(fsd->smb2, url->server, url->share, username) < 0)
+	{
+		return -1;
+	}
+	return 0;
+
+redirected:
+	for (p = rest; *p != '\0'; p++)
+	{
+		if (*p == '\\')
+			*p = '/';
+	}
+	*dfsroot = strdup(rest);
+	fsd->dfspath = strdup(dfspath);
+	return 0;
+}
 
 static void *smb2fs_init(struct fuse_conn_info *fci)
 {
@@ -114,6 +397,9 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 	const char               *username;
 	const char               *password;
 	const char               *domain;
+	char                     *dfsroot = NULL;
+	BOOL                      dfs_link = FALSE;
+	const char               *rootarg;
 
 	md = fuse_get_context()->private_data;
 
@@ -123,6 +409,23 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 	if (md->args[ARG_NO_HANDLES_RCV])
 		cfg_handles_rcv = FALSE;
 
+	if (md->args[ARG_STATFS_CACHE])
+	{
+		cfg_statfs_age = *(LONG *)md->args[ARG_STATFS_CACHE];
+		if (cfg_statfs_age < 0)
+			cfg_statfs_age = 0;
+	}
+
+	if (md->args[ARG_MEM_BUDGET])
+	{
+		cfg_mem_budget = *(LONG *)md->args[ARG_MEM_BUDGET];
+		if (cfg_mem_budget < MEM_BUDGET_MIN)
+			cfg_mem_budget = MEM_BUDGET_MIN;
+	}
+
+	if (md->args[ARG_LOCAL_LOCKS])
+		cfg_local_locks = TRUE;
+
 	fsd = calloc(1, sizeof(*fsd));
 	if (fsd == NULL)
 	{
@@ -139,6 +442,44 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 		return NULL;
 	}
 
+	fsd->pf_phr = AllocateNewRegistry(phr_incarnation++);
+	if (fsd->pf_phr == NULL)
+	{
+		request_error("Failed to allocate memory for the pointer handle registry");
+		FreeRegistry(fsd->phr);
+		free(fsd);
+		fsd = NULL;
+		return NULL;
+	}
+
+	fsd->ds_phr = AllocateNewRegistry(phr_incarnation++);
+	if (fsd->ds_phr == NULL)
+	{
+		request_error("Failed to allocate memory for the pointer handle registry");
+		FreeRegistry(fsd->pf_phr);
+		FreeRegistry(fsd->phr);
+		free(fsd);
+		fsd = NULL;
+		return NULL;
+	}
+
+	fsd->dc = AllocateDirCache(DIRCACHE_MAX_DIRS, DIRCACHE_TTL, DIRCACHE_MAX_AGE);
+	if (fsd->dc == NULL)
+	{
+		request_error("Failed to allocate memory for the directory cache");
+		FreeRegistry(fsd->ds_phr);
+		FreeRegistry(fsd->pf_phr);
+		FreeRegistry(fsd->phr);
+		free(fsd);
+		fsd = NULL;
+		return NULL;
+	}
+
+#ifndef __amigaos4__
+	mem_task = FindTask(NULL);
+	set_malloc_reclaim(smb2fs_mem_emergency);
+#endif
+
 	if (md->args[ARG_READONLY])
 		fsd->rdonly = TRUE;
 
@@ -204,6 +545,13 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 		smb2_set_password(fsd->smb2, "");
 	}
 
+	/* Spare a reconnect deriving the NTLMv2 key once more */
+	if (have_ntlm_key)
+	{
+		smb2_set_ntlm_key(fsd->smb2, username ? username : smb2_get_user(fsd->smb2),
+			smb2_get_domain(fsd->smb2), ntlm_key);
+	}
+
 	// CONNECTION DEBUG: Log connection attempt details
 	KPrintF((STRPTR)"=== SMB2 CONNECTION ATTEMPT ===\n");
 	KPrintF((STRPTR)"Server: %s\n", url->server ? url->server : "(null)");
@@ -214,6 +562,13 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 	KPrintF((STRPTR)"Calling smb2_connect_share()...\n");
 	int connect_result = smb2_connect_share(fsd->smb2, url->server, url->share, username);
 	KPrintF((STRPTR)"smb2_connect_share() returned: %d\n", connect_result);
+
+	// A DFS link is no share of its own, its referral comes through IPC$
+	if (connect_result < 0 && smb2_get_nterror(fsd->smb2) == SMB2_STATUS_PATH_NOT_COVERED)
+	{
+		dfs_link = TRUE;
+		connect_result = smb2_connect_share(fsd->smb2, url->server, "IPC$", username);
+	}
 	
 	if (connect_result < 0)
 	{
@@ -226,6 +581,8 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 	}
 	else
 	{
+		have_ntlm_key = smb2_get_ntlm_key(fsd->smb2, ntlm_key) == 0;
+
 		KPrintF("[%lu] CONNECTION SUCCESS! Checking socket...\n", (ULONG)time(NULL));
 		int initial_fd = smb2_get_fd(fsd->smb2);
 		KPrintF("[%lu] Initial socket fd after connection: %d\n", (ULONG)time(NULL), initial_fd);
@@ -315,10 +672,27 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 		}
 	}
 
+	if (smb2fs_dfs_redirect(url, username, &dfsroot, dfs_link) < 0)
+	{
+		request_error("Failed to connect to %s/%s.\n%s", url->server, url->share,
+		              smb2_get_error(fsd->smb2));
+		smb2_destroy_url(url);
+		smb2fs_destroy(fsd);
+		return NULL;
+	}
+
 	// Configure timeout to prevent errno:60 timeouts during large uploads.
 	// Default 250ms timeout is too aggressive for Samba server delays.
 	// Disable libsmb2 timeout entirely for stable large file transfers.
 	smb2_set_timeout(fsd->smb2, 0);  // Returns void, no error checking needed
+
+	// Idle keepalive with RTT based dead peer detection. This replaces the
+	// fixed 20 second ECHO that used to be sent from the read/write loops.
+	smb2_set_keepalive(fsd->smb2, KEEPALIVE_IDLE, 0, smb2fs_peer_dead, NULL);
+
+	// Record locks granted locally must reach the server before an oplock
+	// break is acknowledged.
+	smb2_set_oplock_or_lease_break_callback(fsd->smb2, smb2fs_oplock_break);
 	
 	// Configure socket timeouts for stability while maintaining libsmb2's expected blocking behavior
 	// REMOVED: O_NONBLOCK setting which conflicted with libsmb2's internal state machine
@@ -356,9 +730,18 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 
 	fsd->connected = TRUE;
 
-	if (url->path != NULL && url->path[0] != '\0')
+	// The size of the volume came along with the tree connect, so the
+	// first Info() after mounting or reconnecting needs no round trip.
+	if (smb2_get_share_statvfs(fsd->smb2, &fsd->sfs_cache) == 0)
+	{
+		fsd->sfs_time  = time(NULL);
+		fsd->sfs_stale = FALSE;
+	}
+
+	rootarg = (dfsroot != NULL) ? dfsroot : url->path;
+	if (rootarg != NULL && rootarg[0] != '\0')
 	{
-		const char *patharg = url->path;
+		const char *patharg = rootarg;
 		int         pos     = 0;
 		char        pathbuf[MAXPATHLEN];
 		char        namebuf[256];
@@ -399,6 +782,7 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 			if (fsd->rootdir == NULL)
 			{
 				request_error("Failed to allocate memory for the root directory");
+				free(dfsroot);
 				smb2_destroy_url(url);
 				smb2fs_destroy(fsd);
 				return NULL;
@@ -419,6 +803,7 @@ static void *smb2fs_init(struct fuse_conn_info *fci)
 		}
 	}
 
+	free(dfsroot);
 	smb2_destroy_url(url);
 	url = NULL;
 
@@ -448,6 +833,10 @@ static void smb2fs_destroy(void *initret)
 		fsd->smb2 = NULL;
 	}
 
+	smb2fs_prefetch_flush();
+	smb2fs_openfile_flush();
+	smb2fs_meta_flush();
+
 	if (fsd->rootdir != NULL)
 	{
 		// KPrintF((STRPTR)"[smb2fs] smb2fs_destroy => free root dir.\n");
@@ -456,12 +845,33 @@ static void smb2fs_destroy(void *initret)
 		fsd->rootdir = NULL;
 	}
 
+	free(fsd->dfspath);
+	fsd->dfspath = NULL;
+
 	if (fsd->phr != NULL)
 	{
 		FreeRegistry(fsd->phr);
 		fsd->phr = NULL;
 	}
 
+	if (fsd->pf_phr != NULL)
+	{
+		FreeRegistry(fsd->pf_phr);
+		fsd->pf_phr = NULL;
+	}
+
+	if (fsd->ds_phr != NULL)
+	{
+		FreeRegistry(fsd->ds_phr);
+		fsd->ds_phr = NULL;
+	}
+
+	if (fsd->dc != NULL)
+	{
+		FreeDirCache(fsd->dc);
+		fsd->dc = NULL;
+	}
+
 
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_destroy => free fsd.\n");
 	free(fsd);
@@ -513,11 +923,19 @@ static int handle_connection_fault()
 	smb2_destroy_context(fsd->smb2);
 	fsd->smb2 = NULL;
 
+	smb2fs_prefetch_flush();
+	smb2fs_openfile_flush();
+	smb2fs_meta_flush();
+	FreeRegistry(fsd->pf_phr);
+	FreeRegistry(fsd->ds_phr);
+	FreeDirCache(fsd->dc);
+
 	if (fsd->rootdir != NULL)
 	{
 		free(fsd->rootdir);
 		fsd->rootdir = NULL;
 	}
+	free(fsd->dfspath);
 	free(fsd);
 	fsd = NULL;
 
@@ -533,6 +951,125 @@ static int handle_connection_fault()
 	return FALSE;
 }
 
+/*
+ * A path based operation failed with STATUS_PATH_NOT_COVERED: the DFS
+ * target the mount was redirected to no longer holds its part of the
+ * namespace (the link was moved, or the target taken out of it). Tell the
+ * referral cache and mount again, which goes through the cache to the
+ * next target, or through a new referral once no target is left. Returns
+ * TRUE if the operation is to be tried again on the new mount.
+ */
+static BOOL smb2fs_dfs_moved(void)
+{
+	char dfspath[MAXPATHLEN];
+
+	if (fsd->dfspath == NULL ||
+	    smb2_get_nterror(fsd->smb2) != SMB2_STATUS_PATH_NOT_COVERED)
+		return FALSE;
+
+	KPrintF((STRPTR)"[smb2fs] DFS target no longer covers %s\n", fsd->dfspath);
+	strlcpy(dfspath, fsd->dfspath, sizeof(dfspath));
+	smb2_dfs_target_failed(dfspath);
+
+	smb2fs_destroy(fsd);
+	return smb2fs_init(NULL) != NULL;
+}
+
+/*
+ * Did an operation fail because the connection is gone, or for a reason of
+ * its own? -1 is both what the sync calls return when the transport fails
+ * and -EPERM from the server, so then an ECHO has to tell.
+ */
+static BOOL smb2fs_connection_lost(int rc)
+{
+	if (fsd->peer_dead)
+		return TRUE;
+
+	switch (rc)
+	{
+		case -ENETRESET:
+		case -ECONNRESET:
+		case -ENOTCONN:
+		case -EPIPE:
+			return TRUE;
+		case -1:
+			return smb2_echo(fsd->smb2) < 0;
+	}
+
+	return FALSE;
+}
+
+/*
+ * If the keepalive has declared the server dead, throw the connection away
+ * so that the caller goes through the normal reconnect path right away
+ * instead of hanging on a socket timeout.
+ */
+static BOOL smb2fs_peer_lost(void)
+{
+	if (!fsd->peer_dead)
+		return FALSE;
+
+	fsd->connected = FALSE; /* no point in a TREE_DISCONNECT */
+	smb2fs_destroy(fsd);
+
+	return TRUE;
+}
+
+/*
+ * Handle any replies that are already waiting on the socket without blocking,
+ * so that a background statfs refresh can complete between operations.
+ */
+static void smb2fs_service_pending(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd      = smb2_get_fd(fsd->smb2);
+	pfd.events  = smb2_which_events(fsd->smb2);
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, 0) > 0)
+		smb2_service(fsd->smb2, pfd.revents);
+}
+
+static void smb2fs_statfs_cb(struct smb2_context *smb2, int status, void *command_data, void *cb_data)
+{
+	struct smb2fs *fs = cb_data;
+
+	fs->sfs_refreshing = FALSE;
+	if (status == 0)
+	{
+		fs->sfs_cache = fs->sfs_refresh;
+		fs->sfs_time  = time(NULL);
+	}
+}
+
+/*
+ * Keep the cached free space roughly in step with our own changes until the
+ * next refresh. Frees whose size we don't know just mark the cache stale.
+ */
+static void smb2fs_statfs_charge(uint64_t bytes, int files)
+{
+	struct smb2_statvfs *c = &fsd->sfs_cache;
+	uint64_t             blocks;
+
+	if (fsd->sfs_time == 0 || c->f_frsize == 0)
+		return;
+
+	blocks = (bytes + c->f_frsize - 1) / c->f_frsize;
+	c->f_bfree  = c->f_bfree > blocks ? c->f_bfree - blocks : 0;
+	c->f_bavail = c->f_bavail > blocks ? c->f_bavail - blocks : 0;
+
+	if (files > 0)
+	{
+		c->f_ffree  = c->f_ffree > (uint32_t)files ? c->f_ffree - files : 0;
+		c->f_favail = c->f_favail > (uint32_t)files ? c->f_favail - files : 0;
+	}
+}
+
+static void smb2fs_statfs_expire(void)
+{
+	fsd->sfs_stale = TRUE;
+}
 
 static int smb2fs_statfs(const char *path, struct statvfs *sfs)
 {
@@ -543,7 +1080,7 @@ static int smb2fs_statfs(const char *path, struct statvfs *sfs)
 	uint32_t            frsize;
 	uint64_t            blocks, bfree, bavail;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 		/*
 		* trying to reconnect in smb2fs_statfs could be cumbersome usability,
 		* do to the frequent polls triggered somewhere in either AmigaDOS or filesysbox.library.
@@ -565,20 +1102,44 @@ static int smb2fs_statfs(const char *path, struct statvfs *sfs)
 
 	// debug_print_smb2_context(fsd->smb2);
 
-	do {
-		rc = smb2_statvfs(fsd->smb2, path, &smb2_sfs);
-		if(rc < -1)
-		{
-			// KPrintF("[smb2fs_statfs] r2: %ld\n", rc);
-			// KPrintF("[smb2fs_statfs] r2_text: %s\n", nterror_to_str(rc));
-			return rc;
-		}
-		else if (rc < 0)
+	if (cfg_statfs_age > 0 && fsd->sfs_time != 0)
+	{
+		/* Answer from the cache and refresh it in the background */
+		smb2fs_service_pending();
+
+		if (!fsd->peer_dead && !fsd->sfs_refreshing &&
+			(fsd->sfs_stale || time(NULL) - fsd->sfs_time >= cfg_statfs_age))
 		{
-			if(!handle_connection_fault())
-				return -ENODEV;
+			if (smb2_statvfs_async(fsd->smb2, path, &fsd->sfs_refresh, smb2fs_statfs_cb, fsd) == 0)
+			{
+				fsd->sfs_refreshing = TRUE;
+				fsd->sfs_stale = FALSE;
+			}
 		}
-	} while(rc < 0);
+
+		smb2_sfs = fsd->sfs_cache;
+	}
+	else
+	{
+		do {
+			rc = smb2_statvfs(fsd->smb2, path, &smb2_sfs);
+			if(rc < -1)
+			{
+				// KPrintF("[smb2fs_statfs] r2: %ld\n", rc);
+				// KPrintF("[smb2fs_statfs] r2_text: %s\n", nterror_to_str(rc));
+				return rc;
+			}
+			else if (rc < 0)
+			{
+				if(!handle_connection_fault())
+					return -ENODEV;
+			}
+		} while(rc < 0);
+
+		fsd->sfs_cache = smb2_sfs;
+		fsd->sfs_time  = time(NULL);
+		fsd->sfs_stale = FALSE;
+	}
 
 	frsize = smb2_sfs.f_frsize;
 	blocks = smb2_sfs.f_blocks;
@@ -632,7 +1193,7 @@ static void smb2fs_fillstat(struct fbx_stat *stbuf, const struct smb2_stat_64 *s
 			stbuf->st_mode = S_IFLNK;
 			break;
 	}
-	stbuf->st_mode |= S_IRWXU; /* Can we do something better? */
+	stbuf->st_mode |= S_IRWXU; /* unless the EAs say otherwise, see smb2fs_meta_apply() */
 
 	stbuf->st_ino       = smb2_st->smb2_ino;
 	stbuf->st_nlink     = smb2_st->smb2_nlink;
@@ -645,149 +1206,1559 @@ static void smb2fs_fillstat(struct fbx_stat *stbuf, const struct smb2_stat_64 *s
 	stbuf->st_ctimensec = smb2_st->smb2_ctime_nsec;
 }
 
-static int smb2fs_getattr(const char *path, struct fbx_stat *stbuf)
+/* Paths compare like AmigaDOS names do, without regard to case */
+static BOOL smb2fs_path_match(const char *a, const char *b, size_t len)
 {
-	// KPrintF((STRPTR)"[smb2fs] smb2fs_getattr started.\n");
-	struct smb2_stat_64 smb2_st;
-	int                 rc;
-	char                pathbuf[MAXPATHLEN];
+	size_t i;
 
-	if (fsd == NULL)
+	for (i = 0; i < len; i++)
 	{
-		if(cfg_reconnect_req)
-		{
-			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
-				return -ENODEV;
-		}
-		else if(!smb2fs_init(NULL))
-			return -ENODEV;
+		if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+			return FALSE;
+		if (a[i] == '\0')
+			break;
 	}
 
-	if (fsd->rootdir != NULL)
+	return TRUE;
+}
+
+static void smb2fs_openfile_add(const char *path, struct smb2fh *smb2fh, BOOL writable)
+{
+	struct smb2fs_openfile *of;
+
+	of = calloc(1, sizeof(*of));
+	if (of == NULL)
+		return;
+
+	of->path = strdup(path);
+	if (of->path == NULL)
 	{
-		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
-		strlcat(pathbuf, path, sizeof(pathbuf));
-		path = pathbuf;
+		free(of);
+		return;
+	}
+	of->smb2fh   = smb2fh;
+	of->writable = writable;
+	of->eof      = -1;
+
+	of->next = fsd->of_list;
+	fsd->of_list = of;
+}
+
+/* Locks go away with the handle, the server releases them on close */
+static void smb2fs_reclock_free(struct smb2fs_openfile *of)
+{
+	struct smb2fs_reclock *lk, *next;
+
+	for (lk = of->locks; lk != NULL; lk = next)
+	{
+		next = lk->next;
+		free(lk);
+	}
+	of->locks = NULL;
+}
+
+static void smb2fs_openfile_remove(struct smb2fh *smb2fh)
+{
+	struct smb2fs_openfile **pp, *of;
+
+	for (pp = &fsd->of_list; (of = *pp) != NULL; pp = &of->next)
+	{
+		if (of->smb2fh == smb2fh)
+		{
+			*pp = of->next;
+			smb2fs_reclock_free(of);
+			free(of->path);
+			free(of);
+			break;
+		}
+	}
+}
+
+static void smb2fs_openfile_flush(void)
+{
+	struct smb2fs_openfile *of, *next;
+
+	for (of = fsd->of_list; of != NULL; of = next)
+	{
+		next = of->next;
+		smb2fs_reclock_free(of);
+		free(of->path);
+		free(of);
+	}
+	fsd->of_list = NULL;
+}
+
+static struct smb2fs_openfile *smb2fs_openfile_get(struct smb2fh *smb2fh)
+{
+	struct smb2fs_openfile *of;
+
+	for (of = fsd->of_list; of != NULL; of = of->next)
+	{
+		if (of->smb2fh == smb2fh)
+			return of;
+	}
+
+	return NULL;
+}
+
+/* Find an open handle for path, one that can change attributes if writable is set */
+static struct smb2fh *smb2fs_openfile_find(const char *path, BOOL writable)
+{
+	struct smb2fs_openfile *of;
+
+	for (of = fsd->of_list; of != NULL; of = of->next)
+	{
+		if ((of->writable || !writable) && smb2fs_path_match(of->path, path, strlen(path) + 1))
+			return of->smb2fh;
+	}
+
+	return NULL;
+}
+
+/* The file at path was truncated or extended to size */
+static void smb2fs_openfile_resized(const char *path, int64_t size)
+{
+	struct smb2fs_openfile *of;
+
+	for (of = fsd->of_list; of != NULL; of = of->next)
+	{
+		if (smb2fs_path_match(of->path, path, strlen(path) + 1))
+			of->eof = size;
+	}
+}
+
+/* Keep tracking open files (and files in directories) that were renamed */
+static void smb2fs_openfile_rename(const char *srcpath, const char *dstpath)
+{
+	struct smb2fs_openfile *of;
+	char                    pathbuf[MAXPATHLEN];
+	char                   *newpath;
+	size_t                  len = strlen(srcpath);
+
+	for (of = fsd->of_list; of != NULL; of = of->next)
+	{
+		if (!smb2fs_path_match(of->path, srcpath, len) ||
+			(of->path[len] != '\0' && of->path[len] != '/'))
+			continue;
+
+		strlcpy(pathbuf, dstpath, sizeof(pathbuf));
+		if (strlcat(pathbuf, of->path + len, sizeof(pathbuf)) >= sizeof(pathbuf))
+			newpath = NULL;
+		else
+			newpath = strdup(pathbuf);
+		if (newpath != NULL)
+		{
+			free(of->path);
+			of->path = newpath;
+		}
+		else
+			of->path[0] = '\0'; /* matches no path */
+	}
+}
+
+/* Stop using the handles of a file that was deleted */
+static void smb2fs_openfile_forget(const char *path)
+{
+	struct smb2fs_openfile *of;
+
+	for (of = fsd->of_list; of != NULL; of = of->next)
+	{
+		if (smb2fs_path_match(of->path, path, strlen(path) + 1))
+			of->path[0] = '\0';
+	}
+}
+
+/* Oplock to request when opening a file */
+static uint8_t smb2fs_oplock_level(void)
+{
+	return cfg_local_locks ? SMB2_OPLOCK_LEVEL_EXCLUSIVE : SMB2_OPLOCK_LEVEL_NONE;
+}
+
+static BOOL smb2fs_reclock_overlap(const struct smb2fs_reclock *lk, uint64_t offset, uint64_t length)
+{
+	return offset < lk->offset + lk->length && lk->offset < offset + length;
+}
+
+/* Lock a range through the handle of an open file and remember it */
+static int smb2fs_reclock_add(struct smb2fs_openfile *of, uint64_t offset, uint64_t length, uint32_t flags)
+{
+	struct smb2fs_reclock    *lk;
+	struct smb2_lock_element  el;
+	int                       rc;
+
+	lk = calloc(1, sizeof(*lk));
+	if (lk == NULL)
+		return -ENOLCK;
+
+	lk->offset = offset;
+	lk->length = length;
+	lk->flags  = flags;
+
+	if (smb2_get_oplock_level(of->smb2fh) >= SMB2_OPLOCK_LEVEL_EXCLUSIVE)
+	{
+		lk->local = TRUE;
+	}
+	else
+	{
+		memset(&el, 0, sizeof(el));
+		el.offset = offset;
+		el.length = length;
+		el.flags  = flags | SMB2_LOCKFLAG_FAIL_IMMEDIATELY;
+
+		rc = smb2_lock(fsd->smb2, of->smb2fh, &el, 1);
+		if (rc < 0)
+		{
+			free(lk);
+			return rc == -EDEADLK ? -EAGAIN : rc;
+		}
+	}
+
+	lk->next = of->locks;
+	of->locks = lk;
+
+	return 0;
+}
+
+/*
+ * Take a lock on behalf of an open file. Like a POSIX lock it replaces the
+ * locks of the same open file where it overlaps them, rather than being
+ * refused because of them. The server would count those as conflicts, so
+ * they are given back first, and the parts of them the new lock leaves
+ * out are locked again after it. Another client can get in between and
+ * take such a part, which is then lost.
+ */
+static int smb2fs_reclock_set(struct smb2fs_openfile *of, uint64_t offset, uint64_t length, uint32_t flags)
+{
+	struct smb2fs_reclock    *lk, **pp, *old = NULL;
+	struct smb2_lock_element  el;
+	uint64_t                  end = offset + length;
+	int                       rc;
+
+	for (pp = &of->locks; (lk = *pp) != NULL; )
+	{
+		if (smb2fs_reclock_overlap(lk, offset, length))
+		{
+			*pp = lk->next;
+			lk->next = old;
+			old = lk;
+		}
+		else
+			pp = &lk->next;
+	}
+
+	for (lk = old; lk != NULL; lk = lk->next)
+	{
+		if (lk->local)
+			continue;
+
+		memset(&el, 0, sizeof(el));
+		el.offset = lk->offset;
+		el.length = lk->length;
+		el.flags  = SMB2_LOCKFLAG_UNLOCK;
+
+		rc = smb2_lock(fsd->smb2, of->smb2fh, &el, 1);
+		if (rc < 0)
+		{
+			/* Leave the list as it was, an UNLOCK fails when the connection goes */
+			while ((lk = old) != NULL)
+			{
+				old = lk->next;
+				lk->next = of->locks;
+				of->locks = lk;
+			}
+			return rc;
+		}
+	}
+
+	rc = smb2fs_reclock_add(of, offset, length, flags);
+
+	while ((lk = old) != NULL)
+	{
+		old = lk->next;
+		if (rc < 0)
+		{
+			/* Not replaced after all, try to have the old one back */
+			smb2fs_reclock_add(of, lk->offset, lk->length, lk->flags);
+		}
+		else
+		{
+			if (lk->offset < offset)
+				smb2fs_reclock_add(of, lk->offset, offset - lk->offset, lk->flags);
+			if (lk->offset + lk->length > end)
+				smb2fs_reclock_add(of, end, lk->offset + lk->length - end, lk->flags);
+		}
+		free(lk);
+	}
+
+	return rc;
+}
+
+/* Try a lock on the server and give it straight back if it was granted */
+static int smb2fs_reclock_probe(struct smb2fs_openfile *of, uint64_t offset, uint64_t length, uint32_t flags)
+{
+	struct smb2_lock_element el;
+	int                      rc;
+
+	memset(&el, 0, sizeof(el));
+	el.offset = offset;
+	el.length = length;
+	el.flags  = flags | SMB2_LOCKFLAG_FAIL_IMMEDIATELY;
+
+	rc = smb2_lock(fsd->smb2, of->smb2fh, &el, 1);
+	if (rc < 0)
+		return rc == -EDEADLK ? -EAGAIN : rc;
+
+	el.flags = SMB2_LOCKFLAG_UNLOCK;
+	return smb2_lock(fsd->smb2, of->smb2fh, &el, 1);
+}
+
+/*
+ * F_GETLK: would a lock conflict with one held by someone else? The locks
+ * of the open file itself never do. The server counts them as conflicts
+ * though, so only the parts of the range they leave free are probed there,
+ * and not at all under an exclusive oplock, as then nobody else has the
+ * file open.
+ */
+static int smb2fs_reclock_test(struct smb2fs_openfile *of, uint64_t offset, uint64_t length, uint32_t flags)
+{
+	struct smb2fs_reclock *lk, *first;
+	uint64_t               pos = offset, end = offset + length;
+	int                    rc;
+
+	if (smb2_get_oplock_level(of->smb2fh) >= SMB2_OPLOCK_LEVEL_EXCLUSIVE)
+		return 0;
+
+	while (pos < end)
+	{
+		first = NULL;
+		for (lk = of->locks; lk != NULL; lk = lk->next)
+		{
+			if (smb2fs_reclock_overlap(lk, pos, end - pos) &&
+				(first == NULL || lk->offset < first->offset))
+				first = lk;
+		}
+		if (first == NULL)
+			return smb2fs_reclock_probe(of, pos, end - pos, flags);
+
+		if (first->offset > pos)
+		{
+			rc = smb2fs_reclock_probe(of, pos, first->offset - pos, flags);
+			if (rc < 0)
+				return rc;
+		}
+		pos = first->offset + first->length;
+	}
+
+	return 0;
+}
+
+/*
+ * Release the locks that lie within a range. SMB2 can only unlock exactly
+ * what was locked, so locks that are only partly covered are kept.
+ */
+static int smb2fs_reclock_clear(struct smb2fs_openfile *of, uint64_t offset, uint64_t length)
+{
+	struct smb2_lock_element  els[SMB2_MAX_LOCK_ELEMENTS];
+	struct smb2fs_reclock   **pp, *lk;
+	int                       count, rc;
+
+	do
+	{
+		count = 0;
+		for (pp = &of->locks; (lk = *pp) != NULL; )
+		{
+			if (lk->offset < offset || lk->offset + lk->length > offset + length)
+			{
+				pp = &lk->next;
+				continue;
+			}
+			if (!lk->local)
+			{
+				if (count == SMB2_MAX_LOCK_ELEMENTS)
+				{
+					pp = &lk->next;
+					continue;
+				}
+				memset(&els[count], 0, sizeof(els[count]));
+				els[count].offset = lk->offset;
+				els[count].length = lk->length;
+				els[count].flags  = SMB2_LOCKFLAG_UNLOCK;
+				count++;
+			}
+			*pp = lk->next;
+			free(lk);
+		}
+
+		if (count > 0)
+		{
+			rc = smb2_lock(fsd->smb2, of->smb2fh, els, count);
+			if (rc < 0)
+				return rc;
+		}
+	} while (count == SMB2_MAX_LOCK_ELEMENTS);
+
+	return 0;
+}
+
+static void smb2fs_reclock_push_cb(struct smb2_context *smb2, int status, void *command_data, void *cb_data)
+{
+	if (status != 0)
+		KPrintF((STRPTR)"[smb2fs] failed to send record locks: %s\n", smb2_get_error(smb2));
+}
+
+/* Send the locks that were granted locally, while the oplock is still ours */
+static void smb2fs_reclock_push(struct smb2fs_openfile *of)
+{
+	struct smb2_lock_element els[SMB2_MAX_LOCK_ELEMENTS];
+	struct smb2fs_reclock   *lk;
+	int                      count = 0;
+
+	for (lk = of->locks; lk != NULL; lk = lk->next)
+	{
+		if (!lk->local)
+			continue;
+
+		memset(&els[count], 0, sizeof(els[count]));
+		els[count].offset = lk->offset;
+		els[count].length = lk->length;
+		els[count].flags  = lk->flags | SMB2_LOCKFLAG_FAIL_IMMEDIATELY;
+		lk->local = FALSE;
+
+		if (++count == SMB2_MAX_LOCK_ELEMENTS)
+		{
+			smb2_lock_async(fsd->smb2, of->smb2fh, els, count, smb2fs_reclock_push_cb, NULL);
+			count = 0;
+		}
+	}
+
+	if (count > 0)
+		smb2_lock_async(fsd->smb2, of->smb2fh, els, count, smb2fs_reclock_push_cb, NULL);
+}
+
+/*
+ * Called for every oplock break, before libsmb2 queues the acknowledgement,
+ * so the locks queued here are seen by the server first.
+ */
+static void smb2fs_oplock_break(struct smb2_context *smb2, int status,
+                                struct smb2_oplock_or_lease_break_reply *rep,
+                                uint8_t *new_oplock_level, uint32_t *new_lease_state)
+{
+	struct smb2fs_openfile *of;
+
+	if (status != 0 || rep == NULL || rep->break_type != SMB2_BREAK_TYPE_OPLOCK_NOTIFICATION)
+		return;
+	if (fsd == NULL || fsd->smb2 != smb2)
+		return;
+
+	for (of = fsd->of_list; of != NULL; of = of->next)
+	{
+		if (memcmp(smb2_get_file_id(of->smb2fh), rep->lock.oplock.file_id, SMB2_FD_SIZE) == 0)
+			smb2fs_reclock_push(of);
+	}
+}
+
+static void smb2fs_meta_unlink(struct smb2fs_meta *m)
+{
+	struct smb2fs_meta **pp;
+
+	for (pp = &fsd->meta_list; *pp != NULL; pp = &(*pp)->next)
+	{
+		if (*pp == m)
+		{
+			*pp = m->next;
+			fsd->meta_count--;
+			break;
+		}
+	}
+}
+
+static void smb2fs_meta_free(struct smb2fs_meta *m)
+{
+	fsd->meta_bytes -= m->bytes;
+	free(m->comment);
+	free(m->path);
+	free(m);
+}
+
+static void smb2fs_meta_flush(void)
+{
+	struct smb2fs_meta *m, *next;
+
+	for (m = fsd->meta_list; m != NULL; m = next)
+	{
+		next = m->next;
+		smb2fs_meta_free(m);
+	}
+	fsd->meta_list    = NULL;
+	fsd->meta_count   = 0;
+	fsd->meta_bytes   = 0;
+	fsd->meta_pending = 0;
+}
+
+/* Free a discarded entry once its query is no longer in flight */
+static void smb2fs_meta_release(struct smb2fs_meta *m)
+{
+	if (m->discard && m->state != META_PENDING)
+	{
+		smb2fs_meta_unlink(m);
+		smb2fs_meta_free(m);
+	}
+}
+
+static void smb2fs_meta_drop(struct smb2fs_meta *m)
+{
+	m->discard = TRUE;
+	smb2fs_meta_release(m);
+}
+
+static struct smb2fs_meta *smb2fs_meta_find(const char *path)
+{
+	struct smb2fs_meta *m;
+	size_t              len = strlen(path) + 1;
+
+	for (m = fsd->meta_list; m != NULL; m = m->next)
+	{
+		if (!m->discard && smb2fs_path_match(m->path, path, len))
+			break;
+	}
+
+	if (m != NULL && m != fsd->meta_list)
+	{
+		smb2fs_meta_unlink(m);
+		m->next = fsd->meta_list;
+		fsd->meta_list = m;
+		fsd->meta_count++;
+	}
+
+	return m;
+}
+
+/* Forget a path, and anything below it, after it was changed */
+static void smb2fs_meta_forget(const char *path)
+{
+	struct smb2fs_meta *m, *next;
+	size_t              len;
+
+	if (path == NULL || fsd->meta_list == NULL)
+		return;
+
+	len = strlen(path);
+	for (m = fsd->meta_list; m != NULL; m = next)
+	{
+		next = m->next;
+		if (smb2fs_path_match(m->path, path, len) && (m->path[len] == '\0' || m->path[len] == '/'))
+			smb2fs_meta_drop(m);
+	}
+}
+
+/* Evict the least recently used entry that is not being queried */
+static BOOL smb2fs_meta_evict(void)
+{
+	struct smb2fs_meta *m, *victim = NULL;
+
+	for (m = fsd->meta_list; m != NULL; m = m->next)
+	{
+		if (m->state != META_PENDING)
+			victim = m;
+	}
+
+	if (victim == NULL)
+		return FALSE;
+
+	smb2fs_meta_unlink(victim);
+	smb2fs_meta_free(victim);
+	return TRUE;
+}
+
+static void smb2fs_meta_parse(struct smb2fs_meta *m, const struct smb2_file_full_ea_info *ea)
+{
+	const uint8_t *v;
+	size_t         len;
+
+	for (;;)
+	{
+		if (smb2fs_path_match(ea->ea_name, META_EA_MODE, sizeof(META_EA_MODE)) && ea->ea_value_length == 4)
+		{
+			v = ea->ea_value;
+			m->prot     = ((uint32_t)v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3];
+			m->has_prot = TRUE;
+		}
+		else if (smb2fs_path_match(ea->ea_name, META_EA_COMMENT, sizeof(META_EA_COMMENT)) && ea->ea_value_length != 0 &&
+			m->comment == NULL)
+		{
+			len = ea->ea_value_length;
+			if (len > META_COMMENT_MAX)
+				len = META_COMMENT_MAX;
+			m->comment = malloc(len + 1);
+			if (m->comment != NULL)
+			{
+				memcpy(m->comment, ea->ea_value, len);
+				m->comment[len] = '\0';
+				m->bytes        += len + 1;
+				fsd->meta_bytes += len + 1;
+			}
+		}
+
+		if (ea->next_entry_offset == 0)
+			break;
+		ea++;
+	}
+}
+
+static void smb2fs_meta_cb(struct smb2_context *smb2, int status, void *command_data, void *cb_data)
+{
+	struct smb2fs_meta *m = cb_data;
+
+	if (!m->expired)
+		fsd->meta_pending--;
+
+	if (status == 0)
+	{
+		if (command_data != NULL)
+		{
+			smb2fs_meta_parse(m, command_data);
+			smb2_free_data(smb2, command_data);
+		}
+		m->state = META_READY;
+	}
+	else
+	{
+		m->state   = META_FAILED;
+		m->discard = TRUE;
+	}
+
+	smb2fs_meta_release(m);
+}
+
+/* Queue the EA query of a file, unless its EAs are known already */
+static void smb2fs_meta_start(const char *path, const struct smb2_stat_64 *st)
+{
+	struct smb2fs_meta *m;
+	char                srvbuf[MAXPATHLEN];
+	const char         *srvpath = path;
+
+	m = smb2fs_meta_find(path);
+	if (m != NULL)
+	{
+		if (m->state == META_PENDING ||
+			(m->ctime == st->smb2_ctime && m->ctime_nsec == st->smb2_ctime_nsec))
+			return;
+		smb2fs_meta_drop(m);
+	}
+
+	while (fsd->meta_count >= META_MAX_ENTRIES)
+	{
+		if (!smb2fs_meta_evict())
+			return;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return;
+
+	m->path = strdup(path);
+	if (m->path == NULL)
+	{
+		free(m);
+		return;
+	}
+	m->ctime      = st->smb2_ctime;
+	m->ctime_nsec = st->smb2_ctime_nsec;
+	m->state      = META_PENDING;
+	m->bytes      = sizeof(*m) + strlen(path) + 1;
+
+	m->next = fsd->meta_list;
+	fsd->meta_list = m;
+	fsd->meta_count++;
+	fsd->meta_bytes += m->bytes;
+
+	if (fsd->rootdir != NULL)
+	{
+		strlcpy(srvbuf, fsd->rootdir, sizeof(srvbuf));
+		strlcat(srvbuf, path, sizeof(srvbuf));
+		srvpath = srvbuf;
+	}
+
+	if (srvpath[0] == '/') srvpath++; /* Remove initial slash */
+
+	if (send_compound_getea(fsd->smb2, srvpath, smb2fs_meta_cb, m) < 0)
+	{
+		m->state = META_FAILED;
+		smb2fs_meta_drop(m);
+		return;
+	}
+	fsd->meta_pending++;
+}
+
+/*
+ * Drive the socket until all the queued EA queries are answered. Queries
+ * still unanswered after the timeout are given up on: their entries are
+ * discarded, and freed by the callback whenever the reply does arrive.
+ */
+static void smb2fs_meta_wait(void)
+{
+	struct smb2fs_meta *m;
+	struct pollfd       pfd;
+	time_t              start;
+
+	start = time(NULL);
+	while (fsd->smb2 != NULL && fsd->meta_pending > 0 &&
+		time(NULL) - start < META_WAIT_TIMEOUT)
+	{
+		pfd.fd      = smb2_get_fd(fsd->smb2);
+		pfd.events  = smb2_which_events(fsd->smb2);
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, 1000) < 0)
+			break;
+		if (smb2_service(fsd->smb2, pfd.revents) < 0)
+			break;
+	}
+
+	if (fsd->meta_pending == 0)
+		return;
+
+	for (m = fsd->meta_list; m != NULL; m = m->next)
+	{
+		if (m->state == META_PENDING && !m->expired)
+		{
+			m->expired = TRUE;
+			m->discard = TRUE;
+			fsd->meta_pending--;
+		}
+	}
+}
+
+/* The EAs of a file if they have been read since it last changed */
+static struct smb2fs_meta *smb2fs_meta_lookup(const char *path, const struct smb2_stat_64 *st)
+{
+	struct smb2fs_meta *m;
+
+	if (st->smb2_ea_size == 0)
+		return NULL;
+
+	m = smb2fs_meta_find(path);
+	if (m == NULL || m->state != META_READY ||
+		m->ctime != st->smb2_ctime || m->ctime_nsec != st->smb2_ctime_nsec)
+		return NULL;
+
+	return m;
+}
+
+/* Same as smb2fs_meta_lookup(), but reads the EAs if need be */
+static struct smb2fs_meta *smb2fs_meta_get(const char *path, const struct smb2_stat_64 *st)
+{
+	if (st->smb2_ea_size == 0)
+		return NULL;
+
+	smb2fs_meta_start(path, st);
+	smb2fs_meta_wait();
+
+	return smb2fs_meta_lookup(path, st);
+}
+
+static void smb2fs_meta_child(char *buf, size_t size, const char *dirpath, const char *name)
+{
+	size_t len;
+
+	strlcpy(buf, dirpath, size);
+	len = strlen(buf);
+	if (len == 0 || buf[len - 1] != '/')
+		strlcat(buf, "/", size);
+	strlcat(buf, name, size);
+}
+
+/* Queue the EA query of a directory entry that has EAs */
+static void smb2fs_meta_start_entry(const char *dirpath, const char *name, const struct smb2_stat_64 *st)
+{
+	char pathbuf[MAXPATHLEN];
+
+	if (st->smb2_ea_size == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return;
+
+	smb2fs_meta_child(pathbuf, sizeof(pathbuf), dirpath, name);
+	smb2fs_meta_start(pathbuf, st);
+}
+
+/* The owner RWE bits are active low, those of group and other active high */
+static mode_t smb2fs_prot_to_mode(uint32_t prot)
+{
+	mode_t mode = 0;
+
+	if (!(prot & FIBF_READ))        mode |= S_IRUSR;
+	if (!(prot & FIBF_WRITE))       mode |= S_IWUSR;
+	if (!(prot & FIBF_EXECUTE))     mode |= S_IXUSR;
+	if (prot & FIBF_GRP_READ)       mode |= S_IRGRP;
+	if (prot & FIBF_GRP_WRITE)      mode |= S_IWGRP;
+	if (prot & FIBF_GRP_EXECUTE)    mode |= S_IXGRP;
+	if (prot & FIBF_OTR_READ)       mode |= S_IROTH;
+	if (prot & FIBF_OTR_WRITE)      mode |= S_IWOTH;
+	if (prot & FIBF_OTR_EXECUTE)    mode |= S_IXOTH;
+
+	return mode;
+}
+
+static uint32_t smb2fs_mode_to_prot(mode_t mode)
+{
+	uint32_t prot = 0;
+
+	if (!(mode & S_IRUSR))          prot |= FIBF_READ;
+	if (!(mode & S_IWUSR))          prot |= FIBF_WRITE;
+	if (!(mode & S_IXUSR))          prot |= FIBF_EXECUTE;
+	if (mode & S_IRGRP)             prot |= FIBF_GRP_READ;
+	if (mode & S_IWGRP)             prot |= FIBF_GRP_WRITE;
+	if (mode & S_IXGRP)             prot |= FIBF_GRP_EXECUTE;
+	if (mode & S_IROTH)             prot |= FIBF_OTR_READ;
+	if (mode & S_IWOTH)             prot |= FIBF_OTR_WRITE;
+	if (mode & S_IXOTH)             prot |= FIBF_OTR_EXECUTE;
+
+	return prot;
+}
+
+static void smb2fs_meta_apply(struct fbx_stat *stbuf, const struct smb2fs_meta *m)
+{
+	if (m != NULL && m->has_prot)
+		stbuf->st_mode = (stbuf->st_mode & S_IFMT) | smb2fs_prot_to_mode(m->prot);
+}
+
+/* Apply the EAs of a directory entry, as far as they are known */
+static void smb2fs_meta_apply_entry(struct fbx_stat *stbuf, const char *dirpath, const char *name,
+                                    const struct smb2_stat_64 *st)
+{
+	char pathbuf[MAXPATHLEN];
+
+	if (st->smb2_ea_size == 0 || dirpath == NULL)
+		return;
+
+	smb2fs_meta_child(pathbuf, sizeof(pathbuf), dirpath, name);
+	smb2fs_meta_apply(stbuf, smb2fs_meta_lookup(pathbuf, st));
+}
+
+struct smb2fs_meta_set_data {
+	BOOL done;
+	BOOL abandoned; /* the caller is gone, the callback frees it */
+	int  status;
+};
+
+static void smb2fs_meta_set_cb(struct smb2_context *smb2, int status, void *command_data, void *cb_data)
+{
+	struct smb2fs_meta_set_data *sd = cb_data;
+
+	if (sd->abandoned)
+	{
+		free(sd);
+		return;
+	}
+	sd->status = status;
+	sd->done   = TRUE;
+}
+
+/* Set (or with len 0 remove) one EA of a file and wait for the result */
+static int smb2fs_meta_set(const char *path, const char *name, const void *value, size_t len)
+{
+	struct smb2fs_meta_set_data  *sd;
+	struct smb2_file_full_ea_info ea;
+	struct pollfd                 pfd;
+	int                           status;
+
+	bzero(&ea, sizeof(ea));
+	ea.ea_name         = name;
+	ea.ea_name_length  = strlen(name);
+	ea.ea_value        = value;
+	ea.ea_value_length = len;
+
+	/* Left to the callback if the connection fails, it still runs then */
+	sd = calloc(1, sizeof(*sd));
+	if (sd == NULL)
+		return -ENOMEM;
+
+	if (send_compound_setea(fsd->smb2, path, &ea, smb2fs_meta_set_cb, sd) < 0)
+	{
+		free(sd);
+		return -1;
+	}
+
+	while (!sd->done)
+	{
+		pfd.fd      = smb2_get_fd(fsd->smb2);
+		pfd.events  = smb2_which_events(fsd->smb2);
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, 1000) < 0 ||
+			smb2_keepalive_service(fsd->smb2) < 0 ||
+			smb2_service(fsd->smb2, pfd.revents) < 0)
+		{
+			if (sd->done)
+				free(sd);
+			else
+				sd->abandoned = TRUE;
+			return -1;
+		}
+	}
+
+	status = sd->status;
+	free(sd);
+	return status;
+}
+
+/* The stat of a path, from the directory cache if it is there */
+static int smb2fs_stat_path(const char *path, struct smb2_stat_64 *smb2_st)
+{
+	struct smb2fh      *smb2fh;
+	int                 rc;
+	char                pathbuf[MAXPATHLEN];
+	const char         *fspath = path;
+	BOOL                moved = FALSE;
+
+	switch (LookupDirCache(fsd->dc, path, smb2_st))
+	{
+		case DIRCACHE_FOUND:
+			return 0;
+		case DIRCACHE_NOT_FOUND:
+			return -ENOENT;
+	}
+
+	/* A QUERY_INFO on an open handle saves the CREATE and CLOSE */
+	smb2fh = smb2fs_openfile_find(path, FALSE);
+	if (smb2fh != NULL)
+	{
+		rc = smb2_fstat(fsd->smb2, smb2fh, smb2_st);
+		if (rc == 0)
+			return 0;
+		if (rc < -1)
+			return rc;
+		/* connection problem, handled below */
+	}
+
+again:
+	if (fsd->rootdir != NULL)
+	{
+		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
+		strlcat(pathbuf, path, sizeof(pathbuf));
+		path = pathbuf;
+	}
+
+	if (path[0] == '/') path++; /* Remove initial slash */
+
+	do {
+		rc = smb2_stat(fsd->smb2, path, smb2_st);
+		if(rc < -1)
+		{
+			// KPrintF("[smb2fs_getattr] r2: %ld\n", rc);
+			// KPrintF("[smb2fs_getattr] r2_text: %s\n", nterror_to_str(rc));
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				path = fspath;
+				goto again;
+			}
+			return rc;
+		}
+		else if (rc < 0)
+		{
+			if(!handle_connection_fault())
+				return -ENODEV;
+		}
+	} while(rc < 0);
+
+	return 0;
+}
+
+static int smb2fs_getattr(const char *path, struct fbx_stat *stbuf)
+{
+	// KPrintF((STRPTR)"[smb2fs] smb2fs_getattr started.\n");
+	struct smb2_stat_64 smb2_st;
+	int                 rc;
+
+	if (fsd == NULL || smb2fs_peer_lost())
+	{
+		if(cfg_reconnect_req)
+		{
+			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
+				return -ENODEV;
+		}
+		else if(!smb2fs_init(NULL))
+			return -ENODEV;
+	}
+
+	rc = smb2fs_stat_path(path, &smb2_st);
+	if (rc != 0)
+		return rc;
+
+	smb2fs_fillstat(stbuf, &smb2_st);
+	smb2fs_meta_apply(stbuf, smb2fs_meta_get(path, &smb2_st));
+
+	return 0;
+}
+
+static int smb2fs_fgetattr(const char *path, struct fbx_stat *stbuf,
+                           struct fuse_file_info *fi)
+{
+	// KPrintF((STRPTR)"[smb2fs] smb2fs_fgetattr started.\n");
+	struct smb2fh      *smb2fh;
+	struct smb2_stat_64 smb2_st;
+	int                 rc;
+
+	if (fsd == NULL || smb2fs_peer_lost())
+	{
+		if(cfg_reconnect_req)
+		{
+			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
+				return -ENODEV;
+		}
+		else if(!smb2fs_init(NULL))
+			return -ENODEV;
+	}
+
+	if (HandleToPointer(fsd->pf_phr, (uint32_t) fi->fh) != NULL)
+		return smb2fs_getattr(path, stbuf);
+
+	do {
+		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+		if (smb2fh == NULL)
+			return -EINVAL;
+
+		rc = smb2_fstat(fsd->smb2, smb2fh, &smb2_st);
+		if(rc < -1)
+		{
+			// KPrintF("[smb2fs_fgetattr] r2: %ld\n", rc);
+			// KPrintF("[smb2fs_fgetattr] r2_text: %s\n", nterror_to_str(rc));
+			return rc;
+		}
+		else if (rc < 0)
+		{
+			if(!handle_connection_fault())
+				return -ENODEV;
+		}
+	} while(rc < 0);
+
+	smb2fs_fillstat(stbuf, &smb2_st);
+	if (path != NULL)
+		smb2fs_meta_apply(stbuf, smb2fs_meta_get(path, &smb2_st));
+
+	return 0;
+}
+
+static int smb2fs_mkdir(const char *path, mode_t mode)
+{
+	// KPrintF((STRPTR)"[smb2fs] smb2fs_mkdir started.\n");
+	int  rc;
+	char pathbuf[MAXPATHLEN];
+	const char *fspath = path;
+	BOOL moved = FALSE;
+
+	if (fsd == NULL || smb2fs_peer_lost())
+	{
+		if(cfg_reconnect_req)
+		{
+			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
+				return -ENODEV;
+		}
+		else if(!smb2fs_init(NULL))
+			return -ENODEV;
+	}
+
+	if (fsd->rdonly)
+		return -EROFS;
+
+	smb2fs_path_changed(path);
+
+again:
+	if (fsd->rootdir != NULL)
+	{
+		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
+		strlcat(pathbuf, path, sizeof(pathbuf));
+		path = pathbuf;
 	}
 
 	if (path[0] == '/') path++; /* Remove initial slash */
 
-	do {
-		rc = smb2_stat(fsd->smb2, path, &smb2_st);
-		if(rc < -1)
-		{
-			// KPrintF("[smb2fs_getattr] r2: %ld\n", rc);
-			// KPrintF("[smb2fs_getattr] r2_text: %s\n", nterror_to_str(rc));
-			return rc;
-		}
-		else if (rc < 0)
+	do {
+		rc = smb2_mkdir(fsd->smb2, path);
+		if(rc < -1)
+		{
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				path = fspath;
+				goto again;
+			}
+			return rc;
+		}
+		else if (rc < 0)
+		{
+			if(!handle_connection_fault())
+				return -ENODEV;
+		}
+	} while(rc < 0);
+
+	smb2fs_statfs_charge(1, 1);
+
+	return 0;
+}
+
+static void smb2fs_prefetch_unlink(struct smb2fs_prefetch *pf)
+{
+	struct smb2fs_prefetch **pp;
+
+	for (pp = &fsd->pf_list; *pp != NULL; pp = &(*pp)->next)
+	{
+		if (*pp == pf)
+		{
+			*pp = pf->next;
+			break;
+		}
+	}
+}
+
+static void smb2fs_prefetch_free(struct smb2fs_prefetch *pf)
+{
+	fsd->pf_bytes -= pf->size;
+	free(pf->data);
+	free(pf->path);
+	free(pf);
+}
+
+static void smb2fs_prefetch_flush(void)
+{
+	struct smb2fs_prefetch *pf, *next;
+
+	for (pf = fsd->pf_list; pf != NULL; pf = next)
+	{
+		next = pf->next;
+		smb2fs_prefetch_free(pf);
+	}
+	fsd->pf_list = NULL;
+}
+
+/* Free a discarded entry once nobody uses it and no read is in flight */
+static void smb2fs_prefetch_release(struct smb2fs_prefetch *pf)
+{
+	if (pf->discard && pf->users == 0 && pf->state != PREFETCH_PENDING)
+	{
+		smb2fs_prefetch_unlink(pf);
+		smb2fs_prefetch_free(pf);
+	}
+}
+
+static void smb2fs_prefetch_drop(struct smb2fs_prefetch *pf)
+{
+	pf->discard = TRUE;
+
+	/* No point in finishing a read nobody wants. The callback still runs
+	 * and may free the entry, so don't touch it afterwards.
+	 */
+	if (pf->state == PREFETCH_PENDING)
+	{
+		smb2_cancel(fsd->smb2, pf->msgid);
+		return;
+	}
+
+	smb2fs_prefetch_release(pf);
+}
+
+static struct smb2fs_prefetch *smb2fs_prefetch_find(const char *path)
+{
+	struct smb2fs_prefetch *pf;
+
+	for (pf = fsd->pf_list; pf != NULL; pf = pf->next)
+	{
+		if (!pf->discard && strcmp(pf->path, path) == 0)
+			break;
+	}
+
+	if (pf != NULL && pf->state != PREFETCH_PENDING &&
+		(pf->state == PREFETCH_FAILED || time(NULL) - pf->time >= PREFETCH_TTL))
+	{
+		smb2fs_prefetch_drop(pf);
+		pf = NULL;
+	}
+
+	return pf;
+}
+
+/* Forget a path, and anything below it, after it was changed */
+static void smb2fs_prefetch_forget(const char *path)
+{
+	struct smb2fs_prefetch *pf, *next;
+	size_t                  len;
+
+	if (path == NULL || fsd->pf_list == NULL)
+		return;
+
+	/* Cancelling a read allocates, which must not evict next under us */
+#ifndef __amigaos4__
+	pf_walking++;
+#endif
+	len = strlen(path);
+	for (pf = fsd->pf_list; pf != NULL; pf = next)
+	{
+		next = pf->next;
+		if (strncmp(pf->path, path, len) == 0 && (pf->path[len] == '\0' || pf->path[len] == '/'))
+			smb2fs_prefetch_drop(pf);
+	}
+#ifndef __amigaos4__
+	pf_walking--;
+#endif
+}
+
+/* Drop everything cached about a path that is about to be changed */
+static void smb2fs_path_changed(const char *path)
+{
+	smb2fs_prefetch_forget(path);
+	smb2fs_meta_forget(path);
+	InvalidateDirCache(fsd->dc, path);
+}
+
+/* Evict the least recently used idle entry */
+static BOOL smb2fs_prefetch_evict(void)
+{
+	struct smb2fs_prefetch *pf, *victim;
+
+	victim = NULL;
+	for (pf = fsd->pf_list; pf != NULL; pf = pf->next)
+	{
+		if (pf->users == 0 && pf->state != PREFETCH_PENDING)
+			victim = pf;
+	}
+	if (victim == NULL)
+		return FALSE;
+
+	smb2fs_prefetch_unlink(victim);
+	smb2fs_prefetch_free(victim);
+
+	return TRUE;
+}
+
+static size_t smb2fs_mem_used(void)
+{
+	struct smb2fs_prefetch *pf;
+	size_t                  used = fsd->pf_bytes + fsd->dc->bytes + fsd->meta_bytes;
+
+	if (fsd->smb2 != NULL)
+	{
+		used += smb2_get_queued_bytes(fsd->smb2);
+
+		/* A pending prefetch reads into its own buffer, which libsmb2
+		 * counts with the queued request already
+		 */
+		for (pf = fsd->pf_list; pf != NULL; pf = pf->next)
+		{
+			if (pf->state == PREFETCH_PENDING)
+				used -= pf->size;
+		}
+	}
+
+	return used;
+}
+
+/* Shrink the caches, speculative data first, until size more bytes fit */
+static BOOL smb2fs_mem_reclaim(size_t size)
+{
+	size_t budget = (size_t)cfg_mem_budget * 1024;
+	size_t other;
+
+	if (size > budget)
+		return FALSE;
+
+	while (smb2fs_mem_used() + size > budget)
+	{
+		if (!smb2fs_prefetch_evict() && !smb2fs_meta_evict())
+			break;
+	}
+
+	if (smb2fs_mem_used() + size > budget)
+	{
+		other = smb2fs_mem_used() - fsd->dc->bytes;
+		TrimDirCache(fsd->dc, budget - size > other ? budget - size - other : 0);
+	}
+
+	return smb2fs_mem_used() + size <= budget;
+}
+
+/*
+ * Make room for size more bytes of cached or queued data. If shrinking the
+ * caches is not enough the caller is held back until enough of the queued
+ * requests have completed, and turned away if they don't in time.
+ */
+static BOOL smb2fs_mem_admit(size_t size)
+{
+	struct pollfd pfd;
+	time_t        start;
+
+	if (smb2fs_mem_reclaim(size))
+		return TRUE;
+
+	start = time(NULL);
+	while (fsd->smb2 != NULL && smb2_get_queued_bytes(fsd->smb2) != 0 &&
+		time(NULL) - start < MEM_STALL_TIMEOUT)
+	{
+		pfd.fd      = smb2_get_fd(fsd->smb2);
+		pfd.events  = smb2_which_events(fsd->smb2);
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, 100) < 0)
+			break;
+		if (smb2_service(fsd->smb2, pfd.revents) < 0)
+			break;
+
+		if (smb2fs_mem_reclaim(size))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+#ifndef __amigaos4__
+/*
+ * An allocation failed. This is called from inside malloc(), which tries
+ * once more if anything was freed. Only prefetch buffers can go right away:
+ * one in use is held by its users count, and a pending one by libsmb2.
+ * The caller may still hold pointers into the metadata and directory
+ * caches, so those are only dropped later by smb2fs_housekeeping().
+ */
+static int smb2fs_mem_emergency(void)
+{
+	int freed = 0;
+
+	mem_emergency = TRUE;
+
+	/* Other tasks share the pool, but not the caches */
+	if (fsd == NULL || pf_walking != 0 || FindTask(NULL) != mem_task)
+		return 0;
+
+	while (smb2fs_prefetch_evict())
+		freed = 1;
+
+	return freed;
+}
+#endif
+
+static void smb2fs_housekeeping(void)
+{
+#ifndef __amigaos4__
+	if (mem_emergency)
+	{
+		mem_emergency = FALSE;
+
+		/* Drop everything that can be read again */
+		if (fsd != NULL && fsd->dc != NULL)
 		{
-			if(!handle_connection_fault())
-				return -ENODEV;
+			while (smb2fs_prefetch_evict())
+				;
+			while (smb2fs_meta_evict())
+				;
+			TrimDirCache(fsd->dc, 0);
 		}
-	} while(rc < 0);
+	}
+#endif
 
-	smb2fs_fillstat(stbuf, &smb2_st);
+	/* Send ECHOs while idle too, so a dead server is noticed without an operation */
+	if (fsd != NULL && fsd->smb2 != NULL && !fsd->peer_dead)
+	{
+		smb2fs_service_pending();
+		smb2_keepalive_service(fsd->smb2);
+	}
 
-	return 0;
+	/*
+	 * Reconnect right away, while the server may still hold our durable
+	 * handles. If the user is to be asked first, the next operation does it.
+	 */
+	if (fsd != NULL && smb2fs_peer_lost() && !cfg_reconnect_req)
+		smb2fs_init(NULL);
 }
 
-static int smb2fs_fgetattr(const char *path, struct fbx_stat *stbuf,
-                           struct fuse_file_info *fi)
+/* Evict the least recently used idle entries until size more bytes fit */
+static BOOL smb2fs_prefetch_reserve(uint32_t size)
 {
-	// KPrintF((STRPTR)"[smb2fs] smb2fs_fgetattr started.\n");
-	struct smb2fh      *smb2fh;
-	struct smb2_stat_64 smb2_st;
-	int                 rc;
+	while (fsd->pf_bytes + size > PREFETCH_MAX_BYTES)
+	{
+		if (!smb2fs_prefetch_evict())
+			return FALSE;
+	}
 
-	if (fsd == NULL)
+	return smb2fs_mem_admit(size);
+}
+
+static void smb2fs_prefetch_cb(struct smb2_context *smb2, int status, void *command_data, void *cb_data)
+{
+	struct smb2fs_prefetch *pf = cb_data;
+
+	if (status == 0)
 	{
-		if(cfg_reconnect_req)
-		{
-			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
-				return -ENODEV;
-		}
-		else if(!smb2fs_init(NULL))
-			return -ENODEV;
+		pf->length = *(uint32_t *)command_data;
+		pf->state  = PREFETCH_READY;
+	}
+	else
+	{
+		pf->state   = PREFETCH_FAILED;
+		pf->discard = TRUE;
 	}
 
-	do {
-		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-		if (smb2fh == NULL)
-			return -EINVAL;
+	smb2fs_prefetch_release(pf);
+}
 
-		rc = smb2_fstat(fsd->smb2, smb2fh, &smb2_st);
-		if(rc < -1)
-		{
-			// KPrintF("[smb2fs_fgetattr] r2: %ld\n", rc);
-			// KPrintF("[smb2fs_fgetattr] r2_text: %s\n", nterror_to_str(rc));
-			return rc;
-		}
-		else if (rc < 0)
-		{
-			if(!handle_connection_fault())
-				return -ENODEV;
-		}
-	} while(rc < 0);
+static BOOL smb2fs_is_companion(const char *name)
+{
+	static const char suffix[] = ".info";
+	size_t            len = strlen(name);
+	size_t            i;
 
-	smb2fs_fillstat(stbuf, &smb2_st);
+	if (len <= sizeof(suffix) - 1)
+		return FALSE;
 
-	return 0;
+	name += len - (sizeof(suffix) - 1);
+	for (i = 0; suffix[i] != '\0'; i++)
+	{
+		if (tolower((unsigned char)name[i]) != suffix[i])
+			return FALSE;
+	}
+
+	return TRUE;
 }
 
-static int smb2fs_mkdir(const char *path, mode_t mode)
+static void smb2fs_prefetch_start(const char *dirpath, const struct smb2dirent *ent)
 {
-	// KPrintF((STRPTR)"[smb2fs] smb2fs_mkdir started.\n");
-	int  rc;
-	char pathbuf[MAXPATHLEN];
+	struct smb2fs_prefetch *pf;
+	char                    pathbuf[MAXPATHLEN];
+	char                    srvbuf[MAXPATHLEN];
+	const char             *srvpath;
+	size_t                  len;
+
+	strlcpy(pathbuf, dirpath, sizeof(pathbuf));
+	len = strlen(pathbuf);
+	if (len == 0 || pathbuf[len - 1] != '/')
+		strlcat(pathbuf, "/", sizeof(pathbuf));
+	if (strlcat(pathbuf, ent->name, sizeof(pathbuf)) >= sizeof(pathbuf))
+		return;
 
-	if (fsd == NULL)
+	pf = smb2fs_prefetch_find(pathbuf);
+	if (pf != NULL)
 	{
-		if(cfg_reconnect_req)
-		{
-			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
-				return -ENODEV;
-		}
-		else if(!smb2fs_init(NULL))
-			return -ENODEV;
+		if (pf->state == PREFETCH_PENDING ||
+			(pf->size == ent->st.smb2_size && pf->mtime == ent->st.smb2_mtime))
+			return;
+		smb2fs_prefetch_drop(pf);
 	}
 
-	if (fsd->rdonly)
-		return -EROFS;
+	if (!smb2fs_prefetch_reserve(ent->st.smb2_size))
+		return;
+
+	pf = calloc(1, sizeof(*pf));
+	if (pf == NULL)
+		return;
+
+	pf->path = strdup(pathbuf);
+	pf->data = malloc(ent->st.smb2_size);
+	if (pf->path == NULL || pf->data == NULL)
+	{
+		free(pf->data);
+		free(pf->path);
+		free(pf);
+		return;
+	}
+	pf->size  = ent->st.smb2_size;
+	pf->mtime = ent->st.smb2_mtime;
+	pf->time  = time(NULL);
+	pf->state = PREFETCH_PENDING;
 
+	pf->next = fsd->pf_list;
+	fsd->pf_list = pf;
+	fsd->pf_bytes += pf->size;
+
+	srvpath = pathbuf;
 	if (fsd->rootdir != NULL)
 	{
-		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
-		strlcat(pathbuf, path, sizeof(pathbuf));
-		path = pathbuf;
+		strlcpy(srvbuf, fsd->rootdir, sizeof(srvbuf));
+		strlcat(srvbuf, pathbuf, sizeof(srvbuf));
+		srvpath = srvbuf;
 	}
 
-	if (path[0] == '/') path++; /* Remove initial slash */
+	if (srvpath[0] == '/') srvpath++; /* Remove initial slash */
 
-	do {
-		rc = smb2_mkdir(fsd->smb2, path);
-		if(rc < -1)
-		{
-			return rc;
-		}
-		else if (rc < 0)
+	if (send_compound_read(fsd->smb2, srvpath, pf->data, pf->size, smb2fs_prefetch_cb, pf, &pf->msgid) < 0)
+	{
+		pf->state = PREFETCH_FAILED;
+		smb2fs_prefetch_drop(pf);
+	}
+}
+
+/* Drive the socket until a prefetch that an open is waiting for is done */
+static void smb2fs_prefetch_wait(struct smb2fs_prefetch *pf)
+{
+	struct pollfd pfd;
+
+	while (pf->state == PREFETCH_PENDING)
+	{
+		pfd.fd      = smb2_get_fd(fsd->smb2);
+		pfd.events  = smb2_which_events(fsd->smb2);
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, 1000) < 0)
+			break;
+		if (smb2_service(fsd->smb2, pfd.revents) < 0)
+			break;
+	}
+}
+
+/*
+ * Serve an open from the prefetch cache. Reads on the returned handle are
+ * answered from memory, and the first write or truncate reopens the file
+ * for real (see smb2fs_prefetch_promote()).
+ */
+static BOOL smb2fs_prefetch_open(const char *path, struct fuse_file_info *fi)
+{
+	struct smb2fs_prefetch *pf;
+
+	pf = smb2fs_prefetch_find(path);
+	if (pf == NULL)
+		return FALSE;
+
+	pf->users++;
+	smb2fs_prefetch_wait(pf);
+
+	if (pf->state == PREFETCH_READY && !pf->discard)
+	{
+		fi->fh = AllocateHandleForPointer(fsd->pf_phr, pf);
+		if (fi->fh != 0)
 		{
-			if(!handle_connection_fault())
-				return -ENODEV;
+			smb2fs_prefetch_unlink(pf);
+			pf->next = fsd->pf_list;
+			fsd->pf_list = pf;
+			return TRUE;
 		}
-	} while(rc < 0);
+	}
 
-	return 0;
+	pf->users--;
+	smb2fs_prefetch_release(pf);
+
+	return FALSE;
+}
+
+static void smb2fs_prefetch_close(struct fuse_file_info *fi)
+{
+	struct smb2fs_prefetch *pf;
+
+	pf = (struct smb2fs_prefetch *) HandleToPointer(fsd->pf_phr, (uint32_t) fi->fh);
+	RemoveHandle(fsd->pf_phr, (uint32_t) fi->fh);
+	fi->fh = (uint64_t)(size_t)NULL;
+
+	pf->users--;
+	smb2fs_prefetch_release(pf);
 }
 
 static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_opendir started.\n");
-	struct smb2dir *smb2dir;
-	char            pathbuf[MAXPATHLEN];
-	int             r2;
+	struct smb2dir     *smb2dir;
+	struct DirSnapshot *snap;
+	struct smb2_stat_64 smb2_st;
+	char                pathbuf[MAXPATHLEN];
+	const char         *fspath = path;
+	int                 r2;
+	BOOL                moved = FALSE;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -798,6 +2769,7 @@ static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 			return -ENODEV;
 	}
 
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -807,6 +2779,24 @@ static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 
 	if (path[0] == '/') path++; /* Remove initial slash */
 
+	/*
+	 * If the directory hasn't changed since we last listed it, one stat
+	 * instead of a full enumeration is enough. Any error here just means
+	 * the directory is enumerated, which reports it properly.
+	 */
+	if (CanSnapshotDirListing(fsd->dc, fspath) &&
+		smb2_stat(fsd->smb2, path, &smb2_st) == 0 &&
+		(snap = SnapshotDirListing(fsd->dc, fspath, &smb2_st)) != NULL)
+	{
+		fi->fh = AllocateHandleForPointer(fsd->ds_phr, snap);
+		if (fi->fh == 0)
+		{
+			FreeDirSnapshot(snap);
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
 	do {
 		smb2dir = smb2_opendir_r2(fsd->smb2, path, &r2);
 		if (smb2dir == NULL)
@@ -817,7 +2807,15 @@ static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 					return -ENODEV;
 			}
 			else
+			{
+				if (!moved && smb2fs_dfs_moved())
+				{
+					moved = TRUE;
+					path = fspath;
+					goto again;
+				}
 				return -ENOENT;
+			}
 		}
 	} while(smb2dir == NULL);
 	// smb2dir = smb2_opendir(fsd->smb2, path);
@@ -839,9 +2837,10 @@ static int smb2fs_opendir(const char *path, struct fuse_file_info *fi)
 static int smb2fs_releasedir(const char *path, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_releasedir started.\n");
-	struct smb2dir *smb2dir;
+	struct smb2dir     *smb2dir;
+	struct DirSnapshot *snap;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -852,6 +2851,15 @@ static int smb2fs_releasedir(const char *path, struct fuse_file_info *fi)
 			return -ENODEV;
 	}
 
+	snap = (struct DirSnapshot *) HandleToPointer(fsd->ds_phr, (uint32_t) fi->fh);
+	if (snap != NULL)
+	{
+		FreeDirSnapshot(snap);
+		RemoveHandle(fsd->ds_phr, (uint32_t) fi->fh);
+		fi->fh = (uint64_t)(size_t)NULL;
+		return 0;
+	}
+
 	// smb2dir = (struct smb2dir *)(size_t)fi->fh;
 	// if (smb2dir == NULL)
 	// 	return -EINVAL;
@@ -873,8 +2881,14 @@ static int smb2fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler
 	struct smb2dir    *smb2dir;
 	struct smb2dirent *ent;
 	struct fbx_stat    stbuf;
-
-	if (fsd == NULL)
+	BOOL               prefetching = FALSE;
+	struct DirCacheDir *listing = NULL;
+	struct DirSnapshot *snap;
+	struct smb2dirent  snapent;
+	size_t             i;
+	long               pos;
+
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -888,6 +2902,41 @@ static int smb2fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler
 	if (fi == NULL)
 		return -EINVAL;
 
+	/* A directory that was found unchanged is listed from the cache */
+	snap = (struct DirSnapshot *) HandleToPointer(fsd->ds_phr, (uint32_t) fi->fh);
+	if (snap != NULL)
+	{
+		/* Read the EAs of all the entries that have any in one go */
+		if (path != NULL)
+		{
+			for (i = 0; i < snap->count; i++)
+				smb2fs_meta_start_entry(path, snap->entries[i].name, &snap->entries[i].st);
+			smb2fs_meta_wait();
+		}
+
+		for (i = 0; i < snap->count; i++)
+		{
+			snapent.name = snap->entries[i].name;
+			snapent.st   = snap->entries[i].st;
+			smb2fs_fillstat(&stbuf, &snapent.st);
+			smb2fs_meta_apply_entry(&stbuf, path, snapent.name, &snapent.st);
+			filler(buffer, snapent.name, &stbuf, 0);
+
+			if (path != NULL && snapent.st.smb2_type == SMB2_TYPE_FILE &&
+				snapent.st.smb2_size > 0 && snapent.st.smb2_size <= PREFETCH_MAX_FILE &&
+				smb2fs_is_companion(snapent.name))
+			{
+				smb2fs_prefetch_start(path, &snapent);
+				prefetching = TRUE;
+			}
+		}
+
+		if (prefetching)
+			smb2fs_service_pending();
+
+		return 0;
+	}
+
 	// smb2dir = (struct smb2dir *)(size_t)fi->fh;
 	// if (smb2dir == NULL)
 	// 	return -EINVAL;
@@ -895,12 +2944,60 @@ static int smb2fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler
 	if (smb2dir == NULL)
 		return -EINVAL;
 
+	/* Read the EAs of all the entries that have any in one go */
+	if (path != NULL)
+	{
+		pos = smb2_telldir(fsd->smb2, smb2dir);
+		while ((ent = smb2_readdir(fsd->smb2, smb2dir)) != NULL)
+			smb2fs_meta_start_entry(path, ent->name, &ent->st);
+		smb2_seekdir(fsd->smb2, smb2dir, pos);
+		smb2fs_meta_wait();
+	}
+
+	/* Only a listing read from the start can prove that a name is absent */
+	if (path != NULL && smb2_telldir(fsd->smb2, smb2dir) == 0)
+		listing = BeginDirListing(path);
+
 	while ((ent = smb2_readdir(fsd->smb2, smb2dir)) != NULL)
 	{
 		smb2fs_fillstat(&stbuf, &ent->st);
+		smb2fs_meta_apply_entry(&stbuf, path, ent->name, &ent->st);
 		filler(buffer, ent->name, &stbuf, 0);
+
+		/* The times of the directory itself tell when to list it again */
+		if (listing != NULL && strcmp(ent->name, ".") == 0)
+			SetDirListingStamp(listing, &ent->st);
+
+		if (listing != NULL && strcmp(ent->name, ".") != 0 && strcmp(ent->name, "..") != 0 &&
+			(AddDirListingEntry(listing, ent->name, &ent->st) != 0 ||
+			 listing->bytes > (size_t)cfg_mem_budget * 1024 / 4))
+		{
+			/* Too big to be worth caching */
+			AbortDirListing(listing);
+			listing = NULL;
+		}
+
+		if (path != NULL && ent->st.smb2_type == SMB2_TYPE_FILE &&
+			ent->st.smb2_size > 0 && ent->st.smb2_size <= PREFETCH_MAX_FILE &&
+			smb2fs_is_companion(ent->name))
+		{
+			smb2fs_prefetch_start(path, ent);
+			prefetching = TRUE;
+		}
+	}
+
+	if (listing != NULL)
+	{
+		if (smb2fs_mem_reclaim(listing->bytes))
+			CommitDirListing(fsd->dc, listing);
+		else
+			AbortDirListing(listing);
 	}
 
+	/* Get the prefetch requests on their way */
+	if (prefetching)
+		smb2fs_service_pending();
+
 	return 0;
 }
 
@@ -910,9 +3007,11 @@ static int smb2fs_open(const char *path, struct fuse_file_info *fi)
 	struct smb2fh *smb2fh;
 	int            flags;
 	char           pathbuf[MAXPATHLEN];
+	const char    *fspath = path;
 	int            r2;
+	BOOL           moved = FALSE;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -923,6 +3022,13 @@ static int smb2fs_open(const char *path, struct fuse_file_info *fi)
 			return -ENODEV;
 	}
 
+	if (LookupDirCache(fsd->dc, path, NULL) == DIRCACHE_NOT_FOUND)
+		return -ENOENT;
+
+	if (smb2fs_prefetch_open(path, fi))
+		return 0;
+
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -938,7 +3044,7 @@ static int smb2fs_open(const char *path, struct fuse_file_info *fi)
 	{
 		do 
 		{
-			smb2fh = smb2_open_r2(fsd->smb2, path, flags, &r2);
+			smb2fh = smb2_open_oplock_r2(fsd->smb2, path, flags, smb2fs_oplock_level(), &r2);
 			if(r2 == -1 || r2 == SMB2_STATUS_CANCELLED)
 			{
 				if(!handle_connection_fault())
@@ -956,10 +3062,17 @@ static int smb2fs_open(const char *path, struct fuse_file_info *fi)
 			{
 				return -ENOMEM;
 			}
+			smb2fs_openfile_add(fspath, smb2fh, (flags & O_ACCMODE) == O_RDWR);
 			return 0;
 		}
 		else
 		{
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				path = fspath;
+				goto again;
+			}
 			/* If O_RDWR failed, try O_RDONLY */
 			if ((flags & O_ACCMODE) == O_RDWR)
 			{
@@ -971,15 +3084,32 @@ static int smb2fs_open(const char *path, struct fuse_file_info *fi)
 	}
 }
 
+/* Replace a handle served from the prefetch cache with a real one */
+static int smb2fs_prefetch_promote(const char *path, struct fuse_file_info *fi)
+{
+	struct smb2fs_prefetch *pf;
+
+	pf = (struct smb2fs_prefetch *) HandleToPointer(fsd->pf_phr, (uint32_t) fi->fh);
+	if (pf == NULL)
+		return 0;
+
+	pf->discard = TRUE;
+	smb2fs_prefetch_close(fi);
+
+	return smb2fs_open(path, fi);
+}
+
 static int smb2fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_create started.\n");
 	struct smb2fh *smb2fh;
 	int            flags;
 	char           pathbuf[MAXPATHLEN];
+	const char    *fspath = path;
 	int            r2;
+	BOOL           moved = FALSE;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -993,6 +3123,9 @@ static int smb2fs_create(const char *path, mode_t mode, struct fuse_file_info *f
 	if (fsd->rdonly)
 		return -EROFS;
 
+	smb2fs_path_changed(path);
+
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1006,7 +3139,7 @@ static int smb2fs_create(const char *path, mode_t mode, struct fuse_file_info *f
 
 	do 
 	{
-		smb2fh = smb2_open_r2(fsd->smb2, path, flags, &r2);
+		smb2fh = smb2_open_oplock_r2(fsd->smb2, path, flags, smb2fs_oplock_level(), &r2);
 		if(r2 == -1 || r2 == SMB2_STATUS_CANCELLED)
 		{
 			if(!handle_connection_fault())
@@ -1022,18 +3155,69 @@ static int smb2fs_create(const char *path, mode_t mode, struct fuse_file_info *f
 		{
 			return -ENOMEM;
 		}
+		smb2fs_openfile_add(fspath, smb2fh, TRUE);
+		smb2fs_statfs_charge(1, 1);
 		return 0;
 	}
 
+	if (!moved && smb2fs_dfs_moved())
+	{
+		moved = TRUE;
+		path = fspath;
+		goto again;
+	}
 	return -1; // r2
 }
 
-static int smb2fs_release(const char *path, struct fuse_file_info *fi)
+static int smb2fs_release(const char *path, struct fuse_file_info *fi)
+{
+	// KPrintF((STRPTR)"[smb2fs] smb2fs_release started.\n");
+	struct smb2fh *smb2fh;
+
+	if (fsd == NULL || smb2fs_peer_lost())
+	{
+		if(cfg_reconnect_req)
+		{
+			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
+				return -ENODEV;
+		}
+		else if(!smb2fs_init(NULL))
+			return -ENODEV;
+	}
+
+	if (HandleToPointer(fsd->pf_phr, (uint32_t) fi->fh) != NULL)
+	{
+		smb2fs_prefetch_close(fi);
+		return 0;
+	}
+
+	// smb2fh = (struct smb2fh *)(size_t)fi->fh;
+	// if (smb2fh == NULL)
+	// 	return -EINVAL;
+	smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+	if (smb2fh == NULL)
+		return -EINVAL;
+
+	smb2fs_openfile_remove(smb2fh);
+	smb2_close(fsd->smb2, smb2fh);
+	RemoveHandle(fsd->phr, (uint32_t) fi->fh);
+	fi->fh = (uint64_t)(size_t)NULL;
+
+	return 0;
+}
+
+static int smb2fs_lock(const char *path, struct fuse_file_info *fi, int cmd, struct flock *fl)
 {
-	// KPrintF((STRPTR)"[smb2fs] smb2fs_release started.\n");
-	struct smb2fh *smb2fh;
+	// KPrintF((STRPTR)"[smb2fs] smb2fs_lock started.\n");
+	struct smb2fh          *smb2fh;
+	struct smb2fs_openfile *of;
+	uint64_t                offset, length;
+	uint32_t                flags;
+	time_t                  start;
+	int                     rc;
+	int				rc_open = 0;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1042,18 +3226,103 @@ static int smb2fs_release(const char *path, struct fuse_file_info *fi)
 		}
 		else if(!smb2fs_init(NULL))
 			return -ENODEV;
+
+		if(cfg_handles_rcv)
+		{
+			rc_open = smb2fs_open(path, fi);
+			if(rc_open < 0)
+				return -EIO;
+		}
 	}
 
-	// smb2fh = (struct smb2fh *)(size_t)fi->fh;
-	// if (smb2fh == NULL)
-	// 	return -EINVAL;
-	smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
-	if (smb2fh == NULL)
+	if (fl->l_whence != SEEK_SET || fl->l_start < 0 || fl->l_len < 0)
 		return -EINVAL;
 
-	smb2_close(fsd->smb2, smb2fh);
-	RemoveHandle(fsd->phr, (uint32_t) fi->fh);
-	fi->fh = (uint64_t)(size_t)NULL;
+	/* A length of zero locks up to the end of the file, however far it grows */
+	offset = fl->l_start;
+	length = fl->l_len != 0 ? (uint64_t)fl->l_len : (uint64_t)-1 - offset;
+
+	switch (fl->l_type)
+	{
+		case F_RDLCK:
+			flags = SMB2_LOCKFLAG_SHARED_LOCK;
+			break;
+		case F_WRLCK:
+			flags = SMB2_LOCKFLAG_EXCLUSIVE_LOCK;
+			break;
+		case F_UNLCK:
+			flags = SMB2_LOCKFLAG_UNLOCK;
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	rc = smb2fs_prefetch_promote(path, fi);
+	if (rc < 0)
+		return rc;
+
+	start = time(NULL);
+	do {
+		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
+		if (smb2fh == NULL)
+			return -EINVAL;
+		of = smb2fs_openfile_get(smb2fh);
+		if (of == NULL)
+			return -ENOLCK;
+
+		if (flags == SMB2_LOCKFLAG_UNLOCK)
+		{
+			if (cmd == F_GETLK)
+				return -EINVAL;
+			rc = smb2fs_reclock_clear(of, offset, length);
+		}
+		else if (cmd == F_GETLK)
+		{
+			rc = smb2fs_reclock_test(of, offset, length, flags);
+			if (rc == 0)
+			{
+				fl->l_type = F_UNLCK;
+			}
+			else if (rc == -EAGAIN)
+			{
+				/* SMB2 can't tell who holds the conflicting lock */
+				fl->l_pid = 0;
+				return 0;
+			}
+		}
+		else
+		{
+			rc = smb2fs_reclock_set(of, offset, length, flags);
+			if (rc == -EAGAIN && cmd == F_SETLKW && time(NULL) - start < LOCK_WAIT_TIMEOUT)
+			{
+				Delay(LOCK_RETRY_DELAY);
+				continue;
+			}
+		}
+
+		/* A lock refused for a reason of its own, -EPERM included */
+		if (rc < 0 && !smb2fs_connection_lost(rc))
+		{
+			return rc;
+		}
+		else if (rc < 0)
+		{
+			if(!handle_connection_fault())
+				return -ENODEV;
+
+			if(cfg_handles_rcv)
+			{
+				rc_open = smb2fs_open(path, fi);
+				if(rc_open < 0)
+					return -EIO;
+			}
+			else
+			{
+				/* even if connection has reestablished, we do not have a handle recovery for now and need to fail the op */
+				return -EIO;
+			}
+		}
+	} while(rc < 0);
 
 	return 0;
 }
@@ -1064,6 +3333,7 @@ static int smb2fs_read(const char *path, char *buffer, size_t size,
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_read started with path:\"%s\".\n", path);
 	struct smb2fh *smb2fh;
+	struct smb2fs_prefetch *pf;
 	int64_t        new_offset;
 	size_t         max_read_size, count;
 	int            rc = 0;
@@ -1071,7 +3341,7 @@ static int smb2fs_read(const char *path, char *buffer, size_t size,
 	int            result;
 	char 			*buffer_ref;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1089,6 +3359,17 @@ static int smb2fs_read(const char *path, char *buffer, size_t size,
 		}
 	}
 
+	pf = (struct smb2fs_prefetch *) HandleToPointer(fsd->pf_phr, (uint32_t) fi->fh);
+	if (pf != NULL)
+	{
+		if (offset >= (fbx_off_t)pf->length)
+			return 0;
+		if (size > pf->length - offset)
+			size = pf->length - offset;
+		memcpy(buffer, pf->data + offset, size);
+		return size;
+	}
+
 	do {
 		buffer_ref = buffer;
 
@@ -1112,11 +3393,6 @@ static int smb2fs_read(const char *path, char *buffer, size_t size,
 		static size_t bytes_since_service = 0;
 		service_counter = 0;
 		bytes_since_service = 0;
-		
-		// SMB2 echo keep-alive tracking
-		static time_t last_echo = 0;
-		time_t current_time = time(NULL);
-		last_echo = current_time; // Reset echo timer at start of read
 
 		while (size > 0)
 		{
@@ -1164,13 +3440,6 @@ static int smb2fs_read(const char *path, char *buffer, size_t size,
 					} while (serv > 0);
 					service_counter = 0;
 					bytes_since_service = 0;
-					
-					// Check for SMB2 echo keep-alive (every 20 seconds)
-					current_time = time(NULL);
-					if (current_time - last_echo >= 20) {
-						smb2_echo(fsd->smb2);
-						last_echo = current_time;
-					}
 				}
 			}
 
@@ -1196,14 +3465,15 @@ static int smb2fs_write(const char *path, const char *buffer, size_t size,
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_write started.\n");
 	struct smb2fh *smb2fh;
-	int64_t        new_offset;
+	struct smb2fs_openfile *of;
+	int64_t        new_offset, end_of_file;
 	size_t         max_write_size, count;
 	int            rc = 0;
 	int				rc_open = 0;
 	int            result;
 	const char		*buffer_ref;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1224,12 +3494,28 @@ static int smb2fs_write(const char *path, const char *buffer, size_t size,
 	if (fsd->rdonly)
 		return -EROFS;
 
+	rc = smb2fs_prefetch_promote(path, fi);
+	if (rc < 0)
+		return rc;
+	smb2fs_path_changed(path);
+
 	do {
 		buffer_ref = buffer;
 		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
 		if (smb2fh == NULL)
 			return -EINVAL;
 
+		/*
+		 * smb2_lseek() only knows the size at open time, so the end of
+		 * what was since written through the handle is kept in its
+		 * openfile, and only growth past that is charged to statfs.
+		 */
+		of = smb2fs_openfile_get(smb2fh);
+		if (of != NULL && of->eof >= 0)
+			end_of_file = of->eof;
+		else
+			end_of_file = smb2_lseek(fsd->smb2, smb2fh, 0, SEEK_END, NULL);
+
 		new_offset = smb2_lseek(fsd->smb2, smb2fh, offset, SEEK_SET, NULL);
 		if (new_offset < 0)
 		{
@@ -1256,10 +3542,7 @@ static int smb2fs_write(const char *path, const char *buffer, size_t size,
 		service_counter = 0;
 		bytes_since_service = 0;
 		
-		// SMB2 echo keep-alive tracking
-		static time_t last_echo = 0;
 		time_t current_time = time(NULL);
-		last_echo = current_time; // Reset echo timer at start of write
 		
 		// CRITICAL: Validate socket before ANY write operations!
 		int write_sock_fd = smb2_get_fd(fsd->smb2);
@@ -1324,13 +3607,6 @@ static int smb2fs_write(const char *path, const char *buffer, size_t size,
 					} while (serv > 0);
 					service_counter = 0;
 					bytes_since_service = 0;
-					
-					// Check for SMB2 echo keep-alive (every 20 seconds)
-					current_time = time(NULL);
-					if (current_time - last_echo >= 20) {
-						smb2_echo(fsd->smb2);
-						last_echo = current_time;
-					}
 				}
 				
 				// Increment success counter and potentially grow chunk size
@@ -1358,16 +3634,28 @@ static int smb2fs_write(const char *path, const char *buffer, size_t size,
 		
 	} while(rc < 0);
 
+	if (end_of_file >= 0 && offset + result > end_of_file)
+	{
+		smb2fs_statfs_charge(offset + result - (offset > end_of_file ? offset : end_of_file), 0);
+		end_of_file = offset + result;
+	}
+	of = smb2fs_openfile_get(smb2fh);
+	if (of != NULL && end_of_file >= 0)
+		of->eof = end_of_file;
+
 	return result;
 }
 
 static int smb2fs_truncate(const char *path, fbx_off_t size)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_truncate started.\n");
-	int  rc;
-	char pathbuf[MAXPATHLEN];
+	struct smb2fh *smb2fh;
+	int            rc;
+	char           pathbuf[MAXPATHLEN];
+	const char    *fspath = path;
+	BOOL           moved = FALSE;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1381,6 +3669,26 @@ static int smb2fs_truncate(const char *path, fbx_off_t size)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	smb2fs_path_changed(path);
+
+	/* A SET_INFO on an open handle saves the CREATE and CLOSE, and can't
+	 * run into a sharing violation with our own open.
+	 */
+	smb2fh = smb2fs_openfile_find(path, TRUE);
+	if (smb2fh != NULL)
+	{
+		rc = smb2_ftruncate(fsd->smb2, smb2fh, size);
+		if (rc == 0)
+		{
+			smb2fs_openfile_resized(fspath, size);
+			smb2fs_statfs_expire();
+			return 0;
+		}
+		if (rc < -1)
+			return rc;
+	}
+
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1394,6 +3702,12 @@ static int smb2fs_truncate(const char *path, fbx_off_t size)
 		rc = smb2_truncate(fsd->smb2, path, size);
 		if(rc < -1)
 		{
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				path = fspath;
+				goto again;
+			}
 			return rc;
 		}
 		else if (rc < 0)
@@ -1403,6 +3717,9 @@ static int smb2fs_truncate(const char *path, fbx_off_t size)
 		}
 	} while(rc < 0);
 
+	smb2fs_openfile_resized(fspath, size);
+	smb2fs_statfs_expire();
+
 	return 0;
 }
 
@@ -1413,7 +3730,7 @@ static int smb2fs_ftruncate(const char *path, fbx_off_t size, struct fuse_file_i
 	int            rc;
 	int				rc_open = 0;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1434,6 +3751,11 @@ static int smb2fs_ftruncate(const char *path, fbx_off_t size, struct fuse_file_i
 	if (fsd->rdonly)
 		return -EROFS;
 
+	rc = smb2fs_prefetch_promote(path, fi);
+	if (rc < 0)
+		return rc;
+	smb2fs_path_changed(path);
+
 	
 	do {
 		smb2fh = (struct smb2fh *) HandleToPointer(fsd->phr, (uint32_t) fi->fh);
@@ -1464,15 +3786,21 @@ static int smb2fs_ftruncate(const char *path, fbx_off_t size, struct fuse_file_i
 		}
 	} while(rc < 0);
 
+	smb2fs_openfile_resized(path, size);
+	smb2fs_statfs_expire();
+
 	return 0;
 }
 
 static int smb2fs_utimens(const char *path, const struct timespec tv[2])
 {
-	int  rc;
-	char pathbuf[MAXPATHLEN];
+	struct smb2fh *smb2fh;
+	int            rc;
+	char           pathbuf[MAXPATHLEN];
+	const char    *fspath = path;
+	BOOL           moved = FALSE;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1486,6 +3814,18 @@ static int smb2fs_utimens(const char *path, const struct timespec tv[2])
 	if (fsd->rdonly)
 		return -EROFS;
 
+	smb2fs_path_changed(path);
+
+	/* One SET_INFO instead of two CREATE+INFO+CLOSE compounds */
+	smb2fh = smb2fs_openfile_find(path, TRUE);
+	if (smb2fh != NULL)
+	{
+		rc = smb2_futimens(fsd->smb2, smb2fh, tv);
+		if (rc == 0 || rc < -1)
+			return rc;
+	}
+
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1498,19 +3838,179 @@ static int smb2fs_utimens(const char *path, const struct timespec tv[2])
 	rc = smb2_utimens(fsd->smb2, path, tv);
 	if (rc < 0)
 	{
+		if (!moved && smb2fs_dfs_moved())
+		{
+			moved = TRUE;
+			path = fspath;
+			goto again;
+		}
 		return rc;
 	}
 
 	return 0;
 }
 
-static int smb2fs_unlink(const char *path)
+/* Store one of the EAs that carry the AmigaDOS metadata of a file */
+static int smb2fs_meta_store(const char *path, const char *name, const void *value, size_t len)
 {
-	// KPrintF((STRPTR)"[smb2fs] smb2fs_unlink started.\n");
 	int  rc;
 	char pathbuf[MAXPATHLEN];
+	const char *fspath = path;
+	BOOL moved = FALSE;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
+	{
+		if(cfg_reconnect_req)
+		{
+			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
+				return -ENODEV;
+		}
+		else if(!smb2fs_init(NULL))
+			return -ENODEV;
+	}
+
+	if (fsd->rdonly)
+		return -EROFS;
+
+	smb2fs_path_changed(path);
+
+again:
+	if (fsd->rootdir != NULL)
+	{
+		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
+		strlcat(pathbuf, path, sizeof(pathbuf));
+		path = pathbuf;
+	}
+
+	if (path[0] == '/') path++; /* Remove initial slash */
+
+	do {
+		rc = smb2fs_meta_set(path, name, value, len);
+		if(rc < -1)
+		{
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				path = fspath;
+				goto again;
+			}
+			return rc;
+		}
+		else if (rc < 0)
+		{
+			if(!handle_connection_fault())
+				return -ENODEV;
+		}
+	} while(rc < 0);
+
+	return 0;
+}
+
+static int smb2fs_chmod(const char *path, mode_t mode)
+{
+	struct smb2_stat_64 smb2_st;
+	struct smb2fs_meta *m;
+	uint32_t            prot = 0;
+	uint8_t             value[4];
+	int                 rc;
+
+	if (fsd == NULL || smb2fs_peer_lost())
+	{
+		if(cfg_reconnect_req)
+		{
+			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
+				return -ENODEV;
+		}
+		else if(!smb2fs_init(NULL))
+			return -ENODEV;
+	}
+
+	rc = smb2fs_stat_path(path, &smb2_st);
+	if (rc != 0)
+		return rc;
+
+	/* Only the bits of the mode are replaced, see META_PROT_MODE_BITS */
+	m = smb2fs_meta_get(path, &smb2_st);
+	if (m != NULL && m->has_prot)
+		prot = m->prot & ~META_PROT_MODE_BITS;
+	prot |= smb2fs_mode_to_prot(mode);
+
+	value[0] = prot >> 24;
+	value[1] = prot >> 16;
+	value[2] = prot >> 8;
+	value[3] = prot;
+
+	return smb2fs_meta_store(path, META_EA_MODE, value, sizeof(value));
+}
+
+static int smb2fs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+	struct smb2_stat_64 smb2_st;
+	struct smb2fs_meta *m;
+	size_t              len;
+	int                 rc;
+
+	if (strcmp(name, META_XATTR_COMMENT) != 0)
+		return -EOPNOTSUPP;
+
+	if (fsd == NULL || smb2fs_peer_lost())
+	{
+		if(cfg_reconnect_req)
+		{
+			if(!(request_reconnect(last_server) && smb2fs_init(NULL)))
+				return -ENODEV;
+		}
+		else if(!smb2fs_init(NULL))
+			return -ENODEV;
+	}
+
+	rc = smb2fs_stat_path(path, &smb2_st);
+	if (rc != 0)
+		return rc;
+
+	m = smb2fs_meta_get(path, &smb2_st);
+	if (m == NULL || m->comment == NULL)
+		return -ENODATA;
+
+	len = strlen(m->comment);
+	if (size == 0)
+		return len;
+	if (size < len)
+		return -ERANGE;
+
+	memcpy(value, m->comment, len);
+	return len;
+}
+
+static int smb2fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	if (strcmp(name, META_XATTR_COMMENT) != 0)
+		return -EOPNOTSUPP;
+
+	if (size > META_COMMENT_MAX)
+		size = META_COMMENT_MAX;
+
+	/* An empty comment is no comment */
+	return smb2fs_meta_store(path, META_EA_COMMENT, value, size);
+}
+
+static int smb2fs_removexattr(const char *path, const char *name)
+{
+	if (strcmp(name, META_XATTR_COMMENT) != 0)
+		return -EOPNOTSUPP;
+
+	return smb2fs_meta_store(path, META_EA_COMMENT, NULL, 0);
+}
+
+static int smb2fs_unlink(const char *path)
+{
+	// KPrintF((STRPTR)"[smb2fs] smb2fs_unlink started.\n");
+	int         rc;
+	char        pathbuf[MAXPATHLEN];
+	const char *fspath = path;
+	BOOL        moved = FALSE;
+
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1524,6 +4024,9 @@ static int smb2fs_unlink(const char *path)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	smb2fs_path_changed(path);
+
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1537,6 +4040,12 @@ static int smb2fs_unlink(const char *path)
 		rc = smb2_unlink(fsd->smb2, path);
 		if(rc < -1)
 		{
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				path = fspath;
+				goto again;
+			}
 			return rc;
 		}
 		else if (rc < 0)
@@ -1546,6 +4055,9 @@ static int smb2fs_unlink(const char *path)
 		}
 	} while(rc < 0);
 
+	smb2fs_openfile_forget(fspath);
+	smb2fs_statfs_expire();
+
 	return 0;
 }
 
@@ -1558,9 +4070,10 @@ static int smb2fs_rmdir(const char *path)
 	int  r2;
 	struct smb2dirent *ent;
 	BOOL notempty = FALSE;
+	const char *fspath = path;
+	BOOL moved = FALSE;
 
-
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1574,6 +4087,9 @@ static int smb2fs_rmdir(const char *path)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	smb2fs_path_changed(path);
+
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1594,7 +4110,15 @@ static int smb2fs_rmdir(const char *path)
 					return -ENODEV;
 			}
 			else
+			{
+				if (!moved && smb2fs_dfs_moved())
+				{
+					moved = TRUE;
+					path = fspath;
+					goto again;
+				}
 				return -ENOENT;
+			}
 		}
 	} while(smb2dir == NULL);
 
@@ -1618,6 +4142,12 @@ static int smb2fs_rmdir(const char *path)
 		rc = smb2_rmdir(fsd->smb2, path);
 		if(rc < -1)
 		{
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				path = fspath;
+				goto again;
+			}
 			return rc;
 		}
 		else if (rc < 0)
@@ -1627,6 +4157,8 @@ static int smb2fs_rmdir(const char *path)
 		}
 	} while(rc < 0);
 
+	smb2fs_statfs_expire();
+
 	return 0;
 }
 
@@ -1635,8 +4167,10 @@ static int smb2fs_readlink(const char *path, char *buffer, size_t size)
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_readlink started.\n");
 	int  rc;
 	char pathbuf[MAXPATHLEN];
+	const char *fspath = path;
+	BOOL moved = FALSE;
 
-	if (fsd == NULL)
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1647,6 +4181,7 @@ static int smb2fs_readlink(const char *path, char *buffer, size_t size)
 			return -ENODEV;
 	}
 
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(pathbuf, fsd->rootdir, sizeof(pathbuf));
@@ -1660,6 +4195,12 @@ static int smb2fs_readlink(const char *path, char *buffer, size_t size)
 		rc = smb2_readlink(fsd->smb2, path, buffer, size);
 		if(rc < -1)
 		{
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				path = fspath;
+				goto again;
+			}
 			return rc;
 		}
 		else if (rc < 0)
@@ -1675,11 +4216,14 @@ static int smb2fs_readlink(const char *path, char *buffer, size_t size)
 static int smb2fs_rename(const char *srcpath, const char *dstpath)
 {
 	// KPrintF((STRPTR)"[smb2fs] smb2fs_rename started.\n");
-	int  rc;
-	char srcpathbuf[MAXPATHLEN];
-	char dstpathbuf[MAXPATHLEN];
-
-	if (fsd == NULL)
+	int         rc;
+	char        srcpathbuf[MAXPATHLEN];
+	char        dstpathbuf[MAXPATHLEN];
+	const char *fssrcpath = srcpath;
+	const char *fsdstpath = dstpath;
+	BOOL        moved = FALSE;
+
+	if (fsd == NULL || smb2fs_peer_lost())
 	{
 		if(cfg_reconnect_req)
 		{
@@ -1693,6 +4237,10 @@ static int smb2fs_rename(const char *srcpath, const char *dstpath)
 	if (fsd->rdonly)
 		return -EROFS;
 
+	smb2fs_path_changed(srcpath);
+	smb2fs_path_changed(dstpath);
+
+again:
 	if (fsd->rootdir != NULL)
 	{
 		strlcpy(srcpathbuf, fsd->rootdir, sizeof(srcpathbuf));
@@ -1710,6 +4258,13 @@ static int smb2fs_rename(const char *srcpath, const char *dstpath)
 		rc = smb2_rename(fsd->smb2, srcpath, dstpath);
 		if(rc < -1)
 		{
+			if (!moved && smb2fs_dfs_moved())
+			{
+				moved = TRUE;
+				srcpath = fssrcpath;
+				dstpath = fsdstpath;
+				goto again;
+			}
 			return rc;
 		}
 		else if (rc < 0)
@@ -1719,6 +4274,8 @@ static int smb2fs_rename(const char *srcpath, const char *dstpath)
 		}
 	} while(rc < 0);
 
+	smb2fs_openfile_rename(fssrcpath, fsdstpath);
+
 	return 0;
 }
 
@@ -1743,11 +4300,16 @@ static struct fuse_operations smb2fs_ops =
 	.open       = smb2fs_open,
 	.create     = smb2fs_create,
 	.release    = smb2fs_release,
+	.lock       = smb2fs_lock,
 	.read       = smb2fs_read,
 	.write      = smb2fs_write,
 	.truncate   = smb2fs_truncate,
 	.ftruncate  = smb2fs_ftruncate,
 	.utimens    = smb2fs_utimens,
+	.chmod      = smb2fs_chmod,
+	.getxattr   = smb2fs_getxattr,
+	.setxattr   = smb2fs_setxattr,
+	.removexattr = smb2fs_removexattr,
 	.unlink     = smb2fs_unlink,
 	.rmdir      = smb2fs_rmdir,
 	.readlink   = smb2fs_readlink,
@@ -1852,6 +4414,7 @@ int smb2fs_main(struct DosPacket *pkt)
 	uint32                    fsflags;
 #endif
 	struct FbxFS             *fs = NULL;
+	struct FbxTimerCallbackData *timer;
 	int                       error;
 	int                       rc = RETURN_ERROR;
 
@@ -1910,8 +4473,13 @@ int smb2fs_main(struct DosPacket *pkt)
 
 	if (fs != NULL)
 	{
+		timer = FbxInstallTimerCallback(fs, smb2fs_housekeeping, HOUSEKEEPING_PERIOD);
+
 		FbxEventLoop(fs);
 
+		if (timer != NULL)
+			FbxUninstallTimerCallback(fs, timer);
+
 		rc = RETURN_OK;
 	}
 
@@ -1923,6 +4491,9 @@ cleanup:
 		fs = NULL;
 	}
 
+	/* The resolver's helper process runs our code */
+	smb2_resolve_shutdown();
+
 	if (pkt != NULL)
 	{
 		ReplyPkt(pkt, DOSFALSE, error);
@@ -1941,6 +4512,9 @@ cleanup:
 		md.device = NULL;
 	}
 
+	memset(ntlm_key, 0, sizeof(ntlm_key));
+	have_ntlm_key = FALSE;
+
 	/* NOTE: bsdsocket.library cleanup is handled in start_os3.c */
 
 	return rc;
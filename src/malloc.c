@@ -5,10 +5,13 @@
 #include <proto/exec.h>
 
 static APTR mempool;
+static struct SignalSemaphore mempool_sem; /* the resolver helper allocates too */
+static int (*mempool_reclaim)(void);
 
 #define ALLOC_EXTRA_BYTES 0
 
 int setup_malloc(void) {
+	InitSemaphore(&mempool_sem);
 	mempool = CreatePool(MEMF_ANY, 8192, 2048);
 	return mempool != NULL;
 }
@@ -17,8 +20,22 @@ void cleanup_malloc(void) {
 	DeletePool(mempool);
 }
 
+/* Called when an allocation fails, to have cached data dropped. It returns
+ * nonzero if it freed anything right away, and the allocation is then tried
+ * once more.
+ */
+void set_malloc_reclaim(int (*reclaim)(void)) {
+	mempool_reclaim = reclaim;
+}
+
 void *malloc(size_t size) {
-	size_t *pmem = AllocPooled(mempool, size + sizeof(size_t) + ALLOC_EXTRA_BYTES);
+	size_t *pmem;
+	ObtainSemaphore(&mempool_sem);
+	pmem = AllocPooled(mempool, size + sizeof(size_t) + ALLOC_EXTRA_BYTES);
+	if (pmem == NULL && mempool_reclaim != NULL && mempool_reclaim()) {
+		pmem = AllocPooled(mempool, size + sizeof(size_t) + ALLOC_EXTRA_BYTES);
+	}
+	ReleaseSemaphore(&mempool_sem);
 	if (pmem != NULL) {
 		*pmem++ = size;
 	} else
@@ -30,7 +47,9 @@ void free(void *ptr) {
 	if (ptr != NULL) {
 		size_t *pmem = ptr;
 		size_t size = *--pmem;
+		ObtainSemaphore(&mempool_sem);
 		FreePooled(mempool, pmem, size + sizeof(size_t) + ALLOC_EXTRA_BYTES);
+		ReleaseSemaphore(&mempool_sem);
 	}
 }
 
@@ -0,0 +1,265 @@
+/*
+ * smb2-handler - SMB2 file system client
+ *
+ * Copyright (C) 2025 by the smb2-handler authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the smb2-handler
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+#include <smb2/libsmb2-raw.h>
+
+#define DEFAULT_OUTPUT_BUFFER_LENGTH 0xffff
+
+/*
+ * Read or write the extended attributes of a file with a single
+ * CREATE+QUERY_INFO+CLOSE or CREATE+SET_INFO+CLOSE compound, so that the
+ * attributes of many files can be fetched at the same time.
+ */
+
+struct ea_cb_data {
+	smb2_command_cb cb;
+	void *cb_data;
+
+	uint32_t status;
+	struct smb2_file_full_ea_info *eas;
+};
+
+static void ea_cb_1(struct smb2_context *smb2, int status, void *command_data, void *private_data)
+{
+	struct ea_cb_data *ea_data = private_data;
+
+	if (ea_data->status == SMB2_STATUS_SUCCESS)
+	{
+		ea_data->status = status;
+	}
+}
+
+static void getea_cb_2(struct smb2_context *smb2, int status, void *command_data, void *private_data)
+{
+	struct ea_cb_data *ea_data = private_data;
+	struct smb2_query_info_reply *rep = command_data;
+
+	/* A file without any EAs is not an error here */
+	if (status == SMB2_STATUS_NO_EAS_ON_FILE)
+	{
+		status = SMB2_STATUS_SUCCESS;
+		rep = NULL;
+	}
+
+	if (ea_data->status == SMB2_STATUS_SUCCESS)
+	{
+		ea_data->status = status;
+	}
+	if (ea_data->status != SMB2_STATUS_SUCCESS || rep == NULL)
+	{
+		return;
+	}
+
+	ea_data->eas = rep->output_buffer;
+}
+
+static void ea_cb_3(struct smb2_context *smb2, int status, void *command_data, void *private_data)
+{
+	struct ea_cb_data *ea_data = private_data;
+
+	if (ea_data->status == SMB2_STATUS_SUCCESS)
+	{
+		ea_data->status = status;
+	}
+
+	if (ea_data->status != SMB2_STATUS_SUCCESS && ea_data->eas != NULL)
+	{
+		smb2_free_data(smb2, ea_data->eas);
+		ea_data->eas = NULL;
+	}
+
+	ea_data->cb(smb2, -nterror_to_errno(ea_data->status), ea_data->eas, ea_data->cb_data);
+	free(ea_data);
+}
+
+/*
+ * The callback gets the list of EAs (NULL if the file has none), which it
+ * must free with smb2_free_data().
+ */
+int send_compound_getea(struct smb2_context *smb2, const char *path, smb2_command_cb cb, void *cb_data)
+{
+	struct ea_cb_data *ea_data;
+	struct smb2_create_request cr_req;
+	struct smb2_query_info_request qi_req;
+	struct smb2_close_request cl_req;
+	struct smb2_pdu *pdu, *next_pdu;
+
+	ea_data = calloc(1, sizeof(*ea_data));
+	if (ea_data == NULL)
+	{
+		smb2_set_error(smb2, "Failed to allocate ea_data");
+		return -1;
+	}
+
+	ea_data->cb = cb;
+	ea_data->cb_data = cb_data;
+
+	/* CREATE command */
+	bzero(&cr_req, sizeof(cr_req));
+	cr_req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+	cr_req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+	cr_req.desired_access = SMB2_FILE_READ_ATTRIBUTES | SMB2_FILE_READ_EA;
+	cr_req.file_attributes = 0;
+	cr_req.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE | SMB2_FILE_SHARE_DELETE;
+	cr_req.create_disposition = SMB2_FILE_OPEN;
+	cr_req.create_options = 0;
+	cr_req.name = path;
+
+	pdu = smb2_cmd_create_async(smb2, &cr_req, ea_cb_1, ea_data);
+	if (pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create create command");
+		free(ea_data);
+		return -1;
+	}
+
+	/* QUERY INFO command */
+	bzero(&qi_req, sizeof(qi_req));
+	qi_req.info_type = SMB2_0_INFO_FILE;
+	qi_req.file_info_class = SMB2_FILE_FULL_EA_INFORMATION;
+	qi_req.output_buffer_length = DEFAULT_OUTPUT_BUFFER_LENGTH;
+	qi_req.additional_information = 0;
+	qi_req.flags = SL_RESTART_SCAN;
+	memcpy(qi_req.file_id, compound_file_id, SMB2_FD_SIZE);
+
+	next_pdu = smb2_cmd_query_info_async(smb2, &qi_req, getea_cb_2, ea_data);
+	if (next_pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create query command");
+		free(ea_data);
+		smb2_free_pdu(smb2, pdu);
+		return -1;
+	}
+	smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+	/* CLOSE command */
+	bzero(&cl_req, sizeof(cl_req));
+	cl_req.flags = 0;
+	memcpy(cl_req.file_id, compound_file_id, SMB2_FD_SIZE);
+
+	next_pdu = smb2_cmd_close_async(smb2, &cl_req, ea_cb_3, ea_data);
+	if (next_pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create close command");
+		free(ea_data);
+		smb2_free_pdu(smb2, pdu);
+		return -1;
+	}
+	smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+	smb2_queue_pdu(smb2, pdu);
+
+	return 0;
+}
+
+static void setea_cb_2(struct smb2_context *smb2, int status, void *command_data, void *private_data)
+{
+	struct ea_cb_data *ea_data = private_data;
+
+	if (ea_data->status == SMB2_STATUS_SUCCESS)
+	{
+		ea_data->status = status;
+	}
+}
+
+/* An EA with an empty value is removed from the file */
+int send_compound_setea(struct smb2_context *smb2, const char *path, struct smb2_file_full_ea_info *eas,
+                        smb2_command_cb cb, void *cb_data)
+{
+	struct ea_cb_data *ea_data;
+	struct smb2_create_request cr_req;
+	struct smb2_set_info_request si_req;
+	struct smb2_close_request cl_req;
+	struct smb2_pdu *pdu, *next_pdu;
+
+	ea_data = calloc(1, sizeof(*ea_data));
+	if (ea_data == NULL)
+	{
+		smb2_set_error(smb2, "Failed to allocate ea_data");
+		return -1;
+	}
+
+	ea_data->cb = cb;
+	ea_data->cb_data = cb_data;
+
+	/* CREATE command */
+	bzero(&cr_req, sizeof(cr_req));
+	cr_req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+	cr_req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+	cr_req.desired_access = SMB2_FILE_WRITE_ATTRIBUTES | SMB2_FILE_WRITE_EA;
+	cr_req.file_attributes = 0;
+	cr_req.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE | SMB2_FILE_SHARE_DELETE;
+	cr_req.create_disposition = SMB2_FILE_OPEN;
+	cr_req.create_options = 0;
+	cr_req.name = path;
+
+	pdu = smb2_cmd_create_async(smb2, &cr_req, ea_cb_1, ea_data);
+	if (pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create create command");
+		free(ea_data);
+		return -1;
+	}
+
+	/* SET INFO command */
+	bzero(&si_req, sizeof(si_req));
+	si_req.info_type = SMB2_0_INFO_FILE;
+	si_req.file_info_class = SMB2_FILE_FULL_EA_INFORMATION;
+	si_req.additional_information = 0;
+	memcpy(si_req.file_id, compound_file_id, SMB2_FD_SIZE);
+	si_req.input_data = eas;
+
+	next_pdu = smb2_cmd_set_info_async(smb2, &si_req, setea_cb_2, ea_data);
+	if (next_pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create set command");
+		free(ea_data);
+		smb2_free_pdu(smb2, pdu);
+		return -1;
+	}
+	smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+	/* CLOSE command */
+	bzero(&cl_req, sizeof(cl_req));
+	cl_req.flags = 0;
+	memcpy(cl_req.file_id, compound_file_id, SMB2_FD_SIZE);
+
+	next_pdu = smb2_cmd_close_async(smb2, &cl_req, ea_cb_3, ea_data);
+	if (next_pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create close command");
+		free(ea_data);
+		smb2_free_pdu(smb2, pdu);
+		return -1;
+	}
+	smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+	smb2_queue_pdu(smb2, pdu);
+
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * smb2-handler - SMB2 file system client
+ *
+ * Copyright (C) 2025 by the smb2-handler authors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the smb2-handler
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+#include <smb2/libsmb2-raw.h>
+
+/*
+ * Read a whole (small) file with a single CREATE+READ+CLOSE compound, so
+ * that many of them can be in flight at the same time.
+ */
+
+struct read_cb_data {
+	smb2_command_cb cb;
+	void *cb_data;
+
+	uint32_t status;
+	uint8_t *buf;
+	uint32_t count;
+};
+
+static void read_cb_1(struct smb2_context *smb2, int status, void *command_data, void *private_data)
+{
+	struct read_cb_data *read_data = private_data;
+
+	if (read_data->status == SMB2_STATUS_SUCCESS)
+	{
+		read_data->status = status;
+	}
+}
+
+static void read_cb_2(struct smb2_context *smb2, int status, void *command_data, void *private_data)
+{
+	struct read_cb_data *read_data = private_data;
+	struct smb2_read_reply *rep = command_data;
+	uint32_t count;
+
+	if (read_data->status == SMB2_STATUS_SUCCESS)
+	{
+		read_data->status = status;
+	}
+	if (read_data->status != SMB2_STATUS_SUCCESS || rep == NULL)
+	{
+		return;
+	}
+
+	count = rep->data_length;
+	if (count > read_data->count)
+	{
+		count = read_data->count;
+	}
+	if (rep->data != NULL && rep->data != read_data->buf)
+	{
+		memcpy(read_data->buf, rep->data, count);
+	}
+	read_data->count = count;
+}
+
+static void read_cb_3(struct smb2_context *smb2, int status, void *command_data, void *private_data)
+{
+	struct read_cb_data *read_data = private_data;
+
+	if (read_data->status == SMB2_STATUS_SUCCESS)
+	{
+		read_data->status = status;
+	}
+
+	/* command_data points to the number of bytes read on success */
+	read_data->cb(smb2, -nterror_to_errno(read_data->status), &read_data->count, read_data->cb_data);
+	free(read_data);
+}
+
+int send_compound_read(struct smb2_context *smb2, const char *path, void *buf, uint32_t count,
+                       smb2_command_cb cb, void *cb_data, uint64_t *message_id)
+{
+	struct read_cb_data *read_data;
+	struct smb2_create_request cr_req;
+	struct smb2_read_request rd_req;
+	struct smb2_close_request cl_req;
+	struct smb2_pdu *pdu, *next_pdu;
+
+	read_data = calloc(1, sizeof(*read_data));
+	if (read_data == NULL)
+	{
+		smb2_set_error(smb2, "Failed to allocate read_data");
+		return -1;
+	}
+
+	read_data->cb = cb;
+	read_data->cb_data = cb_data;
+	read_data->buf = buf;
+	read_data->count = count;
+
+	/* CREATE command */
+	bzero(&cr_req, sizeof(cr_req));
+	cr_req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+	cr_req.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+	cr_req.desired_access = SMB2_FILE_READ_DATA | SMB2_FILE_READ_ATTRIBUTES;
+	cr_req.file_attributes = 0;
+	cr_req.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE;
+	cr_req.create_disposition = SMB2_FILE_OPEN;
+	cr_req.create_options = SMB2_FILE_NON_DIRECTORY_FILE;
+	cr_req.name = path;
+
+	pdu = smb2_cmd_create_async(smb2, &cr_req, read_cb_1, read_data);
+	if (pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create create command");
+		free(read_data);
+		return -1;
+	}
+
+	/* READ command */
+	bzero(&rd_req, sizeof(rd_req));
+	rd_req.flags = 0;
+	rd_req.length = count;
+	rd_req.offset = 0;
+	rd_req.buf = buf;
+	memcpy(rd_req.file_id, compound_file_id, SMB2_FD_SIZE);
+	rd_req.minimum_count = 0;
+	rd_req.channel = SMB2_CHANNEL_NONE;
+	rd_req.remaining_bytes = 0;
+
+	next_pdu = smb2_cmd_read_async(smb2, &rd_req, read_cb_2, read_data);
+	if (next_pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create read command");
+		free(read_data);
+		smb2_free_pdu(smb2, pdu);
+		return -1;
+	}
+	smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+	/* CLOSE command */
+	bzero(&cl_req, sizeof(cl_req));
+	cl_req.flags = 0;
+	memcpy(cl_req.file_id, compound_file_id, SMB2_FD_SIZE);
+
+	next_pdu = smb2_cmd_close_async(smb2, &cl_req, read_cb_3, read_data);
+	if (next_pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create close command");
+		free(read_data);
+		smb2_free_pdu(smb2, pdu);
+		return -1;
+	}
+	smb2_add_compound_pdu(smb2, pdu, next_pdu);
+
+	smb2_queue_pdu(smb2, pdu);
+
+	/* The whole compound can be cancelled through the first request */
+	if (message_id != NULL)
+	{
+		*message_id = smb2_get_pdu_message_id(smb2, pdu);
+	}
+
+	return 0;
+}
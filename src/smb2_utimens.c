@@ -32,15 +32,9 @@
 #include <dos/dostags.h>
 #include <dos/dos.h>
 
-#define DEFAULT_OUTPUT_BUFFER_LENGTH 0xffff
-
-struct pollfd {
-	int fd;
-	short events;
-	short revents;
-};
+#include "poll-compat.h"
 
-int poll(struct pollfd *fds, unsigned int nfds, int timo);
+#define DEFAULT_OUTPUT_BUFFER_LENGTH 0xffff
 
 struct stat_cb_data {
 	smb2_command_cb cb;
@@ -312,6 +306,10 @@ static int wait_for_reply(struct smb2_context *smb2, struct sync_cb_data *cb_dat
 			smb2_set_error(smb2, "Poll failed");
 			return -1;
 		}
+		if (smb2_keepalive_service(smb2) < 0)
+		{
+			return -1;
+		}
 		if (pfd.revents == 0)
 		{
 			continue;
@@ -417,3 +415,57 @@ int smb2_utimens(struct smb2_context *smb2, const char *path, const struct times
 	free(cb_data);
 	return status;
 }
+
+/* Same as smb2_utimens() but through a handle that has write attribute access */
+int smb2_futimens(struct smb2_context *smb2, struct smb2fh *fh, const struct timespec tv[2])
+{
+	struct sync_cb_data *cb_data;
+	struct smb2_file_basic_info fbi;
+	struct smb2_set_info_request si_req;
+	struct smb2_pdu *pdu;
+	int status;
+	int rc;
+
+	/* Fields left at zero are not changed by the server, so there is no
+	 * need to read the current values first.
+	 */
+	bzero(&fbi, sizeof(fbi));
+	fbi.last_write_time.tv_sec = tv[0].tv_sec;
+	fbi.last_write_time.tv_usec = tv[0].tv_nsec / 1000;
+	fbi.change_time.tv_sec = tv[0].tv_sec;
+	fbi.change_time.tv_usec = tv[0].tv_nsec / 1000;
+
+	cb_data = calloc(1, sizeof(*cb_data));
+	if (cb_data == NULL)
+	{
+		smb2_set_error(smb2, "Failed to allocate sync_cb_data");
+		return -ENOMEM;
+	}
+
+	bzero(&si_req, sizeof(si_req));
+	si_req.info_type = SMB2_0_INFO_FILE;
+	si_req.file_info_class = SMB2_FILE_BASIC_INFORMATION;
+	si_req.additional_information = 0;
+	memcpy(si_req.file_id, smb2_get_file_id(fh), SMB2_FD_SIZE);
+	si_req.input_data = &fbi;
+
+	pdu = smb2_cmd_set_info_async(smb2, &si_req, generic_status_cb, cb_data);
+	if (pdu == NULL)
+	{
+		smb2_set_error(smb2, "Failed to create set command");
+		free(cb_data);
+		return -1;
+	}
+	smb2_queue_pdu(smb2, pdu);
+
+	rc = wait_for_reply(smb2, cb_data);
+	if (rc < 0)
+	{
+		cb_data->status = SMB2_STATUS_CANCELLED;
+		return -1;
+	}
+
+	status = -nterror_to_errno(cb_data->status);
+	free(cb_data);
+	return status;
+}
@@ -25,6 +25,9 @@
 #include <proto/exec.h>
 #include <proto/dos.h>
 #include <proto/filesysbox.h>
+#include <stdint.h>
+
+#include "poll-compat.h"
 
 #define ID_SMB2_DISK (0x534D4202UL)
 
@@ -40,7 +43,21 @@ LONG request_reconnect(const char *server);
 int smb2fs_main(struct DosPacket *pkt);
 
 struct smb2_context;
+struct smb2fh;
 int smb2_utimens(struct smb2_context *smb2, const char *path, const struct timespec tv[2]);
+int smb2_futimens(struct smb2_context *smb2, struct smb2fh *fh, const struct timespec tv[2]);
+int send_compound_read(struct smb2_context *smb2, const char *path, void *buf, uint32_t count,
+                       void (*cb)(struct smb2_context *, int, void *, void *), void *cb_data,
+                       uint64_t *message_id);
+struct smb2_file_full_ea_info;
+int send_compound_getea(struct smb2_context *smb2, const char *path,
+                        void (*cb)(struct smb2_context *, int, void *, void *), void *cb_data);
+int send_compound_setea(struct smb2_context *smb2, const char *path, struct smb2_file_full_ea_info *eas,
+                        void (*cb)(struct smb2_context *, int, void *, void *), void *cb_data);
+
+#ifndef __amigaos4__
+void set_malloc_reclaim(int (*reclaim)(void));
+#endif
 
 #ifdef __libnix__
 size_t strlcpy(char *dst, const char *src, size_t size);